@@ -3,12 +3,16 @@
 
 // dfusvc.cpp
 #include <windows.h>
+#include <cstdio>
 #include <iostream>
 #include <memory>
+#include <vector>
 #include <boost/thread/thread.hpp>
 #include <boost/program_options.hpp>
 
 #include "dfusvc_server.h"
+#include "dfusvc_image_cache.h"
+#include "dfusvc_job_scheduler.h"
 
 int main(int argc, TCHAR * argv[])
 {
@@ -21,12 +25,24 @@ int main(int argc, TCHAR * argv[])
     }
 
     std::string pipename("");
+    size_t cacheSize = dfusvc::ImageCache::k_defaultBudget / (1024 * 1024);
+    size_t maxSessions = dfusvc::JobScheduler::k_defaultMaxSessions;
+    std::vector<std::string> modelSessions;
+    std::vector<std::string> deadlineOptions;
+    size_t hubSessions = 0;
+    uint32_t hubRate = 0;
     try
     {
         boost::program_options::options_description desc{ "Options" };
         desc.add_options()
             ("help, h", "Help screen")
-            ("name", boost::program_options::value<std::string>()->default_value(""), "Pipe name");
+            ("name", boost::program_options::value<std::string>()->default_value(""), "Pipe name")
+            ("image-cache", boost::program_options::value<size_t>(&cacheSize)->default_value(cacheSize), "MiB of staged images kept")
+            ("max-sessions", boost::program_options::value<size_t>(&maxSessions)->default_value(maxSessions), "Devices written or read at once")
+            ("model-sessions", boost::program_options::value<std::vector<std::string>>(&modelSessions)->composing(), "Devices of a model written or read at once, as vid:pid=sessions in hex:hex=decimal")
+            ("hub-sessions", boost::program_options::value<size_t>(&hubSessions)->default_value(hubSessions), "Devices behind one hub written or read at once, 0 for no cap")
+            ("hub-rate", boost::program_options::value<uint32_t>(&hubRate)->default_value(hubRate), "Bytes per second through one hub, 0 for no cap")
+            ("deadline", boost::program_options::value<std::vector<std::string>>(&deadlineOptions)->composing(), "Milliseconds a device may take unless a request says, as open, erase, write, manifest or job=ms");
 
         boost::program_options::variables_map vm;
         store(parse_command_line(argc, argv, desc), vm);
@@ -53,6 +69,51 @@ int main(int argc, TCHAR * argv[])
     }
 
 
+    dfusvc::DFUServiceServer::setImageCacheSize(cacheSize * 1024 * 1024);
+    dfusvc::DFUServiceServer::setMaxSessions(maxSessions);
+    dfusvc::DFUServiceServer::setHubMaxSessions(hubSessions);
+    dfusvc::DFUServiceServer::setHubRate(hubRate);
+    dfusvc::Deadlines deadlines;
+    for (auto& option : deadlineOptions) {
+        char name[16];
+        unsigned int ms = 0;
+        if (2 != sscanf(option.c_str(), "%15[a-z]=%u", name, &ms)) {
+            std::cout << "Invalid deadline " << option << std::endl;
+            return -1;
+        }
+        std::string deadline(name);
+        if (deadline == "open") {
+            deadlines.open = ms;
+        }
+        else if (deadline == "erase") {
+            deadlines.erase = ms;
+        }
+        else if (deadline == "write") {
+            deadlines.write = ms;
+        }
+        else if (deadline == "manifest") {
+            deadlines.manifest = ms;
+        }
+        else if (deadline == "job") {
+            deadlines.job = ms;
+        }
+        else {
+            std::cout << "Invalid deadline " << option << std::endl;
+            return -1;
+        }
+    }
+    dfusvc::DFUServiceServer::setDefaultDeadlines(deadlines);
+    for (auto& model : modelSessions) {
+        unsigned int vid = 0;
+        unsigned int pid = 0;
+        unsigned int sessions = 0;
+        if (3 != sscanf(model.c_str(), "%x:%x=%u", &vid, &pid, &sessions) || vid > 0xffff || pid > 0xffff) {
+            std::cout << "Invalid model-sessions " << model << std::endl;
+            return -1;
+        }
+        dfusvc::DFUServiceServer::setModelMaxSessions(vid, pid, sessions);
+    }
+
     auto svc =  std::make_shared<dfusvc::DFUServiceServer>(pipename);
     if (svc->waitForConnection() != 0) {
         return -1;
@@ -0,0 +1,409 @@
+// SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+// SPDX-License-Identifier: GPL2.0-or-later
+
+// dfusvc_client.cpp
+#include "dfusvc_client.h"
+
+#include <algorithm>
+#include <vector>
+#include <boost/algorithm/string.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+namespace dfusvc {
+
+static const char k_lz4[] = "lz4";
+
+DFUServiceClient::DFUServiceClient(void)
+: d_hPipe(INVALID_HANDLE_VALUE)
+, d_readEvent(CreateEvent(NULL, TRUE, FALSE, NULL))
+, d_writeEvent(CreateEvent(NULL, TRUE, FALSE, NULL))
+, d_stopEvent(CreateEvent(NULL, TRUE, FALSE, NULL))
+, d_connected(false)
+, d_nextId(0)
+{
+}
+
+DFUServiceClient::~DFUServiceClient(void)
+{
+    disconnect();
+    CloseHandle(d_readEvent);
+    CloseHandle(d_writeEvent);
+    CloseHandle(d_stopEvent);
+}
+
+int DFUServiceClient::connect(const std::string& name, int timeoutMs)
+{
+    boost::unique_lock<boost::mutex> lock(d_mutex);
+    if (d_connected || d_hPipe != INVALID_HANDLE_VALUE) {
+        return -1;
+    }
+
+    std::string pipeName = "\\\\.\\pipe\\";
+    pipeName += name.empty() ? "dfusvcpipe" : name;
+
+    // Overlapped, so the pipe is read and written at the same time
+    while (1) {
+        d_hPipe = CreateFile(pipeName.c_str(),
+                             GENERIC_READ | GENERIC_WRITE,
+                             0,
+                             NULL,
+                             OPEN_EXISTING,
+                             FILE_FLAG_OVERLAPPED,
+                             NULL);
+        if (d_hPipe != INVALID_HANDLE_VALUE) {
+            break;
+        }
+        if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipe(pipeName.c_str(), timeoutMs)) {
+            return -1;
+        }
+    }
+
+    DWORD dwMode = PIPE_READMODE_MESSAGE;
+    if (!SetNamedPipeHandleState(d_hPipe, &dwMode, NULL, NULL)) {
+        CloseHandle(d_hPipe);
+        d_hPipe = INVALID_HANDLE_VALUE;
+        return -1;
+    }
+
+    ResetEvent(d_stopEvent);
+    d_connected = true;
+    d_compression.clear();
+    d_writer = boost::thread(&DFUServiceClient::writeLoop, this);
+    d_reader = boost::thread(&DFUServiceClient::readLoop, this);
+    return 0;
+}
+
+void DFUServiceClient::disconnect(void)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(d_mutex);
+        d_connected = false;
+    }
+    d_queued.notify_all();
+    SetEvent(d_stopEvent);
+    if (d_writer.joinable()) {
+        d_writer.join();
+    }
+    if (d_reader.joinable()) {
+        d_reader.join();
+    }
+
+    boost::unique_lock<boost::mutex> lock(d_mutex);
+    if (d_hPipe != INVALID_HANDLE_VALUE) {
+        CloseHandle(d_hPipe);
+        d_hPipe = INVALID_HANDLE_VALUE;
+    }
+}
+
+void DFUServiceClient::setClientName(const std::string& name)
+{
+    boost::unique_lock<boost::mutex> lock(d_mutex);
+    d_clientName = name;
+}
+
+bool DFUServiceClient::takesLz4(void)
+{
+    boost::unique_lock<boost::mutex> lock(d_mutex);
+    std::vector<std::string> compressions;
+    boost::algorithm::split(compressions, d_compression, boost::algorithm::is_any_of(","));
+    return std::find(compressions.begin(), compressions.end(), k_lz4) != compressions.end();
+}
+
+template <class RESPONSE>
+std::future<ClientResult<RESPONSE>> DFUServiceClient::submit(int handle,
+                                                             boost::shared_ptr<CommandRequest> request,
+                                                             std::function<void(RESPONSE&)> observe,
+                                                             int priority)
+{
+    auto promise = boost::make_shared<std::promise<ClientResult<RESPONSE>>>();
+    std::future<ClientResult<RESPONSE>> future = promise->get_future();
+
+    auto pending = boost::make_shared<Pending>();
+    pending->request = request;
+    pending->handle = handle;
+    pending->priority = priority;
+    pending->settled = false;
+    pending->fail = [promise](ErrorType err, const std::string& reason) {
+        ClientResult<RESPONSE> result;
+        result.error = err;
+        result.reason = reason;
+        promise->set_value(result);
+    };
+    pending->respond = [promise, observe](const MessageView& view,
+                                          const std::vector<uint8_t>& raw,
+                                          bool last) {
+        ClientResult<RESPONSE> result = clientResult<RESPONSE>(view, raw);
+        if (result.error == e_noError && observe) {
+            observe(result.response);
+        }
+        if (!last && result.error == e_noError) {
+            return false;
+        }
+        promise->set_value(result);
+        return true;
+    };
+
+    {
+        boost::unique_lock<boost::mutex> lock(d_mutex);
+        if (d_connected) {
+            // 0 is a request without id
+            if (0 == ++d_nextId) {
+                ++d_nextId;
+            }
+            pending->id = d_nextId;
+            d_queue.push_back(pending);
+            d_queued.notify_one();
+            return future;
+        }
+    }
+    pending->fail(e_commErr, "Not connected to the server");
+    return future;
+}
+
+std::future<ClientResult<OpenResponse>> DFUServiceClient::open(uint16_t vid, uint16_t pid)
+{
+    // Later downloads compress their images if the server takes it
+    return submit<OpenResponse>(-1, boost::make_shared<OpenRequest>(vid, pid),
+        [this](OpenResponse& resp) {
+        boost::unique_lock<boost::mutex> lock(d_mutex);
+        d_compression = resp.compression();
+    });
+}
+
+std::future<ClientResult<DownloadResponse>> DFUServiceClient::download(int handle,
+                                                                       const FirmwareImage& image,
+                                                                       const DownloadOptions& options,
+                                                                       DownloadProgress progress)
+{
+    std::vector<uint8_t> none;
+    auto req = boost::make_shared<DownloadRequest>(handle,
+                                                   none,
+                                                   options.dfuseAddress,
+                                                   options.massErase,
+                                                   options.leave,
+                                                   options.dryRun,
+                                                   options.delta,
+                                                   options.verify,
+                                                   options.image);
+    req->setData(image);
+    req->setDeadlines(options.deadlines);
+
+    if (options.compress && takesLz4()) {
+        req->setCompression(k_lz4);
+    }
+    return submit<DownloadResponse>(handle, req, progress, options.priority);
+}
+
+std::future<ClientResult<StageImageResponse>> DFUServiceClient::stageImage(const FirmwareImage& image)
+{
+    auto req = boost::make_shared<StageImageRequest>();
+    req->setData(image);
+    if (takesLz4()) {
+        req->setCompression(k_lz4);
+    }
+
+    return submit<StageImageResponse>(-1, req, std::function<void(StageImageResponse&)>());
+}
+
+std::future<ClientResult<CloseResponse>> DFUServiceClient::close(int handle)
+{
+    return submit<CloseResponse>(handle, boost::make_shared<CloseRequest>(handle),
+                                 std::function<void(CloseResponse&)>());
+}
+
+std::future<ClientResult<ListResponse>> DFUServiceClient::list(void)
+{
+    return submit<ListResponse>(-1, boost::make_shared<ListRequest>(),
+                                std::function<void(ListResponse&)>());
+}
+
+int DFUServiceClient::cancel(int handle)
+{
+    std::vector<boost::shared_ptr<Pending>> cancelled;
+    {
+        boost::unique_lock<boost::mutex> lock(d_mutex);
+        auto it = d_queue.begin();
+        while (it != d_queue.end()) {
+            if ((*it)->handle == handle) {
+                cancelled.push_back(*it);
+                it = d_queue.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+    for (auto& pending : cancelled) {
+        pending->fail(e_cancelledErr, "Request cancelled");
+    }
+    return static_cast<int>(cancelled.size());
+}
+
+void DFUServiceClient::writeLoop(void)
+{
+    while (1) {
+        boost::shared_ptr<Pending> pending;
+        {
+            boost::unique_lock<boost::mutex> lock(d_mutex);
+            while (d_queue.empty() && d_connected) {
+                d_queued.wait(lock);
+            }
+            if (!d_connected) {
+                return;
+            }
+            pending = d_queue.front();
+            d_queue.pop_front();
+        }
+
+        // The hex of the image only exists while it is written
+        std::vector<uint8_t> raw;
+        int ret = pending->request->serialize(raw);
+        pending->request.reset();
+        if (ret < 0) {
+            pending->fail(e_commErr, "Can not serialize request");
+            continue;
+        }
+        CommandRequestUtil::setRequestId(raw, pending->id);
+        if (0 != pending->priority) {
+            CommandRequestUtil::setField(raw, "priority", std::to_string(pending->priority));
+        }
+        {
+            boost::unique_lock<boost::mutex> lock(d_mutex);
+            if (!d_clientName.empty()) {
+                CommandRequestUtil::setField(raw, "client", d_clientName);
+            }
+        }
+        {
+            boost::unique_lock<boost::mutex> lock(d_mutex);
+            if (!d_connected) {
+                lock.unlock();
+                pending->fail(e_commErr, "Not connected to the server");
+                return;
+            }
+            // In flight before it is written, the server may answer
+            // before the write returns
+            d_inFlight[pending->id] = pending;
+        }
+        if (writeMessage(raw) < 0) {
+            SetEvent(d_stopEvent);
+            return;
+        }
+    }
+}
+
+void DFUServiceClient::readLoop(void)
+{
+    std::vector<uint8_t> raw;
+    while (readMessage(raw) == 0) {
+        MessageView view;
+        bool last = true;
+        if (view.parse(raw) == 0 && view.type() != e_error) {
+            last = view.tree().get<bool>("lastResponse", true);
+        }
+
+        // Responses of different requests interleave, the id tells them
+        // apart
+        boost::shared_ptr<Pending> pending;
+        {
+            boost::unique_lock<boost::mutex> lock(d_mutex);
+            auto it = d_inFlight.find(view.id());
+            if (it == d_inFlight.end()) {
+                continue;
+            }
+            pending = it->second;
+            if (last) {
+                d_inFlight.erase(it);
+            }
+        }
+        if (!pending->settled) {
+            pending->settled = pending->respond(view, raw, last);
+        }
+    }
+    failAll(e_commErr, "Connection to the server lost");
+}
+
+DWORD DFUServiceClient::waitIo(OVERLAPPED& ov, DWORD& bytes)
+{
+    HANDLE events[2] = { ov.hEvent, d_stopEvent };
+    if (WaitForMultipleObjects(2, events, FALSE, INFINITE) != WAIT_OBJECT_0) {
+        CancelIoEx(d_hPipe, &ov);
+    }
+    if (!GetOverlappedResult(d_hPipe, &ov, &bytes, TRUE)) {
+        return GetLastError();
+    }
+    return ERROR_SUCCESS;
+}
+
+int DFUServiceClient::readMessage(std::vector<uint8_t>& raw)
+{
+    // Read a whole message, sizing the buffer to it once the first part
+    // showed it is longer
+    size_t used = 0;
+    raw.resize(k_bufferSize);
+    while (1) {
+        OVERLAPPED ov = {};
+        ov.hEvent = d_readEvent;
+        if (!ReadFile(d_hPipe, raw.data() + used, static_cast<DWORD>(raw.size() - used), NULL, &ov)) {
+            DWORD err = GetLastError();
+            if (err != ERROR_IO_PENDING && err != ERROR_MORE_DATA) {
+                return -1;
+            }
+        }
+        DWORD cbRead = 0;
+        DWORD err = waitIo(ov, cbRead);
+        used += cbRead;
+        if (err == ERROR_SUCCESS) {
+            raw.resize(used);
+            return 0;
+        }
+        if (err != ERROR_MORE_DATA) {
+            return -1;
+        }
+        DWORD cbLeft = 0;
+        if (!PeekNamedPipe(d_hPipe, NULL, 0, NULL, NULL, &cbLeft)) {
+            return -1;
+        }
+        raw.resize(used + std::max<size_t>(cbLeft, k_bufferSize));
+    }
+}
+
+int DFUServiceClient::writeMessage(const std::vector<uint8_t>& raw)
+{
+    OVERLAPPED ov = {};
+    ov.hEvent = d_writeEvent;
+    if (!WriteFile(d_hPipe, raw.data(), static_cast<DWORD>(raw.size()), NULL, &ov)
+        && GetLastError() != ERROR_IO_PENDING) {
+        return -1;
+    }
+    DWORD cbWritten = 0;
+    if (waitIo(ov, cbWritten) != ERROR_SUCCESS || cbWritten != raw.size()) {
+        return -1;
+    }
+    return 0;
+}
+
+void DFUServiceClient::failAll(ErrorType err, const std::string& reason)
+{
+    std::vector<boost::shared_ptr<Pending>> failed;
+    {
+        boost::unique_lock<boost::mutex> lock(d_mutex);
+        d_connected = false;
+        for (auto& entry : d_inFlight) {
+            failed.push_back(entry.second);
+        }
+        failed.insert(failed.end(), d_queue.begin(), d_queue.end());
+        d_inFlight.clear();
+        d_queue.clear();
+    }
+    d_queued.notify_all();
+    SetEvent(d_stopEvent);
+    for (auto& pending : failed) {
+        if (!pending->settled) {
+            pending->settled = true;
+            pending->fail(err, reason);
+        }
+    }
+}
+
+}
@@ -0,0 +1,214 @@
+// SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+// SPDX-License-Identifier: GPL2.0-or-later
+
+// dfusvc_client.h
+#ifndef DFUSVC_CLIENT_H
+#define DFUSVC_CLIENT_H
+
+#include <windows.h>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/unordered_map.hpp>
+#include "dfusvc_command.h"
+#include "dfusvc_firmware_image.h"
+
+namespace dfusvc {
+
+template <class RESPONSE>
+struct ClientResult
+{
+// Outcome of a request sent by a DFUServiceClient
+    ErrorType error = e_noError;
+        // e_noError if response holds the answer of the server
+    std::string reason;
+        // Why the request failed, as the server or the client put it
+    RESPONSE response;
+        // Last response of the server to the request
+};
+
+template <class RESPONSE>
+ClientResult<RESPONSE> clientResult(const MessageView& view, const std::vector<uint8_t>& raw)
+    // The outcome a response makes for a request answered by RESPONSE,
+    // an ErrorResponse fails it with the error of the server
+{
+    ClientResult<RESPONSE> result;
+    if (view.type() == e_error) {
+        ErrorResponse err(e_commErr, "Receive malformed error response");
+        err.deserialize(raw);
+        result.error = err.errorCode();
+        result.reason = err.errorString();
+        if (result.error == e_noError) {
+            // An error response fails the request whatever it says
+            result.error = e_commErr;
+        }
+    }
+    else if (result.response.deserialize(raw) < 0) {
+        result.error = e_commErr;
+        result.reason = "Receive malformed response";
+    }
+    return result;
+}
+
+struct DownloadOptions
+{
+// How DFUServiceClient::download() writes an image, see DownloadRequest
+    uint32_t dfuseAddress = 0;
+    bool massErase = false;
+    bool leave = false;
+    bool dryRun = false;
+    bool delta = false;
+    bool verify = false;
+    std::string image;
+        // SHA-256 of a staged image to download instead of the image
+        // passed, see DFUServiceClient::stageImage()
+    bool compress = true;
+        // Compress the image if the server listed LZ4 when a device was
+        // opened
+    int priority = 0;
+        // Downloads with a higher priority start first when the server
+        // has more queued than it runs at once
+    Deadlines deadlines;
+        // The download fails with e_timeoutErr once one expires
+};
+
+                        // ======================
+                        // class DFUServiceClient
+                        // ======================
+
+class DFUServiceClient
+{
+// One connection to the pipe of a blpdevupd server, shared by every
+// request. Requests are queued and written by a thread of their own while
+// another thread reads the responses, so any number of them can be
+// outstanding. Each request carries an id, the server runs it alongside the
+// others and tags its responses with the id, so responses to requests for
+// different devices interleave. Requests for the same device run in the
+// order they were made. Each request returns a future that is ready with
+// the last response to it. Safe to use from several threads.
+public:
+    // TYPES
+    typedef std::function<void(DownloadResponse&)> DownloadProgress;
+        // Called with every DownloadResponse, the last included, on the
+        // thread reading the pipe. It must not block
+
+private:
+    // TYPES
+    enum {
+        k_bufferSize = 4096
+    };
+
+    struct Pending {
+        uint32_t id;
+            // Request id the responses carry
+        boost::shared_ptr<CommandRequest> request;
+            // Serialized only once it is its turn on the pipe, until
+            // then it shares the image of the caller
+        int handle;
+            // Device the request is for, -1 if none
+        int priority;
+        bool settled;
+            // The future is ready, the rest of the responses are dropped
+        std::function<bool(const MessageView&, const std::vector<uint8_t>&, bool)> respond;
+            // Take a response, and whether it is the last. Returns true
+            // once the future is ready
+        std::function<void(ErrorType, const std::string&)> fail;
+            // Make the future ready with an error
+    };
+
+    // DATA
+    HANDLE d_hPipe;
+    HANDLE d_readEvent;
+    HANDLE d_writeEvent;
+    HANDLE d_stopEvent;
+    bool d_connected;
+    uint32_t d_nextId;
+    std::string d_clientName;
+    std::string d_compression;
+        // Compressions listed by the server in its last OpenResponse
+    std::deque<boost::shared_ptr<Pending>> d_queue;
+        // Requests not written yet
+    boost::unordered_map<uint32_t, boost::shared_ptr<Pending>> d_inFlight;
+        // Requests written and not answered yet, by id
+    boost::thread d_writer;
+    boost::thread d_reader;
+    boost::mutex d_mutex;
+    boost::condition_variable d_queued;
+
+    // NOT IMPLEMENTED
+    DFUServiceClient(const DFUServiceClient&);
+    DFUServiceClient& operator=(const DFUServiceClient&);
+
+    // MANIPULTORS
+    bool takesLz4(void);
+        // Return true if the server listed LZ4 in its last OpenResponse
+    template <class RESPONSE>
+    std::future<ClientResult<RESPONSE>> submit(int handle,
+                                               boost::shared_ptr<CommandRequest> request,
+                                               std::function<void(RESPONSE&)> observe,
+                                               int priority = 0);
+        // Queue request and return the future of its last response,
+        // observe is called with every response to it
+    void writeLoop(void);
+    void readLoop(void);
+        // Bodies of the writer and reader threads
+    DWORD waitIo(OVERLAPPED& ov, DWORD& bytes);
+        // Wait for overlapped I/O on the pipe, cancelling it if the
+        // client stops. Returns ERROR_SUCCESS or the error of the I/O
+    int readMessage(std::vector<uint8_t>& raw);
+    int writeMessage(const std::vector<uint8_t>& raw);
+        // Returns -1 if the pipe broke or the client stops
+    void failAll(ErrorType err, const std::string& reason);
+        // Disconnect and make every outstanding future ready with err
+
+public:
+    // CREATORS
+    DFUServiceClient(void);
+    ~DFUServiceClient(void);
+        // Disconnect, see disconnect()
+
+    // MANIPULTORS
+    int connect(const std::string& name = std::string(), int timeoutMs = 5000);
+        // Connect to the server listening on pipe name, "dfusvcpipe" if
+        // empty, waiting up to timeoutMs for it to be free. Returns -1 if
+        // it is not there or still connected, disconnect() first once a
+        // connection is lost
+    void disconnect(void);
+        // Close the connection. Outstanding requests fail with e_commErr
+    void setClientName(const std::string& name);
+        // Name sent with every request, the server shares the devices
+        // fairly between the names it gets. Clients that share one
+        // connection may each use their own DFUServiceClient name
+    std::future<ClientResult<OpenResponse>> open(uint16_t vid, uint16_t pid);
+        // Open the DFU device vid:pid, the response has its handle
+    std::future<ClientResult<DownloadResponse>> download(int handle,
+                                                         const FirmwareImage& image,
+                                                         const DownloadOptions& options = DownloadOptions(),
+                                                         DownloadProgress progress = DownloadProgress());
+        // Download image into the device. The image is shared, not
+        // copied, and is hex encoded straight from it when the request is
+        // written. image may be null if options name a staged image
+    std::future<ClientResult<StageImageResponse>> stageImage(const FirmwareImage& image);
+        // Keep image in the server, downloads can then name it by the
+        // digest in the response
+    std::future<ClientResult<CloseResponse>> close(int handle);
+        // Close the device
+    std::future<ClientResult<ListResponse>> list(void);
+        // List the devices the server holds open
+    int cancel(int handle);
+        // Withdraw the requests for the device that were not written to
+        // the pipe yet, their futures fail with e_cancelledErr. A request
+        // the server has started on runs to the end. Returns the number
+        // of requests withdrawn
+};
+
+}
+
+#endif //DFUSVC_CLIENT_H
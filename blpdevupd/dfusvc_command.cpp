@@ -8,17 +8,124 @@
 
 #include <sstream>
 #include <map>
+#include <stdexcept>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/algorithm/hex.hpp>
 #include <boost/interprocess/containers/vector.hpp>
 #include <boost/interprocess/streams/vectorstream.hpp>
+#include <boost/interprocess/streams/bufferstream.hpp>
+#include <boost/make_shared.hpp>
+#include "dfusvc_lz4.h"
+#include <utility>
 
 
 
 namespace dfusvc
 {
 
+static const char k_lz4[] = "lz4";
+
+static void putData(boost::property_tree::ptree& pt,
+                    const FirmwareImage& data,
+                    const std::string& compression)
+    // Put image data hex encoded, compressed first if asked to
+{
+    // The hex is written once, straight into the tree
+    std::string hex;
+    if (compression == k_lz4) {
+        std::vector<uint8_t> block;
+        Lz4Codec::compress(data.data(), data.size(), block);
+        hex.reserve(block.size() * 2);
+        boost::algorithm::hex(block.begin(), block.end(), std::back_inserter(hex));
+        pt.put("compression", compression);
+        pt.put("size", data.size());
+    } else {
+        hex.reserve(data.size() * 2);
+        boost::algorithm::hex(data.begin(), data.end(), std::back_inserter(hex));
+    }
+    pt.put("data", std::string());
+    pt.get_child("data").data().swap(hex);
+}
+
+static FirmwareImage getData(const boost::property_tree::ptree& pt)
+    // Get image data put by putData(), throws if it is malformed or
+    // compressed in an unknown way. The image is decoded straight into
+    // the buffer it is shared from
+{
+    // The hex is read where the parser left it
+    static const std::string none;
+    auto child = pt.get_child_optional("data");
+    const std::string& hex = child ? child->data() : none;
+    std::string compression = pt.get<std::string>("compression", "");
+
+    std::vector<uint8_t> data;
+    if (compression.empty()) {
+        data.reserve(hex.size() / 2);
+        boost::algorithm::unhex(hex.c_str(), std::back_inserter(data));
+        return FirmwareImage(std::move(data));
+    }
+    if (compression != k_lz4) {
+        throw std::runtime_error("Unknown compression " + compression);
+    }
+    // Only the compressed block is held twice, the image is written
+    // once in place
+    std::vector<uint8_t> block;
+    block.reserve(hex.size() / 2);
+    boost::algorithm::unhex(hex.c_str(), std::back_inserter(block));
+    // The size comes from the client, nothing is allocated for more than
+    // the block can hold
+    size_t size = pt.get<size_t>("size");
+    if (size > Lz4Codec::maxSize(block.size())) {
+        throw std::runtime_error("Compressed data too small for its size");
+    }
+    data.resize(size);
+    if (Lz4Codec::decompress(block.data(), block.size(), data.data(), data.size()) < 0) {
+        throw std::runtime_error("Corrupt compressed data");
+    }
+    return FirmwareImage(std::move(data));
+}
+
+static void putDeadlines(boost::property_tree::ptree& pt, const Deadlines& deadlines)
+    // Put the deadlines set in a request, none if all are 0
+{
+    boost::property_tree::ptree child;
+    if (deadlines.open) {
+        child.put("open", deadlines.open);
+    }
+    if (deadlines.erase) {
+        child.put("erase", deadlines.erase);
+    }
+    if (deadlines.write) {
+        child.put("write", deadlines.write);
+    }
+    if (deadlines.manifest) {
+        child.put("manifest", deadlines.manifest);
+    }
+    if (deadlines.job) {
+        child.put("job", deadlines.job);
+    }
+    if (!child.empty()) {
+        pt.add_child("deadlines", child);
+    }
+}
+
+static Deadlines getDeadlines(const boost::property_tree::ptree& pt)
+    // Get the deadlines put by putDeadlines(), throws if they are
+    // malformed
+{
+    Deadlines deadlines;
+    auto child = pt.get_child_optional("deadlines");
+    if (child) {
+        deadlines.open = child->get<uint32_t>("open", 0);
+        deadlines.erase = child->get<uint32_t>("erase", 0);
+        deadlines.write = child->get<uint32_t>("write", 0);
+        deadlines.manifest = child->get<uint32_t>("manifest", 0);
+        deadlines.job = child->get<uint32_t>("job", 0);
+    }
+    return deadlines;
+}
+
 OpenRequest::OpenRequest()
 : d_pid(0)
 , d_vid(0)
@@ -44,10 +151,8 @@ int OpenRequest::serialize(std::vector<uint8_t>& raw)
         std::ostringstream buf;
         boost::property_tree::write_json(buf, pt, false);
 
-        raw.clear();
-        for (auto it : buf.str()) {
-            raw.push_back(it);
-        }
+        std::string json = buf.str();
+        raw.assign(json.begin(), json.end());
         return 0;
     }
     catch (const std::exception& exc) {
@@ -65,12 +170,10 @@ uint16_t OpenRequest::vid(void)
     return uint16_t(d_vid);
 }
 
-int OpenRequest::deserialize(std::vector<uint8_t> raw)
+int OpenRequest::deserialize(const MessageView& view)
 {
     try {
-        boost::property_tree::ptree pt_req;
-        std::istringstream is(std::string(raw.begin(), raw.end()));
-        read_json(is, pt_req);
+        const boost::property_tree::ptree& pt_req = view.tree();
 
         d_pid = pt_req.get<uint16_t>("pid");
         d_vid = pt_req.get<uint16_t>("vid");
@@ -86,8 +189,9 @@ OpenResponse::OpenResponse(void)
 {
 }
 
-OpenResponse::OpenResponse(int handle)
+OpenResponse::OpenResponse(int handle, const std::string& compression)
 : d_handle(handle)
+, d_compression(compression)
 {
 }
 
@@ -98,14 +202,15 @@ int OpenResponse::serialize(std::vector<uint8_t>& raw)
         boost::property_tree::ptree pt;
         pt.put("type", e_open);
         pt.put("handle", d_handle);
+        if (!d_compression.empty()) {
+            pt.put("compression", d_compression);
+        }
 
         std::ostringstream buf;
         boost::property_tree::write_json(buf, pt, false);
 
-        raw.clear();
-        for (auto it : buf.str()) {
-            raw.push_back(it);
-        }
+        std::string json = buf.str();
+        raw.assign(json.begin(), json.end());
         return 0;
     }
     catch (const std::exception& exc) {
@@ -118,7 +223,7 @@ int OpenResponse::handle(void)
     return d_handle;
 }
 
-int OpenResponse::deserialize(std::vector<uint8_t> raw)
+int OpenResponse::deserialize(const std::vector<uint8_t>& raw)
 {
     try {
         boost::property_tree::ptree pt_req;
@@ -126,6 +231,7 @@ int OpenResponse::deserialize(std::vector<uint8_t> raw)
         read_json(is, pt_req);
 
         d_handle = pt_req.get<int>("handle");
+        d_compression = pt_req.get<std::string>("compression", "");
 
         return 0;
     }
@@ -134,74 +240,194 @@ int OpenResponse::deserialize(std::vector<uint8_t> raw)
     }
 }
 
+std::string OpenResponse::compression(void)
+{
+    return d_compression;
+}
 
 DownloadRequest::DownloadRequest()
 : d_handle(-1)
+, d_dfuseAddress(0)
+, d_massErase(false)
+, d_leave(false)
+, d_dryRun(false)
+, d_delta(false)
+, d_verify(false)
 {
-    d_data.clear();
 }
-DownloadRequest::DownloadRequest(int handle, std::vector<uint8_t>& data)
+DownloadRequest::DownloadRequest(int handle,
+                                 std::vector<uint8_t>& data,
+                                 uint32_t dfuseAddress,
+                                 bool massErase,
+                                 bool leave,
+                                 bool dryRun,
+                                 bool delta,
+                                 bool verify,
+                                 const std::string& image)
 : d_handle(handle)
-, d_data(data)
+, d_dfuseAddress(dfuseAddress)
+, d_massErase(massErase)
+, d_leave(leave)
+, d_dryRun(dryRun)
+, d_delta(delta)
+, d_verify(verify)
+, d_image(image)
 {
+    if (d_image.empty()) {
+        d_data = FirmwareImage(data);
+    }
 }
 int DownloadRequest::serialize(std::vector<uint8_t>& raw)
 {
     try {
-        std::ostringstream oss;
-        boost::algorithm::hex(d_data.begin(), d_data.end(), std::ostream_iterator<char>(oss));
         boost::property_tree::ptree pt;
         pt.put("type", e_download);
         pt.put("handle", d_handle);
-        pt.put("data", oss.str());
+        putImage(pt);
 
         std::ostringstream buf;
         boost::property_tree::write_json(buf, pt, false);
 
-        raw.clear();
-        for (auto it : buf.str()) {
-            raw.push_back(it);
-        }
+        std::string json = buf.str();
+        raw.assign(json.begin(), json.end());
         return 0;
     } catch (const std::exception& exc) {
         return -1;
     }
 }
-int DownloadRequest::deserialize(std::vector<uint8_t> raw)
+int DownloadRequest::deserialize(const MessageView& view)
 {
     try {
-        boost::property_tree::ptree pt_req;
-        std::istringstream is(std::string(raw.begin(), raw.end()));
-        read_json(is, pt_req);
+        const boost::property_tree::ptree& pt_req = view.tree();
 
         d_handle = pt_req.get<int>("handle");
-        std::string& heximage = pt_req.get<std::string>("data");
-
-        boost::algorithm::unhex(heximage.c_str(), std::back_inserter(d_data));
+        getImage(pt_req);
         return 0;
     } catch (const std::exception& exc) {
         return -1;
     }
 }
 
+void DownloadRequest::putImage(boost::property_tree::ptree& pt)
+{
+    // A staged image is only named
+    if (d_image.empty()) {
+        putData(pt, d_data, d_compression);
+    } else {
+        pt.put("image", d_image);
+    }
+    // DfuSe options are only sent when used
+    if (d_dfuseAddress) {
+        pt.put("dfuse_address", d_dfuseAddress);
+    }
+    if (d_massErase) {
+        pt.put("mass_erase", d_massErase);
+    }
+    if (d_leave) {
+        pt.put("leave", d_leave);
+    }
+    if (d_dryRun) {
+        pt.put("dry_run", d_dryRun);
+    }
+    if (d_delta) {
+        pt.put("delta", d_delta);
+    }
+    if (d_verify) {
+        pt.put("verify", d_verify);
+    }
+    putDeadlines(pt, d_deadlines);
+}
+
+void DownloadRequest::getImage(const boost::property_tree::ptree& pt_req)
+{
+    d_dfuseAddress = pt_req.get<uint32_t>("dfuse_address", 0);
+    d_massErase = pt_req.get<bool>("mass_erase", false);
+    d_leave = pt_req.get<bool>("leave", false);
+    d_dryRun = pt_req.get<bool>("dry_run", false);
+    d_delta = pt_req.get<bool>("delta", false);
+    d_verify = pt_req.get<bool>("verify", false);
+    d_image = pt_req.get<std::string>("image", "");
+    d_deadlines = getDeadlines(pt_req);
+    d_data = getData(pt_req);
+}
+
+void DownloadRequest::setData(const FirmwareImage& data)
+{
+    d_data = data;
+}
+
+void DownloadRequest::setCompression(const std::string& compression)
+{
+    d_compression = compression;
+}
+
+void DownloadRequest::setDeadlines(const Deadlines& deadlines)
+{
+    d_deadlines = deadlines;
+}
+
+Deadlines DownloadRequest::deadlines(void)
+{
+    return d_deadlines;
+}
+
 int DownloadRequest::handle(void)
 {
     return d_handle;
 }
 
-std::vector<uint8_t> DownloadRequest::data(void)
+const FirmwareImage& DownloadRequest::data(void)
 {
     return d_data;
 }
 
+uint32_t DownloadRequest::dfuseAddress(void)
+{
+    return d_dfuseAddress;
+}
+
+bool DownloadRequest::massErase(void)
+{
+    return d_massErase;
+}
+
+bool DownloadRequest::leave(void)
+{
+    return d_leave;
+}
+
+bool DownloadRequest::dryRun(void)
+{
+    return d_dryRun;
+}
+
+bool DownloadRequest::delta(void)
+{
+    return d_delta;
+}
+
+bool DownloadRequest::verify(void)
+{
+    return d_verify;
+}
+
+std::string DownloadRequest::image(void)
+{
+    return d_image;
+}
+
 DownloadResponse::DownloadResponse(size_t sent, 
                                    size_t total,
                                    int handle,
-                                   bool last)
+                                   bool last,
+                                   const std::string& erasePlan,
+                                   const std::string& verifyReport)
 : d_sent(sent)
 , d_total(total)
 , d_last(last)
 , d_handle(handle)
+, d_erasePlan(erasePlan)
+, d_verifyReport(verifyReport)
 {
 }
 
@@ -214,12 +440,16 @@ int DownloadResponse::serialize(std::vector<uint8_t>& raw)
         pt_resp.put("bytes_downloaded", d_sent);
         pt_resp.put("bytes_total", d_total);
         pt_resp.put("handle", d_handle);
+        if (!d_erasePlan.empty()) {
+            pt_resp.put("erase_plan", d_erasePlan);
+        }
+        if (!d_verifyReport.empty()) {
+            pt_resp.put("verify", d_verifyReport);
+        }
         std::ostringstream sresponse;
         boost::property_tree::write_json(sresponse, pt_resp, false);
-        raw.clear();
-        for (auto it : sresponse.str()) {
-            raw.push_back(it);
-        }
+        std::string json = sresponse.str();
+        raw.assign(json.begin(), json.end());
         return 0;
     } catch (const std::exception& exc) {
         return -1;
@@ -229,7 +459,7 @@ int DownloadResponse::handle(void)
 {
     return d_handle;
 }
-int DownloadResponse::deserialize(std::vector<uint8_t> raw)
+int DownloadResponse::deserialize(const std::vector<uint8_t>& raw)
 {
     try {
         boost::property_tree::ptree pt_req;
@@ -240,6 +470,8 @@ int DownloadResponse::deserialize(std::vector<uint8_t> raw)
         d_total = pt_req.get<size_t>("bytes_total");
         d_last = pt_req.get<bool>("lastResponse");
         d_handle = pt_req.get<int>("handle");
+        d_erasePlan = pt_req.get<std::string>("erase_plan", "");
+        d_verifyReport = pt_req.get<std::string>("verify", "");
         return 0;
     } catch (const std::exception& exc) {
         return -1;
@@ -257,15 +489,540 @@ bool DownloadResponse::final(void)
 {
     return d_last;
 }
-int CommandRequestUtil::getCommandType(CommandType& type, std::vector<uint8_t> raw)
+std::string DownloadResponse::erasePlan(void)
+{
+    return d_erasePlan;
+}
+std::string DownloadResponse::verifyReport(void)
 {
-    boost::property_tree::ptree pt_req;
-    std::istringstream is(std::string(raw.begin(), raw.end()));
-    read_json(is, pt_req);
+    return d_verifyReport;
+}
 
-    type = static_cast<CommandType>(pt_req.get<int>("type"));
+MultiDownloadRequest::MultiDownloadRequest()
+{
+}
 
-    return 0;
+MultiDownloadRequest::MultiDownloadRequest(const std::vector<int>& handles,
+                                           std::vector<uint8_t>& data,
+                                           uint32_t dfuseAddress,
+                                           bool massErase,
+                                           bool leave,
+                                           bool dryRun,
+                                           bool delta,
+                                           bool verify,
+                                           const std::string& image)
+: DownloadRequest(-1, data, dfuseAddress, massErase, leave, dryRun, delta, verify, image)
+, d_handles(handles)
+{
+}
+
+int MultiDownloadRequest::serialize(std::vector<uint8_t>& raw)
+{
+    try {
+        boost::property_tree::ptree pt;
+        pt.put("type", e_multiDownload);
+        boost::property_tree::ptree handles;
+        for (int handle : d_handles) {
+            boost::property_tree::ptree item;
+            item.put("", handle);
+            handles.push_back(std::make_pair("", item));
+        }
+        pt.add_child("handles", handles);
+        putImage(pt);
+
+        std::ostringstream buf;
+        boost::property_tree::write_json(buf, pt, false);
+
+        std::string json = buf.str();
+        raw.assign(json.begin(), json.end());
+        return 0;
+    } catch (const std::exception& exc) {
+        return -1;
+    }
+}
+
+int MultiDownloadRequest::deserialize(const MessageView& view)
+{
+    try {
+        const boost::property_tree::ptree& pt_req = view.tree();
+
+        d_handles.clear();
+        for (auto& item : pt_req.get_child("handles")) {
+            d_handles.push_back(item.second.get_value<int>());
+        }
+        getImage(pt_req);
+        return 0;
+    } catch (const std::exception& exc) {
+        return -1;
+    }
+}
+
+std::vector<int> MultiDownloadRequest::handles(void)
+{
+    return d_handles;
+}
+
+MultiDownloadResponse::MultiDownloadResponse(const std::vector<DownloadResult>& results)
+: d_results(results)
+{
+}
+
+int MultiDownloadResponse::serialize(std::vector<uint8_t>& raw)
+{
+    try {
+        boost::property_tree::ptree pt_resp;
+        boost::property_tree::ptree results;
+        size_t failed = 0;
+        for (auto& result : d_results) {
+            boost::property_tree::ptree item;
+            item.put("handle", result.handle);
+            item.put("bytes_downloaded", result.sent);
+            item.put("error", result.error);
+            if (!result.reason.empty()) {
+                item.put("reason", result.reason);
+            }
+            if (!result.report.empty()) {
+                item.put("report", result.report);
+            }
+            results.push_back(std::make_pair("", item));
+            if (result.error != e_noError) {
+                failed++;
+            }
+        }
+        pt_resp.put("type", e_multiDownload);
+        pt_resp.put("lastResponse", true);
+        pt_resp.put("succeeded", d_results.size() - failed);
+        pt_resp.put("failed", failed);
+        pt_resp.add_child("results", results);
+        std::ostringstream sresponse;
+        boost::property_tree::write_json(sresponse, pt_resp, false);
+        std::string json = sresponse.str();
+        raw.assign(json.begin(), json.end());
+        return 0;
+    } catch (const std::exception& exc) {
+        return -1;
+    }
+}
+
+int MultiDownloadResponse::deserialize(const std::vector<uint8_t>& raw)
+{
+    try {
+        boost::property_tree::ptree pt_req;
+        std::istringstream is(std::string(raw.begin(), raw.end()));
+        read_json(is, pt_req);
+
+        d_results.clear();
+        for (auto& item : pt_req.get_child("results")) {
+            DownloadResult result;
+            result.handle = item.second.get<int>("handle");
+            result.sent = item.second.get<size_t>("bytes_downloaded");
+            result.error = static_cast<ErrorType>(item.second.get<int>("error"));
+            result.reason = item.second.get<std::string>("reason", "");
+            result.report = item.second.get<std::string>("report", "");
+            d_results.push_back(result);
+        }
+        return 0;
+    } catch (const std::exception& exc) {
+        return -1;
+    }
+}
+
+std::vector<DownloadResult> MultiDownloadResponse::results(void)
+{
+    return d_results;
+}
+StageImageRequest::StageImageRequest()
+{
+}
+
+StageImageRequest::StageImageRequest(const std::vector<uint8_t>& data)
+: d_data(FirmwareImage(data))
+{
+}
+
+int StageImageRequest::serialize(std::vector<uint8_t>& raw)
+{
+    try {
+        boost::property_tree::ptree pt;
+        pt.put("type", e_stageImage);
+        putData(pt, d_data, d_compression);
+
+        std::ostringstream buf;
+        boost::property_tree::write_json(buf, pt, false);
+
+        std::string json = buf.str();
+        raw.assign(json.begin(), json.end());
+        return 0;
+    } catch (const std::exception& exc) {
+        return -1;
+    }
+}
+
+const FirmwareImage& StageImageRequest::data(void)
+{
+    return d_data;
+}
+
+int StageImageRequest::deserialize(const MessageView& view)
+{
+    try {
+        const boost::property_tree::ptree& pt_req = view.tree();
+
+        d_data = getData(pt_req);
+        return 0;
+    } catch (const std::exception& exc) {
+        return -1;
+    }
+}
+
+void StageImageRequest::setData(const FirmwareImage& data)
+{
+    d_data = data;
+}
+
+void StageImageRequest::setCompression(const std::string& compression)
+{
+    d_compression = compression;
+}
+
+StageImageResponse::StageImageResponse(const std::string& digest, size_t size)
+: d_digest(digest)
+, d_size(size)
+{
+}
+
+int StageImageResponse::serialize(std::vector<uint8_t>& raw)
+{
+    try {
+        boost::property_tree::ptree pt_resp;
+        pt_resp.put("type", e_stageImage);
+        pt_resp.put("digest", d_digest);
+        pt_resp.put("size", d_size);
+        std::ostringstream sresponse;
+        boost::property_tree::write_json(sresponse, pt_resp, false);
+        std::string json = sresponse.str();
+        raw.assign(json.begin(), json.end());
+        return 0;
+    } catch (const std::exception& exc) {
+        return -1;
+    }
+}
+
+int StageImageResponse::deserialize(const std::vector<uint8_t>& raw)
+{
+    try {
+        boost::property_tree::ptree pt_req;
+        std::istringstream is(std::string(raw.begin(), raw.end()));
+        read_json(is, pt_req);
+
+        d_digest = pt_req.get<std::string>("digest");
+        d_size = pt_req.get<size_t>("size");
+        return 0;
+    } catch (const std::exception& exc) {
+        return -1;
+    }
+}
+
+std::string StageImageResponse::digest(void)
+{
+    return d_digest;
+}
+
+size_t StageImageResponse::size(void)
+{
+    return d_size;
+}
+
+UploadRequest::UploadRequest()
+: d_handle(-1)
+, d_dfuseAddress(0)
+, d_length(0)
+{
+}
+
+UploadRequest::UploadRequest(int handle,
+                             uint32_t dfuseAddress,
+                             size_t length,
+                             const std::string& hash,
+                             const std::string& file)
+: d_handle(handle)
+, d_dfuseAddress(dfuseAddress)
+, d_length(length)
+, d_hash(hash)
+, d_file(file)
+{
+}
+
+int UploadRequest::serialize(std::vector<uint8_t>& raw)
+{
+    try {
+        boost::property_tree::ptree pt;
+        pt.put("type", e_upload);
+        pt.put("handle", d_handle);
+        if (d_dfuseAddress) {
+            pt.put("dfuse_address", d_dfuseAddress);
+        }
+        if (d_length) {
+            pt.put("length", d_length);
+        }
+        if (!d_hash.empty()) {
+            pt.put("hash", d_hash);
+        }
+        if (!d_file.empty()) {
+            pt.put("file", d_file);
+        }
+        putDeadlines(pt, d_deadlines);
+
+        std::ostringstream buf;
+        boost::property_tree::write_json(buf, pt, false);
+
+        std::string json = buf.str();
+        raw.assign(json.begin(), json.end());
+        return 0;
+    } catch (const std::exception& exc) {
+        return -1;
+    }
+}
+
+int UploadRequest::deserialize(const MessageView& view)
+{
+    try {
+        const boost::property_tree::ptree& pt_req = view.tree();
+
+        d_handle = pt_req.get<int>("handle");
+        d_dfuseAddress = pt_req.get<uint32_t>("dfuse_address", 0);
+        d_length = pt_req.get<size_t>("length", 0);
+        d_hash = pt_req.get<std::string>("hash", "");
+        d_file = pt_req.get<std::string>("file", "");
+        d_deadlines = getDeadlines(pt_req);
+        return 0;
+    } catch (const std::exception& exc) {
+        return -1;
+    }
+}
+
+int UploadRequest::handle(void)
+{
+    return d_handle;
+}
+
+uint32_t UploadRequest::dfuseAddress(void)
+{
+    return d_dfuseAddress;
+}
+
+Deadlines UploadRequest::deadlines(void)
+{
+    return d_deadlines;
+}
+
+void UploadRequest::setDeadlines(const Deadlines& deadlines)
+{
+    d_deadlines = deadlines;
+}
+
+size_t UploadRequest::length(void)
+{
+    return d_length;
+}
+
+std::string UploadRequest::hash(void)
+{
+    return d_hash;
+}
+
+std::string UploadRequest::file(void)
+{
+    return d_file;
+}
+
+UploadResponse::UploadResponse(int handle,
+                               uint32_t address,
+                               size_t offset,
+                               const std::vector<uint8_t>& data,
+                               bool last,
+                               const std::string& digest)
+: d_handle(handle)
+, d_address(address)
+, d_offset(offset)
+, d_data(data)
+, d_last(last)
+, d_digest(digest)
+{
+}
+
+int UploadResponse::serialize(std::vector<uint8_t>& raw)
+{
+    try {
+        std::ostringstream oss;
+        boost::algorithm::hex(d_data.begin(), d_data.end(), std::ostream_iterator<char>(oss));
+        boost::property_tree::ptree pt_resp;
+        pt_resp.put("type", e_upload);
+        pt_resp.put("lastResponse", d_last);
+        pt_resp.put("handle", d_handle);
+        pt_resp.put("address", d_address);
+        pt_resp.put("offset", d_offset);
+        pt_resp.put("bytes_uploaded", d_offset + d_data.size());
+        pt_resp.put("data", oss.str());
+        if (!d_digest.empty()) {
+            pt_resp.put("digest", d_digest);
+        }
+        std::ostringstream sresponse;
+        boost::property_tree::write_json(sresponse, pt_resp, false);
+        std::string json = sresponse.str();
+        raw.assign(json.begin(), json.end());
+        return 0;
+    } catch (const std::exception& exc) {
+        return -1;
+    }
+}
+
+int UploadResponse::deserialize(const std::vector<uint8_t>& raw)
+{
+    try {
+        boost::property_tree::ptree pt_req;
+        std::istringstream is(std::string(raw.begin(), raw.end()));
+        read_json(is, pt_req);
+
+        d_handle = pt_req.get<int>("handle");
+        d_address = pt_req.get<uint32_t>("address");
+        d_offset = pt_req.get<size_t>("offset");
+        d_last = pt_req.get<bool>("lastResponse");
+        std::string heximage = pt_req.get<std::string>("data");
+        d_data.clear();
+        boost::algorithm::unhex(heximage.c_str(), std::back_inserter(d_data));
+        d_digest = pt_req.get<std::string>("digest", "");
+        return 0;
+    } catch (const std::exception& exc) {
+        return -1;
+    }
+}
+
+int UploadResponse::handle(void)
+{
+    return d_handle;
+}
+
+uint32_t UploadResponse::address(void)
+{
+    return d_address;
+}
+
+size_t UploadResponse::offset(void)
+{
+    return d_offset;
+}
+
+std::vector<uint8_t> UploadResponse::data(void)
+{
+    return d_data;
+}
+
+bool UploadResponse::final(void)
+{
+    return d_last;
+}
+
+std::string UploadResponse::digest(void)
+{
+    return d_digest;
+}
+
+int CommandRequestUtil::getCommandType(CommandType& type, const std::vector<uint8_t>& raw)
+{
+    MessageView view;
+    int ret = view.parse(raw);
+    type = view.type();
+    return ret;
+}
+
+void CommandRequestUtil::setRequestId(std::vector<uint8_t>& raw, uint32_t id)
+{
+    setField(raw, "id", std::to_string(id));
+}
+
+void CommandRequestUtil::setField(std::vector<uint8_t>& raw,
+                                  const std::string& name,
+                                  const std::string& value)
+{
+    // Every message is a JSON object, the field goes in front of its first
+    // one rather than through the tree again
+    if (raw.empty() || raw[0] != '{') {
+        return;
+    }
+    boost::property_tree::ptree pt;
+    pt.put(boost::property_tree::ptree::path_type(name, '\0'), value);
+    std::ostringstream buf;
+    boost::property_tree::write_json(buf, pt, false);
+    // {"name":"value"}\n, escaped by the writer
+    std::string field = buf.str();
+    field = field.substr(1, field.find_last_of('}') - 1) + ",";
+    raw.insert(raw.begin() + 1, field.begin(), field.end());
+}
+
+MessageView::MessageView(void)
+: d_type(e_unknown)
+, d_id(0)
+, d_priority(0)
+{
+}
+
+CommandType MessageView::type(void) const
+{
+    return d_type;
+}
+
+uint32_t MessageView::id(void) const
+{
+    return d_id;
+}
+
+int MessageView::priority(void) const
+{
+    return d_priority;
+}
+
+const std::string& MessageView::client(void) const
+{
+    return d_client;
+}
+
+const boost::property_tree::ptree& MessageView::tree(void) const
+{
+    return *d_tree;
+}
+
+int MessageView::parse(const std::vector<uint8_t>& raw)
+{
+    try {
+        // Read in place, a download request is megabytes of hex
+        boost::interprocess::ibufferstream is(reinterpret_cast<const char *>(raw.data()), raw.size());
+        auto tree = boost::make_shared<boost::property_tree::ptree>();
+        read_json(is, *tree);
+
+        d_type = static_cast<CommandType>(tree->get<int>("type", e_unknown));
+        d_id = tree->get<uint32_t>("id", 0);
+        d_priority = tree->get<int>("priority", 0);
+        d_client = tree->get<std::string>("client", "");
+        d_tree = tree;
+        return 0;
+    } catch (const std::exception& exc) {
+        d_type = e_unknown;
+        d_id = 0;
+        d_priority = 0;
+        d_client.clear();
+        d_tree.reset();
+        return -1;
+    }
+}
+
+int CommandRequest::deserialize(const std::vector<uint8_t>& raw)
+{
+    MessageView view;
+    if (view.parse(raw) < 0) {
+        return -1;
+    }
+    return deserialize(view);
 }
 
 CloseRequest::CloseRequest(void)
@@ -288,10 +1045,8 @@ int CloseRequest::serialize(std::vector<uint8_t>& raw)
         pt_resp.put("handle", d_handle);
         std::ostringstream sresponse;
         boost::property_tree::write_json(sresponse, pt_resp, false);
-        raw.clear();
-        for (auto it : sresponse.str()) {
-            raw.push_back(it);
-        }
+        std::string json = sresponse.str();
+        raw.assign(json.begin(), json.end());
         return 0;
     }
     catch (const std::exception& exc) {
@@ -304,12 +1059,10 @@ int CloseRequest::handle(void)
     return d_handle;
 }
 
-int CloseRequest::deserialize(std::vector<uint8_t> raw)
+int CloseRequest::deserialize(const MessageView& view)
 {
     try {
-        boost::property_tree::ptree pt_req;
-        std::istringstream is(std::string(raw.begin(), raw.end()));
-        read_json(is, pt_req);
+        const boost::property_tree::ptree& pt_req = view.tree();
 
         d_handle = pt_req.get<int>("handle");
         return 0;
@@ -331,10 +1084,8 @@ int CloseResponse::serialize(std::vector<uint8_t>& raw)
         pt_resp.put("type", e_close);
         std::ostringstream sresponse;
         boost::property_tree::write_json(sresponse, pt_resp, false);
-        raw.clear();
-        for (auto it : sresponse.str()) {
-            raw.push_back(it);
-        }
+        std::string json = sresponse.str();
+        raw.assign(json.begin(), json.end());
         return 0;
     }
     catch (const std::exception& exc) {
@@ -342,11 +1093,126 @@ int CloseResponse::serialize(std::vector<uint8_t>& raw)
     }
 }
 
-int CloseResponse::deserialize(std::vector<uint8_t> raw)
+int CloseResponse::deserialize(const std::vector<uint8_t>& raw)
 {
     return 0;
 }
 
+ListRequest::ListRequest(void)
+{
+}
+
+int ListRequest::serialize(std::vector<uint8_t>& raw)
+{
+    try {
+        boost::property_tree::ptree pt_req;
+        pt_req.put("type", e_list);
+        std::ostringstream sresponse;
+        boost::property_tree::write_json(sresponse, pt_req, false);
+        std::string json = sresponse.str();
+        raw.assign(json.begin(), json.end());
+        return 0;
+    }
+    catch (const std::exception& exc) {
+        return -1;
+    }
+}
+
+int ListRequest::deserialize(const MessageView& view)
+{
+    return 0;
+}
+
+ListResponse::ListResponse(const std::vector<DeviceInfo>& devices,
+                           const std::vector<BusUsage>& buses)
+: d_devices(devices)
+, d_buses(buses)
+{
+}
+
+int ListResponse::serialize(std::vector<uint8_t>& raw)
+{
+    try {
+        boost::property_tree::ptree pt_resp;
+        boost::property_tree::ptree devices;
+        for (auto& device : d_devices) {
+            boost::property_tree::ptree item;
+            item.put("handle", device.handle);
+            item.put("vid", device.vid);
+            item.put("pid", device.pid);
+            item.put("path", device.path);
+            devices.push_back(std::make_pair("", item));
+        }
+        boost::property_tree::ptree buses;
+        for (auto& bus : d_buses) {
+            boost::property_tree::ptree item;
+            item.put("bus", bus.bus);
+            item.put("sessions", bus.sessions);
+            item.put("bytes", bus.bytes);
+            item.put("bytesPerSecond", bus.bytesPerSecond);
+            buses.push_back(std::make_pair("", item));
+        }
+        pt_resp.put("type", e_list);
+        pt_resp.add_child("devices", devices);
+        pt_resp.add_child("buses", buses);
+        std::ostringstream sresponse;
+        boost::property_tree::write_json(sresponse, pt_resp, false);
+        std::string json = sresponse.str();
+        raw.assign(json.begin(), json.end());
+        return 0;
+    }
+    catch (const std::exception& exc) {
+        return -1;
+    }
+}
+
+int ListResponse::deserialize(const std::vector<uint8_t>& raw)
+{
+    try {
+        boost::property_tree::ptree pt_resp;
+        std::istringstream is(std::string(raw.begin(), raw.end()));
+        read_json(is, pt_resp);
+
+        d_devices.clear();
+        // An empty array is written as an empty string
+        for (auto& item : pt_resp.get_child("devices")) {
+            DeviceInfo device;
+            device.handle = item.second.get<int>("handle");
+            device.vid = item.second.get<uint16_t>("vid");
+            device.pid = item.second.get<uint16_t>("pid");
+            device.path = item.second.get<std::string>("path", "");
+            d_devices.push_back(device);
+        }
+        d_buses.clear();
+        // Servers that do not schedule by bus leave it out
+        auto buses = pt_resp.get_child_optional("buses");
+        if (buses) {
+            for (auto& item : *buses) {
+                BusUsage bus;
+                bus.bus = item.second.get<int>("bus");
+                bus.sessions = item.second.get<size_t>("sessions");
+                bus.bytes = item.second.get<uint64_t>("bytes");
+                bus.bytesPerSecond = item.second.get<uint32_t>("bytesPerSecond");
+                d_buses.push_back(bus);
+            }
+        }
+        return 0;
+    }
+    catch (const std::exception& exc) {
+        return -1;
+    }
+}
+
+std::vector<DeviceInfo> ListResponse::devices(void)
+{
+    return d_devices;
+}
+
+std::vector<BusUsage> ListResponse::buses(void)
+{
+    return d_buses;
+}
+
 ErrorResponse::ErrorResponse(ErrorType err, 
                              std::string errString)
 :d_err(err)
@@ -364,10 +1230,8 @@ int ErrorResponse::serialize(std::vector<uint8_t>& raw)
         pt_resp.put("errorString", d_string);
         std::ostringstream sresponse;
         boost::property_tree::write_json(sresponse, pt_resp, false);
-        raw.clear();
-        for (auto it : sresponse.str()) {
-            raw.push_back(it);
-        }
+        std::string json = sresponse.str();
+        raw.assign(json.begin(), json.end());
         return 0;
     }
     catch (const std::exception& exc) {
@@ -377,15 +1241,15 @@ int ErrorResponse::serialize(std::vector<uint8_t>& raw)
 
 ErrorType ErrorResponse::errorCode(void)
 {
-    return ErrorType();
+    return d_err;
 }
 
 std::string ErrorResponse::errorString(void)
 {
-    return std::string();
+    return d_string;
 }
 
-int ErrorResponse::deserialize(std::vector<uint8_t> raw)
+int ErrorResponse::deserialize(const std::vector<uint8_t>& raw)
 {
     try {
         boost::property_tree::ptree pt_req;
@@ -413,10 +1277,8 @@ int TerminateRequest::serialize(std::vector<uint8_t>& raw)
         pt_resp.put("type", e_terminate);
         std::ostringstream sresponse;
         boost::property_tree::write_json(sresponse, pt_resp, false);
-        raw.clear();
-        for (auto it : sresponse.str()) {
-            raw.push_back(it);
-        }
+        std::string json = sresponse.str();
+        raw.assign(json.begin(), json.end());
         return 0;
     }
     catch (const std::exception& exc) {
@@ -424,7 +1286,7 @@ int TerminateRequest::serialize(std::vector<uint8_t>& raw)
     }
 }
 
-int TerminateRequest::deserialize(std::vector<uint8_t> raw)
+int TerminateRequest::deserialize(const MessageView& view)
 {
     return 0;
 }
@@ -440,10 +1302,8 @@ int TerminateResponse::serialize(std::vector<uint8_t>& raw)
         pt_resp.put("type", e_terminate);
         std::ostringstream sresponse;
         boost::property_tree::write_json(sresponse, pt_resp, false);
-        raw.clear();
-        for (auto it : sresponse.str()) {
-            raw.push_back(it);
-        }
+        std::string json = sresponse.str();
+        raw.assign(json.begin(), json.end());
         return 0;
     }
     catch (const std::exception& exc) {
@@ -451,7 +1311,7 @@ int TerminateResponse::serialize(std::vector<uint8_t>& raw)
     }
 }
 
-int TerminateResponse::deserialize(std::vector<uint8_t> raw)
+int TerminateResponse::deserialize(const std::vector<uint8_t>& raw)
 {
     return 0;
 }
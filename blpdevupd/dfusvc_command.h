@@ -8,7 +8,10 @@
 #include <vector>
 #include <memory>
 #include <string>
+#include <boost/property_tree/ptree_fwd.hpp>
+#include <boost/shared_ptr.hpp>
 #include <dfutransport.h>
+#include "dfusvc_firmware_image.h"
 
 namespace dfusvc {
 
@@ -18,7 +21,11 @@ enum CommandType{
     e_download,
     e_close,
     e_error,
-    e_terminate
+    e_terminate,
+    e_upload,
+    e_stageImage,
+    e_multiDownload,
+    e_list
 };
 
 enum ErrorType {
@@ -27,31 +34,96 @@ enum ErrorType {
     e_timeoutErr,
     e_deviceErr,
     e_commErr,
-    e_unknownCmdErr
+    e_unknownCmdErr,
+    e_imageErr,     // the image is corrupt or not meant for the device
+    e_cancelledErr, // the client withdrew the request before sending it
+    e_verifyErr     // the image read back different, the reason is the
+                    // verify report
 };
 
 
 
+struct Deadlines
+{
+// Milliseconds a device may take, 0 for no deadline. A download or upload
+// that outlasts one aborts the device and fails with e_timeoutErr
+    uint32_t open = 0;
+        // Until the device is ready for the transfer
+    uint32_t erase = 0;
+        // One DfuSe erase, mass erase included
+    uint32_t write = 0;
+        // One block, until the device has written it
+    uint32_t manifest = 0;
+        // From the end of the image until the device manifested
+    uint32_t job = 0;
+        // The whole download or upload
+};
+
                         // =====================
                         // class CommandRequest
                         // =====================
 
+class MessageView
+{
+// A client message parsed once. The server picks the command by its type,
+// then the command reads its request from the same tree.
+private:
+    // DATA
+    boost::shared_ptr<const boost::property_tree::ptree> d_tree;
+    CommandType d_type;
+    uint32_t d_id;
+    int d_priority;
+    std::string d_client;
+public:
+    // CREATORS
+    MessageView(void);
+
+    // ACCESSORS
+    CommandType type(void) const;
+        // Type of the message, e_unknown if it has none or was not parsed
+    uint32_t id(void) const;
+        // Request id of the message envelope, 0 if it has none
+    int priority(void) const;
+        // Priority of the request among the queued jobs, higher first.
+        // 0 if it has none
+    const std::string& client(void) const;
+        // Name of the client that sent the request, jobs are shared
+        // fairly between clients. Empty if it has none
+    const boost::property_tree::ptree& tree(void) const;
+        // The parsed message, only after parse() succeeded
+
+    // MANIPULTORS
+    int parse(const std::vector<uint8_t>& raw);
+        // Parse a raw message, returns -1 if it is not valid JSON
+};
+
 class CommandRequest 
 {
 // Interface class for all client to server requests
 public:
     virtual int serialize(std::vector<uint8_t>& raw) = 0;
         // serialize message function
-    virtual int deserialize(std::vector<uint8_t> raw) = 0;
+    virtual int deserialize(const std::vector<uint8_t>& raw);
         // Deserialize message function
+    virtual int deserialize(const MessageView& view) = 0;
+        // Deserialize a message already parsed
 };
 
 class CommandRequestUtil
 {
 // Command Request util class
 public:
-    static int getCommandType(CommandType& type, std::vector<uint8_t> raw);
+    static int getCommandType(CommandType& type, const std::vector<uint8_t>& raw);
         // Extract command type from Command Request
+    static void setRequestId(std::vector<uint8_t>& raw, uint32_t id);
+        // Put id in the envelope of a serialized message that has none.
+        // A client tags its requests, the server tags every response with
+        // the id of the request it answers
+    static void setField(std::vector<uint8_t>& raw,
+                         const std::string& name,
+                         const std::string& value);
+        // Put a field the message has not got in its envelope, such as
+        // "priority" or "client"
 };
 
 class CommandResponse
@@ -60,7 +132,7 @@ class CommandResponse
 public:
     virtual int serialize(std::vector<uint8_t>& raw) = 0;
         // serialize message function
-    virtual int deserialize(std::vector<uint8_t> raw) = 0;
+    virtual int deserialize(const std::vector<uint8_t>& raw) = 0;
         // Deserialize message function
 };
 
@@ -85,7 +157,8 @@ public:
         // vid field accessors
     
     //MANIPULTORS
-    int deserialize(std::vector<uint8_t> raw) override;
+    using CommandRequest::deserialize;
+    int deserialize(const MessageView& view) override;
         // Deserialize message function
 };
 
@@ -96,10 +169,11 @@ class OpenResponse : public CommandResponse
 private:
     // DATA
     int d_handle;
+    std::string d_compression;
 public:
     // CREATORS
     OpenResponse(void);
-    OpenResponse(int handle);
+    OpenResponse(int handle, const std::string& compression = std::string());
 
     // ACCESSORS
     int serialize(std::vector<uint8_t>& raw) override;
@@ -107,9 +181,12 @@ public:
 
     int handle(void);
         // Device handle accessor
+    std::string compression(void);
+        // Comma separated compressions the server accepts for image
+        // data, empty if it only takes it uncompressed
 
     //MANIPULTORS
-    int deserialize(std::vector<uint8_t> raw) override;
+    int deserialize(const std::vector<uint8_t>& raw) override;
         // Deserialize message function
 };
 
@@ -119,23 +196,78 @@ class DownloadRequest : public CommandRequest
 private:
     // DATA
     int d_handle;
-    std::vector<uint8_t> d_data;
+    FirmwareImage d_data;
+    uint32_t d_dfuseAddress;
+    bool d_massErase;
+    bool d_leave;
+    bool d_dryRun;
+    bool d_delta;
+    bool d_verify;
+    std::string d_image;
+    std::string d_compression;
+    Deadlines d_deadlines;
+protected:
+    // ACCESSORS
+    void putImage(boost::property_tree::ptree& pt);
+        // Put the image and download options in a request
+    // MANIPULTORS
+    void getImage(const boost::property_tree::ptree& pt);
+        // Get the image and download options from a request, throws
+        // if they are malformed
 public:
     // CREATORS
     DownloadRequest();
-    DownloadRequest(int handle, std::vector<uint8_t>& data);
+    DownloadRequest(int handle,
+                    std::vector<uint8_t>& data,
+                    uint32_t dfuseAddress = 0,
+                    bool massErase = false,
+                    bool leave = false,
+                    bool dryRun = false,
+                    bool delta = false,
+                    bool verify = false,
+                    const std::string& image = std::string());
+        // data is ignored, and may be empty, when image names a staged
+        // image
     
     // ACCESSORS
     int serialize(std::vector<uint8_t>& raw) override;
         // serialize message function
     int handle(void);
         // handle field accessor
-    std::vector<uint8_t> data(void);
-        // data field accessor
+    const FirmwareImage& data(void);
+        // data field accessor, shared with the request
+    uint32_t dfuseAddress(void);
+        // DfuSe start address of a raw image, 0 for a DfuSe file or a
+        // device without DfuSe support
+    bool massErase(void);
+        // Return true if a DfuSe device is mass erased before download
+    bool leave(void);
+        // Return true if a DfuSe device starts the new firmware when done
+    bool dryRun(void);
+        // Return true if the DfuSe erase plan is reported instead of
+        // downloading
+    bool delta(void);
+        // Return true if a DfuSe device only gets the pages that differ
+        // from what it holds
+    bool verify(void);
+        // Return true if the image is read back and compared once written
+    std::string image(void);
+        // SHA-256 of an image staged with a StageImageRequest to
+        // download instead of data, empty to download data
+    Deadlines deadlines(void);
+        // Deadlines of the download, those left 0 are the server's
 
     //MANIPULTORS
-    int deserialize(std::vector<uint8_t> raw) override;
+    using CommandRequest::deserialize;
+    int deserialize(const MessageView& view) override;
         // Deserialize message function
+    void setData(const FirmwareImage& data);
+        // Download data, shared with the caller rather than copied
+    void setCompression(const std::string& compression);
+        // Compress data with compression ("lz4") when serialized. Only
+        // use one the server listed in its OpenResponse
+    void setDeadlines(const Deadlines& deadlines);
+        // Deadlines of the download
 
 };
 
@@ -148,12 +280,16 @@ private:
     size_t d_sent;
     size_t d_total;
     bool d_last;
+    std::string d_erasePlan;
+    std::string d_verifyReport;
 public:
     // CREATORS
     DownloadResponse(size_t sent = 0,
                      size_t total = 0,
                      int handle = 0,
-                    bool last = false);
+                    bool last = false,
+                    const std::string& erasePlan = std::string(),
+                    const std::string& verifyReport = std::string());
 
     // ACCESSORS
     int serialize(std::vector<uint8_t>& raw) override;
@@ -167,9 +303,229 @@ public:
     bool final(void);
         // Return true if this is the last response from server
         // false if this is not the last response
+    std::string erasePlan(void);
+        // Return the DfuSe erase plan of a dry run, empty otherwise
+    std::string verifyReport(void);
+        // Return the bytes verified if verify was requested, empty
+        // otherwise. An image that reads back different fails the
+        // download with e_verifyErr instead
+
+    //MANIPULTORS
+    int deserialize(const std::vector<uint8_t>& raw) override;
+        // Deserialize message function
+};
+
+class MultiDownloadRequest : public DownloadRequest
+{
+// Download one image to several devices at once, the image and options are
+// those of a DownloadRequest
+private:
+    // DATA
+    std::vector<int> d_handles;
+public:
+    // CREATORS
+    MultiDownloadRequest();
+    MultiDownloadRequest(const std::vector<int>& handles,
+                         std::vector<uint8_t>& data,
+                         uint32_t dfuseAddress = 0,
+                         bool massErase = false,
+                         bool leave = false,
+                         bool dryRun = false,
+                         bool delta = false,
+                         bool verify = false,
+                         const std::string& image = std::string());
+
+    // ACCESSORS
+    int serialize(std::vector<uint8_t>& raw) override;
+        // serialize message function
+    std::vector<int> handles(void);
+        // Handles of the devices to download to
+
+    //MANIPULTORS
+    using CommandRequest::deserialize;
+    int deserialize(const MessageView& view) override;
+        // Deserialize message function
+};
+
+struct DownloadResult
+{
+// Outcome of the download to one device of a MultiDownloadRequest
+    int handle;
+    size_t sent;
+        // Bytes downloaded into the device
+    ErrorType error;
+        // e_noError if the whole image was downloaded
+    std::string reason;
+        // Why the download failed
+    std::string report;
+        // The erase plan of a dry run, or the verify report
+};
+
+class MultiDownloadResponse : public CommandResponse
+{
+// Last response to a MultiDownloadRequest, once every device is done. The
+// progress of each device comes before it as DownloadResponses.
+private:
+    // DATA
+    std::vector<DownloadResult> d_results;
+public:
+    // CREATORS
+    MultiDownloadResponse(const std::vector<DownloadResult>& results = std::vector<DownloadResult>());
+
+    // ACCESSORS
+    int serialize(std::vector<uint8_t>& raw) override;
+        // serialize message function
+    std::vector<DownloadResult> results(void);
+        // Return the outcome per device, in the order of the request
+
+    //MANIPULTORS
+    int deserialize(const std::vector<uint8_t>& raw) override;
+        // Deserialize message function
+};
+
+class StageImageRequest : public CommandRequest
+{
+// Keep an image in the server so download requests can refer to it by its
+// SHA-256 instead of carrying it
+private:
+    // DATA
+    FirmwareImage d_data;
+    std::string d_compression;
+public:
+    // CREATORS
+    StageImageRequest();
+    StageImageRequest(const std::vector<uint8_t>& data);
+
+    // ACCESSORS
+    int serialize(std::vector<uint8_t>& raw) override;
+        // serialize message function
+    const FirmwareImage& data(void);
+        // data field accessor, shared with the request
+
+    //MANIPULTORS
+    using CommandRequest::deserialize;
+    int deserialize(const MessageView& view) override;
+        // Deserialize message function
+    void setData(const FirmwareImage& data);
+        // Stage data, shared with the caller rather than copied
+    void setCompression(const std::string& compression);
+        // See DownloadRequest::setCompression()
+};
+
+class StageImageResponse : public CommandResponse
+{
+// Image staged response
+private:
+    // DATA
+    std::string d_digest;
+    size_t d_size;
+public:
+    // CREATORS
+    StageImageResponse(const std::string& digest = std::string(),
+                       size_t size = 0);
+
+    // ACCESSORS
+    int serialize(std::vector<uint8_t>& raw) override;
+        // serialize message function
+    std::string digest(void);
+        // Return the hex SHA-256 to download the image with
+    size_t size(void);
+        // Return the length of the image
+
+    //MANIPULTORS
+    int deserialize(const std::vector<uint8_t>& raw) override;
+        // Deserialize message function
+};
+
+class UploadRequest : public CommandRequest
+{
+// DFU upload (firmware readback) request
+private:
+    // DATA
+    int d_handle;
+    uint32_t d_dfuseAddress;
+    size_t d_length;
+    std::string d_hash;
+    std::string d_file;
+    Deadlines d_deadlines;
+public:
+    // CREATORS
+    UploadRequest();
+    UploadRequest(int handle,
+                  uint32_t dfuseAddress = 0,
+                  size_t length = 0,
+                  const std::string& hash = std::string(),
+                  const std::string& file = std::string());
+
+    // ACCESSORS
+    int serialize(std::vector<uint8_t>& raw) override;
+        // serialize message function
+    int handle(void);
+        // handle field accessor
+    uint32_t dfuseAddress(void);
+        // DfuSe address to read from, 0 for the start of the first
+        // memory segment or a device without DfuSe support
+    size_t length(void);
+        // Bytes to read, 0 to read to the end of the DfuSe memory
+        // segment or until the device has no more
+    std::string hash(void);
+        // "crc32" or "sha256" to only get the digest of what was read,
+        // empty to get the data
+    std::string file(void);
+        // Path the server writes what was read to instead of sending
+        // it, empty to get the data
+    Deadlines deadlines(void);
+        // Deadlines of the upload, those left 0 are the server's
+
+    //MANIPULTORS
+    using CommandRequest::deserialize;
+    int deserialize(const MessageView& view) override;
+        // Deserialize message function
+    void setDeadlines(const Deadlines& deadlines);
+        // Deadlines of the upload, only open and job apply
+};
+
+class UploadResponse : public CommandResponse
+{
+// DFU upload response, one per chunk read from the device
+private:
+    // DATA
+    int d_handle;
+    uint32_t d_address;
+    size_t d_offset;
+    std::vector<uint8_t> d_data;
+    bool d_last;
+    std::string d_digest;
+public:
+    // CREATORS
+    UploadResponse(int handle = 0,
+                   uint32_t address = 0,
+                   size_t offset = 0,
+                   const std::vector<uint8_t>& data = std::vector<uint8_t>(),
+                   bool last = false,
+                   const std::string& digest = std::string());
+
+    // ACCESSORS
+    int serialize(std::vector<uint8_t>& raw) override;
+        // serialize message function
+    int handle(void);
+        // Return the handle of device
+    uint32_t address(void);
+        // Return the device address of the chunk, the offset for a
+        // device without DfuSe support
+    size_t offset(void);
+        // Return the offset of the chunk in the upload
+    std::vector<uint8_t> data(void);
+        // Return the bytes read, possibly none in the last response
+    std::string digest(void);
+        // Return the hex digest of all bytes read if a hash was
+        // requested, empty otherwise
+    bool final(void);
+        // Return true if this is the last response from server
+        // false if this is not the last response
 
     //MANIPULTORS
-    int deserialize(std::vector<uint8_t> raw) override;
+    int deserialize(const std::vector<uint8_t>& raw) override;
         // Deserialize message function
 };
 
@@ -191,7 +547,8 @@ public:
         // Handle accessor
 
     //MANIPULTORS
-    int deserialize(std::vector<uint8_t> raw) override;
+    using CommandRequest::deserialize;
+    int deserialize(const MessageView& view) override;
         // Deserialize message function
 };
 
@@ -209,7 +566,72 @@ public:
         // serialize message function
 
     //MANIPULTORS
-    int deserialize(std::vector<uint8_t> raw) override;
+    int deserialize(const std::vector<uint8_t>& raw) override;
+        // Deserialize message function
+};
+
+class ListRequest : public CommandRequest
+{
+// Request the devices the server holds open
+public:
+    // CREATORS
+    ListRequest(void);
+
+    // ACCESSORS
+    int serialize(std::vector<uint8_t>& raw) override;
+        // serialize message function
+
+    //MANIPULTORS
+    using CommandRequest::deserialize;
+    int deserialize(const MessageView& view) override;
+        // Deserialize message function
+};
+
+struct DeviceInfo
+{
+// A device opened by an OpenRequest and not closed yet
+    int handle;
+    uint16_t vid;
+    uint16_t pid;
+    std::string path;
+        // Port path, "bus-port.port...", empty if unknown
+};
+
+struct BusUsage
+{
+// Use of one USB bus by the devices written or read through it
+    int bus;
+    size_t sessions;
+        // Devices on the bus being written or read
+    uint64_t bytes;
+        // Bytes moved since the server started
+    uint32_t bytesPerSecond;
+        // Recent rate, 0 once the bus is idle
+};
+
+class ListResponse : public CommandResponse
+{
+// Devices the server holds open, by handle
+private:
+    // DATA
+    std::vector<DeviceInfo> d_devices;
+    std::vector<BusUsage> d_buses;
+public:
+    // CREATORS
+    ListResponse(const std::vector<DeviceInfo>& devices = std::vector<DeviceInfo>(),
+                 const std::vector<BusUsage>& buses = std::vector<BusUsage>());
+
+    // ACCESSORS
+    int serialize(std::vector<uint8_t>& raw) override;
+        // serialize message function
+    std::vector<DeviceInfo> devices(void);
+        // Return the open devices, in the order of their handles
+    std::vector<BusUsage> buses(void);
+        // Return the buses devices were written or read on, in the order
+        // of their numbers
+
+    //MANIPULTORS
+    int deserialize(const std::vector<uint8_t>& raw) override;
         // Deserialize message function
 };
 
@@ -228,7 +650,8 @@ public:
     // serialize message function
 
     //MANIPULTORS
-    int deserialize(std::vector<uint8_t> raw) override;
+    using CommandRequest::deserialize;
+    int deserialize(const MessageView& view) override;
     // Deserialize message function
 };
 
@@ -246,7 +669,7 @@ public:
     // serialize message function
 
 //MANIPULTORS
-    int deserialize(std::vector<uint8_t> raw) override;
+    int deserialize(const std::vector<uint8_t>& raw) override;
     // Deserialize message function
 };
 
@@ -271,7 +694,7 @@ public:
         // Get error string
 
     //MANIPULTORS
-    int deserialize(std::vector<uint8_t> raw) override;
+    int deserialize(const std::vector<uint8_t>& raw) override;
         // Deserialize message function
 };
 
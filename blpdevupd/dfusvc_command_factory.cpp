@@ -0,0 +1,40 @@
+// SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+// SPDX-License-Identifier: GPL2.0-or-later
+
+// dfusvc_command_factory.cpp
+#include "dfusvc_command_factory.h"
+
+namespace dfusvc
+{
+
+template <class COMMAND>
+static std::shared_ptr<ServerCommand> makeCommand(const MessageView& request)
+{
+    return std::make_shared<COMMAND>(request);
+}
+
+static const struct {
+    CommandType type;
+    std::shared_ptr<ServerCommand> (*make)(const MessageView& request);
+} s_commands[] = {
+    { e_open,           makeCommand<ServerOpenCommand> },
+    { e_download,       makeCommand<ServerDownloadCommand> },
+    { e_close,          makeCommand<ServerCloseCommand> },
+    { e_terminate,      makeCommand<ServerTerminateCommand> },
+    { e_upload,         makeCommand<ServerUploadCommand> },
+    { e_stageImage,     makeCommand<ServerStageImageCommand> },
+    { e_multiDownload,  makeCommand<ServerMultiDownloadCommand> },
+    { e_list,           makeCommand<ServerListCommand> }
+};
+
+std::shared_ptr<ServerCommand> ServerCommandFactory::makeServerCommand(const MessageView& request)
+{
+    for (auto& command : s_commands) {
+        if (command.type == request.type()) {
+            return command.make(request);
+        }
+    }
+    return nullptr;
+}
+
+}
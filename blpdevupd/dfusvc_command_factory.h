@@ -0,0 +1,31 @@
+// SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+// SPDX-License-Identifier: GPL2.0-or-later
+
+// dfusvc_command_factory.h
+#ifndef DFUSVC_COMMAND_FACTORY_H
+#define DFUSVC_COMMAND_FACTORY_H
+
+#include <memory>
+#include "dfusvc_command.h"
+#include "dfusvc_server.h"
+
+namespace dfusvc
+{
+
+                        // ===========================
+                        // class ServerCommandFactory
+                        // ===========================
+
+class ServerCommandFactory
+{
+// ServerCommand Factory class. This class create concrete server command objects according
+// to the type field in message, from a table with one entry per command type.
+public:
+    static std::shared_ptr<ServerCommand> makeServerCommand(const MessageView& request);
+        // Factory method create concrete objects, null if the type of
+        // the request has no command
+};
+
+}
+
+#endif //DFUSVC_COMMAND_FACTORY_H
@@ -0,0 +1,70 @@
+// SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+// SPDX-License-Identifier: GPL2.0-or-later
+
+// dfusvc_firmware_image.cpp
+#include "dfusvc_firmware_image.h"
+
+#include <utility>
+#include <boost/make_shared.hpp>
+
+namespace dfusvc {
+
+FirmwareImage::FirmwareImage(void)
+: d_offset(0)
+, d_size(0)
+{
+}
+
+FirmwareImage::FirmwareImage(std::vector<uint8_t> data)
+: d_buffer(boost::make_shared<const std::vector<uint8_t>>(std::move(data)))
+, d_offset(0)
+, d_size(d_buffer->size())
+{
+}
+
+const uint8_t *FirmwareImage::data(void) const
+{
+    return d_buffer ? d_buffer->data() + d_offset : nullptr;
+}
+
+size_t FirmwareImage::size(void) const
+{
+    return d_size;
+}
+
+bool FirmwareImage::empty(void) const
+{
+    return 0 == d_size;
+}
+
+bool FirmwareImage::isNull(void) const
+{
+    return !d_buffer;
+}
+
+FirmwareImage FirmwareImage::slice(size_t offset, size_t size) const
+{
+    FirmwareImage image(*this);
+
+    if (offset > d_size) {
+        offset = d_size;
+    }
+    if (size > d_size - offset) {
+        size = d_size - offset;
+    }
+    image.d_offset += offset;
+    image.d_size = size;
+    return image;
+}
+
+const uint8_t *FirmwareImage::begin(void) const
+{
+    return data();
+}
+
+const uint8_t *FirmwareImage::end(void) const
+{
+    return data() + d_size;
+}
+
+}
@@ -0,0 +1,57 @@
+// SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+// SPDX-License-Identifier: GPL2.0-or-later
+
+// dfusvc_firmware_image.h
+#ifndef DFUSVC_FIRMWARE_IMAGE_H
+#define DFUSVC_FIRMWARE_IMAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+namespace dfusvc {
+
+                        // ===================
+                        // class FirmwareImage
+                        // ===================
+
+class FirmwareImage
+{
+// A firmware image, or a slice of one, that is never modified. Copies and
+// slices share the bytes, which are freed with the last of them, so one
+// decoded image serves the cache, every device of a fan-out download and
+// the verify without being copied.
+private:
+    // DATA
+    boost::shared_ptr<const std::vector<uint8_t>> d_buffer;
+    size_t d_offset;
+    size_t d_size;
+
+public:
+    // CREATORS
+    FirmwareImage(void);
+        // A null image, see isNull()
+    explicit FirmwareImage(std::vector<uint8_t> data);
+        // An image of data, move the vector in to not copy it
+
+    // ACCESSORS
+    const uint8_t *data(void) const;
+        // First byte of the image
+    size_t size(void) const;
+        // Bytes in the image
+    bool empty(void) const;
+        // Return true if the image has no bytes
+    bool isNull(void) const;
+        // Return true if the image was default constructed
+    FirmwareImage slice(size_t offset, size_t size) const;
+        // The size bytes from offset, sharing the bytes of this image.
+        // Clipped to the end of the image
+    const uint8_t *begin(void) const;
+    const uint8_t *end(void) const;
+        // Iterate over the bytes
+};
+
+}
+
+#endif //DFUSVC_FIRMWARE_IMAGE_H
@@ -0,0 +1,107 @@
+// SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+// SPDX-License-Identifier: GPL2.0-or-later
+
+// dfusvc_image_cache.cpp
+#include "dfusvc_image_cache.h"
+
+#include <algorithm>
+#include <cctype>
+#include <iterator>
+#include <boost/algorithm/hex.hpp>
+
+extern "C"
+{
+#include "dfu_sha256.h"
+}
+
+namespace dfusvc {
+
+ImageCache::ImageCache(size_t budget)
+: d_budget(budget)
+, d_bytes(0)
+{
+}
+
+size_t ImageCache::bytes(void) const
+{
+    boost::mutex::scoped_lock lock(d_mutex);
+    return d_bytes;
+}
+
+size_t ImageCache::budget(void) const
+{
+    boost::mutex::scoped_lock lock(d_mutex);
+    return d_budget;
+}
+
+void ImageCache::evict(size_t budget)
+{
+    while (d_bytes > budget && !d_lru.empty()) {
+        auto it = d_images.find(d_lru.back());
+        d_bytes -= it->second.image.size();
+        d_images.erase(it);
+        d_lru.pop_back();
+    }
+}
+
+std::string ImageCache::put(const FirmwareImage& image)
+{
+    // Hash outside the lock, it is the expensive part
+    std::string key = digest(image);
+
+    boost::mutex::scoped_lock lock(d_mutex);
+    auto it = d_images.find(key);
+    if (it != d_images.end()) {
+        d_lru.splice(d_lru.begin(), d_lru, it->second.lru);
+        return key;
+    }
+    if (image.size() > d_budget) {
+        return std::string();
+    }
+    evict(d_budget - image.size());
+
+    Entry entry;
+    entry.image = image;
+    d_lru.push_front(key);
+    entry.lru = d_lru.begin();
+    d_images[key] = entry;
+    d_bytes += image.size();
+    return key;
+}
+
+FirmwareImage ImageCache::get(const std::string& digest)
+{
+    std::string key(digest);
+    std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+
+    boost::mutex::scoped_lock lock(d_mutex);
+    auto it = d_images.find(key);
+    if (it == d_images.end()) {
+        return FirmwareImage();
+    }
+    d_lru.splice(d_lru.begin(), d_lru, it->second.lru);
+    return it->second.image;
+}
+
+void ImageCache::setBudget(size_t budget)
+{
+    boost::mutex::scoped_lock lock(d_mutex);
+    d_budget = budget;
+    evict(d_budget);
+}
+
+std::string ImageCache::digest(const FirmwareImage& image)
+{
+    struct dfu_sha256 ctx;
+    unsigned char sum[DFU_SHA256_LENGTH];
+
+    dfu_sha256_init(&ctx);
+    dfu_sha256_update(&ctx, image.data(), image.size());
+    dfu_sha256_final(&ctx, sum);
+
+    std::string hex;
+    boost::algorithm::hex_lower(sum, sum + sizeof(sum), std::back_inserter(hex));
+    return hex;
+}
+
+}
@@ -0,0 +1,81 @@
+// SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+// SPDX-License-Identifier: GPL2.0-or-later
+
+// dfusvc_image_cache.h
+#ifndef DFUSVC_IMAGE_CACHE_H
+#define DFUSVC_IMAGE_CACHE_H
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+#include "dfusvc_firmware_image.h"
+
+namespace dfusvc {
+
+                        // =================
+                        // class ImageCache
+                        // =================
+
+class ImageCache
+{
+// Firmware images staged by clients, keyed by the hex SHA-256 of their
+// contents. Images are evicted least recently used first once they take
+// more than the byte budget. Safe to use from several threads.
+public:
+    // TYPES
+    enum {
+        k_defaultBudget = 64 * 1024 * 1024
+    };
+
+private:
+    // TYPES
+    struct Entry {
+        FirmwareImage image;
+            // stays valid for whoever holds it after eviction
+        std::list<std::string>::iterator lru;
+    };
+
+    // DATA
+    size_t d_budget;
+    size_t d_bytes;
+    std::list<std::string> d_lru;
+        // Digests, most recently used first
+    boost::unordered_map<std::string, Entry> d_images;
+    mutable boost::mutex d_mutex;
+
+    // MANIPULTORS
+    void evict(size_t budget);
+        // Drop the least recently used images until at most budget
+        // bytes are cached
+
+public:
+    // CREATORS
+    ImageCache(size_t budget = k_defaultBudget);
+
+    // ACCESSORS
+    size_t bytes(void) const;
+        // Bytes of all cached images
+    size_t budget(void) const;
+        // Bytes the cache holds at most
+
+    // MANIPULTORS
+    std::string put(const FirmwareImage& image);
+        // Cache the image, sharing its bytes, and return its digest. An
+        // image already cached is only marked used. Returns an empty
+        // string if the image is bigger than the whole budget
+    FirmwareImage get(const std::string& digest);
+        // Return the image and mark it used, a null image if it is not
+        // cached
+    void setBudget(size_t budget);
+        // Change the byte budget, evicting what no longer fits
+
+    static std::string digest(const FirmwareImage& image);
+        // Lower case hex SHA-256 of the image
+};
+
+}
+
+#endif //DFUSVC_IMAGE_CACHE_H
@@ -0,0 +1,337 @@
+// SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+// SPDX-License-Identifier: GPL2.0-or-later
+
+// dfusvc_job_scheduler.cpp
+#include "dfusvc_job_scheduler.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <boost/unordered_set.hpp>
+
+namespace dfusvc {
+
+static uint32_t model(uint16_t vid, uint16_t pid)
+{
+    return (uint32_t(vid) << 16) | pid;
+}
+
+static std::string hubOf(const std::string& path)
+    // Hub the device at path is plugged in, "bus" for a root hub. Empty
+    // if path is
+{
+    size_t end = path.find_last_of(".-");
+    return end == std::string::npos ? path : path.substr(0, end);
+}
+
+static int busOf(const std::string& path)
+    // Bus of the device at path, -1 if path is empty
+{
+    return path.empty() ? -1 : atoi(path.c_str());
+}
+
+template <class KEY>
+static size_t countOf(const boost::unordered_map<KEY, size_t>& counts, const KEY& key)
+    // Jobs running under key, entries are dropped once they reach 0
+{
+    auto it = counts.find(key);
+    return it == counts.end() ? 0 : it->second;
+}
+
+JobScheduler::JobScheduler(void)
+: d_maxSessions(k_defaultMaxSessions)
+, d_running(0)
+, d_hubMaxSessions(0)
+, d_hubRate(0)
+, d_stop(false)
+{
+    d_preparer = boost::thread(&JobScheduler::prepareLoop, this);
+}
+
+JobScheduler::~JobScheduler(void)
+{
+    wait();
+    {
+        boost::mutex::scoped_lock lock(d_mutex);
+        d_stop = true;
+    }
+    d_changed.notify_all();
+    d_preparer.join();
+}
+
+size_t JobScheduler::queued(void)
+{
+    boost::mutex::scoped_lock lock(d_mutex);
+    return d_queue.size();
+}
+
+size_t JobScheduler::running(void)
+{
+    boost::mutex::scoped_lock lock(d_mutex);
+    return d_running;
+}
+
+std::vector<BusUsage> JobScheduler::busUsage(void)
+{
+    boost::mutex::scoped_lock lock(d_mutex);
+    std::vector<BusUsage> usage;
+    Clock::time_point now = Clock::now();
+    for (auto& entry : d_buses) {
+        const Bus& bus = entry.second;
+        BusUsage item;
+        item.bus = entry.first;
+        item.sessions = bus.sessions;
+        item.bytes = bus.bytes;
+        item.bytesPerSecond = bus.rate;
+        // The rate is only taken while bytes come
+        if (0 == bus.sessions || now - bus.windowStart > boost::chrono::seconds(2)) {
+            item.bytesPerSecond = 0;
+        }
+        usage.push_back(item);
+    }
+    return usage;
+}
+
+void JobScheduler::setMaxSessions(size_t sessions)
+{
+    boost::mutex::scoped_lock lock(d_mutex);
+    d_maxSessions = std::max<size_t>(sessions, 1);
+    schedule();
+}
+
+void JobScheduler::setModelMaxSessions(uint16_t vid, uint16_t pid, size_t sessions)
+{
+    boost::mutex::scoped_lock lock(d_mutex);
+    if (0 == sessions) {
+        d_modelCaps.erase(model(vid, pid));
+    }
+    else {
+        d_modelCaps[model(vid, pid)] = sessions;
+    }
+    schedule();
+}
+
+void JobScheduler::setHubMaxSessions(size_t sessions)
+{
+    boost::mutex::scoped_lock lock(d_mutex);
+    d_hubMaxSessions = sessions;
+    schedule();
+    d_changed.notify_all();
+}
+
+void JobScheduler::setHubRate(uint32_t bytesPerSecond)
+{
+    boost::mutex::scoped_lock lock(d_mutex);
+    d_hubRate = bytesPerSecond;
+}
+
+uint32_t JobScheduler::transferred(const std::string& path, size_t bytes)
+{
+    if (path.empty()) {
+        return 0;
+    }
+    boost::mutex::scoped_lock lock(d_mutex);
+    Clock::time_point now = Clock::now();
+    Bus& bus = d_buses[busOf(path)];
+    bus.bytes += bytes;
+    bus.windowBytes += bytes;
+    Clock::duration window = now - bus.windowStart;
+    if (window >= boost::chrono::seconds(1)) {
+        bus.rate = uint32_t(bus.windowBytes * 1000 / boost::chrono::duration_cast<boost::chrono::milliseconds>(window).count());
+        bus.windowBytes = 0;
+        bus.windowStart = now;
+    }
+
+    if (0 == d_hubRate) {
+        return 0;
+    }
+    // Each transfer on the hub pushes back when the next may go, the
+    // sessions on it share the rate
+    Clock::time_point& free = d_hubFree[hubOf(path)];
+    free = std::max(free, now) + boost::chrono::microseconds(uint64_t(bytes) * 1000000 / d_hubRate);
+    int64_t wait = boost::chrono::duration_cast<boost::chrono::microseconds>(free - now).count();
+    return uint32_t((wait + 999) / 1000);
+}
+
+void JobScheduler::submit(const Job& job)
+{
+    auto entry = std::make_shared<Entry>();
+    entry->job = job;
+    entry->preparing = false;
+    entry->prepared = false;
+
+    boost::mutex::scoped_lock lock(d_mutex);
+    d_queue.push_back(entry);
+    d_changed.notify_all();
+}
+
+void JobScheduler::wait(void)
+{
+    boost::mutex::scoped_lock lock(d_mutex);
+    while (!d_queue.empty() || d_running > 0) {
+        d_changed.wait(lock);
+    }
+}
+
+void JobScheduler::schedule(void)
+{
+    while (d_running < d_maxSessions) {
+        // Jobs for one device run in the order they came, only the first
+        // queued for a device may start
+        boost::unordered_set<int> seen;
+        auto best = d_queue.end();
+        for (auto it = d_queue.begin(); it != d_queue.end(); ++it) {
+            const Entry& entry = **it;
+            if (!seen.insert(entry.job.handle).second) {
+                continue;
+            }
+            if (!entry.prepared || d_deviceRunning.count(entry.job.handle)) {
+                continue;
+            }
+            auto cap = d_modelCaps.find(model(entry.job.vid, entry.job.pid));
+            if (cap != d_modelCaps.end() && countOf(d_modelRunning, cap->first) >= cap->second) {
+                continue;
+            }
+            std::string hub = hubOf(entry.job.path);
+            if (!hub.empty() && 0 != d_hubMaxSessions && countOf(d_hubRunning, hub) >= d_hubMaxSessions) {
+                continue;
+            }
+            if (best == d_queue.end()) {
+                best = it;
+                continue;
+            }
+            const Entry& other = **best;
+            if (entry.job.priority != other.job.priority) {
+                if (entry.job.priority > other.job.priority) {
+                    best = it;
+                }
+                continue;
+            }
+            // Fair between clients, the one with fewer jobs running goes
+            // first
+            size_t clientRunning = countOf(d_clientRunning, entry.job.client);
+            size_t otherClientRunning = countOf(d_clientRunning, other.job.client);
+            if (clientRunning != otherClientRunning) {
+                if (clientRunning < otherClientRunning) {
+                    best = it;
+                }
+                continue;
+            }
+            // Then spread over the hubs, a device behind an idle hub gets
+            // bandwidth a busy one has not. Otherwise the queue is in the
+            // order jobs came
+            if (countOf(d_hubRunning, hub) < countOf(d_hubRunning, hubOf(other.job.path))) {
+                best = it;
+            }
+        }
+        if (best == d_queue.end()) {
+            return;
+        }
+
+        std::shared_ptr<Entry> entry = *best;
+        d_queue.erase(best);
+        d_running++;
+        d_deviceRunning[entry->job.handle]++;
+        d_modelRunning[model(entry->job.vid, entry->job.pid)]++;
+        d_clientRunning[entry->job.client]++;
+        started(entry->job.path);
+        boost::thread(&JobScheduler::run, this, entry).detach();
+    }
+}
+
+void JobScheduler::run(std::shared_ptr<Entry> entry)
+{
+    // A download returns from start() once it is queued in libdfu.dll and
+    // finishes on its thread, this one is let go
+    entry->job.command->start(entry->job.send, [this, entry]() {
+        done(entry);
+    });
+}
+
+void JobScheduler::done(std::shared_ptr<Entry> entry)
+{
+    boost::mutex::scoped_lock lock(d_mutex);
+    const Job& job = entry->job;
+    if (0 == --d_deviceRunning[job.handle]) {
+        d_deviceRunning.erase(job.handle);
+    }
+    if (0 == --d_modelRunning[model(job.vid, job.pid)]) {
+        d_modelRunning.erase(model(job.vid, job.pid));
+    }
+    if (0 == --d_clientRunning[job.client]) {
+        d_clientRunning.erase(job.client);
+    }
+    finished(job.path);
+    d_running--;
+    schedule();
+    d_changed.notify_all();
+}
+
+void JobScheduler::started(const std::string& path)
+{
+    if (path.empty()) {
+        return;
+    }
+    d_hubRunning[hubOf(path)]++;
+    auto bus = d_buses.find(busOf(path));
+    if (bus == d_buses.end()) {
+        Bus idle = { 0, 0, 0, Clock::now(), 0 };
+        bus = d_buses.insert(std::make_pair(busOf(path), idle)).first;
+    }
+    bus->second.sessions++;
+}
+
+void JobScheduler::finished(const std::string& path)
+{
+    if (path.empty()) {
+        return;
+    }
+    std::string hub = hubOf(path);
+    if (0 == --d_hubRunning[hub]) {
+        d_hubRunning.erase(hub);
+        d_hubFree.erase(hub);
+    }
+    d_buses[busOf(path)].sessions--;
+}
+
+void JobScheduler::prepareLoop(void)
+{
+    boost::mutex::scoped_lock lock(d_mutex);
+    while (1) {
+        // The job likely to start first is prepared first
+        std::shared_ptr<Entry> next;
+        for (auto& entry : d_queue) {
+            if (entry->prepared || entry->preparing) {
+                continue;
+            }
+            if (!next || entry->job.priority > next->job.priority) {
+                next = entry;
+            }
+        }
+        if (!next) {
+            if (d_stop) {
+                return;
+            }
+            d_changed.wait(lock);
+            continue;
+        }
+
+        next->preparing = true;
+        lock.unlock();
+        // A job that can not run has answered with an error
+        int ret = next->job.command->prepare(next->job.send);
+        lock.lock();
+        next->preparing = false;
+        if (ret < 0) {
+            d_queue.remove(next);
+        }
+        else {
+            next->prepared = true;
+        }
+        // A failed job no longer holds back the later ones for its device
+        schedule();
+        d_changed.notify_all();
+    }
+}
+
+}
@@ -0,0 +1,166 @@
+// SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+// SPDX-License-Identifier: GPL2.0-or-later
+
+// dfusvc_job_scheduler.h
+#ifndef DFUSVC_JOB_SCHEDULER_H
+#define DFUSVC_JOB_SCHEDULER_H
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/chrono.hpp>
+#include <boost/unordered_map.hpp>
+#include "dfusvc_command.h"
+#include "dfusvc_server.h"
+
+namespace dfusvc {
+
+                        // ==================
+                        // class JobScheduler
+                        // ==================
+
+class JobScheduler
+{
+// Runs the commands for open devices, downloads, uploads and closes, on
+// threads of their own. Queued jobs are prepared one after the other while
+// they wait, so a job starts on a device with its image already decoded
+// and checked. A job starts once it is prepared, no earlier job for its
+// device is queued or running, and neither the global nor the per vid/pid
+// cap on sessions is reached. The highest priority goes first, then the
+// client with the fewest jobs running, then the job on the least busy hub,
+// then the oldest job.
+//
+// Devices behind one hub share its link to the host, so jobs are also
+// grouped by the hub their device is plugged in. A hub may be capped in
+// sessions and in bytes per second, and the bytes moved are counted per
+// bus for the metrics. Safe to use from several threads.
+public:
+    // TYPES
+    enum {
+        k_defaultMaxSessions = 16
+    };
+
+    struct Job {
+        std::shared_ptr<ServerCommand> command;
+        std::function<int(CommandResponse&)> send;
+            // Where the command sends its responses
+        int handle;
+            // Device the command is for
+        uint16_t vid;
+        uint16_t pid;
+            // Model of the device, 0 if it is not open
+        int priority;
+            // Higher runs first
+        std::string client;
+            // Name the requests of one client share, may be empty
+        std::string path;
+            // Port path of the device, "bus-port.port...", empty if
+            // unknown
+    };
+
+private:
+    // TYPES
+    typedef boost::chrono::steady_clock Clock;
+
+    struct Entry {
+        Job job;
+        bool preparing;
+        bool prepared;
+    };
+
+    struct Bus {
+        size_t sessions;
+        uint64_t bytes;
+        uint64_t windowBytes;
+            // Bytes since windowStart, the rate is taken once a second
+        Clock::time_point windowStart;
+        uint32_t rate;
+    };
+
+    // DATA
+    size_t d_maxSessions;
+    boost::unordered_map<uint32_t, size_t> d_modelCaps;
+        // Sessions per vid << 16 | pid at most, none if absent
+    std::list<std::shared_ptr<Entry>> d_queue;
+        // Jobs not started, in the order they came
+    size_t d_running;
+    boost::unordered_map<int, size_t> d_deviceRunning;
+    boost::unordered_map<uint32_t, size_t> d_modelRunning;
+    boost::unordered_map<std::string, size_t> d_clientRunning;
+    size_t d_hubMaxSessions;
+    uint32_t d_hubRate;
+        // Sessions and bytes per second per hub at most, 0 for no cap
+    boost::unordered_map<std::string, size_t> d_hubRunning;
+        // Sessions by the hub their device is plugged in
+    boost::unordered_map<std::string, Clock::time_point> d_hubFree;
+        // When the bytes already moved through a capped hub have had
+        // their time
+    std::map<int, Bus> d_buses;
+    bool d_stop;
+    boost::thread d_preparer;
+    boost::mutex d_mutex;
+    boost::condition_variable d_changed;
+        // Signalled whenever a job is queued, prepared or done
+
+    // NOT IMPLEMENTED
+    JobScheduler(const JobScheduler&);
+    JobScheduler& operator=(const JobScheduler&);
+
+    // MANIPULTORS
+    void schedule(void);
+        // Start every job that may start, d_mutex held
+    void started(const std::string& path);
+    void finished(const std::string& path);
+        // Count a session on the hub and bus of path, d_mutex held
+    void run(std::shared_ptr<Entry> entry);
+        // Start a started job, done() is called once it is finished
+    void done(std::shared_ptr<Entry> entry);
+        // Count a job as finished and schedule the next
+    void prepareLoop(void);
+        // Prepare queued jobs, highest priority first
+
+public:
+    // CREATORS
+    JobScheduler(void);
+    ~JobScheduler(void);
+        // Wait for every job, see wait()
+
+    // ACCESSORS
+    size_t queued(void);
+        // Jobs not started yet
+    size_t running(void);
+        // Jobs started and not done
+    std::vector<BusUsage> busUsage(void);
+        // Use of the buses sessions ran on, by bus number
+
+    // MANIPULTORS
+    void setMaxSessions(size_t sessions);
+        // Jobs that run at once at most, at least one
+    void setModelMaxSessions(uint16_t vid, uint16_t pid, size_t sessions);
+        // Jobs that run at once on devices vid:pid at most, 0 for no cap
+        // but the global one
+    void setHubMaxSessions(size_t sessions);
+        // Sessions that run at once on devices behind one hub at most, 0
+        // for no cap
+    void setHubRate(uint32_t bytesPerSecond);
+        // Bytes per second moved through one hub at most, 0 for no cap
+    uint32_t transferred(const std::string& path, size_t bytes);
+        // Count bytes moved to or from the device at path. Return the
+        // milliseconds its session waits before its next transfer to
+        // keep its hub under its rate, see DFUTransport::throttle()
+    void submit(const Job& job);
+        // Queue the job
+    void wait(void);
+        // Block until no job is queued or running
+};
+
+}
+
+#endif //DFUSVC_JOB_SCHEDULER_H
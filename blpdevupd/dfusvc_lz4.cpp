@@ -0,0 +1,163 @@
+// SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+// SPDX-License-Identifier: GPL2.0-or-later
+
+// dfusvc_lz4.cpp
+#include "dfusvc_lz4.h"
+
+#include <cstring>
+
+namespace dfusvc {
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void putLength(std::vector<uint8_t>& block, size_t len)
+    // The part of a length beyond what its token nibble holds
+{
+    while (len >= 255) {
+        block.push_back(255);
+        len -= 255;
+    }
+    block.push_back(uint8_t(len));
+}
+
+static bool getLength(const uint8_t *block, size_t len, size_t& pos, size_t& value)
+{
+    uint8_t b;
+    do {
+        if (pos >= len) {
+            return false;
+        }
+        b = block[pos++];
+        value += b;
+    } while (b == 255);
+    return true;
+}
+
+static void putSequence(std::vector<uint8_t>& block,
+                        const uint8_t *literals,
+                        size_t literalLen,
+                        size_t offset,
+                        size_t matchLen)
+    // One sequence, matchLen is 0 for the literals that end the block
+{
+    size_t extra = matchLen ? matchLen - 4 : 0;
+    block.push_back(uint8_t(((literalLen < 15 ? literalLen : 15) << 4) |
+                            (extra < 15 ? extra : 15)));
+    if (literalLen >= 15) {
+        putLength(block, literalLen - 15);
+    }
+    block.insert(block.end(), literals, literals + literalLen);
+    if (!matchLen) {
+        return;
+    }
+    block.push_back(uint8_t(offset));
+    block.push_back(uint8_t(offset >> 8));
+    if (extra >= 15) {
+        putLength(block, extra - 15);
+    }
+}
+
+void Lz4Codec::compress(const uint8_t *data, size_t len, std::vector<uint8_t>& block)
+{
+    size_t anchor = 0;
+    size_t pos = 0;
+
+    block.clear();
+    block.reserve(len + len / 255 + 16);
+
+    // Greedy parse with a table of the last position of each hashed
+    // 4 byte sequence
+    if (len > k_matchLimit) {
+        std::vector<uint32_t> table(size_t(1) << k_hashLog, 0);
+        size_t limit = len - k_matchLimit;
+
+        while (pos < limit) {
+            uint32_t sequence = read32(data + pos);
+            uint32_t hash = (sequence * 2654435761u) >> (32 - k_hashLog);
+            size_t ref = table[hash];
+            table[hash] = uint32_t(pos);
+
+            if (ref >= pos || pos - ref > k_maxOffset || read32(data + ref) != sequence) {
+                pos++;
+                continue;
+            }
+            size_t matchLen = k_minMatch;
+            size_t maxLen = len - k_lastLiterals - pos;
+            while (matchLen < maxLen && data[ref + matchLen] == data[pos + matchLen]) {
+                matchLen++;
+            }
+            putSequence(block, data + anchor, pos - anchor, pos - ref, matchLen);
+            pos += matchLen;
+            anchor = pos;
+        }
+    }
+    putSequence(block, data + anchor, len - anchor, 0, 0);
+}
+
+size_t Lz4Codec::maxSize(size_t len)
+{
+    return len * 255 + 16;
+}
+
+int Lz4Codec::decompress(const uint8_t *block, size_t len, uint8_t *data, size_t size)
+{
+    size_t in = 0;
+    size_t out = 0;
+
+    while (in < len) {
+        uint8_t token = block[in++];
+
+        size_t literalLen = token >> 4;
+        if (literalLen == 15 && !getLength(block, len, in, literalLen)) {
+            return -1;
+        }
+        if (literalLen > len - in || literalLen > size - out) {
+            return -1;
+        }
+        std::memcpy(data + out, block + in, literalLen);
+        in += literalLen;
+        out += literalLen;
+
+        // The last sequence has no match
+        if (in == len) {
+            break;
+        }
+        if (len - in < 2) {
+            return -1;
+        }
+        size_t offset = block[in] | (block[in + 1] << 8);
+        in += 2;
+        if (offset == 0 || offset > out) {
+            return -1;
+        }
+        size_t matchLen = token & 15;
+        if (matchLen == 15 && !getLength(block, len, in, matchLen)) {
+            return -1;
+        }
+        matchLen += k_minMatch;
+        if (matchLen > size - out) {
+            return -1;
+        }
+
+        // Matches may overlap what they produce, runs have offset 1
+        const uint8_t *ref = data + out - offset;
+        if (offset == 1) {
+            std::memset(data + out, *ref, matchLen);
+        } else if (offset >= matchLen) {
+            std::memcpy(data + out, ref, matchLen);
+        } else {
+            for (size_t i = 0; i < matchLen; i++) {
+                data[out + i] = ref[i];
+            }
+        }
+        out += matchLen;
+    }
+    return out == size ? 0 : -1;
+}
+
+}
@@ -0,0 +1,49 @@
+// SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+// SPDX-License-Identifier: GPL2.0-or-later
+
+// dfusvc_lz4.h
+#ifndef DFUSVC_LZ4_H
+#define DFUSVC_LZ4_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace dfusvc {
+
+                        // ===============
+                        // class Lz4Codec
+                        // ===============
+
+class Lz4Codec
+{
+// Compression of firmware images sent through the pipe, in the LZ4 block
+// format so any LZ4 library can produce or read it. Firmware compresses
+// well, erased flash and tables are long runs of the same bytes.
+private:
+    // TYPES
+    enum {
+        k_hashLog = 14,
+            // log2 of the entries of the match finder table
+        k_minMatch = 4,
+        k_lastLiterals = 5,
+            // the block ends with at least this many literals
+        k_matchLimit = 12,
+            // no match starts in the last bytes of the block
+        k_maxOffset = 65535
+    };
+
+public:
+    static void compress(const uint8_t *data, size_t len, std::vector<uint8_t>& block);
+        // Compress data into one LZ4 block
+    static int decompress(const uint8_t *block, size_t len, uint8_t *data, size_t size);
+        // Decompress an LZ4 block into the size bytes at data. Returns -1
+        // if the block is malformed or does not hold exactly size bytes
+    static size_t maxSize(size_t len);
+        // Most bytes an LZ4 block of len bytes can decompress to, each
+        // byte of a match length adds at most 255
+};
+
+}
+
+#endif //DFUSVC_LZ4_H
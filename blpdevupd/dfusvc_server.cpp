@@ -16,14 +16,151 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/make_shared.hpp>
 #include <boost/unordered_map.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <algorithm>
+#include <deque>
 #include "dfutransport.h"
+#include "dfusvc_command_factory.h"
+#include "dfusvc_firmware_image.h"
+#include "dfusvc_image_cache.h"
+#include "dfusvc_job_scheduler.h"
 
 namespace dfusvc {
 
-static boost::unordered_map<int, boost::shared_ptr<DFUTransport>> s_deviceMap;
+struct Device {
+// A device opened by a client
+    DFUTransport dfu;
+    boost::mutex mutex;
+    boost::condition_variable released;
+    bool busy;
+        // Set while a command uses the device, see DeviceLock
+    bool closed;
+};
+
+static boost::unordered_map<int, boost::shared_ptr<Device>> s_deviceMap;
 static int s_gcount = 1;
+static boost::mutex s_deviceMutex;
+    // Guards s_deviceMap and s_gcount, commands run concurrently
+static ImageCache s_imageCache;
+static Deadlines s_defaultDeadlines;
+    // Used for the deadlines a request leaves 0, set before requests are
+    // read
+
+static JobScheduler& scheduler(void)
+    // Runs the commands for devices, started with the first of them
+{
+    static JobScheduler s_scheduler;
+    return s_scheduler;
+}
+
+static boost::shared_ptr<Device> findDevice(int handle)
+    // The open device handle, null if there is none. The device is not
+    // locked, see DeviceLock
+{
+    boost::mutex::scoped_lock lock(s_deviceMutex);
+    auto it = s_deviceMap.find(handle);
+    return it == s_deviceMap.end() ? nullptr : it->second;
+}
+
+static void applyDeadlines(DFUTransport& dfu, const Deadlines& requested)
+    // Set the deadlines of the next download or upload on the device
+{
+    DFUTransport::Deadlines deadlines;
+    deadlines.open = requested.open ? requested.open : s_defaultDeadlines.open;
+    deadlines.erase = requested.erase ? requested.erase : s_defaultDeadlines.erase;
+    deadlines.write = requested.write ? requested.write : s_defaultDeadlines.write;
+    deadlines.manifest = requested.manifest ? requested.manifest : s_defaultDeadlines.manifest;
+    deadlines.job = requested.job ? requested.job : s_defaultDeadlines.job;
+    dfu.setDeadlines(deadlines);
+}
+
+static bool timedOut(DFUTransport& dfu, std::string& reason)
+    // Return true and the reason if a deadline failed the last download
+    // or upload on the device, even one the device finished late
+{
+    std::string deadline;
+    if (dfu.expiredDeadline(deadline) < 0) {
+        return false;
+    }
+    reason = "Device exceeded the " + deadline + " deadline";
+    return true;
+}
+
+class DeviceLock
+{
+// The use of an open device by a command. Commands on one device run one
+// after the other, the device stays locked while this exists. A download
+// keeps it until libdfu.dll reports the device done, on another thread.
+private:
+    // DATA
+    boost::shared_ptr<Device> d_device;
+
+    // NOT IMPLEMENTED
+    DeviceLock(const DeviceLock&);
+    DeviceLock& operator=(const DeviceLock&);
+
+public:
+    // CREATORS
+    explicit DeviceLock(int handle)
+    {
+        boost::shared_ptr<Device> device = findDevice(handle);
+        if (!device) {
+            return;
+        }
+        boost::mutex::scoped_lock lock(device->mutex);
+        device->released.wait(lock, [&device] { return !device->busy; });
+        if (!device->closed) {
+            device->busy = true;
+            d_device = device;
+        }
+    }
+    ~DeviceLock(void)
+    {
+        if (!d_device) {
+            return;
+        }
+        boost::mutex::scoped_lock lock(d_device->mutex);
+        d_device->busy = false;
+        d_device->released.notify_all();
+    }
+
+    // MANIPULTORS
+    void close(void)
+        // Commands waiting for the device find it closed
+    {
+        boost::mutex::scoped_lock lock(d_device->mutex);
+        d_device->closed = true;
+    }
+
+    // ACCESSORS
+    explicit operator bool(void) const { return d_device != nullptr; }
+        // Return false if the handle is not open
+    Device *device(void) const { return d_device.get(); }
+    DFUTransport *operator->(void) const { return &d_device->dfu; }
+};
+
+static void runToEnd(ServerCommand& command, std::function<int(dfusvc::CommandResponse&)> fRespSend)
+    // Start the command and wait until it is finished, for the requests
+    // that are run straight away
+{
+    boost::mutex mutex;
+    boost::condition_variable finished;
+    bool done = false;
+    command.start(fRespSend, [&]() {
+        boost::mutex::scoped_lock lock(mutex);
+        done = true;
+        finished.notify_all();
+    });
+    boost::mutex::scoped_lock lock(mutex);
+    finished.wait(lock, [&done] { return done; });
+}
 
 DFUServiceServer::DFUServiceServer(std::string name)
+: d_readEvent(CreateEvent(NULL, TRUE, FALSE, NULL))
+, d_writeEvent(CreateEvent(NULL, TRUE, FALSE, NULL))
+, d_running(0)
 {
 
     if (0 == name.size()) {
@@ -36,7 +173,8 @@ DFUServiceServer::DFUServiceServer(std::string name)
     std::cout << "Pipe Server: Main thread awaiting client connection on" << d_pipeName << std::endl;
     d_hPipe = CreateNamedPipe(
         d_pipeName.c_str(),             // pipe name 
-        PIPE_ACCESS_DUPLEX,       // read/write access 
+        PIPE_ACCESS_DUPLEX |      // read/write access 
+        FILE_FLAG_OVERLAPPED,     // read while writing 
         PIPE_TYPE_MESSAGE |       // message type pipe 
         PIPE_READMODE_MESSAGE |   // message-read mode 
         PIPE_WAIT,                // blocking mode 
@@ -49,8 +187,11 @@ DFUServiceServer::DFUServiceServer(std::string name)
 
 DFUServiceServer::~DFUServiceServer()
 {
+    waitForCommands();
     DisconnectNamedPipe(d_hPipe);
     CloseHandle(d_hPipe);
+    CloseHandle(d_readEvent);
+    CloseHandle(d_writeEvent);
 }
 
 int DFUServiceServer::waitForConnection(void)
@@ -64,7 +205,10 @@ int DFUServiceServer::waitForConnection(void)
     // Wait for the client to connect; if it succeeds, 
     // the function returns a nonzero value. If the function
     // returns zero, GetLastError returns ERROR_PIPE_CONNECTED. 
-    fConnected = ConnectNamedPipe(d_hPipe, NULL) ?
+    OVERLAPPED ov = {};
+    ov.hEvent = d_readEvent;
+    DWORD cbBytes = 0;
+    fConnected = finishIo(ConnectNamedPipe(d_hPipe, &ov), ov, cbBytes) ?
         TRUE : (GetLastError() == ERROR_PIPE_CONNECTED);
     if (fConnected) {
         std::cout << "Client connected, creating a processing thread." << std::endl;
@@ -83,21 +227,40 @@ int DFUServiceServer::processRequest(void)
     std::cout << "Start process request." << std::endl;
 
     // Read client request from pipes
-    std::vector<uint8_t> request;
-    auto ret = getRawRequest(request);
+    std::vector<uint8_t> raw;
+    auto ret = getRawRequest(raw);
     if (ret != 0) {
         return -1;
     }
 
+    // Parse the request once, the command reads it from the same view
+    MessageView request;
+    if (request.parse(raw) < 0) {
+        return this->sendResponse(dfusvc::ErrorResponse(e_commErr, "Receive malformed request"));
+    }
+    std::vector<uint8_t>().swap(raw);
+
     // Create server command according to request
     auto cmd = dfusvc::ServerCommandFactory::makeServerCommand(request);
+    uint32_t id = request.id();
 
     if (nullptr == cmd) {
-        return this->sendResponse(dfusvc::ErrorResponse(e_unknownCmdErr, "Receive unknown command"));
+        return this->sendResponse(dfusvc::ErrorResponse(e_unknownCmdErr, "Receive unknown command"), id);
+    }
+
+    // Tagged requests run concurrently, the client tells their responses
+    // apart by id. Terminate waits for them instead
+    if (0 != id && e_terminate != request.type()) {
+        Job job = { cmd, id, request.priority(), request.client() };
+        dispatch(request.tree().get_optional<int>("handle").get_value_or(0), job);
+        return 0;
+    }
+    if (e_terminate == request.type()) {
+        waitForCommands();
     }
 
     // Execute command
-    ret = cmd->execute(boost::bind(&DFUServiceServer::sendResponse, this, _1));
+    ret = cmd->execute(boost::bind(&DFUServiceServer::sendResponse, this, _1, id));
 
     // Flush the pipe to allow the client to read the pipe's contents 
     // before disconnecting. Then disconnect the pipe, and close the 
@@ -110,6 +273,101 @@ int DFUServiceServer::processRequest(void)
     return ret;
 }
 
+void DFUServiceServer::dispatch(int handle, const Job& job)
+{
+    auto send = boost::bind(&DFUServiceServer::sendResponse, this, _1, job.id);
+
+    // Commands for a device wait for their turn on it and for a session,
+    // the device is looked up once
+    if (0 != handle) {
+        JobScheduler::Job deviceJob;
+        deviceJob.command = job.command;
+        deviceJob.send = send;
+        deviceJob.handle = handle;
+        deviceJob.vid = 0;
+        deviceJob.pid = 0;
+        deviceJob.priority = job.priority;
+        deviceJob.client = job.client;
+        boost::shared_ptr<Device> device = findDevice(handle);
+        if (device) {
+            deviceJob.vid = device->dfu.vendorId();
+            deviceJob.pid = device->dfu.productId();
+            deviceJob.path = device->dfu.portPath();
+        }
+        scheduler().submit(deviceJob);
+        return;
+    }
+
+    // The others need not wait for any other
+    boost::mutex::scoped_lock lock(d_commandMutex);
+    d_running++;
+    boost::thread(&DFUServiceServer::runJob, this, job).detach();
+}
+
+void DFUServiceServer::runJob(Job job)
+{
+    job.command->execute(boost::bind(&DFUServiceServer::sendResponse, this, _1, job.id));
+
+    boost::mutex::scoped_lock lock(d_commandMutex);
+    if (0 == --d_running) {
+        d_idle.notify_all();
+    }
+}
+
+void DFUServiceServer::waitForCommands(void)
+{
+    // A multi download queues jobs for its devices, the scheduler is
+    // waited for once no command is left to queue any
+    {
+        boost::mutex::scoped_lock lock(d_commandMutex);
+        while (d_running > 0) {
+            d_idle.wait(lock);
+        }
+    }
+    scheduler().wait();
+}
+
+BOOL DFUServiceServer::finishIo(BOOL fSuccess, OVERLAPPED& ov, DWORD& cbBytes)
+{
+    if (!fSuccess) {
+        auto error = GetLastError();
+        if (ERROR_IO_PENDING != error && ERROR_MORE_DATA != error) {
+            return FALSE;
+        }
+    }
+    return GetOverlappedResult(d_hPipe, &ov, &cbBytes, TRUE);
+}
+
+void DFUServiceServer::setMaxSessions(size_t sessions)
+{
+    scheduler().setMaxSessions(sessions);
+}
+
+void DFUServiceServer::setHubMaxSessions(size_t sessions)
+{
+    scheduler().setHubMaxSessions(sessions);
+}
+
+void DFUServiceServer::setHubRate(uint32_t bytesPerSecond)
+{
+    scheduler().setHubRate(bytesPerSecond);
+}
+
+void DFUServiceServer::setModelMaxSessions(uint16_t vid, uint16_t pid, size_t sessions)
+{
+    scheduler().setModelMaxSessions(vid, pid, sessions);
+}
+
+void DFUServiceServer::setImageCacheSize(size_t bytes)
+{
+    s_imageCache.setBudget(bytes);
+}
+
+void DFUServiceServer::setDefaultDeadlines(const Deadlines& deadlines)
+{
+    s_defaultDeadlines = deadlines;
+}
+
 int DFUServiceServer::getRawRequest(std::vector<uint8_t>& request)
 {
 
@@ -123,29 +381,35 @@ int DFUServiceServer::getRawRequest(std::vector<uint8_t>& request)
     // function returns ERROR_MORE_DATA).The remainder of the message can 
     // be read using another read operation. at: 
     // https://docs.microsoft.com/en-us/windows/win32/ipc/named-pipe-type-read-and-wait-modes
+    // The message is read straight into request. Once its first part is
+    // in, the pipe tells how much is left and the rest is read at once.
     while (1) {
-        std::vector<char> buf(k_bufferSize, '\0');
+        size_t used = request.size();
+        DWORD cbBytesLeft = 0;
+        if (!PeekNamedPipe(d_hPipe, NULL, 0, NULL, NULL, &cbBytesLeft) || 0 == cbBytesLeft) {
+            cbBytesLeft = k_bufferSize;
+        }
+        request.resize(used + cbBytesLeft);
+
         DWORD cbBytesRead = 0;
-        // Read client requests from the pipe. This simplistic code only allows messages
-        // up to BUFSIZE characters in length.
-        auto fSuccess = ReadFile(
+        OVERLAPPED ov = {};
+        ov.hEvent = d_readEvent;
+        auto fSuccess = finishIo(ReadFile(
 
             d_hPipe,        // handle to pipe 
-            buf.data(),    // buffer to receive data 
-            buf.size(), // size of buffer 
-            &cbBytesRead, // number of bytes read 
-            NULL);        // not overlapped I/O 
+            request.data() + used,    // buffer to receive data 
+            cbBytesLeft, // size of buffer 
+            NULL,         // number of bytes read, see finishIo() 
+            &ov),         // overlapped I/O 
+            ov, cbBytesRead);
 
         std::cout << "bytes read: " << cbBytesRead << std::endl;
+        request.resize(used + cbBytesRead);
         if (fSuccess) {
-            std::cout << "Append packet to request buffer: " << std::endl;
-            request.insert(request.end(), buf.begin(), buf.begin() + cbBytesRead);
             break;
         }
         auto error = GetLastError();
         if (ERROR_MORE_DATA == error) {
-            std::cout << "Append packet to request buffer: " << std::endl;
-            request.insert(request.end(), buf.begin(), buf.begin() + cbBytesRead);
             continue;
         }
         else {
@@ -156,21 +420,28 @@ int DFUServiceServer::getRawRequest(std::vector<uint8_t>& request)
     return 0;
 }
 
-int DFUServiceServer::sendResponse(dfusvc::CommandResponse& resp)
+int DFUServiceServer::sendResponse(dfusvc::CommandResponse& resp, uint32_t id)
 {
     DWORD cbWritten = 0;
     BOOL fSuccess = FALSE;
     std::vector<uint8_t> response;
 
     resp.serialize(response);
+    if (0 != id) {
+        CommandRequestUtil::setRequestId(response, id);
+    }
 
     // Write the reply to the pipe. 
-    fSuccess = WriteFile(
+    boost::mutex::scoped_lock lock(d_sendMutex);
+    OVERLAPPED ov = {};
+    ov.hEvent = d_writeEvent;
+    fSuccess = finishIo(WriteFile(
         d_hPipe,        // handle to pipe 
         response.data(),     // buffer to write from 
         response.size(), // number of bytes to write 
-        &cbWritten,   // number of bytes written 
-        NULL);        // not overlapped I/O 
+        NULL,         // number of bytes written, see finishIo() 
+        &ov),         // overlapped I/O 
+        ov, cbWritten);
 
     if (!fSuccess || response.size() != cbWritten)
     {
@@ -180,78 +451,617 @@ int DFUServiceServer::sendResponse(dfusvc::CommandResponse& resp)
     return 0;
 }
 
+static int downloadFlags(DownloadRequest& req)
+    // DfuSe flags of the options of a download request
+{
+    int flags = 0;
 
+    if (req.massErase()) {
+        flags |= DFUTransport::e_dfuseMassErase;
+    }
+    if (req.leave()) {
+        flags |= DFUTransport::e_dfuseLeave;
+    }
+    if (req.delta()) {
+        flags |= DFUTransport::e_dfuseDelta;
+    }
+    if (req.verify()) {
+        flags |= DFUTransport::e_dfuVerify;
+    }
+    return flags;
+}
 
-ServerDownloadCommand::ServerDownloadCommand(std::vector<uint8_t> raw)
-    :d_rawRequest(raw)
+static FirmwareImage requestImage(DownloadRequest& req)
+    // The staged image a download request names, or the image it carries.
+    // Null if the image is not staged
 {
+    if (!req.image().empty()) {
+        return s_imageCache.get(req.image());
+    }
+    return req.data();
 }
 
-int ServerDownloadCommand::execute(std::function<int(dfusvc::CommandResponse&)> fRespSend)
+ServerDownloadCommand::ServerDownloadCommand(const MessageView& request)
+    : d_request(request)
+    , d_prepared(false)
+    , d_bytesSent(0)
+    , d_bytesTotal(0)
+{
+}
+
+int ServerDownloadCommand::prepare(std::function<int(dfusvc::CommandResponse&)> fRespSend)
 {
+    if (d_prepared) {
+        return 0;
+    }
+    if (nullptr == fRespSend) {
+        return -1;
+    }
+    if (d_req.deserialize(d_request) < 0) {
+        fRespSend(dfusvc::ErrorResponse(e_commErr, "Invalid download request"));
+        return -1;
+    }
+    // The hex of the image is no longer needed once decoded, queued
+    // downloads only hold their images
+    d_request = MessageView();
 
-    DownloadRequest req;
-    req.deserialize(d_rawRequest);
+    // The device is only looked at, another command may be using it
+    boost::shared_ptr<Device> device = findDevice(d_req.handle());
+    if (!device) {
+        fRespSend(dfusvc::ErrorResponse(e_transportErr, "Invalid handle"));
+        return -1;
+    }
 
+    // A staged image is used from the cache, it is not decoded again
+    FirmwareImage image = requestImage(d_req);
+    if (image.isNull()) {
+        fRespSend(dfusvc::ErrorResponse(e_imageErr, "Image " + d_req.image() + " is not staged"));
+        return -1;
+    }
+
+    // Refuse an image with a broken suffix or one made for another
+    // device before any of it reaches the device, the suffix is not sent
+    size_t len = 0;
+    std::string reason;
+    if (device->dfu.checkImage(image.data(), image.size(), len, reason) < 0) {
+        fRespSend(dfusvc::ErrorResponse(e_imageErr, reason));
+        return -1;
+    }
+    d_payload = image.slice(0, len);
+    d_prepared = true;
+    return 0;
+}
+
+int ServerDownloadCommand::execute(std::function<int(dfusvc::CommandResponse&)> fRespSend)
+{
     if (nullptr == fRespSend) {
         return -1;
     }
+    runToEnd(*this, fRespSend);
+    return 0;
+}
 
-    boost::shared_ptr<DFUTransport> dfu;
+void ServerDownloadCommand::start(std::function<int(dfusvc::CommandResponse&)> fRespSend,
+                                  std::function<void(void)> done)
+{
+    // Commands run straight away are prepared here, the error has been
+    // answered
+    if (nullptr == fRespSend || prepare(fRespSend) < 0) {
+        done();
+        return;
+    }
+    DownloadRequest& req = d_req;
+    const FirmwareImage& payload = d_payload;
 
-    if (s_deviceMap.find(req.handle()) != s_deviceMap.end()) {
-        dfu = s_deviceMap.at(req.handle());
+    // Held by the download until libdfu.dll is done with the device
+    auto dfu = std::make_shared<DeviceLock>(req.handle());
+
+    if (!*dfu) {
+        fRespSend(dfusvc::ErrorResponse(e_transportErr, "Invalid handle"));
+        done();
+        return;
     }
-    else {
-        return fRespSend(dfusvc::ErrorResponse(e_transportErr, "Invalid handle"));
+
+    int dfuseFlags = downloadFlags(req);
+
+    if (req.dryRun()) {
+        // Report the DfuSe erase plan, the device is not written
+        std::string plan;
+        if ((*dfu)->plan(payload.data(), payload.size(), req.dfuseAddress(), dfuseFlags | DFUTransport::e_dfuseDryRun, plan) < 0) {
+            fRespSend(dfusvc::ErrorResponse(e_deviceErr, "Fail to plan DfuSe download"));
+        }
+        else {
+            fRespSend(dfusvc::DownloadResponse(0, payload.size(), req.handle(), true, plan));
+        }
+        done();
+        return;
     }
 
-    int bytes_sent = 0;
-    int bytes_total = 0;
-    
-    auto download_cb = [&](int sent, int total) {
+    // The transport keeps its callbacks, they must not own the lock
+    DFUTransport *transport = &dfu->device()->dfu;
+    d_bytesSent = 0;
+    d_bytesTotal = 0;
+
+    auto download_cb = [this, transport, fRespSend](int sent, int total) {
+        // Keeps the hub of the device under its rate
+        transport->throttle(scheduler().transferred(transport->portPath(), sent - d_bytesSent));
         // Send progress update message as none-final to client
-        bytes_sent = sent;
-        bytes_total = total;
-        fRespSend(dfusvc::DownloadResponse(sent, total, req.handle()));
+        d_bytesSent = sent;
+        d_bytesTotal = total;
+        fRespSend(dfusvc::DownloadResponse(sent, total, d_req.handle()));
     };
 
-    int ret = 0;
+    auto downloaded = [this, dfu, fRespSend, done](int ret) mutable {
+        DownloadRequest& req = d_req;
+        DFUTransport& transport = dfu->device()->dfu;
+        if (ret < 0) {
+            std::cout << "Fail to download firmware" << std::endl;
+        }
+
+        // A deadline fails the download even when the device finished
+        // late, the device was aborted and its port is free for the next
+        // job
+        std::string reason;
+        std::string verify;
+        if (timedOut(transport, reason)) {
+            fRespSend(dfusvc::ErrorResponse(e_timeoutErr, reason));
+        }
+        else {
+            // The verify report goes to the client with the final
+            // response, or with the error if the image read back
+            // different
+            if (req.verify() && transport.verifyReport(verify) < 0) {
+                verify = "Not verified";
+            }
+            if (DFUTransport::e_verifyFailed == ret) {
+                fRespSend(dfusvc::ErrorResponse(e_verifyErr, verify));
+            }
+            // libdfu.dll tells whether the device has the image, the
+            // bytes sent do not: a DfuSe file sends less than its length
+            else if (ret < 0) {
+                fRespSend(dfusvc::ErrorResponse(e_deviceErr, "Fail to download firmware"));
+            }
+            else {
+                fRespSend(dfusvc::DownloadResponse(d_bytesSent, d_bytesTotal, req.handle(), true, std::string(), verify));
+            }
+        }
+        dfu.reset();
+        done();
+    };
 
-    // Download firmware into device
-    if ((ret = dfu->download(req.data(), download_cb)) < 0) {
+    // Download firmware into device, DfuSe devices are detected by the
+    // dll. This thread is let go once the download is queued
+    applyDeadlines(*transport, req.deadlines());
+    if (transport->downloadAsync(payload.data(), payload.size(), download_cb, req.dfuseAddress(), dfuseFlags, downloaded) < 0) {
         std::cout << "Fail to download firmware" << std::endl;
+        fRespSend(dfusvc::ErrorResponse(e_deviceErr, "Fail to download firmware"));
+        done();
     }
+}
+
+class MultiDownload
+{
+// One multi download, shared by the jobs that download to its devices. The
+// job that finishes last sends the outcome of every device.
+public:
+    // DATA
+    MultiDownloadRequest req;
+    FirmwareImage image;
+        // Decoded once, read by every device
+    int dfuseFlags;
+    std::vector<DownloadResult> results;
+        // One per device, each written by its own job only
+
+private:
+    std::function<int(dfusvc::CommandResponse&)> d_send;
+    boost::mutex d_mutex;
+        // Responses of all devices share the pipe
+    size_t d_pending;
+
+public:
+    // CREATORS
+    MultiDownload(std::function<int(dfusvc::CommandResponse&)> send, size_t devices)
+    : dfuseFlags(0)
+    , results(devices)
+    , d_send(send)
+    , d_pending(devices)
+    {
+    }
+
+    // MANIPULTORS
+    int send(dfusvc::CommandResponse& resp)
+    {
+        boost::mutex::scoped_lock lock(d_mutex);
+        return d_send(resp);
+    }
+    void finished(void)
+        // Count a device done, once for each. The last one sends the
+        // MultiDownloadResponse
+    {
+        {
+            boost::mutex::scoped_lock lock(d_mutex);
+            if (0 != --d_pending) {
+                return;
+            }
+        }
+        dfusvc::MultiDownloadResponse done(results);
+        send(done);
+    }
+};
+
+class MultiDownloadTarget : public ServerCommand
+{
+// The download to one device of a multi download. It is a job of the
+// scheduler like a single download, so it waits for the same caps and
+// goes by the priority and client of the request.
+private:
+    // DATA
+    std::shared_ptr<MultiDownload> d_download;
+    size_t d_index;
+    FirmwareImage d_payload;
+        // The image without its suffix, once prepared
+    bool d_prepared;
+
+    DownloadResult& result(void) { return d_download->results[d_index]; }
+
+public:
+    // CREATORS
+    MultiDownloadTarget(std::shared_ptr<MultiDownload> download, size_t index)
+    : d_download(download)
+    , d_index(index)
+    , d_prepared(false)
+    {
+    }
+
+    // MANIPULTORS
+    int prepare(std::function<int(dfusvc::CommandResponse&)>) override
+        // Check the image is meant for the device, counts the device done
+        // if it is not
+    {
+        if (d_prepared) {
+            return 0;
+        }
+        boost::shared_ptr<Device> device = findDevice(result().handle);
+        if (!device) {
+            result().error = e_transportErr;
+            result().reason = "Invalid handle";
+            d_download->finished();
+            return -1;
+        }
+        // Each device is checked, they need not all be the same model
+        size_t len = 0;
+        const FirmwareImage& image = d_download->image;
+        if (device->dfu.checkImage(image.data(), image.size(), len, result().reason) < 0) {
+            result().error = e_imageErr;
+            d_download->finished();
+            return -1;
+        }
+        d_payload = image.slice(0, len);
+        d_prepared = true;
+        return 0;
+    }
+
+    int execute(std::function<int(dfusvc::CommandResponse&)> fRespSend) override
+    {
+        runToEnd(*this, fRespSend);
+        return 0;
+    }
+
+    void start(std::function<int(dfusvc::CommandResponse&)> fRespSend,
+               std::function<void(void)> done) override
+        // Returns once the download is queued in libdfu.dll, the device
+        // is counted done on its thread
+    {
+        if (prepare(fRespSend) < 0) {
+            done();
+            return;
+        }
+        std::shared_ptr<MultiDownload> download = d_download;
+        this->download(std::make_shared<DeviceLock>(result().handle), [download, done]() {
+            download->finished();
+            done();
+        });
+    }
+
+private:
+    void download(std::shared_ptr<DeviceLock> dfu, std::function<void(void)> finished)
+        // Queue the download to the device, finished is called once it is
+        // done or failed
+    {
+        MultiDownloadRequest& req = d_download->req;
+        int dfuseFlags = d_download->dfuseFlags;
+        DownloadResult& result = this->result();
+
+        if (!*dfu) {
+            result.error = e_transportErr;
+            result.reason = "Invalid handle";
+            finished();
+            return;
+        }
+
+        if (req.dryRun()) {
+            if ((*dfu)->plan(d_payload.data(), d_payload.size(), req.dfuseAddress(), dfuseFlags | DFUTransport::e_dfuseDryRun, result.report) < 0) {
+                result.error = e_deviceErr;
+                result.reason = "Fail to plan DfuSe download";
+            }
+            finished();
+            return;
+        }
+
+        // The transport keeps its callbacks, they must not own the lock
+        DFUTransport *transport = &dfu->device()->dfu;
+        auto download_cb = [this, transport](int sent, int total) {
+            DownloadResult& result = this->result();
+            transport->throttle(scheduler().transferred(transport->portPath(), sent - result.sent));
+            result.sent = sent;
+            dfusvc::DownloadResponse progress(sent, total, result.handle);
+            d_download->send(progress);
+        };
+        auto downloaded = [this, dfu, finished](int ret) mutable {
+            MultiDownloadRequest& req = d_download->req;
+            DownloadResult& result = this->result();
+            DFUTransport& transport = dfu->device()->dfu;
+            if (timedOut(transport, result.reason)) {
+                result.error = e_timeoutErr;
+            }
+            else if (DFUTransport::e_verifyFailed == ret) {
+                result.error = e_verifyErr;
+                result.reason = "Image read back different";
+            }
+            else if (ret < 0) {
+                result.error = e_deviceErr;
+                result.reason = "Fail to download firmware";
+            }
+            if (req.verify() && transport.verifyReport(result.report) < 0) {
+                result.report = "Not verified";
+            }
+            dfu.reset();
+            finished();
+        };
+        applyDeadlines(*transport, req.deadlines());
+        if (transport->downloadAsync(d_payload.data(), d_payload.size(), download_cb, req.dfuseAddress(), dfuseFlags, downloaded) < 0) {
+            result.error = e_deviceErr;
+            result.reason = "Fail to download firmware";
+            finished();
+        }
+    }
+};
+
+ServerMultiDownloadCommand::ServerMultiDownloadCommand(const MessageView& request)
+    : d_request(request)
+{
+}
+
+int ServerMultiDownloadCommand::execute(std::function<int(dfusvc::CommandResponse&)> fRespSend)
+{
+    if (nullptr == fRespSend) {
+        return -1;
+    }
+    MultiDownloadRequest req;
+    if (req.deserialize(d_request) < 0) {
+        return fRespSend(dfusvc::ErrorResponse(e_commErr, "Invalid multi download request"));
+    }
+
+    std::vector<int> handles = req.handles();
+    auto download = std::make_shared<MultiDownload>(fRespSend, handles.size());
+    download->req = req;
+
+    // One copy of the image, decoded once, is read by every device
+    download->image = requestImage(req);
+    if (download->image.isNull()) {
+        return fRespSend(dfusvc::ErrorResponse(e_imageErr, "Image " + req.image() + " is not staged"));
+    }
+    download->dfuseFlags = downloadFlags(req);
+    if (handles.empty()) {
+        dfusvc::MultiDownloadResponse done(download->results);
+        return fRespSend(done);
+    }
+    for (size_t i = 0; i < handles.size(); i++) {
+        DownloadResult& result = download->results[i];
+        result.handle = handles[i];
+        result.sent = 0;
+        result.error = e_noError;
+    }
+
+    // Each device is a job of its own, the scheduler runs them under the
+    // same caps as single downloads. This thread is done once they are
+    // queued
+    for (size_t i = 0; i < handles.size(); i++) {
+        DownloadResult& result = download->results[i];
+        if (std::find(handles.begin(), handles.begin() + i, result.handle) != handles.begin() + i) {
+            result.error = e_transportErr;
+            result.reason = "Handle listed twice";
+            download->finished();
+            continue;
+        }
+        boost::shared_ptr<Device> device = findDevice(result.handle);
+        if (!device) {
+            result.error = e_transportErr;
+            result.reason = "Invalid handle";
+            download->finished();
+            continue;
+        }
+
+        JobScheduler::Job job;
+        job.command = std::make_shared<MultiDownloadTarget>(download, i);
+        job.send = fRespSend;
+        job.handle = result.handle;
+        job.vid = device->dfu.vendorId();
+        job.pid = device->dfu.productId();
+        job.path = device->dfu.portPath();
+        job.priority = d_request.priority();
+        job.client = d_request.client();
+        scheduler().submit(job);
+    }
+    return 0;
+}
+
+ServerStageImageCommand::ServerStageImageCommand(const MessageView& request)
+    : d_request(request)
+{
+}
 
-    // Check whether the full image is downloaded
-    if (ret == req.data().size()) {
-        return fRespSend(dfusvc::DownloadResponse(bytes_sent, bytes_total, req.handle(), true));
-    } else {
-        return fRespSend(dfusvc::DownloadResponse(bytes_sent, bytes_total, req.handle(), true));
+int ServerStageImageCommand::execute(std::function<int(dfusvc::CommandResponse&)> fRespSend)
+{
+    StageImageRequest req;
+
+    if (nullptr == fRespSend) {
+        return -1;
     }
+    if (req.deserialize(d_request) < 0) {
+        return fRespSend(dfusvc::ErrorResponse(e_commErr, "Invalid stage image request"));
+    }
+
+    size_t size = req.data().size();
+    std::string digest = s_imageCache.put(req.data());
+    if (digest.empty()) {
+        return fRespSend(dfusvc::ErrorResponse(e_imageErr, "Image is bigger than the image cache"));
+    }
+    std::cout << "Staged image " << digest << ", " << s_imageCache.bytes() << " bytes cached" << std::endl;
+    return fRespSend(dfusvc::StageImageResponse(digest, size));
+}
+
+ServerUploadCommand::ServerUploadCommand(const MessageView& request)
+    : d_request(request)
+{
 }
 
-std::shared_ptr<ServerCommand> ServerCommandFactory::makeServerCommand(std::vector<uint8_t> raw)
+int ServerUploadCommand::execute(std::function<int(dfusvc::CommandResponse&)> fRespSend)
 {
-    CommandType type;
-    CommandRequestUtil::getCommandType(type, raw);
-    switch (type)
+    UploadRequest req;
+    req.deserialize(d_request);
+
+    if (nullptr == fRespSend) {
+        return -1;
+    }
+
+    DeviceLock dfu(req.handle());
+
+    if (!dfu) {
+        return fRespSend(dfusvc::ErrorResponse(e_transportErr, "Invalid handle"));
+    }
+    applyDeadlines(dfu.device()->dfu, req.deadlines());
+    std::string reason;
+
+    // Nothing goes through the pipe but the outcome when the data is
+    // hashed or stored by the server
+    if (!req.hash().empty()) {
+        DFUTransport::UploadHash hash;
+        if (req.hash() == "crc32") {
+            hash = DFUTransport::e_crc32;
+        }
+        else if (req.hash() == "sha256") {
+            hash = DFUTransport::e_sha256;
+        }
+        else {
+            return fRespSend(dfusvc::ErrorResponse(e_deviceErr, "Unknown upload hash"));
+        }
+        std::string digest;
+        int ret = dfu->uploadHash(req.dfuseAddress(), req.length(), hash, digest);
+        if (timedOut(dfu.device()->dfu, reason)) {
+            return fRespSend(dfusvc::ErrorResponse(e_timeoutErr, reason));
+        }
+        if (ret < 0) {
+            return fRespSend(dfusvc::ErrorResponse(e_deviceErr, "Fail to upload firmware"));
+        }
+        return fRespSend(dfusvc::UploadResponse(req.handle(), req.dfuseAddress(), ret,
+                                                std::vector<uint8_t>(), true, digest));
+    }
+    if (!req.file().empty()) {
+        int ret = dfu->uploadFile(req.dfuseAddress(), req.length(), req.file());
+        if (timedOut(dfu.device()->dfu, reason)) {
+            return fRespSend(dfusvc::ErrorResponse(e_timeoutErr, reason));
+        }
+        if (ret < 0) {
+            return fRespSend(dfusvc::ErrorResponse(e_deviceErr, "Fail to upload firmware"));
+        }
+        return fRespSend(dfusvc::UploadResponse(req.handle(), req.dfuseAddress(), ret,
+                                                std::vector<uint8_t>(), true));
+    }
+
+    // The device is read on this thread while a sender thread writes the
+    // chunks already read to the pipe, so neither waits for the other
+    // unless k_maxQueued chunks are pending.
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<UploadResponse> queue;
+    bool reading = true;
+    bool sendFailed = false;
+
+    boost::thread sender([&]() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (1) {
+            while (reading && queue.empty()) {
+                cond.wait(lock);
+            }
+            if (queue.empty()) {
+                break;
+            }
+            UploadResponse resp = queue.front();
+            queue.pop_front();
+            cond.notify_all();
+            lock.unlock();
+            int ret = fRespSend(resp);
+            lock.lock();
+            if (ret != 0) {
+                sendFailed = true;
+            }
+        }
+    });
+
+    std::vector<uint8_t> chunk;
+    uint32_t chunkAddress = 0;
+    size_t offset = 0;
+
+    auto upload_cb = [&](uint32_t address, const uint8_t *data, size_t len) {
+        dfu->throttle(scheduler().transferred(dfu->portPath(), len));
+        if (chunk.empty()) {
+            chunkAddress = address;
+        }
+        chunk.insert(chunk.end(), data, data + len);
+        if (chunk.size() < k_chunkSize) {
+            return 0;
+        }
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.size() >= k_maxQueued && !sendFailed) {
+            cond.wait(lock);
+        }
+        if (sendFailed) {
+            // Client is gone, stop reading the device
+            return 1;
+        }
+        queue.push_back(UploadResponse(req.handle(), chunkAddress, offset, chunk));
+        cond.notify_all();
+        offset += chunk.size();
+        chunkAddress += chunk.size();
+        chunk.clear();
+        return 0;
+    };
+
+    int ret = dfu->upload(req.dfuseAddress(), req.length(), upload_cb);
+
     {
-    case e_open:
-        return std::make_shared<ServerOpenCommand>(raw);
-    case e_download:
-        return std::make_shared<ServerDownloadCommand>(raw);
-    case e_close:
-        return std::make_shared<ServerCloseCommand>(raw);
-    case e_terminate:
-        return std::make_shared<ServerTerminateCommand>(raw);
-    default:
-        return nullptr;
+        boost::unique_lock<boost::mutex> lock(mutex);
+        reading = false;
+        cond.notify_all();
+    }
+    sender.join();
+
+    if (sendFailed) {
+        return -1;
     }
+    if (timedOut(dfu.device()->dfu, reason)) {
+        return fRespSend(dfusvc::ErrorResponse(e_timeoutErr, reason));
+    }
+    if (ret < 0) {
+        std::cout << "Fail to upload firmware" << std::endl;
+        return fRespSend(dfusvc::ErrorResponse(e_deviceErr, "Fail to upload firmware"));
+    }
+    return fRespSend(dfusvc::UploadResponse(req.handle(), chunkAddress, offset, chunk, true));
 }
 
-ServerOpenCommand::ServerOpenCommand(std::vector<uint8_t> raw)
-: d_rawRequest(raw)
+ServerOpenCommand::ServerOpenCommand(const MessageView& request)
+: d_request(request)
 {
 
 }
@@ -259,9 +1069,12 @@ ServerOpenCommand::ServerOpenCommand(std::vector<uint8_t> raw)
 int ServerOpenCommand::execute(std::function<int(dfusvc::CommandResponse&)> fRespSend)
 {
     OpenRequest req;
-    req.deserialize(d_rawRequest);
+    req.deserialize(d_request);
 
-    boost::shared_ptr<DFUTransport> dfu = boost::make_shared<DFUTransport>();
+    boost::shared_ptr<Device> device = boost::make_shared<Device>();
+    device->busy = false;
+    device->closed = false;
+    DFUTransport *dfu = &device->dfu;
 
     if (dfu->init() < 0) {
         return fRespSend(dfusvc::ErrorResponse(e_transportErr, "Fail to init dfu transport"));
@@ -286,32 +1099,32 @@ int ServerOpenCommand::execute(std::function<int(dfusvc::CommandResponse&)> fRes
         return fRespSend(dfusvc::ErrorResponse(e_transportErr, "No DFU device found"));
     }
     
+    boost::mutex::scoped_lock lock(s_deviceMutex);
     int handle = s_gcount++;
-    s_deviceMap[handle] = dfu;
+    s_deviceMap[handle] = device;
+    lock.unlock();
 
-    return fRespSend(dfusvc::OpenResponse(handle));
+    // Clients may compress images once they know the server takes it
+    return fRespSend(dfusvc::OpenResponse(handle, "lz4"));
 }
 
-ServerCloseCommand::ServerCloseCommand(std::vector<uint8_t> raw)
-: d_rawRequest(raw)
+ServerCloseCommand::ServerCloseCommand(const MessageView& request)
+: d_request(request)
 {
 }
 
 int ServerCloseCommand::execute(std::function<int(dfusvc::CommandResponse&)> fRespSend)
 {
     CloseRequest req;
-    req.deserialize(d_rawRequest);
+    req.deserialize(d_request);
 
     if (nullptr == fRespSend) {
         return -1;
     }
 
-    boost::shared_ptr<DFUTransport> dfu;
+    DeviceLock dfu(req.handle());
 
-    if (s_deviceMap.find(req.handle()) != s_deviceMap.end()) {
-        dfu = s_deviceMap.at(req.handle());
-    }
-    else {
+    if (!dfu) {
         return fRespSend(dfusvc::ErrorResponse(e_transportErr, "Invalid handle"));
     }
 
@@ -319,12 +1132,45 @@ int ServerCloseCommand::execute(std::function<int(dfusvc::CommandResponse&)> fRe
         return fRespSend(dfusvc::ErrorResponse(e_transportErr, "Can not close device"));
     }
     else {
+        dfu.close();
+        boost::mutex::scoped_lock lock(s_deviceMutex);
+        s_deviceMap.erase(req.handle());
+        lock.unlock();
         return fRespSend(dfusvc::CloseResponse());
     }
 }
 
-ServerTerminateCommand::ServerTerminateCommand(std::vector<uint8_t> raw)
-: d_rawRequest(raw)
+ServerListCommand::ServerListCommand(const MessageView& request)
+: d_request(request)
+{
+}
+
+int ServerListCommand::execute(std::function<int(dfusvc::CommandResponse&)> fRespSend)
+{
+    if (nullptr == fRespSend) {
+        return -1;
+    }
+
+    std::vector<DeviceInfo> devices;
+    boost::mutex::scoped_lock lock(s_deviceMutex);
+    for (auto& entry : s_deviceMap) {
+        DeviceInfo device;
+        device.handle = entry.first;
+        device.vid = entry.second->dfu.vendorId();
+        device.pid = entry.second->dfu.productId();
+        device.path = entry.second->dfu.portPath();
+        devices.push_back(device);
+    }
+    lock.unlock();
+    std::sort(devices.begin(), devices.end(),
+        [](const DeviceInfo& a, const DeviceInfo& b) { return a.handle < b.handle; });
+
+    ListResponse resp(devices, scheduler().busUsage());
+    return fRespSend(resp);
+}
+
+ServerTerminateCommand::ServerTerminateCommand(const MessageView& request)
+: d_request(request)
 {
 }
 
@@ -332,7 +1178,7 @@ int ServerTerminateCommand::execute(std::function<int(dfusvc::CommandResponse&)>
 {
     TerminateRequest req;
     int ret = -1;
-    if (0 == req.deserialize(d_rawRequest)) {
+    if (0 == req.deserialize(d_request)) {
         ret = -1;
     }
 
@@ -6,14 +6,19 @@
 #define DFUSVC_SERVER_H
 
 #include <windows.h>
+#include <memory>
 #include <string>
 #include <vector>
 #include <functional>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include "dfusvc_command.h"
 
 namespace dfusvc
 {
 
+class ServerCommand;
+
                             // =======================
                             // class DFUServiceServer
                             // =======================
@@ -25,14 +30,43 @@ private:
     enum {
         k_bufferSize = 4096
     };
+    struct Job {
+        std::shared_ptr<ServerCommand> command;
+        uint32_t id;
+        int priority;
+        std::string client;
+    };
     std::string d_pipeName = "\\\\.\\pipe\\";
     // DATA
     HANDLE d_hPipe;
+    HANDLE d_readEvent;
+    HANDLE d_writeEvent;
+        // The pipe is overlapped, so responses are written while the next
+        // request is read
+    boost::mutex d_sendMutex;
+        // Responses of concurrent commands go out one whole message at a
+        // time
+    boost::mutex d_commandMutex;
+    boost::condition_variable d_idle;
+    int d_running;
+        // Tagged commands for no device running, the others are run by
+        // the job scheduler
     // MANIPULTORS
+    BOOL finishIo(BOOL fSuccess, OVERLAPPED& ov, DWORD& cbBytes);
+    // This function waits for I/O started on the pipe and returns like
+    // the I/O would have without overlapping
     int getRawRequest(std::vector<uint8_t>& request);
     // This function read a full message from pipe
-    int sendResponse(dfusvc::CommandResponse& resp);
-    // This function send the whole response message to pipe
+    int sendResponse(dfusvc::CommandResponse& resp, uint32_t id = 0);
+    // This function send the whole response message to pipe, tagged
+    // with the request id if it is not 0
+    void dispatch(int handle, const Job& job);
+    // This function runs a tagged command on a thread of its own, or
+    // queues it on the job scheduler if it is for a device handle
+    void runJob(Job job);
+    // This function runs a command that is for no device
+    void waitForCommands(void);
+    // This function blocks until every tagged command is done
 public:
     // CREATORS
     DFUServiceServer(std::string name);
@@ -41,7 +75,29 @@ public:
     int waitForConnection(void);
         // THis function blocks until a client is connect to the server
     int processRequest(void);
-        // This function process a client request synchronously 
+        // This function process a client request. A request without an
+        // id is executed before the next is read. One with an id is
+        // executed concurrently with the others, its responses carry the
+        // id and may interleave with theirs. Requests with an id for the
+        // same device "handle" still run in the order they came
+    static void setImageCacheSize(size_t bytes);
+        // Bytes of staged images kept by the server, the least recently
+        // used are dropped first
+    static void setDefaultDeadlines(const Deadlines& deadlines);
+        // Deadlines of the downloads and uploads that set none of their
+        // own, 0 for none
+    static void setMaxSessions(size_t sessions);
+        // Device commands of tagged requests that run at once at most
+    static void setModelMaxSessions(uint16_t vid, uint16_t pid, size_t sessions);
+        // Device commands of tagged requests that run at once on devices
+        // vid:pid at most, 0 for no cap but the global one
+    static void setHubMaxSessions(size_t sessions);
+        // Device downloads and commands of tagged requests that run at
+        // once on devices behind one hub at most, 0 for no cap
+    static void setHubRate(uint32_t bytesPerSecond);
+        // Bytes per second downloaded or streamed up through one hub at
+        // most, 0 for no cap
+
 
 };
 
@@ -55,8 +111,19 @@ class ServerCommand
 // This is the abstract base class for all server side commands class
 // We use command design pattern here
 public:
+    virtual int prepare(std::function<int(dfusvc::CommandResponse&)> fRespSend) { return 0; }
+        // Get ready to execute while the command waits for its turn.
+        // Returns -1 once it answered with an error if it can not run
     virtual int execute(std::function<int(dfusvc::CommandResponse&)> fRespSend) = 0;
         // Abstract command execution function
+    virtual void start(std::function<int(dfusvc::CommandResponse&)> fRespSend,
+                       std::function<void(void)> done)
+        // Execute without holding the caller when the command can, done
+        // is called once it is finished
+    {
+        execute(fRespSend);
+        done();
+    }
 };
 
 
@@ -69,11 +136,11 @@ class ServerOpenCommand : public ServerCommand
 // This function handls all server side open device command related operation
 // including decoding and execution.
 private:
-    std::vector<uint8_t> d_rawRequest;
-    // The raw command request sent by client.
+    MessageView d_request;
+    // The command request sent by client.
 public:
     // CREATORS
-    ServerOpenCommand(std::vector<uint8_t> raw);
+    ServerOpenCommand(const MessageView& request);
     // Default constructor
 
     virtual int execute(std::function<int(dfusvc::CommandResponse&)> fRespSend) override;
@@ -90,31 +157,127 @@ class ServerDownloadCommand : public ServerCommand
 // This function handls all server side download command related operation
 // including decoding and execution.
 private:
-    std::vector<uint8_t> d_rawRequest;
-        // The raw command request sent by client.
+    MessageView d_request;
+        // The command request sent by client, dropped once prepared.
+    DownloadRequest d_req;
+    FirmwareImage d_payload;
+        // The image decoded and checked, without its suffix
+    bool d_prepared;
+    int d_bytesSent;
+    int d_bytesTotal;
+        // Progress of the running download
 public:
     // CREATORS
-    ServerDownloadCommand(std::vector<uint8_t> raw);
+    ServerDownloadCommand(const MessageView& request);
         // Default constructor
 
+    virtual int prepare(std::function<int(dfusvc::CommandResponse&)> fRespSend) override;
+        // This function decodes the image and checks it is meant for the
+        // device, before the device is free.
+
     virtual int execute(std::function<int(dfusvc::CommandResponse&)> fRespSend) override;
         // This function download binary into it according to the device according to the
         // handle in the client raw request. It will send mutilpe 
         // downloadResponses. The last response will have "last" field marked as true; other
         // responses will have "last" field as false.
+
+    virtual void start(std::function<int(dfusvc::CommandResponse&)> fRespSend,
+                       std::function<void(void)> done) override;
+        // As execute(), but returns once the download is queued in
+        // libdfu.dll. done is called on its thread after the last
+        // response.
+};
+
+                    // =================================
+                    // class ServerMultiDownloadCommand
+                    // =================================
+
+class ServerMultiDownloadCommand : public ServerCommand
+{
+// This function handls the server side of downloading one image to several
+// devices.
+private:
+    MessageView d_request;
+        // The command request sent by client.
+public:
+    // CREATORS
+    ServerMultiDownloadCommand(const MessageView& request);
+        // Default constructor
+
+    virtual int execute(std::function<int(dfusvc::CommandResponse&)> fRespSend) override;
+        // This function queues a job for each device of the request that
+        // checks the image against the device and downloads it, all from
+        // one buffer. The jobs run under the same session caps, priority
+        // and client as single downloads, and the function returns once
+        // they are queued. The progress of each device is sent as
+        // DownloadResponses with its handle; a MultiDownloadResponse with
+        // the outcome per device is the last response, sent by the job
+        // that finishes last.
 };
 
+                    // ==============================
+                    // class ServerStageImageCommand
+                    // ==============================
+
+class ServerStageImageCommand : public ServerCommand
+{
+// This function handls the server side of staging an image in the image
+// cache.
+private:
+    MessageView d_request;
+        // The command request sent by client.
+public:
+    // CREATORS
+    ServerStageImageCommand(const MessageView& request);
+        // Default constructor
+
+    virtual int execute(std::function<int(dfusvc::CommandResponse&)> fRespSend) override;
+        // This function caches the image of the request and answers with
+        // its SHA-256, which download requests can then name instead of
+        // sending the image again.
+};
+
+                    // ==========================
+                    // class ServerUploadCommand
+                    // ==========================
+
+class ServerUploadCommand : public ServerCommand
+{
+// This function handls all server side upload command related operation
+// including decoding and execution.
+private:
+    // TYPES
+    enum {
+        k_chunkSize = 64 * 1024,
+            // Bytes read from the device per UploadResponse
+        k_maxQueued = 4
+            // Responses read ahead of the pipe
+    };
+    MessageView d_request;
+        // The command request sent by client.
+public:
+    // CREATORS
+    ServerUploadCommand(const MessageView& request);
+        // Default constructor
+
+    virtual int execute(std::function<int(dfusvc::CommandResponse&)> fRespSend) override;
+        // This function reads the device according to the handle in the
+        // client raw request. Chunks are sent as UploadResponses while the
+        // device is still being read; the last response has "last" field
+        // marked as true and carries whatever was read after the last chunk.
+        // When a hash or file is requested only that last response is sent.
+};
 
 class ServerCloseCommand : public ServerCommand
 {
     // This function handls all server side close device command related operation
     // including decoding and execution.
 private:
-    std::vector<uint8_t> d_rawRequest;
-    // The raw command request sent by client.
+    MessageView d_request;
+    // The command request sent by client.
 public:
     // CREATORS
-    ServerCloseCommand(std::vector<uint8_t> raw);
+    ServerCloseCommand(const MessageView& request);
     // Default constructor
 
     virtual int execute(std::function<int(dfusvc::CommandResponse&)> fRespSend) override;
@@ -122,33 +285,37 @@ public:
 };
 
 
-class ServerTerminateCommand : public ServerCommand
+class ServerListCommand : public ServerCommand
 {
-    // This function handls all server serviceTerminate request
+    // This function handls the server side of listing the open devices
 private:
-    std::vector<uint8_t> d_rawRequest;
-    // The raw command request sent by client.
+    MessageView d_request;
+    // The command request sent by client.
 public:
     // CREATORS
-    ServerTerminateCommand(std::vector<uint8_t> raw);
+    ServerListCommand(const MessageView& request);
     // Default constructor
 
     virtual int execute(std::function<int(dfusvc::CommandResponse&)> fRespSend) override;
-    // This command close a DFU devicce according to the handle.
+    // This command answers with the handle, vid and pid of every device
+    // opened and not closed yet.
 };
 
-                        // ===========================
-                        // class ServerCommandFactory
-                        // ===========================
-
-class ServerCommandFactory
+class ServerTerminateCommand : public ServerCommand
 {
-// ServerCommand Factory class. This class create concrete server command objects according
-// to the type field in message.
+    // This function handls all server serviceTerminate request
+private:
+    MessageView d_request;
+    // The command request sent by client.
 public:
-    static std::shared_ptr<ServerCommand> makeServerCommand(std::vector<uint8_t> raw);
-        //Factory method create concrete objects
+    // CREATORS
+    ServerTerminateCommand(const MessageView& request);
+    // Default constructor
+
+    virtual int execute(std::function<int(dfusvc::CommandResponse&)> fRespSend) override;
+    // This command close a DFU devicce according to the handle.
 };
+
 }
 
 
@@ -4,22 +4,63 @@
 // dfutransport.cpp
 #include "dfutransport.h"
 
+#include <chrono>
 #include <iostream>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <unordered_map>
 
 
 
 static std::unordered_map<int, DFUTransport*> s_transMap;
+static std::mutex s_transMutex;
+    // Devices are opened while others call back
+
+static DFUTransport *findTransport(int handle)
+{
+    std::lock_guard<std::mutex> lock(s_transMutex);
+    return s_transMap[handle];
+}
+
+static int downloadResult(int ret)
+    // What libdfu.dll returned for a download as a DownloadError or the
+    // bytes sent
+{
+    if (ret == DFUTransport::e_verifyFailed) {
+        return DFUTransport::e_verifyFailed;
+    }
+    if (ret < 0) {
+        return DFUTransport::e_downloadFailed;
+    }
+    else {
+        return ret;
+    }
+}
 
 DFUTransport::DFUTransport()
     :dl(nullptr)
+    , dl_dfuse(nullptr)
+    , dl_dfuse_async(nullptr)
+    , plan_dfuse(nullptr)
+    , check_image(nullptr)
+    , verify_report(nullptr)
+    , ul(nullptr)
+    , ul_file(nullptr)
+    , ul_hash(nullptr)
+    , device_path(nullptr)
+    , set_deadlines(nullptr)
+    , deadline_expired(nullptr)
+    , dfu_throttle(nullptr)
     , dfu_open(nullptr)
     , dfu_close(nullptr)
     , inited(false)
     , handle(-1)
+    , vendor(0)
+    , product(0)
     , hinstLib(nullptr)
     , dl_cb(nullptr)
+    , dl_done(nullptr)
 {
 
 }
@@ -43,6 +84,20 @@ int DFUTransport::init()
         goto done;
 
     }
+    // Optional, libdfu.dll without DfuSe support lacks it
+    dl_dfuse = (f_download_dfuse_t)GetProcAddress(hinstLib, "download_dfuse");
+    dl_dfuse_async = (f_download_dfuse_async_t)GetProcAddress(hinstLib, "download_dfuse_async");
+    plan_dfuse = (f_plan_dfuse_t)GetProcAddress(hinstLib, "plan_dfuse");
+    check_image = (f_check_image_t)GetProcAddress(hinstLib, "check_image");
+    verify_report = (f_verify_report_t)GetProcAddress(hinstLib, "verify_report");
+    ul = (f_upload_t)GetProcAddress(hinstLib, "upload");
+    ul_file = (f_upload_file_t)GetProcAddress(hinstLib, "upload_file");
+    ul_hash = (f_upload_hash_t)GetProcAddress(hinstLib, "upload_hash");
+    device_path = (f_device_path_t)GetProcAddress(hinstLib, "device_path");
+    set_deadlines = (f_set_deadlines_t)GetProcAddress(hinstLib, "set_deadlines");
+    deadline_expired = (f_deadline_expired_t)GetProcAddress(hinstLib, "deadline_expired");
+    dfu_throttle = (f_throttle_t)GetProcAddress(hinstLib, "throttle");
+
     dfu_open = (dfu_open_t)GetProcAddress(hinstLib, "open_device");
     if (NULL == dfu_open) {
         std::cout << "Fail to find open method" << std::endl;
@@ -71,19 +126,169 @@ int DFUTransport::open(uint16_t vid, uint16_t pid)
         return -1;
     }
     handle = ret;
+    vendor = vid;
+    product = pid;
+    path.clear();
+    if (nullptr != device_path) {
+        char buf[40];
+        if (device_path(handle, buf, sizeof(buf)) > 0) {
+            path = buf;
+        }
+    }
+    std::lock_guard<std::mutex> lock(s_transMutex);
     s_transMap[handle] = this;
     return 0;
 
 }
 
-int DFUTransport::download(std::vector<uint8_t> data, std::function<void(int, int)> cb)
+int DFUTransport::download(const std::vector<uint8_t>& data, std::function<void(int, int)> cb)
+{
+    return download(data.data(), data.size(), cb, 0, 0);
+}
+
+int DFUTransport::download(const std::vector<uint8_t>& data,
+                           std::function<void(int, int)> cb,
+                           uint32_t dfuseAddress,
+                           int dfuseFlags)
+{
+    return download(data.data(), data.size(), cb, dfuseAddress, dfuseFlags);
+}
+
+int DFUTransport::download(const uint8_t *data,
+                           size_t len,
+                           std::function<void(int, int)> cb,
+                           uint32_t dfuseAddress,
+                           int dfuseFlags)
+{
+    if (!inited) {
+        return -1;
+    }
+    // libdfu.dll never writes the image, its API predates const
+    uint8_t *din = const_cast<uint8_t *>(data);
+    auto progress = [](int handle, size_t sent, size_t total) {
+        findTransport(handle)->dl_cb(sent, total);
+    };
+    int ret;
+    dl_cb = cb;
+    if (nullptr == dl_dfuse) {
+        if (dfuseAddress || dfuseFlags) {
+            std::cout << "DfuSe download not supported by libdfu.dll" << std::endl;
+            return -1;
+        }
+        ret = dl(handle, din, len, progress);
+    } else {
+        ret = dl_dfuse(handle, din, len, dfuseAddress, dfuseFlags, progress);
+    }
+    return downloadResult(ret);
+}
+
+int DFUTransport::downloadAsync(const uint8_t *data,
+                                size_t len,
+                                std::function<void(int, int)> cb,
+                                uint32_t dfuseAddress,
+                                int dfuseFlags,
+                                std::function<void(int)> done)
 {
     if (!inited) {
         return -1;
     }
+    if (nullptr == dl_dfuse_async || (dfuseFlags & e_dfuseDryRun)) {
+        // An older libdfu.dll, the download holds this thread instead
+        done(download(data, len, cb, dfuseAddress, dfuseFlags));
+        return 0;
+    }
+    uint8_t *din = const_cast<uint8_t *>(data);
+    auto progress = [](int handle, size_t sent, size_t total) {
+        findTransport(handle)->dl_cb(sent, total);
+    };
+    auto finished = [](int handle, int result) {
+        // done may own what owns this transport, let go of it first
+        DFUTransport *transport = findTransport(handle);
+        std::function<void(int)> done;
+        done.swap(transport->dl_done);
+        done(downloadResult(result));
+    };
     dl_cb = cb;
-    int ret = dl(handle, data.data(), data.size(), [](int handle, size_t sent, size_t total) {
-        s_transMap[handle]->dl_cb(sent, total);
+    dl_done = done;
+    if (dl_dfuse_async(handle, din, len, dfuseAddress, dfuseFlags, progress, finished) < 0) {
+        dl_done = nullptr;
+        return -1;
+    }
+    return 0;
+}
+
+int DFUTransport::plan(const std::vector<uint8_t>& data,
+                       uint32_t dfuseAddress,
+                       int dfuseFlags,
+                       std::string& report)
+{
+    return plan(data.data(), data.size(), dfuseAddress, dfuseFlags, report);
+}
+
+int DFUTransport::plan(const uint8_t *data,
+                       size_t len,
+                       uint32_t dfuseAddress,
+                       int dfuseFlags,
+                       std::string& report)
+{
+    if (!inited || nullptr == plan_dfuse) {
+        return -1;
+    }
+    uint8_t *din = const_cast<uint8_t *>(data);
+    int size = plan_dfuse(handle, din, len, dfuseAddress, dfuseFlags, nullptr, 0);
+    if (size < 0) {
+        return -1;
+    }
+    std::vector<char> buf(size + 1);
+    plan_dfuse(handle, din, len, dfuseAddress, dfuseFlags, buf.data(), buf.size());
+    report.assign(buf.data(), size);
+    return 0;
+}
+
+int DFUTransport::checkImage(std::vector<uint8_t>& data, std::string& reason)
+{
+    size_t payload = 0;
+    if (checkImage(data.data(), data.size(), payload, reason) < 0) {
+        return -1;
+    }
+    data.resize(payload);
+    return 0;
+}
+
+int DFUTransport::checkImage(const uint8_t *data,
+                             size_t len,
+                             size_t& payload,
+                             std::string& reason)
+{
+    if (!inited) {
+        return -1;
+    }
+    payload = len;
+    if (nullptr == check_image) {
+        // Older libdfu.dll, the device gets the image unchecked
+        return 0;
+    }
+    char buf[256];
+    int ret = check_image(handle, const_cast<uint8_t *>(data), len, buf, sizeof(buf));
+    if (ret < 0) {
+        reason = buf;
+        return -1;
+    }
+    payload = ret;
+    return 0;
+}
+
+int DFUTransport::upload(uint32_t dfuseAddress,
+                         size_t length,
+                         std::function<int(uint32_t, const uint8_t *, size_t)> cb)
+{
+    if (!inited || nullptr == ul) {
+        return -1;
+    }
+    ul_cb = cb;
+    int ret = ul(handle, dfuseAddress, length,
+        [](int handle, unsigned int address, const uint8_t *data, size_t len) {
+        return findTransport(handle)->ul_cb(address, data, len);
         });
     if (ret < 0) {
         return -1;
@@ -93,6 +298,86 @@ int DFUTransport::download(std::vector<uint8_t> data, std::function<void(int, in
     }
 }
 
+int DFUTransport::uploadFile(uint32_t dfuseAddress, size_t length, const std::string& path)
+{
+    if (!inited || nullptr == ul_file) {
+        return -1;
+    }
+    int ret = ul_file(handle, dfuseAddress, length, path.c_str());
+    return ret < 0 ? -1 : ret;
+}
+
+int DFUTransport::uploadHash(uint32_t dfuseAddress,
+                             size_t length,
+                             UploadHash hash,
+                             std::string& digest)
+{
+    if (!inited || nullptr == ul_hash) {
+        return -1;
+    }
+    char buf[65];
+    int ret = ul_hash(handle, dfuseAddress, length, hash, buf, sizeof(buf));
+    if (ret < 0) {
+        return -1;
+    }
+    digest = buf;
+    return ret;
+}
+
+int DFUTransport::verifyReport(std::string& report)
+{
+    if (!inited || nullptr == verify_report) {
+        return -1;
+    }
+    int len = verify_report(handle, nullptr, 0);
+    if (len < 0) {
+        return -1;
+    }
+    std::vector<char> buf(len + 1);
+    verify_report(handle, buf.data(), buf.size());
+    report.assign(buf.data(), len);
+    return 0;
+}
+
+int DFUTransport::setDeadlines(const Deadlines& deadlines)
+{
+    if (!inited || nullptr == set_deadlines) {
+        return -1;
+    }
+    int ret = set_deadlines(handle, deadlines.open, deadlines.erase, deadlines.write, deadlines.manifest, deadlines.job);
+    return ret < 0 ? -1 : 0;
+}
+
+int DFUTransport::expiredDeadline(std::string& deadline)
+{
+    if (!inited || nullptr == deadline_expired) {
+        return -1;
+    }
+    char buf[16];
+    if (deadline_expired(handle, buf, sizeof(buf)) < 0) {
+        return -1;
+    }
+    deadline = buf;
+    return 0;
+}
+
+int DFUTransport::throttle(uint32_t ms)
+{
+    if (!inited) {
+        return -1;
+    }
+    if (0 == ms) {
+        return 0;
+    }
+    if (nullptr == dfu_throttle) {
+        // An older libdfu.dll calls back on the thread of download() or
+        // upload(), that thread may wait itself
+        std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+        return 0;
+    }
+    return dfu_throttle(handle, ms) < 0 ? -1 : 0;
+}
+
 int DFUTransport::close()
 {
     if (!inited) {
@@ -9,28 +9,162 @@
 #include <cstdint>
 #include <vector>
 #include <functional>
+#include <string>
 
 class DFUTransport
 {
 public:
+	enum DfuseFlags {
+		e_dfuseMassErase = 1,
+		e_dfuseLeave = 2,
+		e_dfuseDryRun = 4,
+		e_dfuseDelta = 8,
+		e_dfuVerify = 16	// any DFU device
+	};
+
+	enum DownloadError {
+		e_downloadFailed = -1,
+		e_verifyFailed = -2	// the image read back different, see
+					// verifyReport()
+	};
+
+	enum UploadHash {
+		e_crc32 = 0,
+		e_sha256 = 1
+	};
+
+	struct Deadlines {	// milliseconds, 0 for none
+		uint32_t open;
+		uint32_t erase;
+		uint32_t write;
+		uint32_t manifest;
+		uint32_t job;
+	};
+
 	DFUTransport();
 	int init();
 	int open(uint16_t vid, uint16_t pid);
-	int download(std::vector<uint8_t> data, std::function<void(int, int)>);
+	int download(const std::vector<uint8_t>& data, std::function<void(int, int)>);
+	int download(const std::vector<uint8_t>& data,
+		     std::function<void(int, int)>,
+		     uint32_t dfuseAddress,
+		     int dfuseFlags);
+	int download(const uint8_t *data,
+		     size_t len,
+		     std::function<void(int, int)>,
+		     uint32_t dfuseAddress,
+		     int dfuseFlags);
+		// DfuSe devices: write a raw image at dfuseAddress, or a DfuSe
+		// file when dfuseAddress is 0; see DfuseFlags. The image is
+		// only read, several devices may be written from one buffer.
+		// Returns the bytes sent, or a DownloadError if the device
+		// did not take the image
+	int downloadAsync(const uint8_t *data,
+			  size_t len,
+			  std::function<void(int, int)>,
+			  uint32_t dfuseAddress,
+			  int dfuseFlags,
+			  std::function<void(int)> done);
+		// As download() but returns once the download is queued, done
+		// gets what download() would have returned on a libdfu.dll
+		// thread. data must outlive the call to done. Returns -1 and
+		// does not call done if the download could not be queued
+	int plan(const std::vector<uint8_t>& data,
+		 uint32_t dfuseAddress,
+		 int dfuseFlags,
+		 std::string& report);
+	int plan(const uint8_t *data,
+		 size_t len,
+		 uint32_t dfuseAddress,
+		 int dfuseFlags,
+		 std::string& report);
+		// DfuSe devices: describe the pages a download would erase
+	int checkImage(std::vector<uint8_t>& data, std::string& reason);
+	int checkImage(const uint8_t *data,
+		       size_t len,
+		       size_t& payload,
+		       std::string& reason);
+		// Check the suffix of the image names the device, without
+		// talking to the device, and strip it from data or return the
+		// length without it in payload. Returns -1 and the reason if
+		// the image is not meant for the device
+	int upload(uint32_t dfuseAddress,
+		   size_t length,
+		   std::function<int(uint32_t, const uint8_t *, size_t)> cb);
+		// Read the device, cb gets the address and contents of each
+		// block and returns non-zero to stop. Returns the bytes read
+	int uploadFile(uint32_t dfuseAddress, size_t length, const std::string& path);
+		// Read the device into a file, returns the bytes read
+	int uploadHash(uint32_t dfuseAddress,
+		       size_t length,
+		       UploadHash hash,
+		       std::string& digest);
+		// Hash what is read without keeping it, returns the bytes read
+	int verifyReport(std::string& report);
+		// Outcome of the verify of the last download, -1 if there was
+		// none
+	int setDeadlines(const Deadlines& deadlines);
+		// Deadlines of the downloads and uploads that follow. Returns
+		// -1 if libdfu.dll can not keep them
+	int expiredDeadline(std::string& deadline);
+		// Name of the deadline that failed the last download or
+		// upload, "open", "erase", "write", "manifest" or "job". -1 if
+		// none did
+	int throttle(uint32_t ms);
+		// Hold the running download or upload back for ms before its
+		// next transfer, call from its callback. Returns -1 if there
+		// is none
 	int close();
+	uint16_t vendorId() const { return vendor; }
+	uint16_t productId() const { return product; }
+		// vid and pid the device was opened with
+	const std::string& portPath() const { return path; }
+		// Where the device is plugged, "bus-port.port...", empty if
+		// libdfu.dll can not tell
 	std::function<void(int, int)> dl_cb;
+	std::function<void(int)> dl_done;
+	std::function<int(uint32_t, const uint8_t *, size_t)> ul_cb;
 private:
 	
 	HINSTANCE hinstLib;
 	typedef void(*download_cb)(int handle, size_t bytes_sent, size_t bytes_total);
 	typedef int(*f_download_t)(int, uint8_t *din, size_t ilen, download_cb cb);
+	typedef int(*f_download_dfuse_t)(int, uint8_t *din, size_t ilen, unsigned int address, int flags, download_cb cb);
+	typedef void(*download_done_cb)(int handle, int result);
+	typedef int(*f_download_dfuse_async_t)(int, uint8_t *din, size_t ilen, unsigned int address, int flags, download_cb cb, download_done_cb done_cb);
+	typedef int(*f_plan_dfuse_t)(int, uint8_t *din, size_t ilen, unsigned int address, int flags, char *report, size_t len);
+	typedef int(*f_check_image_t)(int, uint8_t *din, size_t ilen, char *report, size_t len);
+	typedef int(*f_verify_report_t)(int, char *report, size_t len);
+	typedef int(*upload_cb)(int handle, unsigned int address, const uint8_t *data, size_t len);
+	typedef int(*f_upload_t)(int, unsigned int address, size_t len, upload_cb cb);
+	typedef int(*f_upload_file_t)(int, unsigned int address, size_t len, const char *path);
+	typedef int(*f_upload_hash_t)(int, unsigned int address, size_t len, int hash, char *digest, size_t digest_len);
+	typedef int(*f_device_path_t)(int, char *path, size_t len);
+	typedef int(*f_set_deadlines_t)(int, unsigned int open, unsigned int erase, unsigned int write, unsigned int manifest, unsigned int job);
+	typedef int(*f_deadline_expired_t)(int, char *name, size_t len);
+	typedef int(*f_throttle_t)(int, unsigned int ms);
 	typedef int(*dfu_open_t)(uint16_t vid, uint16_t pid);
 	typedef int(*dfu_close_t)(int);
 	f_download_t dl;
+	f_download_dfuse_t dl_dfuse;
+	f_download_dfuse_async_t dl_dfuse_async;
+	f_plan_dfuse_t plan_dfuse;
+	f_check_image_t check_image;
+	f_verify_report_t verify_report;
+	f_upload_t ul;
+	f_upload_file_t ul_file;
+	f_upload_hash_t ul_hash;
+	f_device_path_t device_path;
+	f_set_deadlines_t set_deadlines;
+	f_deadline_expired_t deadline_expired;
+	f_throttle_t dfu_throttle;
 	dfu_open_t dfu_open;
 	dfu_close_t dfu_close;
 	bool inited;
 	int handle;
+	uint16_t vendor;
+	uint16_t product;
+	std::string path;
 
 };
 
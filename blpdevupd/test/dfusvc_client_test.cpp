@@ -0,0 +1,82 @@
+// SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+// SPDX-License-Identifier: GPL2.0-or-later
+
+// dfusvc_client_test.cpp
+#include <iostream>
+#include <string>
+#include <vector>
+#include "dfusvc_client.h"
+
+using namespace dfusvc;
+
+static int s_failures = 0;
+
+static void check(bool ok, const char *what)
+{
+    if (!ok) {
+        std::cout << "FAILED: " << what << std::endl;
+        s_failures++;
+    }
+}
+
+template <class RESPONSE>
+static ClientResult<RESPONSE> answer(CommandResponse& response, uint32_t id)
+    // The outcome the client makes of response, sent tagged with id
+{
+    std::vector<uint8_t> raw;
+    response.serialize(raw);
+    CommandRequestUtil::setRequestId(raw, id);
+    MessageView view;
+    view.parse(raw);
+    return clientResult<RESPONSE>(view, raw);
+}
+
+static void testErrorResponseFields(void)
+{
+    ErrorResponse sent(e_timeoutErr, "Device exceeded the manifest deadline");
+    std::vector<uint8_t> raw;
+    check(0 == sent.serialize(raw), "error response serializes");
+
+    ErrorResponse received(e_noError, "");
+    check(0 == received.deserialize(raw), "error response deserializes");
+    check(e_timeoutErr == received.errorCode(), "error code survives the pipe");
+    check("Device exceeded the manifest deadline" == received.errorString(),
+          "error string survives the pipe");
+}
+
+static void testErrorFailsRequest(void)
+{
+    ErrorResponse invalid(e_transportErr, "Invalid handle");
+    ClientResult<DownloadResponse> download = answer<DownloadResponse>(invalid, 7);
+    check(e_transportErr == download.error, "invalid handle fails a download");
+    check("Invalid handle" == download.reason, "reason of the server is kept");
+
+    ErrorResponse staged(e_imageErr, "Image 00 is not staged");
+    ClientResult<CloseResponse> close = answer<CloseResponse>(staged, 8);
+    check(e_imageErr == close.error, "error fails any request type");
+
+    ErrorResponse none(e_noError, "");
+    ClientResult<DownloadResponse> odd = answer<DownloadResponse>(none, 9);
+    check(e_noError != odd.error, "error response without a code still fails");
+}
+
+static void testResponseSucceeds(void)
+{
+    DownloadResponse done(10, 10, 3, true);
+    ClientResult<DownloadResponse> result = answer<DownloadResponse>(done, 10);
+    check(e_noError == result.error, "download response succeeds");
+    check(result.response.final(), "last response is kept");
+}
+
+int main(void)
+{
+    testErrorResponseFields();
+    testErrorFailsRequest();
+    testResponseSucceeds();
+    if (s_failures) {
+        std::cout << s_failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All checks passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,184 @@
+// SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+// SPDX-License-Identifier: GPL2.0-or-later
+
+// dfusvc_job_scheduler_test.cpp
+#include <iostream>
+#include <memory>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/chrono.hpp>
+#include "dfusvc_job_scheduler.h"
+
+using namespace dfusvc;
+
+static int s_failures = 0;
+
+static void check(bool ok, const char *what)
+{
+    if (!ok) {
+        std::cout << "FAILED: " << what << std::endl;
+        s_failures++;
+    }
+}
+
+class Gate
+{
+// A flag one thread waits for and another opens
+private:
+    boost::mutex d_mutex;
+    boost::condition_variable d_cond;
+    bool d_open = false;
+
+public:
+    void open(void)
+    {
+        boost::mutex::scoped_lock lock(d_mutex);
+        d_open = true;
+        d_cond.notify_all();
+    }
+    bool wait(int ms)
+        // Return false if the gate is still closed after ms
+    {
+        boost::mutex::scoped_lock lock(d_mutex);
+        return d_cond.wait_for(lock, boost::chrono::milliseconds(ms), [this] { return d_open; });
+    }
+};
+
+class TestCommand : public ServerCommand
+{
+// Waits for prepareGate in prepare() and executeGate in execute() when
+// given, fails prepare() if asked, opens the gates given once there
+public:
+    bool failPrepare = false;
+    Gate *preparing = nullptr;
+    Gate *prepareGate = nullptr;
+    Gate *executing = nullptr;
+    Gate *executeGate = nullptr;
+
+    int prepare(std::function<int(CommandResponse&)>) override
+    {
+        if (preparing) {
+            preparing->open();
+        }
+        if (prepareGate) {
+            prepareGate->wait(5000);
+        }
+        return failPrepare ? -1 : 0;
+    }
+    int execute(std::function<int(CommandResponse&)>) override
+    {
+        if (executing) {
+            executing->open();
+        }
+        if (executeGate) {
+            executeGate->wait(5000);
+        }
+        return 0;
+    }
+};
+
+class AsyncCommand : public ServerCommand
+{
+// Returns from start() at once, like a download queued in libdfu.dll, and
+// finishes on a thread of its own once finishGate opens
+public:
+    Gate started;
+    Gate finishGate;
+    Gate returned;
+    boost::thread finisher;
+
+    ~AsyncCommand(void)
+    {
+        if (finisher.joinable()) {
+            finisher.join();
+        }
+    }
+    int execute(std::function<int(CommandResponse&)>) override
+    {
+        return 0;
+    }
+    void start(std::function<int(CommandResponse&)>, std::function<void(void)> done) override
+    {
+        started.open();
+        finisher = boost::thread([this, done]() {
+            finishGate.wait(5000);
+            done();
+        });
+        returned.open();
+    }
+};
+
+static JobScheduler::Job job(std::shared_ptr<ServerCommand> command, int handle, int priority)
+{
+    JobScheduler::Job job;
+    job.command = command;
+    job.handle = handle;
+    job.vid = 1;
+    job.pid = 2;
+    job.priority = priority;
+    return job;
+}
+
+static void testFailedPrepareStartsNextJob(void)
+{
+    // The preparer is held on a job for device 2 while two jobs for
+    // device 1 queue. The later one has the higher priority and is
+    // prepared first, then the earlier one fails to prepare. Device 2
+    // stays busy, so nothing but the failure may start the later job.
+    JobScheduler scheduler;
+    Gate blockerPreparing, releasePrepare, releaseExecute;
+    auto blocker = std::make_shared<TestCommand>();
+    blocker->preparing = &blockerPreparing;
+    blocker->prepareGate = &releasePrepare;
+    blocker->executeGate = &releaseExecute;
+    scheduler.submit(job(blocker, 2, 9));
+    check(blockerPreparing.wait(5000), "the first job is prepared");
+
+    auto failing = std::make_shared<TestCommand>();
+    failing->failPrepare = true;
+    Gate urgentExecuting;
+    auto urgent = std::make_shared<TestCommand>();
+    urgent->executing = &urgentExecuting;
+    scheduler.submit(job(failing, 1, 0));
+    scheduler.submit(job(urgent, 1, 5));
+    releasePrepare.open();
+
+    check(urgentExecuting.wait(2000), "a job behind a failed one starts");
+    releaseExecute.open();
+    scheduler.wait();
+    check(0 == scheduler.queued(), "no job is left queued");
+}
+
+static void testAsyncJobHoldsItsSession(void)
+{
+    // A job that returned from start() still runs until it calls done, the
+    // only session is not given to the next job before
+    JobScheduler scheduler;
+    scheduler.setMaxSessions(1);
+    auto first = std::make_shared<AsyncCommand>();
+    auto second = std::make_shared<AsyncCommand>();
+    second->finishGate.open();
+    scheduler.submit(job(first, 1, 0));
+    scheduler.submit(job(second, 2, 0));
+
+    check(first->returned.wait(5000), "an async job returns from start()");
+    check(!second->started.wait(300), "the next job waits for the session");
+    check(1 == scheduler.running(), "the returned job still runs");
+    first->finishGate.open();
+    check(second->started.wait(5000), "the next job starts once done is called");
+    scheduler.wait();
+    check(0 == scheduler.running(), "no job is left running");
+}
+
+int main(void)
+{
+    testFailedPrepareStartsNextJob();
+    testAsyncJobHoldsItsSession();
+    if (s_failures) {
+        std::cout << s_failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All checks passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,120 @@
+// SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+// SPDX-License-Identifier: GPL2.0-or-later
+
+// dfusvc_lz4_test.cpp
+#include <iostream>
+#include <string>
+#include <vector>
+#include "dfusvc_lz4.h"
+
+using namespace dfusvc;
+
+static int s_failures = 0;
+
+static void check(bool ok, const std::string& what)
+{
+    if (!ok) {
+        std::cout << "FAILED: " << what << std::endl;
+        s_failures++;
+    }
+}
+
+static std::vector<uint8_t> noise(size_t len, uint32_t seed)
+    // Bytes that do not compress
+{
+    std::vector<uint8_t> data(len);
+    for (size_t i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = seed >> 16;
+    }
+    return data;
+}
+
+static std::vector<uint8_t> firmware(size_t len)
+    // Code like noise between erased flash and repeated tables
+{
+    std::vector<uint8_t> data = noise(len, 7);
+    for (size_t i = 0; i < len; i++) {
+        if (i % 4096 >= 3072) {
+            data[i] = 0xff;
+        } else if (i % 4096 >= 2048) {
+            data[i] = i % 24;
+        }
+    }
+    return data;
+}
+
+static void roundTrip(const std::vector<uint8_t>& data, const std::string& what)
+{
+    std::vector<uint8_t> block;
+    Lz4Codec::compress(data.data(), data.size(), block);
+    check(data.size() <= Lz4Codec::maxSize(block.size()), what + " is within maxSize()");
+
+    std::vector<uint8_t> out(data.size());
+    check(0 == Lz4Codec::decompress(block.data(), block.size(), out.data(), out.size()),
+          what + " decompresses");
+    check(out == data, what + " decompresses to what was compressed");
+
+    // The size is part of the block, a wrong one is refused
+    std::vector<uint8_t> longer(data.size() + 1);
+    check(0 > Lz4Codec::decompress(block.data(), block.size(), longer.data(), longer.size()),
+          what + " does not fill a larger image");
+    if (!data.empty()) {
+        check(0 > Lz4Codec::decompress(block.data(), block.size(), out.data(), out.size() - 1),
+              what + " does not fit a smaller image");
+    }
+}
+
+static void testRoundTrip(void)
+{
+    roundTrip(std::vector<uint8_t>(), "empty image");
+    roundTrip(std::vector<uint8_t>(1, 0x5a), "one byte");
+    // Around the literals a block must end with and the matches it may
+    // not start near its end
+    for (size_t len = 2; len <= 20; len++) {
+        roundTrip(std::vector<uint8_t>(len, 0), std::to_string(len) + " zeros");
+    }
+    roundTrip(std::vector<uint8_t>(100000, 0xff), "erased flash");
+    roundTrip(noise(5000, 1), "noise");
+    roundTrip(firmware(70000), "firmware past the match window");
+}
+
+static int decompress(const std::vector<uint8_t>& block, size_t size)
+{
+    std::vector<uint8_t> out(size);
+    return Lz4Codec::decompress(block.data(), block.size(), out.data(), out.size());
+}
+
+static void testCorruptBlocks(void)
+{
+    // One literal "A" then a match of 4 bytes
+    check(0 == decompress({ 0x10, 'A', 0x01, 0x00, 0x00 }, 5), "a valid run decompresses");
+    check(0 > decompress({ 0x10, 'A', 0x00, 0x00, 0x00 }, 5), "a match at offset 0 is refused");
+    check(0 > decompress({ 0x10, 'A', 0x02, 0x00, 0x00 }, 6), "a match before the output is refused");
+    check(0 > decompress({ 0x10, 'A', 0x01 }, 5), "a truncated offset is refused");
+
+    // 15 or more literals, the length goes on in the next bytes
+    check(0 > decompress({ 0xf0 }, 15), "missing literal length bytes are refused");
+    check(0 > decompress({ 0xf0, 0xff }, 270), "truncated literal length bytes are refused");
+    check(0 > decompress({ 0x30, 'A', 'B' }, 3), "truncated literals are refused");
+
+    // A match of 19 or more, the length goes on after the offset
+    check(0 == decompress({ 0x1f, 'A', 0x01, 0x00, 0x00, 0x00 }, 20), "a long match decompresses");
+    check(0 > decompress({ 0x1f, 'A', 0x01, 0x00 }, 20), "missing match length bytes are refused");
+    check(0 > decompress({ 0x1f, 'A', 0x01, 0x00, 0xff }, 275), "truncated match length bytes are refused");
+
+    // The match would write past the image
+    check(0 > decompress({ 0x1f, 'A', 0x01, 0x00, 0xff, 0x00 }, 20), "a match past the image is refused");
+}
+
+int main(void)
+{
+    testRoundTrip();
+    testCorruptBlocks();
+    if (s_failures) {
+        std::cout << s_failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All checks passed" << std::endl;
+    return 0;
+}
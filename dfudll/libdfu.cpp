@@ -29,10 +29,15 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#include <limits.h>
 #include <stdio.h>
+#include <string.h>
 #include "libusb.h"
 #include <unordered_map>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 // Include C header from dfu-util project
 extern "C"
@@ -42,11 +47,16 @@ extern "C"
 #include "dfu_load.h"
 #include "dfuse_mem.h"
 #include "dfuse.h"
+#include "dfu_sink.h"
 #include "dfu_util.h"
 #include "portable.h"
+#include "quirks.h"
 #include "libdfu_util.h"
 }
 
+#include "libdfu_scheduler.h"
+#include "libdfu_session.h"
+
 /* Must define this in application*/
 
 int verbose = 0;
@@ -54,7 +64,28 @@ int verbose = 0;
 //static dfu_util_t dfu_util;
 static int g_handle = 0;
 static std::unordered_map<int, std::shared_ptr<dfu_util_t>> deviceMap(5);
+/* Devices are opened and closed while others are in use */
+static std::mutex deviceMutex;
+/* Verify outcome of the last download per handle, downloads to different
+ * handles may run at the same time */
+static std::unordered_map<int, std::string> verifyMap(5);
+static std::mutex verifyMutex;
+/* Deadlines of the sessions per handle, and the deadline that failed the
+ * last session */
+static std::unordered_map<int, DfuSession::Deadlines> deadlineMap(5);
+static std::unordered_map<int, std::string> expiredMap(5);
+static std::mutex deadlineMutex;
+/* The session last started per handle, see throttle() */
+static std::unordered_map<int, std::weak_ptr<DfuSession>> sessionMap(5);
+static std::mutex sessionMutex;
+
+static std::shared_ptr<dfu_util_t> find_device(int handle)
+{
+	std::lock_guard<std::mutex> lock(deviceMutex);
+	auto it = deviceMap.find(handle);
 
+	return deviceMap.end() == it ? nullptr : it->second;
+}
 
 extern "C" int open_device(uint16_t vid, uint16_t pid)
 {
@@ -97,144 +128,447 @@ extern "C" int open_device(uint16_t vid, uint16_t pid)
 	printf("Run-time device DFU version %04x\n",
 		libusb_le16_to_cpu(dfu_util->dfu_root->func_dfu.bcdDFUVersion));
 
-	deviceMap[++g_handle] = dfu_util;
-	ret = g_handle;
+	{
+		std::lock_guard<std::mutex> lock(deviceMutex);
+		deviceMap[++g_handle] = dfu_util;
+		ret = g_handle;
+	}
 
 done:
 	return ret;
 }
 
 typedef void(*libdfu_download_cb)(int handle, size_t bytes_sent, size_t bytes_total);
-extern "C"  int download(int handle, uint8_t *din, size_t ilen, libdfu_download_cb cb)
+
+/* Give the session the deadlines set for its handle */
+static void apply_deadlines(int handle, DfuSession& session)
+{
+	std::lock_guard<std::mutex> lock(deadlineMutex);
+	auto it = deadlineMap.find(handle);
+
+	expiredMap.erase(handle);
+	if (deadlineMap.end() != it) {
+		session.set_deadlines(it->second);
+	}
+}
+
+/* Keep the deadline that failed the session, see deadline_expired() */
+static void record_expired(int handle, const DfuSession& session)
+{
+	std::lock_guard<std::mutex> lock(deadlineMutex);
+
+	if (session.timed_out()) {
+		expiredMap[handle] = session.timed_out();
+	}
+}
+
+/* Make the session the one throttle() holds back on its handle */
+static void track_session(int handle, const std::shared_ptr<DfuSession>& session)
+{
+	std::lock_guard<std::mutex> lock(sessionMutex);
+
+	sessionMap[handle] = session;
+}
+
+/* Prepare a session for the device, DfuSe devices report DFU version 1.1a */
+static std::shared_ptr<DfuSession> make_session(int handle,
+						std::shared_ptr<dfu_util_t> dfu_util,
+						uint8_t *din, size_t ilen,
+						unsigned int address, int flags,
+						libdfu_download_cb cb)
+{
+	/* chunks of the device's own size, a DfuSe device strides by it */
+	unsigned int transfer_size = libusb_le16_to_cpu(dfu_util->dfu_root->func_dfu.wTransferSize);
+	if (!transfer_size) {
+		transfer_size = 4096;
+	}
+	auto session = std::make_shared<DfuSession>(handle, dfu_util, din, ilen, cb, transfer_size);
+
+	session->set_verify((flags & DfuSession::e_dfuVerify) != 0);
+	apply_deadlines(handle, *session);
+	track_session(handle, session);
+	if (dfu_util->dfu_root->func_dfu.bcdDFUVersion == libusb_cpu_to_le16(0x11a)) {
+		if (session->set_dfuse(address, flags) < 0) {
+			return nullptr;
+		}
+	} else if (address || (flags & ~DfuSession::e_dfuVerify)) {
+		printf("DfuSe options given for a device without DfuSe support\n");
+		return nullptr;
+	}
+	return session;
+}
+
+/* Collects what a finished session leaves behind for its handle and
+ * returns its outcome() */
+static int finish_download(int handle, DfuSession& session, int flags)
+{
+	int ret = session.outcome();
+	printf("dfuload_do_dnload return: %d", ret);
+	record_expired(handle, session);
+
+	if (flags & DfuSession::e_dfuVerify) {
+		std::vector<char> report(session.verify_report(NULL, 0) + 1);
+		session.verify_report(report.data(), report.size());
+		fputs(report.data(), stdout);
+		std::lock_guard<std::mutex> lock(verifyMutex);
+		verifyMap[handle] = report.data();
+	} else {
+		std::lock_guard<std::mutex> lock(verifyMutex);
+		verifyMap.erase(handle);
+	}
+
+	return ret;
+}
+
+/* Returns the bytes sent once the device has the image, -2 if it read back
+ * different, -1 if the download failed, however much of it was sent */
+extern "C" int download_dfuse(int handle, uint8_t *din, size_t ilen, unsigned int address, int flags, libdfu_download_cb cb)
+{
+	auto dfu_util = find_device(handle);
+
+	if (!dfu_util) {
+		return -1;
+	}
+	auto session = make_session(handle, dfu_util, din, ilen, address, flags, cb);
+	if (!session) {
+		return -1;
+	}
+	if (flags & DfuSession::e_dfuseDryRun) {
+		/* the erase plan was printed, nothing is written */
+		return 0;
+	}
+
+	/* The session is stepped on the shared poll scheduler, this thread
+	 * blocks until it is finished. download_async() does not. */
+	PollScheduler::instance().run([session]() {
+		return session->step(DfuSession::e_timer);
+	});
+	return finish_download(handle, *session, flags);
+}
+
+extern "C" int plan_dfuse(int handle, uint8_t *din, size_t ilen, unsigned int address, int flags, char *report, size_t report_len)
+{
+	auto dfu_util = find_device(handle);
+
+	if (!dfu_util) {
+		return -1;
+	}
+	auto session = make_session(handle, dfu_util, din, ilen, address, flags | DfuSession::e_dfuseDryRun, nullptr);
+	if (!session) {
+		return -1;
+	}
+	return session->erase_plan(report, report_len);
+}
+
+/* Check an image is meant for the device before any of it is sent. The
+ * suffix, if the image claims one, must be intact and name the device,
+ * 0xffff matching any. Returns the length of the image without the suffix,
+ * or -1 and the reason in report. */
+extern "C" int check_image(int handle, uint8_t *din, size_t ilen, char *report, size_t report_len)
 {
-	int ret = 0;
-	
 	struct dfu_file file;
-	struct dfu_if dif;
-	struct memsegment mem;
-	struct memsegment *pmem;
-	uint16_t runtime_vendor;
-	uint16_t runtime_product;
-
-	libusb_device_handle *hdl;
-	struct dfu_if dfuif;
-	struct dfu_status status;
-	int dfuse_device = 0;
-	unsigned int transfer_size = 0;
+	struct dfu_if *dif;
+	enum suffix_req check_suffix = MAYBE_SUFFIX;
 
-	auto it = deviceMap.find(handle);
+	auto dfu_util = find_device(handle);
 
-	if (deviceMap.end() == it) {
+	if (!dfu_util) {
+		return -1;
+	}
+	if (ilen > INT_MAX) {
+		snprintf(report, report_len, "Image is too big");
 		return -1;
 	}
-	auto dfu_util = it->second;
+	/* an image signed "UFD" has a suffix, a broken one is an error */
+	if (ilen >= 16 && din[ilen - 8] == 'U' && din[ilen - 7] == 'F' &&
+	    din[ilen - 6] == 'D')
+		check_suffix = NEEDS_SUFFIX;
 
 	memset(&file, 0, sizeof(file));
+	if (dfu_parse_image(&file, din, (int)ilen, check_suffix, MAYBE_PREFIX,
+			    report, report_len) < 0)
+		return -1;
 
+	dif = dfu_util->dfu_root;
+	if ((file.idVendor != 0xffff && file.idVendor != dif->vendor) ||
+	    (file.idProduct != 0xffff && file.idProduct != dif->product)) {
+		snprintf(report, report_len,
+			 "File ID %04x:%04x does not match device (%04x:%04x)",
+			 file.idVendor, file.idProduct, dif->vendor, dif->product);
+		return -1;
+	}
+	if (file.bcdDevice != 0xffff && file.bcdDevice != dif->bcdDevice) {
+		snprintf(report, report_len,
+			 "File bcdDevice %04x does not match device (%04x)",
+			 file.bcdDevice, dif->bcdDevice);
+		return -1;
+	}
+	if (report_len) {
+		report[0] = '\0';
+	}
+	return file.size.total - file.size.suffix;
+}
 
-	runtime_vendor = dfu_util->match_vendor < 0 ? dfu_util->dfu_root->vendor : dfu_util->match_vendor;
-	runtime_product = dfu_util->match_product < 0 ? dfu_util->dfu_root->product : dfu_util->match_product;
+extern "C" int verify_report(int handle, char *report, size_t report_len)
+{
+	std::lock_guard<std::mutex> lock(verifyMutex);
+	auto it = verifyMap.find(handle);
 
-	printf("Claiming USB DFU Interface...\n");
-	ret = libusb_claim_interface(dfu_util->dfu_root->dev_handle, dfu_util->dfu_root->interface);
-	if (ret < 0) {
-		printf("Cannot claim interface - %s", libusb_error_name(ret));
-		goto done;
+	if (verifyMap.end() == it) {
+		return -1;
+	}
+	if (report && report_len) {
+		snprintf(report, report_len, "%s", it->second.c_str());
 	}
+	return (int)it->second.size();
+}
 
-	printf("Setting Alternate Setting #%d ...\n", dfu_util->dfu_root->altsetting);
-	ret = libusb_set_interface_alt_setting(dfu_util->dfu_root->dev_handle, dfu_util->dfu_root->interface, dfu_util->dfu_root->altsetting);
-	if (ret < 0) {
-		printf("Cannot set alternate interface: %s", libusb_error_name(ret));
-		goto done;
+/* Prepare an upload session for the device, see DfuSession::set_upload() */
+static std::shared_ptr<DfuSession> make_upload_session(int handle,
+						       unsigned int address, size_t length,
+						       unsigned int transfer_size)
+{
+	auto dfu_util = find_device(handle);
+
+	if (!dfu_util) {
+		return nullptr;
+	}
+	bool dfuse = dfu_util->dfu_root->func_dfu.bcdDFUVersion == libusb_cpu_to_le16(0x11a);
+	auto session = std::make_shared<DfuSession>(handle, dfu_util, nullptr, 0, nullptr, transfer_size);
+	if (session->set_upload(address, length, dfuse) < 0) {
+		return nullptr;
 	}
+	apply_deadlines(handle, *session);
+	track_session(handle, session);
+	return session;
+}
 
-status_again:
-	printf("Determining device status: ");
-	ret = dfu_get_status(dfu_util->dfu_root, &status);
-	if (ret < 0) {
-		printf("error get_status: %s\n", libusb_error_name(ret));
-	}
-	printf("state = %s, status = %d\n",
-		dfu_state_to_string(status.bState), status.bStatus);
-
-	milli_sleep(status.bwPollTimeout);
-
-	switch (status.bState) {
-	case DFU_STATE_appIDLE:
-	case DFU_STATE_appDETACH:
-		printf("Device still in Runtime Mode!\n");
-		break;
-	case DFU_STATE_dfuERROR:
-		printf("dfuERROR, clearing status\n");
-        ret = dfu_clear_status(dfu_util->dfu_root->dev_handle, dfu_util->dfu_root->interface);
-        if (ret < 0) {
-            printf("error clear_status, ret = %s\n", libusb_error_name(ret));
-            // If device is in bad status, abort retry to avoid looping
-            return ret;
-        }
-        goto status_again;
-		break;
-	case DFU_STATE_dfuDNLOAD_IDLE:
-	case DFU_STATE_dfuUPLOAD_IDLE:
-		printf("aborting previous incomplete transfer\n");
-        ret = dfu_abort(dfu_util->dfu_root->dev_handle, dfu_util->dfu_root->interface);
-        if (ret < 0) {
-            printf("can't send DFU_ABORT, ret = %s\n", libusb_error_name(ret));
-            return ret;
-        }
-		goto status_again;
-		break;
-	case DFU_STATE_dfuIDLE:
-		printf("dfuIDLE, continuing\n");
-		break;
-	default:
-		break;
-	}
-
-	if (DFU_STATUS_OK != status.bStatus) {
-		printf("WARNING: DFU Status: '%s'\n",
-			dfu_status_to_string(status.bStatus));
-		/* Clear our status & try again. */
-		if (dfu_clear_status(dfu_util->dfu_root->dev_handle, dfu_util->dfu_root->interface) < 0)
-			printf("USB communication error");
-		if (dfu_get_status(dfu_util->dfu_root, &status) < 0)
-			printf("USB communication error");
-		if (DFU_STATUS_OK != status.bStatus)
-			printf("Status is not OK: %d", status.bStatus);
-
-		milli_sleep(status.bwPollTimeout);
-	}
-
-	printf("DFU mode device DFU version %04x\n",
-		libusb_le16_to_cpu(dfu_util->dfu_root->func_dfu.bcdDFUVersion));
+/* Read the device into sink and close it, returns the bytes read */
+static int run_upload(std::shared_ptr<DfuSession> session, struct dfu_sink *sink)
+{
+	session->set_sink(sink);
+	PollScheduler::instance().run([session]() {
+		return session->step(DfuSession::e_timer);
+	});
+	record_expired(session->handle(), *session);
+	if (dfu_sink_close(sink) < 0 || session->state() != DfuSession::e_done) {
+		return -1;
+	}
+	return session->result();
+}
 
-	if (dfu_util->dfu_root->func_dfu.bcdDFUVersion == libusb_cpu_to_le16(0x11a))
-		dfuse_device = 1;
+typedef int(*libdfu_upload_cb)(int handle, unsigned int address, const uint8_t *data, size_t len);
 
-	transfer_size = 4096;
-	file.firmware = din;
-	file.size.total = ilen;
+struct upload_stream {
+	int handle;
+	libdfu_upload_cb cb;
+};
 
-	//ret = dfuload_do_dnload(dfu_util->dfu_root, transfer_size, &file);
-	ret = libdfu_util_download(handle, dfu_util.get(), transfer_size, din, ilen, cb);
-	printf("dfuload_do_dnload return: %d", ret);
-done:
-	
+static int upload_stream_block(void *ctx, unsigned int address, const unsigned char *data, unsigned int len)
+{
+	struct upload_stream *stream = static_cast<struct upload_stream *>(ctx);
+
+	return stream->cb(stream->handle, address, data, len);
+}
+
+extern "C" int upload(int handle, unsigned int address, size_t length, libdfu_upload_cb cb)
+{
+	unsigned int transfer_size = 4096;
+	auto session = make_upload_session(handle, address, length, transfer_size);
+
+	if (!session || !cb) {
+		return -1;
+	}
+	/* cb runs on the scheduler thread, once per block as it is read */
+	std::vector<unsigned char> scratch(transfer_size);
+	struct upload_stream stream = { handle, cb };
+	struct dfu_sink sink;
+	dfu_sink_stream(&sink, upload_stream_block, &stream, scratch.data(), transfer_size);
+	return run_upload(session, &sink);
+}
+
+extern "C" int upload_file(int handle, unsigned int address, size_t length, const char *path)
+{
+	unsigned int transfer_size = 4096;
+	auto session = make_upload_session(handle, address, length, transfer_size);
+
+	if (!session) {
+		return -1;
+	}
+	/* the file is mapped at its full size and cut to what was read */
+	if (session->upload_length() == UINT_MAX) {
+		printf("Upload to a file needs a length for a device without DfuSe support\n");
+		return -1;
+	}
+	struct dfu_sink sink;
+	if (dfu_sink_mapped_file(&sink, path, (unsigned int)session->upload_length()) < 0) {
+		return -1;
+	}
+	return run_upload(session, &sink);
+}
+
+extern "C" int upload_hash(int handle, unsigned int address, size_t length, int hash, char *digest, size_t digest_len)
+{
+	unsigned int transfer_size = 4096;
+	auto session = make_upload_session(handle, address, length, transfer_size);
+
+	if (!session || (hash != DFU_SINK_CRC32 && hash != DFU_SINK_SHA256)) {
+		return -1;
+	}
+	std::vector<unsigned char> scratch(transfer_size);
+	struct dfu_sink sink;
+	dfu_sink_hash(&sink, (enum dfu_sink_hash)hash, scratch.data(), transfer_size);
+	int ret = run_upload(session, &sink);
+	if (ret >= 0) {
+		dfu_sink_digest(&sink, digest, digest_len);
+	}
 	return ret;
 }
 
+extern "C"  int download(int handle, uint8_t *din, size_t ilen, libdfu_download_cb cb)
+{
+	return download_dfuse(handle, din, ilen, 0, 0, cb);
+}
+
+/* Returns once the session is queued, done_cb gets what download_dfuse()
+ * would have returned on a scheduler thread. A dry run has nothing to queue
+ * and is left to download_dfuse(). */
+typedef void(*libdfu_done_cb)(int handle, int result);
+extern "C" int download_dfuse_async(int handle, uint8_t *din, size_t ilen, unsigned int address, int flags, libdfu_download_cb cb, libdfu_done_cb done_cb)
+{
+	auto dfu_util = find_device(handle);
+
+	if (!dfu_util || (flags & DfuSession::e_dfuseDryRun)) {
+		return -1;
+	}
+	/* The caller owns din until done_cb has been invoked */
+	auto session = make_session(handle, dfu_util, din, ilen, address, flags, cb);
+	if (!session) {
+		return -1;
+	}
+	PollScheduler::instance().submit([session, flags, done_cb]() {
+		int wait = session->step(DfuSession::e_timer);
+		if (wait < 0) {
+			int ret = finish_download(session->handle(), *session, flags);
+			if (done_cb) {
+				done_cb(session->handle(), ret);
+			}
+		}
+		return wait;
+	});
+
+	return 0;
+}
+
+extern "C" int download_async(int handle, uint8_t *din, size_t ilen, libdfu_download_cb cb, libdfu_done_cb done_cb)
+{
+	return download_dfuse_async(handle, din, ilen, 0, 0, cb, done_cb);
+}
+
+extern "C" int set_poll_policy(uint16_t vid, uint16_t pid, int adaptive)
+{
+	/* Applies to devices opened after the call */
+	return set_adaptive_poll(vid, pid, adaptive);
+}
+
+extern "C" int set_deadlines(int handle, unsigned int open_ms, unsigned int erase_ms,
+			     unsigned int write_ms, unsigned int manifest_ms, unsigned int job_ms)
+{
+	/* Applies to the downloads and uploads started after the call, 0 for
+	 * no deadline, see DfuSession::Deadlines */
+	DfuSession::Deadlines deadlines = { open_ms, erase_ms, write_ms, manifest_ms, job_ms };
+
+	if (!find_device(handle)) {
+		return -1;
+	}
+	std::lock_guard<std::mutex> lock(deadlineMutex);
+	deadlineMap[handle] = deadlines;
+	return 0;
+}
+
+extern "C" int deadline_expired(int handle, char *name, size_t name_len)
+{
+	/* The deadline that failed the last download or upload, -1 if none */
+	std::lock_guard<std::mutex> lock(deadlineMutex);
+	auto it = expiredMap.find(handle);
+
+	if (expiredMap.end() == it) {
+		return -1;
+	}
+	if (name && name_len) {
+		snprintf(name, name_len, "%s", it->second.c_str());
+	}
+	return (int)it->second.size();
+}
+
+/* Hold back the session running on the handle for at least ms before its
+ * next transfer. Meant for the download and upload callbacks, they run on
+ * a scheduler thread that other sessions share and must not sleep. */
+extern "C" int throttle(int handle, unsigned int ms)
+{
+	std::shared_ptr<DfuSession> session;
+	{
+		std::lock_guard<std::mutex> lock(sessionMutex);
+		auto it = sessionMap.find(handle);
+		if (sessionMap.end() != it) {
+			session = it->second.lock();
+		}
+	}
+	if (!session) {
+		return -1;
+	}
+	session->hold(ms);
+	return 0;
+}
+
+extern "C" int device_path(int handle, char *path, size_t path_len)
+{
+	/* Port path like dfu-util -p takes, bus-port.port... */
+	auto dfu_util = find_device(handle);
+	uint8_t ports[8];
+	char buf[40];
+	int len;
+	int r;
+	int i;
+
+	if (!dfu_util) {
+		return -1;
+	}
+	r = libusb_get_port_numbers(dfu_util->dfu_root->dev, ports, sizeof(ports));
+	len = snprintf(buf, sizeof(buf), "%d", libusb_get_bus_number(dfu_util->dfu_root->dev));
+	for (i = 0; i < r; i++) {
+		len += snprintf(buf + len, sizeof(buf) - len, "%c%d", i ? '.' : '-', ports[i]);
+	}
+	if (path && path_len) {
+		snprintf(path, path_len, "%s", buf);
+	}
+	return len;
+}
+
 extern "C" int close_device(int handle)
 {
-	auto it = deviceMap.find(handle);
+	auto dfu_util = find_device(handle);
 
-	if (deviceMap.end() == it) {
+	if (!dfu_util) {
 		return -1;
 	}
-	auto dfu_util = it->second;
 	libusb_close(dfu_util->dfu_root->dev_handle);
 	dfu_util->dfu_root->dev_handle = NULL;
 	libusb_exit(dfu_util->ctx);
-	deviceMap.erase(handle);
+	{
+		std::lock_guard<std::mutex> lock(deviceMutex);
+		deviceMap.erase(handle);
+	}
+	{
+		std::lock_guard<std::mutex> lock(deadlineMutex);
+		deadlineMap.erase(handle);
+		expiredMap.erase(handle);
+	}
+	{
+		std::lock_guard<std::mutex> lock(sessionMutex);
+		sessionMap.erase(handle);
+	}
+	std::lock_guard<std::mutex> lock(verifyMutex);
+	verifyMap.erase(handle);
 	return 0;
 }
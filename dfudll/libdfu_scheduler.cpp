@@ -0,0 +1,161 @@
+#include "libdfu_scheduler.h"
+
+PollScheduler& PollScheduler::instance(void)
+{
+	/* Never destroyed: joining threads from a static destructor while the
+	 * DLL is being unloaded would deadlock on the loader lock. */
+	static PollScheduler *s_scheduler = new PollScheduler();
+	return *s_scheduler;
+}
+
+PollScheduler::PollScheduler(unsigned int workers)
+: d_wheel(k_wheelSlots)
+, d_pending(0)
+, d_tick(0)
+, d_epoch(clock::now())
+, d_stop(false)
+{
+	if (workers == 0)
+		workers = 1;
+	d_timer = std::thread(&PollScheduler::timer_loop, this);
+	for (unsigned int i = 0; i < workers; i++)
+		d_workers.push_back(std::thread(&PollScheduler::worker_loop, this));
+}
+
+PollScheduler::~PollScheduler()
+{
+	{
+		std::lock_guard<std::mutex> lock(d_mutex);
+		d_stop = true;
+	}
+	d_timerCv.notify_all();
+	d_readyCv.notify_all();
+	d_timer.join();
+	for (auto& worker : d_workers)
+		worker.join();
+}
+
+uint64_t PollScheduler::current_tick(void) const
+{
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+		clock::now() - d_epoch);
+	return elapsed.count() / k_tickMs;
+}
+
+void PollScheduler::submit(step_fn step, unsigned int delay_ms)
+{
+	std::lock_guard<std::mutex> lock(d_mutex);
+	insert(std::move(step), delay_ms);
+}
+
+int PollScheduler::run(step_fn step)
+{
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool done = false;
+	int result = 0;
+
+	submit([&]() {
+		int ret = step();
+		if (ret < 0) {
+			std::lock_guard<std::mutex> lock(mutex);
+			result = ret;
+			done = true;
+			cv.notify_all();
+		}
+		return ret;
+	});
+
+	std::unique_lock<std::mutex> lock(mutex);
+	cv.wait(lock, [&] { return done; });
+	return result;
+}
+
+/* Caller holds d_mutex */
+void PollScheduler::insert(step_fn step, unsigned int delay_ms)
+{
+	uint64_t now;
+	entry e;
+
+	if (delay_ms == 0) {
+		d_ready.push_back(std::move(step));
+		d_readyCv.notify_one();
+		return;
+	}
+
+	now = current_tick();
+	/* The timer thread stops ticking while the wheel is empty, catch up
+	 * here instead of walking every slot that passed in the meantime. */
+	if (d_pending == 0 && d_tick < now)
+		d_tick = now;
+
+	e.due = now + (delay_ms + k_tickMs - 1) / k_tickMs;
+	e.step = std::move(step);
+	d_wheel[e.due % k_wheelSlots].push_back(std::move(e));
+	d_pending++;
+	d_timerCv.notify_one();
+}
+
+void PollScheduler::timer_loop(void)
+{
+	std::unique_lock<std::mutex> lock(d_mutex);
+
+	while (!d_stop) {
+		uint64_t now;
+
+		if (d_pending == 0) {
+			d_timerCv.wait(lock);
+			continue;
+		}
+
+		now = current_tick();
+		while (d_tick < now && d_pending) {
+			std::vector<entry>& slot = d_wheel[++d_tick % k_wheelSlots];
+			size_t i = 0;
+
+			while (i < slot.size()) {
+				if (slot[i].due > d_tick) {
+					/* due on a later turn of the wheel */
+					i++;
+					continue;
+				}
+				d_ready.push_back(std::move(slot[i].step));
+				slot[i] = std::move(slot.back());
+				slot.pop_back();
+				d_pending--;
+			}
+		}
+		if (d_tick < now)
+			d_tick = now;
+
+		if (!d_ready.empty())
+			d_readyCv.notify_all();
+
+		d_timerCv.wait_until(lock,
+			d_epoch + std::chrono::milliseconds((d_tick + 1) * k_tickMs));
+	}
+}
+
+void PollScheduler::worker_loop(void)
+{
+	std::unique_lock<std::mutex> lock(d_mutex);
+
+	while (1) {
+		step_fn step;
+		int ret;
+
+		d_readyCv.wait(lock, [this] { return d_stop || !d_ready.empty(); });
+		if (d_stop)
+			return;
+
+		step = std::move(d_ready.front());
+		d_ready.pop_front();
+
+		lock.unlock();
+		ret = step();
+		lock.lock();
+
+		if (ret >= 0)
+			insert(std::move(step), ret);
+	}
+}
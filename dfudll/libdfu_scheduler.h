@@ -0,0 +1,88 @@
+// libdfu_scheduler.h
+#ifndef LIBDFU_SCHEDULER_H
+#define LIBDFU_SCHEDULER_H
+
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Poll scheduler shared by all DFU sessions of the library.
+ *
+ * A DFU download alternates between short control transfers and waits of
+ * bwPollTimeout milliseconds while the device is busy flashing. Rather than
+ * parking one thread per device in milli_sleep(), a session hands a step
+ * function to the scheduler. Each call to the step does one round of USB
+ * work and returns the number of milliseconds to wait before it may run
+ * again, or a negative value once the session is finished. Pending steps
+ * are kept in a hashed timer wheel and due steps are run by a small pool of
+ * worker threads, so the busy time of one device overlaps with the USB work
+ * of the others.
+ *
+ * Only submit() frees the caller. run() still blocks its caller until the
+ * session is finished, the waits no longer hold a thread per device but
+ * the blocking exports of libdfu hold the calling one. download_async() and
+ * download_dfuse_async() are the exports that return at once and report
+ * through a callback.
+ */
+class PollScheduler
+{
+public:
+	typedef std::function<int(void)> step_fn;
+		/* returns ms until the next step, or < 0 when finished */
+
+	enum {
+		k_tickMs = 1,		/* timer wheel resolution */
+		k_wheelSlots = 512,	/* slots, one wheel turn is 512 ms */
+		k_defaultWorkers = 4
+	};
+
+	static PollScheduler& instance(void);
+		/* process wide scheduler, started on first use */
+
+	explicit PollScheduler(unsigned int workers = k_defaultWorkers);
+	~PollScheduler();
+
+	void submit(step_fn step, unsigned int delay_ms = 0);
+		/* queue a session step to run after delay_ms */
+
+	int run(step_fn step);
+		/* drive a step function to completion on the pool and block the
+		 * caller until it is finished, the caller's thread is parked for
+		 * the whole session; returns the final step value */
+
+private:
+	typedef std::chrono::steady_clock clock;
+
+	struct entry {
+		uint64_t due;		/* absolute tick the step becomes ready */
+		step_fn step;
+	};
+
+	PollScheduler(const PollScheduler&);
+	PollScheduler& operator=(const PollScheduler&);
+
+	uint64_t current_tick(void) const;
+	void insert(step_fn step, unsigned int delay_ms);
+	void timer_loop(void);
+	void worker_loop(void);
+
+	std::mutex d_mutex;
+	std::condition_variable d_timerCv;
+	std::condition_variable d_readyCv;
+	std::vector<std::vector<entry> > d_wheel;
+	std::deque<step_fn> d_ready;
+	size_t d_pending;		/* entries parked in the wheel */
+	uint64_t d_tick;		/* last tick processed by the timer */
+	clock::time_point d_epoch;
+	bool d_stop;
+	std::thread d_timer;
+	std::vector<std::thread> d_workers;
+};
+
+#endif
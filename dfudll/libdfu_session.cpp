@@ -0,0 +1,779 @@
+#include "libdfu_session.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <mutex>
+#include <string>
+
+extern "C"
+{
+#include "portable.h"
+#include "dfu_file.h"
+}
+
+/*
+ * Memory layouts by DfuSe interface name. Devices of the same model share
+ * the name, so repeated flashes of a model parse it once. Layouts are
+ * immutable once parsed and stay cached for the life of the library.
+ */
+static std::shared_ptr<const struct memlayout> cached_layout(const char *alt_name)
+{
+	static std::mutex mutex;
+	static std::map<std::string, std::shared_ptr<const struct memlayout> > layouts;
+
+	if (!alt_name)
+		return nullptr;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = layouts.find(alt_name);
+	if (layouts.end() != it)
+		return it->second;
+
+	struct memlayout *layout = parse_memory_layout(alt_name);
+	if (!layout)
+		return nullptr;
+	std::shared_ptr<const struct memlayout> shared(layout, free_memory_layout);
+	layouts[alt_name] = shared;
+	return shared;
+}
+
+DfuSession::DfuSession(int handle,
+		       std::shared_ptr<dfu_util_t> util,
+		       uint8_t *data,
+		       size_t len,
+		       libdfu_util_download_cb cb,
+		       unsigned int xfer_size)
+: d_handle(handle)
+, d_util(util)
+, d_dif(util->dfu_root)
+, d_data(data)
+, d_len(len)
+, d_xferSize(xfer_size)
+, d_cb(cb)
+, d_state(e_claim)
+, d_recoveries(0)
+, d_statusCleared(false)
+, d_result(0)
+, d_dfuse(false)
+, d_dfuseFlags(0)
+, d_leaveAddress(0)
+, d_element(0)
+, d_elementBase(0)
+, d_deltaPending(false)
+, d_upload(false)
+, d_uploadAddress(0)
+, d_sink(nullptr)
+, d_verify(false)
+, d_verified(0)
+, d_started(false)
+, d_opened(false)
+, d_timedOut(nullptr)
+, d_hold(0)
+, d_enteredAt(clock::now())
+{
+	for (int i = 0; i < k_numStates; i++) {
+		d_stateTime[i] = clock::duration::zero();
+		d_stateCount[i] = 0;
+	}
+	memset(&d_deadlines, 0, sizeof(d_deadlines));
+	memset(&d_plan, 0, sizeof(d_plan));
+	memset(&d_delta, 0, sizeof(d_delta));
+	memset(&d_reader, 0, sizeof(d_reader));
+	memset(&d_policy, 0, sizeof(d_policy));
+	memset(&d_engine, 0, sizeof(d_engine));
+}
+
+DfuSession::~DfuSession()
+{
+	free(d_delta.changed);
+	dfuse_plan_free(&d_plan);
+}
+
+const char *DfuSession::state_name(State state)
+{
+	static const char *names[k_numStates] = {
+		"claim", "setAlt", "statusRecovery", "compare", "upload",
+		"erase",
+		"setAddress",
+		"chunk", "poll", "manifest", "verify", "done", "error"
+	};
+
+	if (state < 0 || state >= k_numStates)
+		return "invalid";
+	return names[state];
+}
+
+/* Length of the image without a DFU suffix, if it has one */
+static size_t strip_dfu_suffix(const uint8_t *data, size_t len)
+{
+	size_t suffix;
+
+	if (len < 16 || data[len - 8] != 'U' || data[len - 7] != 'F' ||
+	    data[len - 6] != 'D')
+		return len;
+	suffix = data[len - 5];
+	if (suffix < 16 || suffix > len)
+		return len;
+	return len - suffix;
+}
+
+int DfuSession::add_element(void *ctx, struct dfuse_element *el)
+{
+	DfuSession *session = static_cast<DfuSession *>(ctx);
+
+	if (el->alt == session->d_dif->altsetting && el->size)
+		session->d_elements.push_back(*el);
+	return 0;
+}
+
+int DfuSession::set_dfuse(unsigned int address, int flags)
+{
+	size_t len = strip_dfu_suffix(d_data, d_len);
+	size_t total = 0;
+
+	if (!d_layout)
+		d_layout = cached_layout(d_dif->alt_name);
+	if (!d_layout) {
+		printf("Failed to parse memory layout\n");
+		return -1;
+	}
+
+	d_elements.clear();
+	if (len >= 5 && !memcmp(d_data, "DfuSe", 5)) {
+		if (address) {
+			printf("This is a DfuSe file, not meant for raw download\n");
+			return -1;
+		}
+		if (dfuse_parse_file(d_data, len, d_dif->altsetting,
+				     add_element, this) != 0)
+			return -1;
+	} else {
+		struct dfuse_element el;
+
+		if (!address) {
+			printf("Raw binary download to a DfuSe device needs an address\n");
+			return -1;
+		}
+		el.address = address;
+		el.size = len;
+		el.data = d_data;
+		el.alt = d_dif->altsetting;
+		d_elements.push_back(el);
+	}
+	if (d_elements.empty()) {
+		printf("Nothing to download for alternate setting %d\n",
+		       d_dif->altsetting);
+		return -1;
+	}
+
+	for (size_t i = 0; i < d_elements.size(); i++) {
+		struct dfuse_element& el = d_elements[i];
+		unsigned int last = el.address + el.size - 1;
+		const struct memsegment *segment;
+
+		/* Check at least that we can write to the last address */
+		segment = find_segment(d_layout.get(), last);
+		if (!segment || !(segment->memtype & DFUSE_WRITEABLE)) {
+			printf("Last page at 0x%08x is not writeable\n", last);
+			return -1;
+		}
+		total += el.size;
+	}
+
+	/* an explicit mass erase replaces the planned page erases */
+	dfuse_plan_free(&d_plan);
+	if (dfuse_plan_erase(&d_plan, d_layout.get(), &d_elements[0],
+			     (int)d_elements.size(),
+			     flags & e_dfuseMassErase) < 0)
+		return -1;
+	if (flags & e_dfuseMassErase)
+		d_plan.mass_erase = 1;
+	if (verbose || (flags & e_dfuseDryRun)) {
+		std::vector<char> report(erase_plan(NULL, 0) + 1);
+		erase_plan(report.data(), report.size());
+		fputs(report.data(), stdout);
+	}
+
+	/* reading back needs the device, a dry run only plans */
+	d_deltaPending = (flags & e_dfuseDelta) &&
+			 !(flags & (e_dfuseMassErase | e_dfuseDryRun));
+
+	d_dfuse = true;
+	d_dfuseFlags = flags;
+	d_leaveAddress = address ? address : d_elements[0].address;
+	d_len = total;
+	return 0;
+}
+
+int DfuSession::erase_plan(char *report, size_t len) const
+{
+	return dfuse_plan_report(&d_plan, report, len);
+}
+
+int DfuSession::set_upload(unsigned int address, size_t length, bool dfuse)
+{
+	const struct memsegment *segment;
+
+	d_upload = true;
+	d_dfuse = dfuse;
+	if (!dfuse) {
+		if (address) {
+			printf("Upload address given for a device without DfuSe support\n");
+			return -1;
+		}
+		/* the device ends the upload with a short block */
+		d_uploadAddress = 0;
+		d_len = length ? length : UINT_MAX;
+		return 0;
+	}
+
+	if (!d_layout)
+		d_layout = cached_layout(d_dif->alt_name);
+	if (!d_layout || !d_layout->count) {
+		printf("Failed to parse memory layout\n");
+		return -1;
+	}
+	if (!address)
+		address = d_layout->segments[0].start;
+	segment = find_segment(d_layout.get(), address);
+	if (!segment || !(segment->memtype & DFUSE_READABLE)) {
+		printf("Page at 0x%08x is not readable\n", address);
+		return -1;
+	}
+	if (!length)
+		length = segment->end - address + 1;
+	segment = find_segment(d_layout.get(), address + length - 1);
+	if (!segment || !(segment->memtype & DFUSE_READABLE)) {
+		printf("Last page at 0x%08x is not readable\n",
+		       (unsigned int)(address + length - 1));
+		return -1;
+	}
+	d_uploadAddress = address;
+	d_len = length;
+	return 0;
+}
+
+void DfuSession::set_sink(struct dfu_sink *sink)
+{
+	d_sink = sink;
+}
+
+void DfuSession::set_verify(bool verify)
+{
+	d_verify = verify;
+}
+
+int DfuSession::verify_report(char *report, size_t len) const
+{
+	char line[64];
+	std::string text;
+
+	snprintf(line, sizeof(line), "Verified %u of %u bytes",
+		 (unsigned int)d_verified, (unsigned int)d_len);
+	text = line;
+	if (!d_mismatches.empty()) {
+		snprintf(line, sizeof(line), ", %u ranges differ",
+			 (unsigned int)d_mismatches.size());
+		text += line;
+	}
+	text += "\n";
+	for (size_t i = 0; i < d_mismatches.size(); i++) {
+		snprintf(line, sizeof(line), "  0x%08x %6u bytes\n",
+			 d_mismatches[i].first, d_mismatches[i].second);
+		text += line;
+	}
+	if (report && len)
+		snprintf(report, len, "%s", text.c_str());
+	return (int)text.size();
+}
+
+int DfuSession::outcome(void) const
+{
+	/* the device took every block, but one read back different */
+	if (!d_mismatches.empty())
+		return -2;
+	if (d_state != e_done)
+		return -1;
+	return d_result;
+}
+
+void DfuSession::set_deadlines(const Deadlines& deadlines)
+{
+	d_deadlines = deadlines;
+}
+
+void DfuSession::abort_transfer(void)
+{
+	if (d_state == e_compare || d_state == e_upload)
+		dfu_reader_abort(&d_reader);
+	else if (d_state > e_statusRecovery)
+		dfu_engine_abort(&d_engine);
+}
+
+int DfuSession::time_out(const char *deadline)
+{
+	printf("Deadline %s expired in state %s\n", deadline, state_name(d_state));
+	d_timedOut = deadline;
+	abort_transfer();
+	return fail();
+}
+
+/* The session deadline that expired, or NULL and the milliseconds left
+ * until the next one expires in left, -1 if there is none */
+const char *DfuSession::expired(int *left)
+{
+	long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+		clock::now() - d_startedAt).count();
+
+	*left = -1;
+	if (d_deadlines.job) {
+		if (elapsed >= d_deadlines.job)
+			return "job";
+		*left = (int)(d_deadlines.job - elapsed);
+	}
+	if (d_deadlines.open && !d_opened) {
+		if (elapsed >= d_deadlines.open)
+			return "open";
+		if (*left < 0 || d_deadlines.open - elapsed < *left)
+			*left = (int)(d_deadlines.open - elapsed);
+	}
+	return NULL;
+}
+
+void DfuSession::hold(unsigned int ms)
+{
+	unsigned int held = d_hold.load();
+
+	while (ms > held && !d_hold.compare_exchange_weak(held, ms))
+		;
+}
+
+int DfuSession::step(Event event)
+{
+	const char *deadline;
+	unsigned int held;
+	int left;
+	int wait;
+
+	if (event == e_cancel) {
+		if (d_state == e_done || d_state == e_error)
+			return -1;
+		printf("Download cancelled in state %s\n", state_name(d_state));
+		abort_transfer();
+		return fail();
+	}
+
+	if (!d_started) {
+		d_started = true;
+		d_startedAt = clock::now();
+	}
+	if (d_state != e_done && d_state != e_error &&
+	    (deadline = expired(&left)) != NULL)
+		return time_out(deadline);
+
+	switch (d_state) {
+	case e_claim:
+		wait = do_claim();
+		break;
+	case e_setAlt:
+		wait = do_set_alt();
+		break;
+	case e_statusRecovery:
+		wait = do_status_recovery();
+		break;
+	case e_compare:
+		wait = do_compare();
+		break;
+	case e_upload:
+		wait = do_upload();
+		break;
+	case e_erase:
+	case e_setAddress:
+	case e_chunk:
+	case e_poll:
+	case e_manifest:
+	case e_verify:
+		wait = do_transfer();
+		break;
+	default:
+		return -1;
+	}
+
+	/* finishing late fails too, there is nothing left to abort */
+	if (d_state == e_done && (deadline = expired(&left)) != NULL) {
+		printf("Deadline %s expired on the last step\n", deadline);
+		d_timedOut = deadline;
+		return fail();
+	}
+
+	/* the callbacks of this step asked to be held back */
+	held = d_hold.exchange(0);
+	if (wait >= 0 && held > (unsigned int)wait)
+		wait = (int)held;
+
+	/* a long bwPollTimeout does not hold the session past its deadline */
+	if (wait > 0 && expired(&left) == NULL && left >= 0 && wait > left)
+		wait = left;
+	return wait;
+}
+
+void DfuSession::print_timings(void) const
+{
+	printf("Session %d state timings:\n", d_handle);
+	for (int i = 0; i < k_numStates; i++) {
+		if (!d_stateCount[i])
+			continue;
+		printf("  %-16s %6u x, %10lld us\n", state_name((State)i),
+		       d_stateCount[i],
+		       (long long)std::chrono::duration_cast<
+			   std::chrono::microseconds>(d_stateTime[i]).count());
+	}
+}
+
+int DfuSession::enter(State next, int wait)
+{
+	clock::time_point now = clock::now();
+
+	d_stateTime[d_state] += now - d_enteredAt;
+	d_stateCount[d_state]++;
+	d_enteredAt = now;
+	d_state = next;
+
+	if ((next == e_done || next == e_error) && verbose)
+		print_timings();
+	return wait;
+}
+
+int DfuSession::fail(void)
+{
+	return enter(e_error, -1);
+}
+
+DfuSession::State DfuSession::transfer_state(enum dfu_engine_phase phase)
+{
+	switch (phase) {
+	case DFU_ENGINE_MASS_ERASE:
+	case DFU_ENGINE_ERASE:
+		return e_erase;
+	case DFU_ENGINE_ADDRESS:
+		return e_setAddress;
+	case DFU_ENGINE_POLL:
+		return e_poll;
+	case DFU_ENGINE_MANIFEST:
+	case DFU_ENGINE_LEAVE:
+		return e_manifest;
+	case DFU_ENGINE_VERIFY:
+		return e_verify;
+	case DFU_ENGINE_DONE:
+		return e_done;
+	case DFU_ENGINE_ERROR:
+		return e_error;
+	default:
+		return e_chunk;
+	}
+}
+
+void DfuSession::progress(void *ctx, size_t done, size_t total)
+{
+	DfuSession *session = static_cast<DfuSession *>(ctx);
+
+	if (session->d_cb) {
+		session->d_cb(session->d_handle, session->d_elementBase + done,
+			      session->d_len);
+	}
+}
+
+void DfuSession::mismatch(void *ctx, unsigned int address, unsigned int len)
+{
+	DfuSession *session = static_cast<DfuSession *>(ctx);
+
+	session->d_mismatches.push_back(std::make_pair(address, len));
+}
+
+void DfuSession::start_transfer(void)
+{
+	d_policy.progress = progress;
+	d_policy.ctx = this;
+	if (d_verify) {
+		d_readBuf.resize(d_xferSize);
+		d_policy.verify = 1;
+		d_policy.verify_buf = d_readBuf.data();
+		d_policy.mismatch = mismatch;
+	}
+	/* report about once per percent, every report is a server response */
+	d_policy.progress_step = d_len / 100;
+	d_policy.prefetch = 1;
+	d_policy.erase_deadline = d_deadlines.erase;
+	d_policy.write_deadline = d_deadlines.write;
+	d_policy.manifest_deadline = d_deadlines.manifest;
+
+	dfu_poll_begin_session(&d_dif->poll);
+	printf("Copying data from PC to DFU device\n");
+
+	if (!d_dfuse) {
+		d_policy.addressing = DFU_ADDR_BLOCKNUM;
+		d_policy.finish = DFU_FINISH_MANIFEST;
+		dfu_engine_init(&d_engine, d_dif, &d_policy, d_xferSize,
+				d_data, d_len, 0);
+		return;
+	}
+
+	/* the planned erases run before the first element is written */
+	d_policy.addressing = DFU_ADDR_DFUSE;
+	d_policy.erase = dfuse_plan_ready;
+	d_policy.erase_ctx = &d_plan;
+	d_policy.skip_blank = 1;
+	d_policy.mass_erase = d_plan.mass_erase;
+	if (!d_plan.mass_erase) {
+		d_policy.erase_pages = d_plan.pages;
+		d_policy.erase_count = d_plan.count;
+	}
+	d_policy.leave_address = d_leaveAddress;
+	d_element = 0;
+	d_elementBase = 0;
+	start_element();
+}
+
+void DfuSession::start_element(void)
+{
+	struct dfuse_element& el = d_elements[d_element];
+
+	if (d_element + 1 < d_elements.size())
+		d_policy.finish = DFU_FINISH_NONE;
+	else if (d_dfuseFlags & e_dfuseLeave)
+		d_policy.finish = DFU_FINISH_LEAVE;
+	else
+		d_policy.finish = DFU_FINISH_ABORT;
+
+	if (verbose)
+		printf("Downloading element %u to address = 0x%08x, size = %u\n",
+		       (unsigned int)d_element, el.address, el.size);
+	dfu_engine_init(&d_engine, d_dif, &d_policy, d_xferSize,
+			el.data, el.size, el.address);
+	/* the erases cover all elements, this one's engine took its copy */
+	d_policy.mass_erase = 0;
+	d_policy.erase_count = 0;
+}
+
+int DfuSession::do_claim(void)
+{
+	int ret;
+
+	printf("Claiming USB DFU Interface...\n");
+	ret = libusb_claim_interface(d_dif->dev_handle, d_dif->interface);
+	if (ret < 0) {
+		printf("Cannot claim interface - %s", libusb_error_name(ret));
+		d_result = ret;
+		return fail();
+	}
+	return enter(e_setAlt, 0);
+}
+
+int DfuSession::do_set_alt(void)
+{
+	int ret;
+
+	printf("Setting Alternate Setting #%d ...\n", d_dif->altsetting);
+	ret = libusb_set_interface_alt_setting(d_dif->dev_handle, d_dif->interface, d_dif->altsetting);
+	if (ret < 0) {
+		printf("Cannot set alternate interface: %s", libusb_error_name(ret));
+		d_result = ret;
+		return fail();
+	}
+	return enter(e_statusRecovery, 0);
+}
+
+int DfuSession::do_status_recovery(void)
+{
+	struct dfu_status status;
+	int ret;
+
+	if (d_recoveries++ == k_maxRecoveries) {
+		printf("Device does not return to dfuIDLE, giving up\n");
+		return fail();
+	}
+
+	printf("Determining device status: ");
+	ret = dfu_get_status(d_dif, &status);
+	if (ret < 0) {
+		printf("error get_status: %s\n", libusb_error_name(ret));
+	}
+	printf("state = %s, status = %d\n",
+		dfu_state_to_string(status.bState), status.bStatus);
+
+	switch (status.bState) {
+	case DFU_STATE_appIDLE:
+	case DFU_STATE_appDETACH:
+		printf("Device still in Runtime Mode!\n");
+		break;
+	case DFU_STATE_dfuERROR:
+		printf("dfuERROR, clearing status\n");
+		ret = dfu_clear_status(d_dif->dev_handle, d_dif->interface);
+		if (ret < 0) {
+			printf("error clear_status, ret = %s\n", libusb_error_name(ret));
+			/* If device is in bad status, abort retry to avoid looping */
+			d_result = ret;
+			return fail();
+		}
+		return status.bwPollTimeout;
+	case DFU_STATE_dfuDNLOAD_IDLE:
+	case DFU_STATE_dfuUPLOAD_IDLE:
+		printf("aborting previous incomplete transfer\n");
+		ret = dfu_abort(d_dif->dev_handle, d_dif->interface);
+		if (ret < 0) {
+			printf("can't send DFU_ABORT, ret = %s\n", libusb_error_name(ret));
+			d_result = ret;
+			return fail();
+		}
+		return status.bwPollTimeout;
+	case DFU_STATE_dfuIDLE:
+		printf("dfuIDLE, continuing\n");
+		break;
+	default:
+		break;
+	}
+
+	if (DFU_STATUS_OK != status.bStatus) {
+		printf("WARNING: DFU Status: '%s'\n",
+			dfu_status_to_string(status.bStatus));
+		if (!d_statusCleared) {
+			/* Clear our status & try again. */
+			d_statusCleared = true;
+			if (dfu_clear_status(d_dif->dev_handle, d_dif->interface) < 0)
+				printf("USB communication error");
+			return status.bwPollTimeout;
+		}
+		printf("Status is not OK: %d", status.bStatus);
+	}
+
+	printf("DFU mode device DFU version %04x\n",
+		libusb_le16_to_cpu(d_dif->func_dfu.bcdDFUVersion));
+	d_opened = true;
+
+	if (d_upload)
+		return start_upload(status.bwPollTimeout);
+	if (d_deltaPending)
+		return start_compare(status.bwPollTimeout);
+	start_transfer();
+	return enter(transfer_state(d_engine.phase), status.bwPollTimeout);
+}
+
+int DfuSession::start_compare(int wait)
+{
+	d_deltaPending = false;
+	if (dfuse_plan_delta_begin(&d_delta, &d_plan, &d_elements[0],
+				   (int)d_elements.size()) < 0) {
+		printf("Image too small for delta flashing, flashing all of it\n");
+		start_transfer();
+		return enter(transfer_state(d_engine.phase), wait);
+	}
+	d_readBuf.resize(d_xferSize);
+	if (!next_range()) {
+		dfuse_plan_delta_end(&d_delta);
+		start_transfer();
+		return enter(transfer_state(d_engine.phase), wait);
+	}
+	return enter(e_compare, wait);
+}
+
+bool DfuSession::next_range(void)
+{
+	unsigned int address, size;
+
+	if (!dfuse_plan_delta_range(&d_delta, &address, &size))
+		return false;
+	if (verbose)
+		printf("Reading back 0x%08x-0x%08x\n", address,
+		       address + size - 1);
+	dfu_reader_init(&d_reader, d_dif, DFU_ADDR_DFUSE, d_xferSize,
+			d_readBuf.data(), address, size, dfuse_plan_compare,
+			&d_delta);
+	return true;
+}
+
+int DfuSession::do_compare(void)
+{
+	int wait = dfu_reader_step(&d_reader);
+
+	if (d_reader.phase == DFU_READER_ERROR) {
+		/* e.g. read protected, recover and write everything */
+		printf("Reading back failed, flashing all of the image\n");
+		d_delta.full = 1;
+		dfuse_plan_delta_end(&d_delta);
+		return enter(e_statusRecovery, 0);
+	}
+	if (d_reader.phase != DFU_READER_DONE)
+		return enter(e_compare, wait);
+	if (next_range())
+		return enter(e_compare, wait);
+
+	dfuse_plan_delta_end(&d_delta);
+	if (verbose) {
+		std::vector<char> report(erase_plan(NULL, 0) + 1);
+		erase_plan(report.data(), report.size());
+		fputs(report.data(), stdout);
+	}
+	start_transfer();
+	return enter(transfer_state(d_engine.phase), wait);
+}
+
+int DfuSession::start_upload(int wait)
+{
+	if (!d_sink) {
+		printf("Nowhere to upload to\n");
+		return fail();
+	}
+	printf("Copying data from DFU device to PC\n");
+	/* blocks are read straight into the sink */
+	dfu_reader_init_sink(&d_reader, d_dif,
+			     d_dfuse ? DFU_ADDR_DFUSE : DFU_ADDR_BLOCKNUM,
+			     d_xferSize, d_uploadAddress, (unsigned int)d_len,
+			     d_sink);
+	return enter(e_upload, wait);
+}
+
+int DfuSession::do_upload(void)
+{
+	int wait = dfu_reader_step(&d_reader);
+
+	d_result = d_reader.offset;
+	if (d_reader.phase == DFU_READER_ERROR)
+		return fail();
+	if (d_reader.phase != DFU_READER_DONE)
+		return enter(e_upload, wait);
+
+	printf("Done, %u bytes read\n", d_reader.offset);
+	return enter(e_done, wait < 0 ? 0 : wait);
+}
+
+int DfuSession::do_transfer(void)
+{
+	int wait = dfu_engine_step(&d_engine);
+
+	d_result = d_elementBase + d_engine.offset;
+	if (d_engine.phase == DFU_ENGINE_ERROR) {
+		d_timedOut = dfu_engine_deadline_name(d_engine.timed_out);
+		return fail();
+	}
+	if (d_engine.phase != DFU_ENGINE_DONE)
+		return enter(transfer_state(d_engine.phase), wait);
+	if (d_engine.verified)
+		d_verified += d_engine.size;
+
+	if (d_dfuse && d_element + 1 < d_elements.size()) {
+		d_elementBase += d_engine.size;
+		d_element++;
+		start_element();
+		return enter(transfer_state(d_engine.phase), wait < 0 ? 0 : wait);
+	}
+
+	if (d_dif->poll.saved_ms)
+		printf("Adaptive polling saved %llu ms in %u polls\n",
+		       d_dif->poll.saved_ms, d_dif->poll.polls);
+	printf("Done!\n");
+	/* let the device settle before anyone talks to it again */
+	return enter(e_done, wait < 0 ? 0 : wait);
+}
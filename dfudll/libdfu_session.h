@@ -0,0 +1,239 @@
+// libdfu_session.h
+#ifndef LIBDFU_SESSION_H
+#define LIBDFU_SESSION_H
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <utility>
+#include <vector>
+
+extern "C"
+{
+#include "dfu.h"
+#include "dfu_util.h"
+#include "dfuse.h"
+#include "dfuse_mem.h"
+#include "dfuse_plan.h"
+#include "dfu_engine.h"
+#include "dfu_sink.h"
+#include "libdfu_util.h"
+}
+
+/*
+ * One DFU or DfuSe download, or upload, expressed as a resumable state
+ * machine.
+ *
+ * Nothing in here blocks on the device: step() performs one short round
+ * of control transfers and returns how long the device needs before the next
+ * event, so an event loop or the PollScheduler can drive any number of
+ * sessions from a few threads. Every state change is timed. Once the device
+ * is idle the transfer states are those of the dfu_engine doing the work.
+ *
+ *   claim -> setAlt -> statusRecovery -+-> chunk <-> poll -> manifest -> done
+ *                                      |                   (verify) ^
+ *                                      |     ^
+ *                      (DfuSe only)    +-> erase <-> poll
+ *                      per element     +-> setAddress -> poll
+ *                      (DfuSe delta)   +-> compare -> statusRecovery
+ *                      (set_upload)    +-> upload -> done
+ */
+class DfuSession
+{
+public:
+	enum State {
+		e_claim = 0,		/* claim the DFU interface */
+		e_setAlt,		/* select the alternate setting */
+		e_statusRecovery,	/* bring the device to dfuIDLE */
+		e_compare,		/* DfuSe delta: read back the planned pages */
+		e_upload,		/* read the device, see set_upload() */
+		e_erase,		/* DfuSe: erase the pages of the next chunk */
+		e_setAddress,		/* DfuSe: load the address pointer */
+		e_chunk,		/* send the next DNLOAD block */
+		e_poll,			/* wait for the device to leave dfuDNBUSY */
+		e_manifest,		/* end of image, wait for manifestation */
+		e_verify,		/* read the image back and compare */
+		e_done,
+		e_error,
+		k_numStates
+	};
+
+	enum Event {
+		e_start,		/* first event of a session */
+		e_timer,		/* the wait returned by step() has elapsed */
+		e_cancel		/* abort the session */
+	};
+
+	DfuSession(int handle,
+		   std::shared_ptr<dfu_util_t> util,
+		   uint8_t *data,
+		   size_t len,
+		   libdfu_util_download_cb cb,
+		   unsigned int xfer_size = 4096);
+	~DfuSession();
+
+	enum DfuseFlags {
+		e_dfuseMassErase = 1,	/* erase the whole flash first */
+		e_dfuseLeave = 2,	/* start the new firmware when done */
+		e_dfuseDryRun = 4,	/* plan only, see erase_plan() */
+		e_dfuseDelta = 8,	/* only rewrite pages that differ */
+		e_dfuVerify = 16	/* any DFU device, see set_verify() */
+	};
+
+	int set_dfuse(unsigned int address, int flags);
+		/* Write the image through DfuSe commands, erasing pages as
+		 * needed. A DfuSe file is written element by element, any
+		 * other image is written at address. Returns -1 if the image
+		 * or the memory layout of the device can not be used. Call
+		 * before the first step. */
+
+	int erase_plan(char *report, size_t len) const;
+		/* Describe the pages set_dfuse() planned to erase, returns
+		 * the length of the description like snprintf() */
+
+	int set_upload(unsigned int address, size_t length, bool dfuse);
+		/* Read the device instead of writing it. DfuSe devices are
+		 * read from address, or the start of their first segment if
+		 * 0, and to the end of that segment if length is 0. Other
+		 * devices are read until they send a short block or length
+		 * bytes were read. Returns -1 if the range is not readable.
+		 * Call before the first step. */
+
+	size_t upload_length(void) const { return d_len; }
+		/* bytes set_upload() will read at most, UINT_MAX if only the
+		 * device knows */
+
+	void set_sink(struct dfu_sink *sink);
+		/* Where the uploaded blocks go, the caller closes it */
+
+	void set_verify(bool verify);
+		/* Read the image back once written and compare it. A
+		 * mismatch fails the session. Call before the first step. */
+
+	int verify_report(char *report, size_t len) const;
+		/* Describe how much was verified and the ranges that read
+		 * back different, returns the length like snprintf() */
+
+	struct Deadlines {		/* milliseconds, 0 for none */
+		unsigned int open;	/* start until the device is dfuIDLE */
+		unsigned int erase;	/* see enum dfu_engine_deadline */
+		unsigned int write;
+		unsigned int manifest;
+		unsigned int job;	/* start until the session is done */
+	};
+
+	void set_deadlines(const Deadlines& deadlines);
+		/* Abort the device and fail the session once a deadline
+		 * expires. Waits returned by step() are cut short to check
+		 * them. Call before the first step. */
+
+	const char *timed_out(void) const { return d_timedOut; }
+		/* "open", "erase", "write", "manifest" or "job", the deadline
+		 * that failed the session, or NULL */
+
+	void hold(unsigned int ms);
+		/* Wait at least ms before the next step, e.g. to keep a hub
+		 * under its rate. Meant for the progress and sink callbacks,
+		 * which run inside step() and must not sleep. Deadlines still
+		 * cut the wait short. */
+
+	int step(Event event);
+		/* Advance the session. Returns the number of milliseconds to
+		 * wait before the next e_timer event, or -1 once the session
+		 * has reached e_done or e_error. */
+
+	State state(void) const { return d_state; }
+	int handle(void) const { return d_handle; }
+	int result(void) const { return d_result; }
+		/* bytes sent or read, or a negative libusb error if the
+		 * interface could not be claimed */
+	int outcome(void) const;
+		/* result() once the session is done, -2 if the image read
+		 * back different, see set_verify(), -1 if it failed. The
+		 * bytes sent say nothing of success: a DfuSe file sends less
+		 * than its length, and a session can fail after the last
+		 * block, in manifestation or verify */
+
+	static const char *state_name(State state);
+	void print_timings(void) const;
+
+private:
+	typedef std::chrono::steady_clock clock;
+
+	enum {
+		k_maxRecoveries = 8
+	};
+
+	DfuSession(const DfuSession&);
+	DfuSession& operator=(const DfuSession&);
+
+	int enter(State next, int wait);
+	int fail(void);
+	void abort_transfer(void);
+	int time_out(const char *deadline);
+	const char *expired(int *left);
+	void start_transfer(void);
+	void start_element(void);
+	int start_compare(int wait);
+	int start_upload(int wait);
+	bool next_range(void);
+	static void progress(void *ctx, size_t done, size_t total);
+	static void mismatch(void *ctx, unsigned int address, unsigned int len);
+	static int add_element(void *ctx, struct dfuse_element *el);
+	static State transfer_state(enum dfu_engine_phase phase);
+
+	int do_claim(void);
+	int do_set_alt(void);
+	int do_status_recovery(void);
+	int do_compare(void);
+	int do_upload(void);
+	int do_transfer(void);
+
+	int d_handle;
+	std::shared_ptr<dfu_util_t> d_util;
+	struct dfu_if *d_dif;
+	uint8_t *d_data;
+	size_t d_len;
+	unsigned int d_xferSize;
+	libdfu_util_download_cb d_cb;
+
+	State d_state;
+	int d_recoveries;
+	bool d_statusCleared;
+	int d_result;
+
+	bool d_dfuse;
+	int d_dfuseFlags;
+	unsigned int d_leaveAddress;
+	std::vector<struct dfuse_element> d_elements;
+	size_t d_element;		/* element being written */
+	size_t d_elementBase;		/* bytes done by earlier elements */
+	std::shared_ptr<const struct memlayout> d_layout;
+	struct dfuse_erase_plan d_plan;
+	bool d_deltaPending;		/* compare before the first write */
+	struct dfuse_delta d_delta;
+	struct dfu_reader d_reader;
+	std::vector<unsigned char> d_readBuf;
+	bool d_upload;
+	unsigned int d_uploadAddress;
+	struct dfu_sink *d_sink;
+	bool d_verify;
+	size_t d_verified;		/* bytes read back and compared */
+	std::vector<std::pair<unsigned int, unsigned int> > d_mismatches;
+	struct dfu_engine_policy d_policy;
+	struct dfu_engine d_engine;
+
+	Deadlines d_deadlines;
+	bool d_started;
+	bool d_opened;			/* left e_statusRecovery once */
+	clock::time_point d_startedAt;
+	const char *d_timedOut;
+	std::atomic<unsigned int> d_hold;	/* see hold() */
+
+	clock::time_point d_enteredAt;
+	clock::duration d_stateTime[k_numStates];
+	unsigned int d_stateCount[k_numStates];
+};
+
+#endif
@@ -8,13 +8,6 @@
 
 typedef void(*libdfu_util_download_cb)(int handle, size_t bytes_sent, size_t bytes_total);
 
-int libdfu_util_download(int handle,
-						 dfu_util_t* util, 
-						 int block_size, 
-						 uint8_t *din, 
-						 size_t dlen, 
-						 libdfu_util_download_cb cb);
-
 #endif
 
 // ----------------------------------------------------------------------------
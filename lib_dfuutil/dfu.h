@@ -23,6 +23,7 @@
 
 #include "libusb.h"
 #include "usb_dfu.h"
+#include "dfu_poll.h"
 
 /* DFU states */
 #define STATE_APP_IDLE                  0x00
@@ -100,6 +101,7 @@ struct dfu_if {
     char *serial_name;
     libusb_device *dev;
     libusb_device_handle *dev_handle;
+    struct dfu_poll_state poll;
     struct dfu_if *next;
 };
 
@@ -0,0 +1,272 @@
+/*
+ * CRC32 of DFU suffixes and uploads
+ *
+ * The portable path is slice-by-16: sixteen tables derived from the
+ * classic byte table let one round fold sixteen bytes with independent
+ * lookups. Where the CPU has carry-less multiply (PCLMULQDQ on x86) or
+ * the ARMv8 CRC32 instructions, checked once at runtime, those take over
+ * for everything but short tails.
+ *
+ * SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+ * SPDX-License-Identifier: GPL2.0-or-later
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dfu_file.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+# define CRC32_CLMUL
+# ifdef _MSC_VER
+#  include <intrin.h>
+#  define CRC32_CLMUL_TARGET
+# else
+#  include <cpuid.h>
+#  define CRC32_CLMUL_TARGET __attribute__((target("pclmul,sse4.1")))
+# endif
+# include <emmintrin.h>
+# include <smmintrin.h>
+# include <wmmintrin.h>
+#elif defined(_M_ARM64) || (defined(__aarch64__) && defined(__linux__))
+# define CRC32_ARMV8
+# ifdef _MSC_VER
+#  include <intrin.h>
+#  define CRC32_ARMV8_TARGET
+# else
+#  include <arm_acle.h>
+#  include <sys/auxv.h>
+#  include <asm/hwcap.h>
+#  ifdef __clang__
+#   define CRC32_ARMV8_TARGET __attribute__((target("crc")))
+#  else
+#   define CRC32_ARMV8_TARGET __attribute__((target("+crc")))
+#  endif
+# endif
+#endif
+
+/* Carry-less multiply only pays off past a few cache lines */
+#define CRC32_CLMUL_MIN 256
+
+static uint32_t crc32_table[16][256];
+static int crc32_clmul_ok;
+static int crc32_armv8_ok;
+static volatile int crc32_ready;
+
+#ifdef CRC32_CLMUL
+
+static int cpu_has_clmul(void)
+{
+	unsigned int ecx;
+#ifdef _MSC_VER
+	int info[4];
+
+	__cpuid(info, 1);
+	ecx = info[2];
+#else
+	unsigned int eax, ebx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+#endif
+	/* PCLMULQDQ and SSE4.1 for the final extract */
+	return (ecx & (1 << 1)) && (ecx & (1 << 19));
+}
+
+/*
+ * Folds four 128 bit lanes across the buffer with carry-less multiplies
+ * by x^(512+-32) and x^(512+32) mod P, then those down to one lane and
+ * Barrett reduces it to 32 bits, see Intel's "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction". size is a multiple
+ * of 16 and at least 64.
+ */
+CRC32_CLMUL_TARGET
+static uint32_t crc32_clmul(uint32_t crc, const uint8_t *p, size_t size)
+{
+	const __m128i k1k2 = _mm_set_epi32(0x00000001, 0xc6e41596,
+					   0x00000001, 0x54442bd4);
+	const __m128i k3k4 = _mm_set_epi32(0x00000000, 0xccaa009e,
+					   0x00000001, 0x751997d0);
+	const __m128i k5 = _mm_set_epi32(0, 0, 0x00000001, 0x63cd6124);
+	const __m128i poly = _mm_set_epi32(0x00000001, 0xf7011641,
+					   0x00000001, 0xdb710641);
+	const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(p + 0));
+	x2 = _mm_loadu_si128((const __m128i *)(p + 16));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 32));
+	x4 = _mm_loadu_si128((const __m128i *)(p + 48));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	p += 64;
+	size -= 64;
+
+	/* fold 64 bytes at a time */
+	while (size >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+			_mm_loadu_si128((const __m128i *)(p + 0)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+			_mm_loadu_si128((const __m128i *)(p + 16)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+			_mm_loadu_si128((const __m128i *)(p + 32)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+			_mm_loadu_si128((const __m128i *)(p + 48)));
+		p += 64;
+		size -= 64;
+	}
+
+	/* four lanes into one */
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* then 16 bytes at a time */
+	while (size >= 16) {
+		x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+			_mm_loadu_si128((const __m128i *)p));
+		p += 16;
+		size -= 16;
+	}
+
+	/* 128 bits to 64 */
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, low32);
+	x1 = _mm_clmulepi64_si128(x1, k5, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x2 = _mm_and_si128(x1, low32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+	x2 = _mm_and_si128(x2, low32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = x1;
+	return (uint32_t)_mm_extract_epi32(x0, 1);
+}
+
+#endif /* CRC32_CLMUL */
+
+#ifdef CRC32_ARMV8
+
+static int cpu_has_armv8_crc(void)
+{
+#ifdef _MSC_VER
+	return IsProcessorFeaturePresent(PF_ARM_V8_CRC32_INSTRUCTIONS_AVAILABLE);
+#else
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#endif
+}
+
+CRC32_ARMV8_TARGET
+static uint32_t crc32_armv8(uint32_t crc, const uint8_t *p, size_t size)
+{
+	for (; size && ((uintptr_t)p & 7); size--)
+		crc = __crc32b(crc, *p++);
+	for (; size >= 8; size -= 8, p += 8)
+		crc = __crc32d(crc, *(const uint64_t *)p);
+	for (; size; size--)
+		crc = __crc32b(crc, *p++);
+	return crc;
+}
+
+#endif /* CRC32_ARMV8 */
+
+/* Reads are little endian whatever the host, compilers make them loads */
+static uint32_t le32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+	       (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t crc32_slice16(uint32_t crc, const uint8_t *p, size_t size)
+{
+	const uint32_t (*t)[256] = crc32_table;
+
+	for (; size >= 16; size -= 16, p += 16) {
+		uint32_t a = le32(p) ^ crc;
+		uint32_t b = le32(p + 4);
+		uint32_t c = le32(p + 8);
+		uint32_t d = le32(p + 12);
+
+		crc = t[15][a & 0xff] ^ t[14][(a >> 8) & 0xff] ^
+		      t[13][(a >> 16) & 0xff] ^ t[12][a >> 24] ^
+		      t[11][b & 0xff] ^ t[10][(b >> 8) & 0xff] ^
+		      t[9][(b >> 16) & 0xff] ^ t[8][b >> 24] ^
+		      t[7][c & 0xff] ^ t[6][(c >> 8) & 0xff] ^
+		      t[5][(c >> 16) & 0xff] ^ t[4][c >> 24] ^
+		      t[3][d & 0xff] ^ t[2][(d >> 8) & 0xff] ^
+		      t[1][(d >> 16) & 0xff] ^ t[0][d >> 24];
+	}
+	for (; size; size--)
+		crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+/* Idempotent, threads racing through it store the same values */
+static void crc32_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+		crc32_table[0][i] = crc;
+	}
+	/* table[n][i] is byte i followed by n zero bytes */
+	for (i = 0; i < 256; i++) {
+		crc = crc32_table[0][i];
+		for (j = 1; j < 16; j++) {
+			crc = crc32_table[0][crc & 0xff] ^ (crc >> 8);
+			crc32_table[j][i] = crc;
+		}
+	}
+#ifdef CRC32_CLMUL
+	crc32_clmul_ok = cpu_has_clmul();
+#endif
+#ifdef CRC32_ARMV8
+	crc32_armv8_ok = cpu_has_armv8_crc();
+#endif
+	crc32_ready = 1;
+}
+
+uint32_t dfu_crc32(uint32_t crc, const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+
+	if (!crc32_ready)
+		crc32_init();
+#ifdef CRC32_CLMUL
+	if (crc32_clmul_ok && size >= CRC32_CLMUL_MIN) {
+		size_t n = size & ~(size_t)15;
+
+		crc = crc32_clmul(crc, p, n);
+		p += n;
+		size -= n;
+	}
+#endif
+#ifdef CRC32_ARMV8
+	if (crc32_armv8_ok)
+		return crc32_armv8(crc, p, size);
+#endif
+	return crc32_slice16(crc, p, size);
+}
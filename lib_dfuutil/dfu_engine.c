@@ -0,0 +1,750 @@
+/*
+ * Policy driven DFU/DfuSe download engine
+ *
+ * One implementation of the DNLOAD / GETSTATUS block loop, shared by plain
+ * DFU downloads (dfu_load.c), DfuSe element downloads (dfuse.c) and the
+ * scheduler driven downloads of libdfu. What differs between them is
+ * supplied as policies: how blocks are addressed, how pages are erased,
+ * where progress goes, how the transfer ends and how it is cancelled.
+ * The engine is resumable, dfu_engine_step() never sleeps and returns the
+ * wait the device asked for, dfu_engine_run() is the blocking driver.
+ * dfu_reader is the same for reading back, e.g. to compare with an image.
+ *
+ * SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+ * SPDX-License-Identifier: GPL2.0-or-later
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "libusb.h"
+
+#include "portable.h"
+#include "dfu.h"
+#include "usb_dfu.h"
+#include "dfu_engine.h"
+
+#define PREFETCH_STRIDE 4096
+
+/* DfuSe writes block wBlockNum to pointer + (wBlockNum - 2) * wTransferSize */
+#define DFUSE_FIRST_BLOCK 2
+#define DFUSE_LAST_BLOCK 0xffff
+
+extern int verbose;
+
+static unsigned int next_chunk_size(const struct dfu_engine *eng)
+{
+	unsigned int xfer_size = (unsigned int)eng->xfer_size;
+	unsigned int left = eng->size - eng->offset;
+
+	if (eng->chunk_limit && eng->chunk_limit < left)
+		left = eng->chunk_limit;
+	return left < xfer_size ? left : xfer_size;
+}
+
+/* Chunks are xfer_size apart, so within a run of chunks the block number
+ * alone addresses the next one, if the device has the same stride */
+static enum dfu_engine_phase address_phase(const struct dfu_engine *eng)
+{
+	if (eng->runs && eng->run_block && eng->run_block <= DFUSE_LAST_BLOCK)
+		return DFU_ENGINE_CHUNK;
+	return DFU_ENGINE_ADDRESS;
+}
+
+static enum dfu_engine_phase next_phase(const struct dfu_engine *eng)
+{
+	if (eng->offset >= eng->size) {
+		/* DfuSe devices are read back before they may leave */
+		if (eng->verify && eng->policy->addressing == DFU_ADDR_DFUSE)
+			return DFU_ENGINE_VERIFY;
+		return DFU_ENGINE_FINISH;
+	}
+	if (eng->policy->addressing == DFU_ADDR_BLOCKNUM)
+		return DFU_ENGINE_CHUNK;
+	return eng->policy->erase ? DFU_ENGINE_ERASE : address_phase(eng);
+}
+
+static int is_blank(const unsigned char *data, unsigned int len)
+{
+	while (len--)
+		if (*data++ != 0xff)
+			return 0;
+	return 1;
+}
+
+static void report(struct dfu_engine *eng, int force)
+{
+	const struct dfu_engine_policy *policy = eng->policy;
+
+	if (!policy->progress)
+		return;
+	if (!force && eng->offset - eng->reported < policy->progress_step)
+		return;
+	eng->reported = eng->offset;
+	policy->progress(policy->ctx, eng->offset, eng->size);
+}
+
+/* Fault in the next block while the device is busy with this one */
+static void prefetch(struct dfu_engine *eng)
+{
+	unsigned int end = eng->offset + next_chunk_size(eng);
+	unsigned int i;
+
+	for (i = eng->offset; i < end; i += PREFETCH_STRIDE)
+		eng->prefetch_sink ^= eng->data[i];
+	eng->prefetched = 1;
+}
+
+static int fail(struct dfu_engine *eng)
+{
+	eng->phase = DFU_ENGINE_ERROR;
+	return -1;
+}
+
+static void flush_mismatch(struct dfu_engine *eng)
+{
+	const struct dfu_engine_policy *policy = eng->policy;
+
+	if (eng->mismatch_len && policy->mismatch)
+		policy->mismatch(policy->ctx, eng->mismatch_start,
+				 eng->mismatch_len);
+	eng->mismatch_len = 0;
+}
+
+static void add_mismatch(struct dfu_engine *eng, unsigned int address,
+			 unsigned int len)
+{
+	if (eng->mismatch_len &&
+	    eng->mismatch_start + eng->mismatch_len == address) {
+		eng->mismatch_len += len;
+	} else {
+		flush_mismatch(eng);
+		eng->mismatch_start = address;
+		eng->mismatch_len = len;
+	}
+	eng->mismatched += len;
+}
+
+/* dfu_read_sink of the verify phase */
+static int verify_block(void *ctx, unsigned int address,
+			const unsigned char *data, unsigned int len)
+{
+	struct dfu_engine *eng = ctx;
+	const unsigned char *expect = eng->data + (address - eng->address);
+	unsigned int i;
+
+	/* the C library compares a word or vector at a time, bytes are
+	 * only looked at to find the ranges that differ */
+	if (!memcmp(data, expect, len))
+		return 0;
+	for (i = 0; i < len; i++) {
+		if (data[i] != expect[i])
+			add_mismatch(eng, address + i, 1);
+	}
+	return 0;
+}
+
+static unsigned int deadline_ms(const struct dfu_engine *eng,
+				enum dfu_engine_deadline deadline)
+{
+	switch (deadline) {
+	case DFU_DEADLINE_ERASE:
+		return eng->policy->erase_deadline;
+	case DFU_DEADLINE_WRITE:
+		return eng->policy->write_deadline;
+	case DFU_DEADLINE_MANIFEST:
+		return eng->policy->manifest_deadline;
+	default:
+		return 0;
+	}
+}
+
+static void begin_op(struct dfu_engine *eng, enum dfu_engine_deadline op)
+{
+	eng->op = op;
+	eng->op_start = milli_time();
+}
+
+/* Milliseconds the operation in flight has left, -1 if it has no deadline */
+static long long time_left(const struct dfu_engine *eng)
+{
+	unsigned int deadline = deadline_ms(eng, eng->op);
+	unsigned long long spent;
+
+	if (!deadline)
+		return -1;
+	spent = milli_time() - eng->op_start;
+	return spent >= deadline ? 0 : (long long)(deadline - spent);
+}
+
+/* Fail the operation in flight for taking longer than it was allowed */
+static int expire(struct dfu_engine *eng)
+{
+	warnx("Device exceeded the %s deadline of %u ms",
+	      dfu_engine_deadline_name(eng->op), deadline_ms(eng, eng->op));
+	eng->timed_out = eng->op;
+	dfu_engine_abort(eng);
+	return -1;
+}
+
+const char *dfu_engine_deadline_name(enum dfu_engine_deadline deadline)
+{
+	switch (deadline) {
+	case DFU_DEADLINE_ERASE:
+		return "erase";
+	case DFU_DEADLINE_WRITE:
+		return "write";
+	case DFU_DEADLINE_MANIFEST:
+		return "manifest";
+	default:
+		return NULL;
+	}
+}
+
+/* DfuSe commands are DNLOAD requests with wBlockNum 0 */
+static int dfuse_command(struct dfu_engine *eng, unsigned char command,
+			 unsigned int address, enum dfu_engine_phase after)
+{
+	unsigned char buf[5];
+	int length = sizeof(buf);
+	int ret;
+
+	/* Mass erase is the erase command without an address */
+	if (command == 0x41 && eng->phase == DFU_ENGINE_MASS_ERASE)
+		length = 1;
+
+	begin_op(eng, command == 0x41 ? DFU_DEADLINE_ERASE : DFU_DEADLINE_WRITE);
+	buf[0] = command;
+	buf[1] = address & 0xff;
+	buf[2] = (address >> 8) & 0xff;
+	buf[3] = (address >> 16) & 0xff;
+	buf[4] = (address >> 24) & 0xff;
+
+	ret = dfu_download(eng->dif->dev_handle, eng->dif->interface,
+			   length, 0, buf);
+	if (ret < 0) {
+		warnx("Error during special command 0x%02x download", command);
+		return fail(eng);
+	}
+	eng->chunk = 0;
+	eng->after_poll = after;
+	eng->phase = DFU_ENGINE_POLL;
+	return 0;
+}
+
+void dfu_engine_init(struct dfu_engine *eng, struct dfu_if *dif,
+		     const struct dfu_engine_policy *policy, int xfer_size,
+		     unsigned char *data, unsigned int size,
+		     unsigned int address)
+{
+	memset(eng, 0, sizeof(*eng));
+	eng->dif = dif;
+	eng->policy = policy;
+	eng->data = data;
+	eng->size = size;
+	eng->address = address;
+	eng->xfer_size = xfer_size;
+	/* the device strides by its own wTransferSize, any other chunk size
+	 * sets the address pointer for every chunk */
+	eng->runs = (unsigned int)xfer_size ==
+		    libusb_le16_to_cpu(dif->func_dfu.wTransferSize);
+	eng->erase_pages = policy->erase_pages;
+	eng->erase_count = policy->erase_count;
+	if (policy->verify) {
+		eng->verify = !!(dif->func_dfu.bmAttributes &
+				 USB_DFU_CAN_UPLOAD);
+		if (!eng->verify)
+			warnx("Device can not upload, download is not "
+			      "verified");
+	}
+	eng->phase = next_phase(eng);
+	if (policy->addressing == DFU_ADDR_DFUSE && policy->mass_erase)
+		eng->phase = DFU_ENGINE_MASS_ERASE;
+	else if (policy->addressing == DFU_ADDR_DFUSE && eng->erase_count)
+		eng->phase = DFU_ENGINE_PRE_ERASE;
+
+	report(eng, 1);
+}
+
+void dfu_engine_abort(struct dfu_engine *eng)
+{
+	if (eng->phase == DFU_ENGINE_DONE || eng->phase == DFU_ENGINE_ERROR)
+		return;
+	dfu_abort(eng->dif->dev_handle, eng->dif->interface);
+	eng->phase = DFU_ENGINE_ERROR;
+}
+
+static int engine_step(struct dfu_engine *eng)
+{
+	const struct dfu_engine_policy *policy = eng->policy;
+	struct dfu_if *dif = eng->dif;
+	struct dfu_status dst;
+	unsigned int page;
+	unsigned int len;
+	int chunk_size;
+	int ret;
+
+	switch (eng->phase) {
+	case DFU_ENGINE_MASS_ERASE:
+		printf("Performing mass erase, this can take a moment\n");
+		ret = dfuse_command(eng, 0x41, 0, next_phase(eng));
+		eng->mass_erasing = 1;
+		return ret;
+
+	case DFU_ENGINE_PRE_ERASE:
+		if (eng->erase_index < eng->erase_count) {
+			page = eng->erase_pages[eng->erase_index++];
+			if (verbose > 1)
+				printf("Erasing page at address 0x%08x\n", page);
+			return dfuse_command(eng, 0x41, page,
+					     DFU_ENGINE_PRE_ERASE);
+		}
+		eng->phase = next_phase(eng);
+		return 0;
+
+	case DFU_ENGINE_ERASE:
+		eng->chunk_limit = 0;
+		chunk_size = next_chunk_size(eng);
+		len = chunk_size;
+		ret = policy->erase(policy->erase_ctx, eng->address + eng->offset,
+				    &len, &page);
+		if (len && len < (unsigned int)chunk_size) {
+			/* the policy only vouches for the start of the chunk */
+			eng->chunk_limit = len;
+			chunk_size = len;
+		}
+		if (ret == DFU_ERASE_FAIL)
+			return fail(eng);
+		if (ret == DFU_ERASE_PAGE) {
+			/* don't rely on the pointer surviving an erase */
+			eng->run_block = 0;
+			return dfuse_command(eng, 0x41, page, DFU_ENGINE_ERASE);
+		}
+		if (ret == DFU_ERASE_SKIP ||
+		    (ret == DFU_ERASE_BLANK && policy->skip_blank &&
+		     is_blank(eng->data + eng->offset, chunk_size))) {
+			/* the flash already holds this chunk, a run goes on
+			 * with the block number of the next one if the chunk
+			 * had the full size */
+			if (eng->run_block && chunk_size == eng->xfer_size)
+				eng->run_block++;
+			else
+				eng->run_block = 0;
+			eng->chunk_limit = 0;
+			eng->offset += chunk_size;
+			eng->bytes_skipped += chunk_size;
+			report(eng, 0);
+			eng->phase = next_phase(eng);
+			return 0;
+		}
+		eng->phase = address_phase(eng);
+		return 0;
+
+	case DFU_ENGINE_ADDRESS:
+		eng->run_block = DFUSE_FIRST_BLOCK;
+		eng->addresses_set++;
+		if (verbose > 2)
+			printf("  Setting address pointer to 0x%08x\n",
+			       eng->address + eng->offset);
+		return dfuse_command(eng, 0x21, eng->address + eng->offset,
+				     DFU_ENGINE_CHUNK);
+
+	case DFU_ENGINE_CHUNK:
+		begin_op(eng, DFU_DEADLINE_WRITE);
+		chunk_size = next_chunk_size(eng);
+		if (verbose > 1 && policy->addressing == DFU_ADDR_DFUSE)
+			printf(" Download from image offset "
+			       "%08x to memory %08x-%08x, size %i\n",
+			       eng->offset, eng->address + eng->offset,
+			       eng->address + eng->offset + chunk_size - 1,
+			       chunk_size);
+
+		ret = dfu_download(dif->dev_handle, dif->interface, chunk_size,
+		    policy->addressing == DFU_ADDR_DFUSE ?
+		    eng->run_block++ : eng->transaction++,
+		    eng->data + eng->offset);
+		if (ret < 0) {
+			warnx("Error during download");
+			return fail(eng);
+		}
+		/* a short chunk ends the run, later chunks are not a
+		 * multiple of xfer_size away from the pointer */
+		if (chunk_size != eng->xfer_size)
+			eng->run_block = 0;
+		eng->chunk_limit = 0;
+		eng->offset += chunk_size;
+		eng->bytes_sent += chunk_size;
+		eng->chunk = chunk_size;
+		eng->prefetched = 0;
+		eng->after_poll = next_phase(eng);
+		eng->phase = DFU_ENGINE_POLL;
+		return 0;
+
+	case DFU_ENGINE_POLL:
+		ret = dfu_get_status(dif, &dst);
+		if (ret < 0) {
+			warnx("Error during download get_status");
+			return fail(eng);
+		}
+
+		/* STM32F405 lies about mass erase timeout */
+		if (eng->mass_erasing == 1 && dst.bwPollTimeout == 100) {
+			dst.bwPollTimeout = 35000;
+			printf("Setting timeout to 35 seconds\n");
+		}
+		if (eng->mass_erasing)
+			eng->mass_erasing++;
+
+		/* Wait while device executes flashing */
+		if (dst.bState == DFU_STATE_dfuDNBUSY ||
+		    dst.bState == DFU_STATE_dfuDNLOAD_SYNC) {
+			if (policy->prefetch && eng->chunk && !eng->prefetched)
+				prefetch(eng);
+			return dfu_poll_next(&dif->poll, dst.bwPollTimeout,
+					     DFU_POLL_DNLOAD);
+		}
+		dfu_poll_finish(&dif->poll, DFU_POLL_DNLOAD);
+		eng->mass_erasing = 0;
+		eng->op = DFU_DEADLINE_NONE;
+
+		if (dst.bStatus != DFU_STATUS_OK) {
+			printf(" failed!\n");
+			printf("state(%u) = %s, status(%u) = %s\n", dst.bState,
+			       dfu_state_to_string(dst.bState), dst.bStatus,
+			       dfu_status_to_string(dst.bStatus));
+			return fail(eng);
+		}
+		if (eng->chunk) {
+			eng->chunk = 0;
+			report(eng, 0);
+		}
+		eng->phase = eng->after_poll;
+		/* DfuSe honours the last timeout before the next request */
+		if (policy->addressing == DFU_ADDR_DFUSE)
+			return dst.bwPollTimeout;
+		return 0;
+
+	case DFU_ENGINE_FINISH:
+		if (eng->reported != eng->offset)
+			report(eng, 1);
+		if (verbose) {
+			printf("Sent a total of %i bytes\n", eng->bytes_sent);
+			if (eng->bytes_skipped)
+				printf("Skipped %i blank bytes\n",
+				       eng->bytes_skipped);
+			if (policy->addressing == DFU_ADDR_DFUSE)
+				printf("Set the address pointer %u times\n",
+				       eng->addresses_set);
+		}
+
+		if (policy->finish == DFU_FINISH_MANIFEST) {
+			begin_op(eng, DFU_DEADLINE_MANIFEST);
+			/* send one zero sized download request to signalize end */
+			ret = dfu_download(dif->dev_handle, dif->interface,
+					   0, eng->transaction, NULL);
+			if (ret < 0) {
+				warnx("Error sending completion packet");
+				return fail(eng);
+			}
+			eng->phase = DFU_ENGINE_MANIFEST;
+			return 0;
+		}
+		if (policy->finish == DFU_FINISH_ABORT ||
+		    policy->finish == DFU_FINISH_LEAVE) {
+			ret = dfu_abort(dif->dev_handle, dif->interface);
+			if (ret >= 0)
+				ret = dfu_get_status(dif, &dst);
+			if (ret < 0 || dst.bState != DFU_STATE_dfuIDLE) {
+				warnx("Failed to enter idle state on abort");
+				return fail(eng);
+			}
+			if (policy->finish == DFU_FINISH_LEAVE)
+				eng->phase = DFU_ENGINE_LEAVE;
+			else
+				eng->phase = DFU_ENGINE_DONE;
+			return dst.bwPollTimeout;
+		}
+		eng->phase = DFU_ENGINE_DONE;
+		return 0;
+
+	case DFU_ENGINE_MANIFEST:
+		/* Transition to MANIFEST_SYNC state */
+		ret = dfu_get_status(dif, &dst);
+		if (ret < 0) {
+			warnx("unable to read DFU status after completion");
+			return fail(eng);
+		}
+		printf("state(%u) = %s, status(%u) = %s\n", dst.bState,
+		       dfu_state_to_string(dst.bState), dst.bStatus,
+		       dfu_status_to_string(dst.bStatus));
+
+		/* FIXME: deal correctly with ManifestationTolerant=0 / WillDetach bits */
+		switch (dst.bState) {
+		case DFU_STATE_dfuMANIFEST_SYNC:
+		case DFU_STATE_dfuMANIFEST:
+			/* some devices (e.g. TAS1020b) need some time before we
+			 * can obtain the status, see DFU_POLL_MANIFEST_DELAY */
+			return dfu_poll_next(&dif->poll, dst.bwPollTimeout,
+					     DFU_POLL_MANIFEST);
+		default:
+			break;
+		}
+		dfu_poll_finish(&dif->poll, DFU_POLL_MANIFEST);
+		/* manifesting past the deadline fails, even if it completed */
+		if (time_left(eng) == 0)
+			return expire(eng);
+		eng->op = DFU_DEADLINE_NONE;
+		eng->phase = DFU_ENGINE_DONE;
+		if (eng->verify) {
+			/* uploads start in dfuIDLE, which only manifestation
+			 * tolerant devices return to */
+			if (dst.bState == DFU_STATE_dfuIDLE)
+				eng->phase = DFU_ENGINE_VERIFY;
+			else
+				warnx("Device did not return to dfuIDLE, "
+				      "download is not verified");
+		}
+		/* let the device settle before anyone talks to it again */
+		return dst.bwPollTimeout;
+
+	case DFU_ENGINE_VERIFY:
+		if (!eng->verifying) {
+			eng->verifying = 1;
+			if (verbose)
+				printf("Verifying %u bytes\n", eng->size);
+			dfu_reader_init(&eng->reader, dif, policy->addressing,
+					eng->xfer_size, policy->verify_buf,
+					eng->address, eng->size, verify_block,
+					eng);
+		}
+		ret = dfu_reader_step(&eng->reader);
+		if (eng->reader.phase == DFU_READER_ERROR) {
+			warnx("Reading back for verify failed");
+			return fail(eng);
+		}
+		if (eng->reader.phase != DFU_READER_DONE)
+			return ret;
+
+		/* what the device did not return can't be right either */
+		if (eng->reader.offset < eng->size)
+			add_mismatch(eng, eng->address + eng->reader.offset,
+				     eng->size - eng->reader.offset);
+		flush_mismatch(eng);
+		if (eng->mismatched) {
+			warnx("Verify failed, %u of %u bytes differ",
+			      eng->mismatched, eng->size);
+			return fail(eng);
+		}
+		printf("Verified %u bytes\n", eng->size);
+		eng->verified = 1;
+		eng->phase = policy->addressing == DFU_ADDR_DFUSE ?
+			     DFU_ENGINE_FINISH : DFU_ENGINE_DONE;
+		return ret;
+
+	case DFU_ENGINE_LEAVE:
+		if (!eng->leave_armed) {
+			eng->leave_armed = 1;
+			return dfuse_command(eng, 0x21, policy->leave_address,
+					     DFU_ENGINE_LEAVE);
+		}
+		/* Zero size block 2 makes the device jump to the address */
+		ret = dfu_download(dif->dev_handle, dif->interface, 0, 2, NULL);
+		if (ret < 0) {
+			warnx("Error sending leave request");
+			return fail(eng);
+		}
+		/* Transition to dfuMANIFEST, the device may be gone already */
+		if (dfu_get_status(dif, &dst) >= 0 &&
+		    dst.bState == DFU_STATE_dfuMANIFEST)
+			printf("Transitioning to dfuMANIFEST state\n");
+		eng->phase = DFU_ENGINE_DONE;
+		return 0;
+
+	case DFU_ENGINE_DONE:
+	case DFU_ENGINE_ERROR:
+		break;
+	}
+	return -1;
+}
+
+int dfu_engine_step(struct dfu_engine *eng)
+{
+	const struct dfu_engine_policy *policy = eng->policy;
+	long long left;
+	int wait;
+
+	if (eng->phase == DFU_ENGINE_DONE || eng->phase == DFU_ENGINE_ERROR)
+		return -1;
+	if (policy->cancelled && policy->cancelled(policy->ctx)) {
+		warnx("Download cancelled");
+		dfu_engine_abort(eng);
+		return -1;
+	}
+	if (time_left(eng) == 0)
+		return expire(eng);
+
+	wait = engine_step(eng);
+	/* wake up when the deadline expires, not after the device said */
+	left = time_left(eng);
+	if (wait > 0 && left >= 0 && wait > left)
+		wait = (int)left;
+	return wait;
+}
+
+int dfu_engine_run(struct dfu_engine *eng)
+{
+	int wait;
+
+	while ((wait = dfu_engine_step(eng)) >= 0) {
+		if (wait)
+			milli_sleep(wait);
+	}
+	return eng->phase == DFU_ENGINE_DONE ? 0 : -1;
+}
+
+void dfu_reader_init(struct dfu_reader *rd, struct dfu_if *dif,
+		     enum dfu_engine_addressing addressing, int xfer_size,
+		     unsigned char *buf, unsigned int address,
+		     unsigned int size, dfu_read_sink sink, void *ctx)
+{
+	memset(rd, 0, sizeof(*rd));
+	rd->dif = dif;
+	rd->addressing = addressing;
+	rd->xfer_size = xfer_size;
+	rd->buf = buf;
+	rd->address = address;
+	rd->size = size;
+	rd->sink = sink;
+	rd->ctx = ctx;
+	rd->phase = addressing == DFU_ADDR_DFUSE ?
+		    DFU_READER_ADDRESS : DFU_READER_BLOCK;
+}
+
+static int reader_fail(struct dfu_reader *rd)
+{
+	rd->phase = DFU_READER_ERROR;
+	return -1;
+}
+
+void dfu_reader_abort(struct dfu_reader *rd)
+{
+	if (rd->phase == DFU_READER_DONE || rd->phase == DFU_READER_ERROR)
+		return;
+	dfu_abort(rd->dif->dev_handle, rd->dif->interface);
+	rd->phase = DFU_READER_ERROR;
+}
+
+int dfu_reader_step(struct dfu_reader *rd)
+{
+	struct dfu_if *dif = rd->dif;
+	struct dfu_status dst;
+	unsigned int address = rd->address + rd->offset;
+	unsigned char cmd[5];
+	unsigned char *buf;
+	unsigned int len;
+	int ret;
+
+	switch (rd->phase) {
+	case DFU_READER_ADDRESS:
+		cmd[0] = 0x21;
+		cmd[1] = address & 0xff;
+		cmd[2] = (address >> 8) & 0xff;
+		cmd[3] = (address >> 16) & 0xff;
+		cmd[4] = (address >> 24) & 0xff;
+		if (verbose > 2)
+			printf("  Setting address pointer to 0x%08x\n", address);
+		ret = dfu_download(dif->dev_handle, dif->interface,
+				   sizeof(cmd), 0, cmd);
+		if (ret < 0) {
+			warnx("Error during special command 0x21 download");
+			return reader_fail(rd);
+		}
+		rd->phase = DFU_READER_POLL;
+		return 0;
+
+	case DFU_READER_POLL:
+		ret = dfu_get_status(dif, &dst);
+		if (ret < 0) {
+			warnx("Error during get_status");
+			return reader_fail(rd);
+		}
+		if (dst.bState == DFU_STATE_dfuDNBUSY)
+			return dst.bwPollTimeout;
+		if (dst.bStatus != DFU_STATUS_OK) {
+			warnx("Setting the address pointer to 0x%08x failed, "
+			      "status(%u) = %s", address, dst.bStatus,
+			      dfu_status_to_string(dst.bStatus));
+			return reader_fail(rd);
+		}
+		rd->phase = DFU_READER_IDLE;
+		return dst.bwPollTimeout;
+
+	case DFU_READER_IDLE:
+	case DFU_READER_FINISH:
+		ret = dfu_abort(dif->dev_handle, dif->interface);
+		if (ret >= 0)
+			ret = dfu_get_status(dif, &dst);
+		if (ret < 0 || dst.bState != DFU_STATE_dfuIDLE) {
+			warnx("Failed to enter idle state on abort");
+			return reader_fail(rd);
+		}
+		if (rd->phase == DFU_READER_FINISH) {
+			rd->phase = DFU_READER_DONE;
+			return dst.bwPollTimeout;
+		}
+		rd->block = 2;
+		rd->phase = DFU_READER_BLOCK;
+		return dst.bwPollTimeout;
+
+	case DFU_READER_BLOCK:
+		len = rd->size - rd->offset;
+		if (len > (unsigned int)rd->xfer_size)
+			len = rd->xfer_size;
+		buf = rd->buffer ? rd->buffer(rd->ctx, rd->offset, len) : rd->buf;
+		if (!buf) {
+			warnx("No room for %u bytes read at offset %u", len,
+			      rd->offset);
+			return reader_fail(rd);
+		}
+		ret = dfu_upload(dif->dev_handle, dif->interface, len,
+				 rd->block++, buf);
+		if (ret < 0) {
+			warnx("Error during upload");
+			return reader_fail(rd);
+		}
+		if (ret) {
+			int stop = rd->sink(rd->ctx, address, buf, ret);
+
+			if (stop < 0)
+				return reader_fail(rd);
+			rd->offset += ret;
+			if (stop) {
+				rd->phase = DFU_READER_FINISH;
+				return 0;
+			}
+		}
+		/* a short block is the end of what the device has */
+		if ((unsigned int)ret < len || rd->offset >= rd->size)
+			rd->phase = DFU_READER_FINISH;
+		else if (rd->addressing == DFU_ADDR_DFUSE &&
+			 rd->block > DFUSE_LAST_BLOCK)
+			rd->phase = DFU_READER_ADDRESS;
+		return 0;
+
+	case DFU_READER_DONE:
+	case DFU_READER_ERROR:
+		break;
+	}
+	return -1;
+}
+
+int dfu_reader_run(struct dfu_reader *rd)
+{
+	int wait;
+
+	while ((wait = dfu_reader_step(rd)) >= 0) {
+		if (wait)
+			milli_sleep(wait);
+	}
+	return rd->phase == DFU_READER_DONE ? 0 : -1;
+}
@@ -0,0 +1,216 @@
+/*
+ * Policy driven DFU/DfuSe download engine
+ *
+ * SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+ * SPDX-License-Identifier: GPL2.0-or-later
+ */
+
+#ifndef DFU_ENGINE_H
+#define DFU_ENGINE_H
+
+#include <stddef.h>
+
+#include "dfu.h"
+#include "dfuse_mem.h"
+
+enum dfu_engine_addressing {
+	DFU_ADDR_BLOCKNUM,	/* DFU 1.x: wBlockNum counts up from 0 */
+	DFU_ADDR_DFUSE		/* DfuSe: SET_ADDRESS once per contiguous run,
+				 * then wBlockNum 2, 3, ... */
+};
+
+enum dfu_engine_finish {
+	DFU_FINISH_MANIFEST,	/* zero length DNLOAD, wait for manifestation */
+	DFU_FINISH_ABORT,	/* DfuSe: abort back to dfuIDLE */
+	DFU_FINISH_LEAVE,	/* DfuSe: abort, then jump to leave_address */
+	DFU_FINISH_NONE		/* leave the device in dfuDNLOAD-IDLE */
+};
+
+/* What a deadline of the policy bounds, see dfu_engine_policy */
+enum dfu_engine_deadline {
+	DFU_DEADLINE_NONE,
+	DFU_DEADLINE_ERASE,	/* DfuSe: one erase command, mass erase too */
+	DFU_DEADLINE_WRITE,	/* one block or address pointer, from the
+				 * DNLOAD until the device is idle again */
+	DFU_DEADLINE_MANIFEST	/* from the end of the image until the
+				 * device manifested */
+};
+
+enum dfu_erase_result {
+	DFU_ERASE_FAIL = -1,	/* range can not be written */
+	DFU_ERASE_WRITE = 0,	/* ready, previous contents unknown */
+	DFU_ERASE_BLANK = 1,	/* ready, range reads back as 0xff */
+	DFU_ERASE_PAGE = 2,	/* erase *page first */
+	DFU_ERASE_SKIP = 3	/* range already holds the data, don't send */
+};
+
+struct dfu_engine_policy {
+	enum dfu_engine_addressing addressing;
+	enum dfu_engine_finish finish;
+
+	/* Erase policy, DfuSe only, see enum dfu_erase_result. Called until
+	 * it stops asking for pages of [address, address + *len) to erase.
+	 * It may shorten *len, the result then holds for that much and the
+	 * rest of the chunk is asked about again. */
+	int (*erase)(void *erase_ctx, unsigned int address, unsigned int *len,
+		     unsigned int *page);
+	void *erase_ctx;		/* e.g. struct dfuse_erase_plan */
+	/* Progress sink, called with bytes done (sent or skipped) */
+	void (*progress)(void *ctx, size_t done, size_t total);
+	/* Cancellation, checked before every step; nonzero aborts */
+	int (*cancelled)(void *ctx);
+	void *ctx;
+
+	int mass_erase;		/* DfuSe: erase the whole flash first */
+	const unsigned int *erase_pages; /* DfuSe: or these pages first */
+	unsigned int erase_count;
+	unsigned int leave_address; /* DfuSe: start address for DFU_FINISH_LEAVE */
+
+	/* Verify: read the image back once written and compare. DfuSe
+	 * devices are read before the finish, DFU devices after they
+	 * manifested, if they are manifestation tolerant. */
+	int verify;
+	unsigned char *verify_buf;	/* xfer_size bytes */
+	/* Called with each range that reads back different */
+	void (*mismatch)(void *ctx, unsigned int address, unsigned int len);
+
+	int skip_blank;		/* don't send all 0xff chunks to erased pages */
+	int prefetch;		/* touch the next chunk while the device is busy */
+	unsigned int progress_step; /* report at most every so many bytes */
+
+	/* Deadlines in milliseconds, 0 for none, see enum
+	 * dfu_engine_deadline. An operation that outlasts its deadline aborts
+	 * the device and fails the engine with timed_out set. Waits returned
+	 * by dfu_engine_step() are cut short so the deadline is checked in
+	 * time, a bwPollTimeout longer than it does not hold the engine. */
+	unsigned int erase_deadline;
+	unsigned int write_deadline;
+	unsigned int manifest_deadline;
+};
+
+enum dfu_engine_phase {
+	DFU_ENGINE_MASS_ERASE,	/* DfuSe: erase the whole flash */
+	DFU_ENGINE_PRE_ERASE,	/* DfuSe: erase the policy's erase_pages */
+	DFU_ENGINE_ERASE,	/* DfuSe: erase the pages of the next chunk */
+	DFU_ENGINE_ADDRESS,	/* DfuSe: load the address pointer */
+	DFU_ENGINE_CHUNK,	/* send the next DNLOAD block */
+	DFU_ENGINE_POLL,	/* wait for the device to leave dfuDNBUSY */
+	DFU_ENGINE_FINISH,	/* whole image sent, see enum dfu_engine_finish */
+	DFU_ENGINE_MANIFEST,	/* wait for manifestation */
+	DFU_ENGINE_VERIFY,	/* read back and compare, see policy->verify */
+	DFU_ENGINE_LEAVE,	/* DfuSe: zero length DNLOAD, device jumps */
+	DFU_ENGINE_DONE,
+	DFU_ENGINE_ERROR
+};
+
+/*
+ * The upload side: reads [address, address + size) block by block and
+ * hands each block to a sink. DfuSe reads start at the address pointer,
+ * plain DFU reads start where the device decides and address is only
+ * passed on to the sink. Resumable like the engine.
+ */
+enum dfu_reader_phase {
+	DFU_READER_ADDRESS,	/* DfuSe: load the address pointer */
+	DFU_READER_POLL,	/* DfuSe: wait for the pointer to be loaded */
+	DFU_READER_IDLE,	/* DfuSe: back to dfuIDLE, uploads start there */
+	DFU_READER_BLOCK,	/* read the next UPLOAD block */
+	DFU_READER_FINISH,	/* abort back to dfuIDLE */
+	DFU_READER_DONE,
+	DFU_READER_ERROR
+};
+
+/* Called with the device address and contents of each block read.
+ * Returns 0 to go on, 1 to stop reading early or -1 to fail. */
+typedef int (*dfu_read_sink)(void *ctx, unsigned int address,
+			     const unsigned char *data, unsigned int len);
+
+/* Optional, where the len bytes at offset of the read are uploaded to,
+ * or NULL to fail. Lets the sink take the data without a copy. */
+typedef unsigned char *(*dfu_read_buffer)(void *ctx, unsigned int offset,
+					  unsigned int len);
+
+struct dfu_reader {
+	struct dfu_if *dif;
+	enum dfu_engine_addressing addressing;
+	dfu_read_sink sink;
+	dfu_read_buffer buffer;		/* NULL to read into buf */
+	void *ctx;
+	unsigned char *buf;		/* one block of xfer_size bytes */
+	int xfer_size;
+	unsigned int address;
+	unsigned int size;
+	unsigned int offset;		/* bytes read */
+	unsigned int block;		/* wBlockNum of the next UPLOAD */
+	enum dfu_reader_phase phase;
+};
+
+struct dfu_engine {
+	struct dfu_if *dif;
+	const struct dfu_engine_policy *policy;
+	unsigned char *data;
+	unsigned int size;
+	unsigned int address;		/* DfuSe address of data[0] */
+	int xfer_size;
+
+	unsigned int offset;		/* bytes done, sent or skipped */
+	unsigned int bytes_sent;
+	unsigned int bytes_skipped;
+	unsigned int reported;		/* offset last given to progress */
+	int chunk;			/* size of the block in flight */
+	unsigned int chunk_limit;	/* erase policy cut the next chunk short */
+	unsigned short transaction;
+	int runs;			/* xfer_size is the wTransferSize of
+					 * the device, chunks may run */
+	unsigned int run_block;		/* DfuSe wBlockNum of the next chunk,
+					 * 0 to set the address pointer */
+	unsigned int addresses_set;
+	enum dfu_engine_phase phase;
+	enum dfu_engine_phase after_poll;
+	int prefetched;			/* next chunk touched this poll */
+	const unsigned int *erase_pages; /* policy->erase_pages at init, the */
+	unsigned int erase_count;	/* policy may move on to the next element */
+	unsigned int erase_index;	/* next of erase_pages */
+	int mass_erasing;		/* 1 until the first mass erase status */
+	int leave_armed;		/* DfuSe leave address was set */
+	int verify;			/* policy->verify and the device can upload */
+	int verifying;			/* reader set up for DFU_ENGINE_VERIFY */
+	int verified;			/* verify ran over the whole image */
+	unsigned int mismatched;	/* bytes that read back different */
+	unsigned int mismatch_start;	/* range not yet given to mismatch */
+	unsigned int mismatch_len;
+	struct dfu_reader reader;
+	volatile unsigned char prefetch_sink;
+	enum dfu_engine_deadline op;	/* deadline of the operation in flight */
+	unsigned long long op_start;	/* milli_time() it began */
+	enum dfu_engine_deadline timed_out; /* deadline that expired, if any */
+};
+
+void dfu_engine_init(struct dfu_engine *eng, struct dfu_if *dif,
+		     const struct dfu_engine_policy *policy, int xfer_size,
+		     unsigned char *data, unsigned int size,
+		     unsigned int address);
+
+/* Runs one round of USB traffic. Returns the number of milliseconds to
+ * wait before the next call, or -1 once the engine is done or failed. */
+int dfu_engine_step(struct dfu_engine *eng);
+
+/* Blocking driver for dfu_engine_step(). Returns 0 or -1 on error. */
+int dfu_engine_run(struct dfu_engine *eng);
+
+/* Aborts the transfer in progress and puts the engine in error. */
+void dfu_engine_abort(struct dfu_engine *eng);
+
+/* "erase", "write" or "manifest", NULL for DFU_DEADLINE_NONE */
+const char *dfu_engine_deadline_name(enum dfu_engine_deadline deadline);
+
+void dfu_reader_init(struct dfu_reader *rd, struct dfu_if *dif,
+		     enum dfu_engine_addressing addressing, int xfer_size,
+		     unsigned char *buf, unsigned int address,
+		     unsigned int size, dfu_read_sink sink, void *ctx);
+
+/* Same contract as dfu_engine_step() */
+int dfu_reader_step(struct dfu_reader *rd);
+int dfu_reader_run(struct dfu_reader *rd);
+void dfu_reader_abort(struct dfu_reader *rd);
+
+#endif /* DFU_ENGINE_H */
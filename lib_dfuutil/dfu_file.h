@@ -2,6 +2,7 @@
 #ifndef DFU_FILE_H
 #define DFU_FILE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 struct dfu_file {
@@ -9,6 +10,8 @@ struct dfu_file {
     const char *name;
     /* Pointer to file loaded into memory */
     uint8_t *firmware;
+    /* firmware is a read-only view of the file, see dfu_map_file() */
+    int mapped;
     /* Different sizes */
     struct {
 	int total;
@@ -49,11 +52,23 @@ enum prefix_type {
 extern int verbose;
 
 void dfu_load_file(struct dfu_file *file, enum suffix_req check_suffix, enum prefix_req check_prefix);
+/* Like dfu_load_file(), but the file is mapped read-only instead of read
+ * when it can be. Processes mapping the same file share its pages. */
+void dfu_map_file(struct dfu_file *file, enum suffix_req check_suffix, enum prefix_req check_prefix);
+void dfu_free_file(struct dfu_file *file);
+/* Parse the suffix and prefix of an image already in memory, without
+ * exiting. file->firmware becomes a view of data. Returns 0, 1 if the image
+ * has no valid suffix, or -1 if it can not be used; reason tells why. */
+int dfu_parse_image(struct dfu_file *file, uint8_t *data, int size,
+    enum suffix_req check_suffix, enum prefix_req check_prefix,
+    char *reason, size_t reason_len);
 void dfu_store_file(struct dfu_file *file, int write_suffix, int write_prefix);
 
 void dfu_progress_bar(const char *desc, unsigned long long curr,
 		unsigned long long max);
 void *dfu_malloc(size_t size);
+/* CRC32 as in the DFU suffix: start from 0xffffffff, not inverted */
+uint32_t dfu_crc32(uint32_t crc, const void *buf, size_t size);
 uint32_t dfu_file_write_crc(int f, uint32_t crc, const void *buf, int size);
 void show_suffix_and_prefix(struct dfu_file *file);
 
@@ -38,23 +38,29 @@
 #include "usb_dfu.h"
 #include "dfu_file.h"
 #include "dfu_load.h"
+#include "dfu_engine.h"
 #include "quirks.h"
 
 int dfuload_do_upload(struct dfu_if *dif, int xfer_size,
-    int expected_size, int fd)
+    int expected_size, struct dfu_sink *sink)
 {
 	int total_bytes = 0;
 	unsigned short transaction = 0;
 	unsigned char *buf;
 	int ret;
 
-	buf = dfu_malloc(xfer_size);
-
 	printf("Copying data from DFU device to PC\n");
 	dfu_progress_bar("Upload", 0, 1);
 
 	while (1) {
 		int rc;
+		/* read straight into where the sink keeps it */
+		buf = dfu_sink_buffer(sink, total_bytes, xfer_size);
+		if (!buf) {
+			warnx("No room for upload data at offset %i", total_bytes);
+			ret = -1;
+			goto out_free;
+		}
 		rc = dfu_upload(dif->dev_handle, dif->interface,
 		    xfer_size, transaction++, buf);
 		if (rc < 0) {
@@ -63,7 +69,10 @@ int dfuload_do_upload(struct dfu_if *dif, int xfer_size,
 			goto out_free;
 		}
 
-		dfu_file_write_crc(fd, 0, buf, rc);
+		if (dfu_sink_write(sink, total_bytes, buf, rc) < 0) {
+			ret = -1;
+			goto out_free;
+		}
 		total_bytes += rc;
 
 		if (total_bytes < 0)
@@ -82,7 +91,6 @@ out_free:
 	dfu_progress_bar("Upload", total_bytes, total_bytes);
 	if (total_bytes == 0)
 		printf("\nFailed.\n");
-	free(buf);
 	if (verbose)
 		printf("Received a total of %i bytes\n", total_bytes);
 	if (expected_size != 0 && total_bytes != expected_size)
@@ -90,107 +98,33 @@ out_free:
 	return ret;
 }
 
+static void dfuload_progress(void *ctx, size_t done, size_t total)
+{
+	dfu_progress_bar("Download", done, total);
+}
+
 int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file)
 {
-	int bytes_sent;
-	int expected_size;
-	unsigned char *buf;
-	unsigned short transaction = 0;
-	struct dfu_status dst;
-	int ret;
+	struct dfu_engine_policy policy;
+	struct dfu_engine eng;
 
 	printf("Copying data from PC to DFU device\n");
 
-	buf = file->firmware;
-	expected_size = file->size.total - file->size.suffix;
-	bytes_sent = 0;
-
-	dfu_progress_bar("Download", 0, 1);
-	while (bytes_sent < expected_size) {
-		int bytes_left;
-		int chunk_size;
-
-		bytes_left = expected_size - bytes_sent;
-		if (bytes_left < xfer_size)
-			chunk_size = bytes_left;
-		else
-			chunk_size = xfer_size;
-
-		ret = dfu_download(dif->dev_handle, dif->interface,
-		    chunk_size, transaction++, chunk_size ? buf : NULL);
-		if (ret < 0) {
-			warnx("Error during download");
-			goto out;
-		}
-		bytes_sent += chunk_size;
-		buf += chunk_size;
-
-		do {
-			ret = dfu_get_status(dif, &dst);
-			if (ret < 0) {
-				errx(EX_IOERR, "Error during download get_status: %d", ret);
-				goto out;
-			}
-
-			if (dst.bState == DFU_STATE_dfuDNLOAD_IDLE ||
-					dst.bState == DFU_STATE_dfuERROR)
-				break;
-
-			/* Wait while device executes flashing */
-			milli_sleep(dst.bwPollTimeout);
-
-		} while (1);
-		if (dst.bStatus != DFU_STATUS_OK) {
-			printf(" failed!\n");
-			printf("state(%u) = %s, status(%u) = %s\n", dst.bState,
-				dfu_state_to_string(dst.bState), dst.bStatus,
-				dfu_status_to_string(dst.bStatus));
-			ret = -1;
-			goto out;
-		}
-		dfu_progress_bar("Download", bytes_sent, bytes_sent + bytes_left);
-	}
+	memset(&policy, 0, sizeof(policy));
+	policy.addressing = DFU_ADDR_BLOCKNUM;
+	policy.finish = DFU_FINISH_MANIFEST;
+	policy.progress = dfuload_progress;
+	policy.prefetch = 1;
 
-	/* send one zero sized download request to signalize end */
-	ret = dfu_download(dif->dev_handle, dif->interface,
-	    0, transaction, NULL);
-	if (ret < 0) {
-		errx(EX_IOERR, "Error sending completion packet");
-		goto out;
-	}
-
-	dfu_progress_bar("Download", bytes_sent, bytes_sent);
+	dfu_poll_begin_session(&dif->poll);
+	dfu_engine_init(&eng, dif, &policy, xfer_size, file->firmware,
+			file->size.total - file->size.suffix, 0);
+	if (dfu_engine_run(&eng) < 0)
+		return eng.bytes_sent;
 
-	if (verbose)
-		printf("Sent a total of %i bytes\n", bytes_sent);
-
-get_status:
-	/* Transition to MANIFEST_SYNC state */
-	ret = dfu_get_status(dif, &dst);
-	if (ret < 0) {
-		warnx("unable to read DFU status after completion");
-		goto out;
-	}
-	printf("state(%u) = %s, status(%u) = %s\n", dst.bState,
-		dfu_state_to_string(dst.bState), dst.bStatus,
-		dfu_status_to_string(dst.bStatus));
-
-	milli_sleep(dst.bwPollTimeout);
-
-	/* FIXME: deal correctly with ManifestationTolerant=0 / WillDetach bits */
-	switch (dst.bState) {
-	case DFU_STATE_dfuMANIFEST_SYNC:
-	case DFU_STATE_dfuMANIFEST:
-		/* some devices (e.g. TAS1020b) need some time before we
-		 * can obtain the status */
-		milli_sleep(1000);
-		goto get_status;
-		break;
-	case DFU_STATE_dfuIDLE:
-		break;
-	}
+	if (dif->poll.saved_ms)
+		printf("Adaptive polling saved %llu ms\n", dif->poll.saved_ms);
 	printf("Done!\n");
 
-out:
-	return bytes_sent;
+	return eng.bytes_sent;
 }
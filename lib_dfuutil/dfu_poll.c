@@ -0,0 +1,106 @@
+/*
+ * Status polling policy for DFU devices
+ *
+ * Many devices report a bwPollTimeout that is much longer than the time
+ * they actually need to write a block. In adaptive mode the host probes
+ * with DFU_GETSTATUS early, starting from the busy time learned on
+ * previous blocks and doubling the wait on every probe, but never waits
+ * longer in total than the device asked for. Once the reported budget is
+ * spent the device is trusted again. The mode is chosen per vid/pid
+ * through QUIRK_ADAPTIVE_POLL, see quirks.c.
+ *
+ * SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+ * SPDX-License-Identifier: GPL2.0-or-later
+ */
+
+#include <string.h>
+
+#include "dfu_poll.h"
+
+void dfu_poll_init(struct dfu_poll_state *poll, enum dfu_poll_mode mode)
+{
+	memset(poll, 0, sizeof(*poll));
+	poll->mode = mode;
+}
+
+void dfu_poll_begin_session(struct dfu_poll_state *poll)
+{
+	/* learned_ms survives sessions, it is history of the device */
+	poll->busy = 0;
+	poll->saved_ms = 0;
+	poll->polls = 0;
+}
+
+/* Called each time DFU_GETSTATUS shows the device still busy. Returns the
+ * number of milliseconds to wait before the next DFU_GETSTATUS. */
+unsigned int dfu_poll_next(struct dfu_poll_state *poll,
+			   unsigned int bwPollTimeout,
+			   enum dfu_poll_phase phase)
+{
+	unsigned int reported = bwPollTimeout;
+	unsigned int wait;
+
+	if (phase == DFU_POLL_MANIFEST)
+		reported += DFU_POLL_MANIFEST_DELAY;
+
+	if (!poll->busy) {
+		poll->busy = 1;
+		poll->budget_ms = reported;
+		poll->waited_ms = 0;
+		poll->probes = 0;
+		if (phase == DFU_POLL_DNLOAD && poll->learned_ms)
+			poll->step_ms = poll->learned_ms;
+		else
+			poll->step_ms = DFU_POLL_MIN_MS;
+	} else if (poll->waited_ms >= poll->budget_ms) {
+		/* A spec compliant host would have asked only now and been
+		 * given another timeout, extend the budget by it. */
+		poll->budget_ms += reported;
+	}
+	poll->probes++;
+	poll->polls++;
+
+	if (poll->mode != DFU_POLL_ADAPTIVE)
+		return reported;
+
+	wait = poll->step_ms;
+	poll->step_ms *= 2;
+	if (phase == DFU_POLL_MANIFEST && wait > DFU_POLL_MANIFEST_CAP)
+		wait = DFU_POLL_MANIFEST_CAP;
+	if (wait > poll->budget_ms - poll->waited_ms)
+		wait = poll->budget_ms - poll->waited_ms;
+
+	poll->waited_ms += wait;
+	return wait;
+}
+
+/* Called once DFU_GETSTATUS shows the device left the busy state */
+void dfu_poll_finish(struct dfu_poll_state *poll, enum dfu_poll_phase phase)
+{
+	if (!poll->busy)
+		return;
+	poll->busy = 0;
+
+	if (poll->mode != DFU_POLL_ADAPTIVE)
+		return;
+
+	/* the reported mode would have waited out the whole budget */
+	if (poll->budget_ms > poll->waited_ms)
+		poll->saved_ms += poll->budget_ms - poll->waited_ms;
+
+	if (phase == DFU_POLL_DNLOAD) {
+		unsigned int observed = poll->waited_ms;
+
+		/* Done on the first probe means we may have waited too long,
+		 * let the estimate drift down so a faster device is noticed */
+		if (poll->probes == 1)
+			observed = observed * 3 / 4;
+
+		if (poll->learned_ms)
+			poll->learned_ms = (3 * poll->learned_ms + observed) / 4;
+		else
+			poll->learned_ms = observed;
+		if (poll->learned_ms < DFU_POLL_MIN_MS)
+			poll->learned_ms = DFU_POLL_MIN_MS;
+	}
+}
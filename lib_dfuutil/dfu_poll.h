@@ -0,0 +1,50 @@
+/*
+ * Status polling policy for DFU devices
+ *
+ * SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+ * SPDX-License-Identifier: GPL2.0-or-later
+ */
+
+#ifndef DFU_POLL_H
+#define DFU_POLL_H
+
+enum dfu_poll_mode {
+	DFU_POLL_REPORTED,	/* wait exactly bwPollTimeout (DFU spec) */
+	DFU_POLL_ADAPTIVE	/* poll early, back off up to bwPollTimeout */
+};
+
+enum dfu_poll_phase {
+	DFU_POLL_DNLOAD,	/* block written, device in dfuDNBUSY */
+	DFU_POLL_MANIFEST	/* device in dfuMANIFEST(-SYNC) */
+};
+
+/* Fixed extra wait of the manifest phase, some devices (e.g. TAS1020b)
+ * need it before they can report their status */
+#define DFU_POLL_MANIFEST_DELAY	1000
+/* Adaptive mode: first probe when nothing was learned yet */
+#define DFU_POLL_MIN_MS		1
+/* Adaptive mode: longest single wait in the manifest phase */
+#define DFU_POLL_MANIFEST_CAP	100
+
+struct dfu_poll_state {
+	enum dfu_poll_mode mode;
+	unsigned int learned_ms;	/* smoothed busy time of previous blocks */
+	/* current busy period */
+	int busy;
+	unsigned int budget_ms;		/* what the reported timeouts allow */
+	unsigned int waited_ms;		/* what we actually waited */
+	unsigned int step_ms;		/* next backoff step */
+	unsigned int probes;		/* DFU_GETSTATUS answered busy */
+	/* accounting for the current session */
+	unsigned long long saved_ms;
+	unsigned int polls;
+};
+
+void dfu_poll_init(struct dfu_poll_state *poll, enum dfu_poll_mode mode);
+void dfu_poll_begin_session(struct dfu_poll_state *poll);
+unsigned int dfu_poll_next(struct dfu_poll_state *poll,
+			   unsigned int bwPollTimeout,
+			   enum dfu_poll_phase phase);
+void dfu_poll_finish(struct dfu_poll_state *poll, enum dfu_poll_phase phase);
+
+#endif /* DFU_POLL_H */
@@ -0,0 +1,27 @@
+/*
+ * SHA-256 (FIPS 180-4) for hashing firmware read back from devices
+ *
+ * SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+ * SPDX-License-Identifier: GPL2.0-or-later
+ */
+
+#ifndef DFU_SHA256_H
+#define DFU_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DFU_SHA256_LENGTH 32
+
+struct dfu_sha256 {
+	uint32_t state[8];
+	uint64_t length;		/* bytes hashed */
+	unsigned char block[64];	/* partial block, length % 64 bytes */
+};
+
+void dfu_sha256_init(struct dfu_sha256 *ctx);
+void dfu_sha256_update(struct dfu_sha256 *ctx, const void *data, size_t len);
+void dfu_sha256_final(struct dfu_sha256 *ctx,
+		      unsigned char digest[DFU_SHA256_LENGTH]);
+
+#endif /* DFU_SHA256_H */
@@ -0,0 +1,254 @@
+/*
+ * Destinations for data read back from a device
+ *
+ * SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+ * SPDX-License-Identifier: GPL2.0-or-later
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "portable.h"
+#include "dfu_file.h"
+#include "dfu_sink.h"
+
+#ifdef HAVE_WINDOWS_H
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+#endif
+
+static unsigned char *in_place(struct dfu_sink *sink, unsigned int offset,
+			       unsigned int len)
+{
+	if (offset > sink->size || len > sink->size - offset)
+		return NULL;
+	return sink->base + offset;
+}
+
+static unsigned char *in_scratch(struct dfu_sink *sink, unsigned int offset,
+				 unsigned int len)
+{
+	return len <= sink->size ? sink->scratch : NULL;
+}
+
+static int stored(struct dfu_sink *sink, unsigned int address,
+		  const unsigned char *data, unsigned int len)
+{
+	return 0;
+}
+
+void dfu_sink_memory(struct dfu_sink *sink, unsigned char *buf,
+		     unsigned int size)
+{
+	memset(sink, 0, sizeof(*sink));
+	sink->buffer = in_place;
+	sink->write = stored;
+	sink->base = buf;
+	sink->size = size;
+}
+
+#ifdef HAVE_WINDOWS_H
+
+static int map_file(struct dfu_sink *sink, const char *name,
+		    unsigned int size)
+{
+	HANDLE file;
+	HANDLE mapping;
+
+	file = CreateFileA(name, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+			   CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return -1;
+	/* the mapping grows the file to size */
+	mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, size, NULL);
+	if (!mapping) {
+		CloseHandle(file);
+		return -1;
+	}
+	sink->base = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+	if (!sink->base) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return -1;
+	}
+	sink->file = file;
+	sink->mapping = mapping;
+	return 0;
+}
+
+static int unmap_file(struct dfu_sink *sink)
+{
+	LARGE_INTEGER end;
+	int ret = 0;
+
+	UnmapViewOfFile(sink->base);
+	CloseHandle(sink->mapping);
+	end.QuadPart = sink->written;
+	if (!SetFilePointerEx(sink->file, end, NULL, FILE_BEGIN) ||
+	    !SetEndOfFile(sink->file))
+		ret = -1;
+	CloseHandle(sink->file);
+	return ret;
+}
+
+#else
+
+static int map_file(struct dfu_sink *sink, const char *name,
+		    unsigned int size)
+{
+	void *base;
+
+	sink->fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0666);
+	if (sink->fd < 0)
+		return -1;
+	if (ftruncate(sink->fd, size) < 0) {
+		close(sink->fd);
+		return -1;
+	}
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    sink->fd, 0);
+	if (base == MAP_FAILED) {
+		close(sink->fd);
+		return -1;
+	}
+	sink->base = base;
+	return 0;
+}
+
+static int unmap_file(struct dfu_sink *sink)
+{
+	int ret = 0;
+
+	munmap(sink->base, sink->size);
+	if (ftruncate(sink->fd, sink->written) < 0)
+		ret = -1;
+	close(sink->fd);
+	return ret;
+}
+
+#endif /* HAVE_WINDOWS_H */
+
+int dfu_sink_mapped_file(struct dfu_sink *sink, const char *name,
+			 unsigned int size)
+{
+	memset(sink, 0, sizeof(*sink));
+	if (!size || map_file(sink, name, size) < 0) {
+		warnx("Could not map %u bytes of %s", size, name);
+		return -1;
+	}
+	sink->buffer = in_place;
+	sink->write = stored;
+	sink->close = unmap_file;
+	sink->size = size;
+	return 0;
+}
+
+static int hash_block(struct dfu_sink *sink, unsigned int address,
+		      const unsigned char *data, unsigned int len)
+{
+	if (sink->hash == DFU_SINK_CRC32)
+		sink->crc = dfu_crc32(sink->crc, data, len);
+	else
+		dfu_sha256_update(&sink->sha256, data, len);
+	return 0;
+}
+
+static int hash_final(struct dfu_sink *sink)
+{
+	uint32_t crc = ~sink->crc;
+
+	if (sink->hash == DFU_SINK_SHA256) {
+		dfu_sha256_final(&sink->sha256, sink->digest);
+		sink->digest_len = DFU_SHA256_LENGTH;
+		return 0;
+	}
+	sink->digest[0] = crc >> 24;
+	sink->digest[1] = crc >> 16;
+	sink->digest[2] = crc >> 8;
+	sink->digest[3] = crc;
+	sink->digest_len = 4;
+	return 0;
+}
+
+void dfu_sink_hash(struct dfu_sink *sink, enum dfu_sink_hash hash,
+		   unsigned char *scratch, unsigned int xfer_size)
+{
+	memset(sink, 0, sizeof(*sink));
+	sink->buffer = in_scratch;
+	sink->write = hash_block;
+	sink->close = hash_final;
+	sink->scratch = scratch;
+	sink->size = xfer_size;
+	sink->hash = hash;
+	sink->crc = 0xffffffff;
+	dfu_sha256_init(&sink->sha256);
+}
+
+static int pass_on(struct dfu_sink *sink, unsigned int address,
+		   const unsigned char *data, unsigned int len)
+{
+	return sink->stream(sink->ctx, address, data, len);
+}
+
+void dfu_sink_stream(struct dfu_sink *sink, dfu_read_sink fn, void *ctx,
+		     unsigned char *scratch, unsigned int xfer_size)
+{
+	memset(sink, 0, sizeof(*sink));
+	sink->buffer = in_scratch;
+	sink->write = pass_on;
+	sink->scratch = scratch;
+	sink->size = xfer_size;
+	sink->stream = fn;
+	sink->ctx = ctx;
+}
+
+unsigned char *dfu_sink_buffer(void *ctx, unsigned int offset,
+			       unsigned int len)
+{
+	struct dfu_sink *sink = ctx;
+
+	return sink->buffer(sink, offset, len);
+}
+
+int dfu_sink_write(void *ctx, unsigned int address,
+		   const unsigned char *data, unsigned int len)
+{
+	struct dfu_sink *sink = ctx;
+	int ret = sink->write(sink, address, data, len);
+
+	if (ret >= 0)
+		sink->written += len;
+	return ret;
+}
+
+int dfu_sink_close(struct dfu_sink *sink)
+{
+	int ret = sink->close ? sink->close(sink) : 0;
+
+	sink->close = NULL;
+	return ret;
+}
+
+int dfu_sink_digest(const struct dfu_sink *sink, char *hex, size_t len)
+{
+	unsigned int i;
+
+	for (i = 0; i < sink->digest_len && 2 * i + 2 < len; i++)
+		snprintf(hex + 2 * i, 3, "%02x", sink->digest[i]);
+	if (len)
+		hex[2 * i] = 0;
+	return 2 * sink->digest_len;
+}
+
+void dfu_reader_init_sink(struct dfu_reader *rd, struct dfu_if *dif,
+			  enum dfu_engine_addressing addressing,
+			  int xfer_size, unsigned int address,
+			  unsigned int size, struct dfu_sink *sink)
+{
+	dfu_reader_init(rd, dif, addressing, xfer_size, NULL, address, size,
+			dfu_sink_write, sink);
+	rd->buffer = dfu_sink_buffer;
+}
@@ -0,0 +1,93 @@
+/*
+ * Destinations for data read back from a device
+ *
+ * A sink hands the reader the memory each block is uploaded to, so
+ * memory and mapped file sinks take the data without a copy, and is then
+ * told the block has arrived. Hash and stream sinks upload to a scratch
+ * block of the caller and consume it in place.
+ *
+ * SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+ * SPDX-License-Identifier: GPL2.0-or-later
+ */
+
+#ifndef DFU_SINK_H
+#define DFU_SINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dfu_engine.h"
+#include "dfu_sha256.h"
+
+enum dfu_sink_hash {
+	DFU_SINK_CRC32,		/* CRC-32 as in zlib, 4 bytes big endian */
+	DFU_SINK_SHA256
+};
+
+struct dfu_sink {
+	/* where the len bytes at offset go, NULL if they do not fit */
+	unsigned char *(*buffer)(struct dfu_sink *sink, unsigned int offset,
+				 unsigned int len);
+	/* the block is in place, same contract as dfu_read_sink */
+	int (*write)(struct dfu_sink *sink, unsigned int address,
+		     const unsigned char *data, unsigned int len);
+	/* optional, returns 0 or -1 */
+	int (*close)(struct dfu_sink *sink);
+
+	unsigned char *base;		/* memory or mapped file */
+	unsigned int size;		/* bytes at base, or of scratch */
+	unsigned int written;		/* bytes given to the sink */
+	unsigned char *scratch;		/* hash and stream: one block */
+
+	enum dfu_sink_hash hash;
+	uint32_t crc;
+	struct dfu_sha256 sha256;
+	unsigned char digest[DFU_SHA256_LENGTH];
+	unsigned int digest_len;	/* set by dfu_sink_close() */
+
+	dfu_read_sink stream;
+	void *ctx;
+
+	void *file;			/* mapped file, platform handles */
+	void *mapping;
+	int fd;
+};
+
+/* Into buf, reads beyond size bytes fail */
+void dfu_sink_memory(struct dfu_sink *sink, unsigned char *buf,
+		     unsigned int size);
+
+/* Into a file of size bytes mapped into memory, truncated to the bytes
+ * read when closed. Returns -1 if the file can not be created. */
+int dfu_sink_mapped_file(struct dfu_sink *sink, const char *name,
+			 unsigned int size);
+
+/* Nothing stored, the digest is available once closed. scratch holds
+ * one block of xfer_size bytes. */
+void dfu_sink_hash(struct dfu_sink *sink, enum dfu_sink_hash hash,
+		   unsigned char *scratch, unsigned int xfer_size);
+
+/* Every block is passed on to fn, e.g. towards a client */
+void dfu_sink_stream(struct dfu_sink *sink, dfu_read_sink fn, void *ctx,
+		     unsigned char *scratch, unsigned int xfer_size);
+
+/* dfu_read_buffer and dfu_read_sink of a sink, ctx is the sink */
+unsigned char *dfu_sink_buffer(void *ctx, unsigned int offset,
+			       unsigned int len);
+int dfu_sink_write(void *ctx, unsigned int address,
+		   const unsigned char *data, unsigned int len);
+
+/* Releases the sink, returns -1 if its data could not be stored */
+int dfu_sink_close(struct dfu_sink *sink);
+
+/* The digest of a closed hash sink in hex, returns its length like
+ * snprintf() */
+int dfu_sink_digest(const struct dfu_sink *sink, char *hex, size_t len);
+
+/* dfu_reader_init() with the blocks going to sink */
+void dfu_reader_init_sink(struct dfu_reader *rd, struct dfu_if *dif,
+			  enum dfu_engine_addressing addressing,
+			  int xfer_size, unsigned int address,
+			  unsigned int size, struct dfu_sink *sink);
+
+#endif /* DFU_SINK_H */
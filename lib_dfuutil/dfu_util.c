@@ -276,6 +276,9 @@ found_dfu:
 					  libusb_cpu_to_le16(0x0110);
 				}
 				pdfu->bMaxPacketSize0 = desc->bMaxPacketSize0;
+				dfu_poll_init(&pdfu->poll,
+				    (pdfu->quirks & QUIRK_ADAPTIVE_POLL) ?
+				    DFU_POLL_ADAPTIVE : DFU_POLL_REPORTED);
 
 				/* queue into list */
 				pdfu->next = util->dfu_root;
@@ -33,18 +33,23 @@
 #include "dfu_file.h"
 #include "dfuse.h"
 #include "dfuse_mem.h"
+#include "dfu_engine.h"
+#include "dfuse_plan.h"
 
 #define DFU_TIMEOUT 5000
 
 extern int verbose;
-static unsigned int last_erased_page = 1; /* non-aligned value, won't match */
-static struct memsegment *mem_layout;
+static struct memlayout *mem_layout;
+static struct dfuse_erase_plan erase_plan;
+static int erase_plan_pending = 0;
 static unsigned int dfuse_address = 0;
 static unsigned int dfuse_length = 0;
 static int dfuse_force = 0;
 static int dfuse_leave = 0;
 static int dfuse_unprotect = 0;
 static int dfuse_mass_erase = 0;
+static int dfuse_dry_run = 0;
+static int dfuse_delta = 0;
 
 unsigned int quad2uint(unsigned char *p)
 {
@@ -101,6 +106,16 @@ void dfuse_parse_options(const char *options)
 			options += 10;
 			continue;
 		}
+		if (!strncmp(options, "dry-run", endword - options)) {
+			dfuse_dry_run = 1;
+			options += 7;
+			continue;
+		}
+		if (!strncmp(options, "delta", endword - options)) {
+			dfuse_delta = 1;
+			options += 5;
+			continue;
+		}
 
 		/* any valid number is interpreted as upload length */
 		number = strtoul(options, &end, 0);
@@ -173,7 +188,7 @@ int dfuse_special_command(struct dfu_if *dif, unsigned int address,
 	int firstpoll = 1;
 
 	if (command == ERASE_PAGE) {
-		struct memsegment *segment;
+		const struct memsegment *segment;
 		int page_size;
 
 		segment = find_segment(mem_layout, address);
@@ -188,7 +203,6 @@ int dfuse_special_command(struct dfu_if *dif, unsigned int address,
 			       address & ~(page_size - 1));
 		buf[0] = 0x41;	/* Erase command */
 		length = 5;
-		last_erased_page = address & ~(page_size - 1);
 	} else if (command == SET_ADDRESS) {
 		if (verbose > 2)
 			printf("  Setting address pointer to 0x%08x\n",
@@ -236,12 +250,19 @@ int dfuse_special_command(struct dfu_if *dif, unsigned int address,
 			}
 		}
 		/* wait while command is executed */
+		if (command == READ_UNPROTECT) {
+			milli_sleep(dst.bwPollTimeout);
+			return ret;
+		}
+		if (dst.bState != DFU_STATE_dfuDNBUSY)
+			break;
 		if (verbose)
 			printf("   Poll timeout %i ms\n", dst.bwPollTimeout);
-		milli_sleep(dst.bwPollTimeout);
-		if (command == READ_UNPROTECT)
-			return ret;
-	} while (dst.bState == DFU_STATE_dfuDNBUSY);
+		milli_sleep(dfu_poll_next(&dif->poll, dst.bwPollTimeout,
+					  DFU_POLL_DNLOAD));
+	} while (1);
+	dfu_poll_finish(&dif->poll, DFU_POLL_DNLOAD);
+	milli_sleep(dst.bwPollTimeout);
 
 	if (dst.bStatus != DFU_STATUS_OK) {
 		errx(EX_IOERR, "%s not correctly executed",
@@ -270,10 +291,16 @@ int dfuse_dnload_chunk(struct dfu_if *dif, unsigned char *data, int size,
 			errx(EX_IOERR, "Error during download get_status");
 			return ret;
 		}
-		milli_sleep(dst.bwPollTimeout);
-	} while (dst.bState != DFU_STATE_dfuDNLOAD_IDLE &&
-		 dst.bState != DFU_STATE_dfuERROR &&
-		 dst.bState != DFU_STATE_dfuMANIFEST);
+		if (dst.bState == DFU_STATE_dfuDNLOAD_IDLE ||
+		    dst.bState == DFU_STATE_dfuERROR ||
+		    dst.bState == DFU_STATE_dfuMANIFEST)
+			break;
+		milli_sleep(dfu_poll_next(&dif->poll, dst.bwPollTimeout,
+					  DFU_POLL_DNLOAD));
+	} while (1);
+	dfu_poll_finish(&dif->poll, DFU_POLL_DNLOAD);
+	/* the spec wants the last timeout honoured before the next request */
+	milli_sleep(dst.bwPollTimeout);
 
 	if (dst.bState == DFU_STATE_dfuMANIFEST)
 			printf("Transitioning to dfuMANIFEST state\n");
@@ -288,7 +315,7 @@ int dfuse_dnload_chunk(struct dfu_if *dif, unsigned char *data, int size,
 	return bytes_sent;
 }
 
-int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd,
+int dfuse_do_upload(struct dfu_if *dif, int xfer_size, struct dfu_sink *sink,
 		    const char *dfuse_options)
 {
 	int total_bytes = 0;
@@ -297,16 +324,14 @@ int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd,
 	int transaction;
 	int ret;
 
-	buf = dfu_malloc(xfer_size);
-
 	if (dfuse_options)
 		dfuse_parse_options(dfuse_options);
 	if (dfuse_length)
 		upload_limit = dfuse_length;
 	if (dfuse_address) {
-		struct memsegment *segment;
+		const struct memsegment *segment;
 
-		mem_layout = parse_memory_layout((char *)dif->alt_name);
+		mem_layout = parse_memory_layout(dif->alt_name);
 		if (!mem_layout)
 			errx(EX_IOERR, "Failed to parse memory layout");
 
@@ -340,13 +365,24 @@ int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd,
 		/* last chunk can be smaller than original xfer_size */
 		if (upload_limit - total_bytes < xfer_size)
 			xfer_size = upload_limit - total_bytes;
+		/* read straight into where the sink keeps it */
+		buf = dfu_sink_buffer(sink, total_bytes, xfer_size);
+		if (!buf) {
+			warnx("No room for upload data at offset %i", total_bytes);
+			ret = -1;
+			goto out_free;
+		}
 		rc = dfuse_upload(dif, xfer_size, buf, transaction++);
 		if (rc < 0) {
 			ret = rc;
 			goto out_free;
 		}
 
-		dfu_file_write_crc(fd, 0, buf, rc);
+		if (dfu_sink_write(sink, dfuse_address + total_bytes, buf,
+				   rc) < 0) {
+			ret = -1;
+			goto out_free;
+		}
 		total_bytes += rc;
 
 		if (total_bytes < 0)
@@ -369,20 +405,24 @@ int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd,
 	}
 
  out_free:
-	free(buf);
-
 	return ret;
 }
 
+static void dfuse_progress(void *ctx, size_t done, size_t total)
+{
+	if (!verbose)
+		dfu_progress_bar("Download", done, total);
+}
+
 /* Writes an element of any size to the device, taking care of page erases */
 /* returns 0 on success, otherwise -EINVAL */
 int dfuse_dnload_element(struct dfu_if *dif, unsigned int dwElementAddress,
 			 unsigned int dwElementSize, unsigned char *data,
 			 int xfer_size)
 {
-	int p;
-	int ret;
-	struct memsegment *segment;
+	struct dfu_engine_policy policy;
+	struct dfu_engine eng;
+	const struct memsegment *segment;
 
 	/* Check at least that we can write to the last address */
 	segment =
@@ -392,151 +432,81 @@ int dfuse_dnload_element(struct dfu_if *dif, unsigned int dwElementAddress,
 			dwElementAddress + dwElementSize - 1);
 	}
 
-	dfu_progress_bar("Download", 0, 1);
-
-	for (p = 0; p < (int)dwElementSize; p += xfer_size) {
-		int page_size;
-		unsigned int erase_address;
-		unsigned int address = dwElementAddress + p;
-		int chunk_size = xfer_size;
-
-		segment = find_segment(mem_layout, address);
-		if (!segment || !(segment->memtype & DFUSE_WRITEABLE)) {
-			errx(EX_IOERR, "Page at 0x%08x is not writeable",
-				address);
-		}
-		page_size = segment->pagesize;
-
-		/* check if this is the last chunk */
-		if (p + chunk_size > (int)dwElementSize)
-			chunk_size = dwElementSize - p;
-
-		/* Erase only for flash memory downloads */
-		if ((segment->memtype & DFUSE_ERASABLE) && !dfuse_mass_erase) {
-			/* erase all involved pages */
-			for (erase_address = address;
-			     erase_address < address + chunk_size;
-			     erase_address += page_size)
-				if ((erase_address & ~(page_size - 1)) !=
-				    last_erased_page)
-					dfuse_special_command(dif,
-							      erase_address,
-							      ERASE_PAGE);
-
-			if (((address + chunk_size - 1) & ~(page_size - 1)) !=
-			    last_erased_page) {
-				if (verbose > 2)
-					printf(" Chunk extends into next page,"
-					       " erase it as well\n");
-				dfuse_special_command(dif,
-						      address + chunk_size - 1,
-						      ERASE_PAGE);
-			}
-		}
-
-		if (verbose) {
-			printf(" Download from image offset "
-			       "%08x to memory %08x-%08x, size %i\n",
-			       p, address, address + chunk_size - 1,
-			       chunk_size);
+	memset(&policy, 0, sizeof(policy));
+	policy.addressing = DFU_ADDR_DFUSE;
+	policy.finish = DFU_FINISH_NONE;
+	/* The planned erases run before the first element is written */
+	if (erase_plan_pending) {
+		erase_plan_pending = 0;
+		if (erase_plan.mass_erase) {
+			policy.mass_erase = 1;
 		} else {
-			dfu_progress_bar("Download", p, dwElementSize);
-		}
-		
-		dfuse_special_command(dif, address, SET_ADDRESS);
-
-		/* transaction = 2 for no address offset */
-		ret = dfuse_dnload_chunk(dif, data + p, chunk_size, 2);
-		if (ret != chunk_size) {
-			errx(EX_IOERR, "Failed to write whole chunk: "
-				"%i of %i bytes", ret, chunk_size);
-			return -EINVAL;
+			policy.erase_pages = erase_plan.pages;
+			policy.erase_count = erase_plan.count;
 		}
 	}
-	if (!verbose)
-		dfu_progress_bar("Download", dwElementSize, dwElementSize);
+	policy.erase = dfuse_plan_ready;
+	policy.erase_ctx = &erase_plan;
+	policy.progress = dfuse_progress;
+	policy.skip_blank = 1;
+	policy.prefetch = 1;
+
+	dfu_engine_init(&eng, dif, &policy, xfer_size, data, dwElementSize,
+			dwElementAddress);
+	if (dfu_engine_run(&eng) < 0) {
+		errx(EX_IOERR, "Failed to write element: "
+			"%u of %u bytes", eng.bytes_sent, dwElementSize);
+		return -EINVAL;
+	}
 	return 0;
 }
 
-static void
+static int
 dfuse_memcpy(unsigned char *dst, unsigned char **src, int *rem, int size)
 {
 	if (size > *rem) {
-		errx(EX_IOERR, "Corrupt DfuSe file: "
+		warnx("Corrupt DfuSe file: "
 		    "Cannot read %d bytes from %d bytes", size, *rem);
+		return -EINVAL;
 	}
 	if (dst != NULL)
 		memcpy(dst, *src, size);
 	(*src) += size;
 	(*rem) -= size;
+	return 0;
 }
 
-/* Download raw binary file to DfuSe device */
-int dfuse_do_bin_dnload(struct dfu_if *dif, int xfer_size,
-			struct dfu_file *file, unsigned int start_address)
-{
-	unsigned int dwElementAddress;
-	unsigned int dwElementSize;
-	unsigned char *data;
-	int ret;
-
-	dwElementAddress = start_address;
-	dwElementSize = file->size.total -
-	    file->size.suffix - file->size.prefix;
-
-	printf("Downloading to address = 0x%08x, size = %i\n",
-	       dwElementAddress, dwElementSize);
-
-	data = file->firmware + file->size.prefix;
-
-	ret = dfuse_dnload_element(dif, dwElementAddress, dwElementSize, data,
-				   xfer_size);
-	if (ret != 0)
-		goto out_free;
-
-	printf("File downloaded successfully\n");
-	ret = dwElementSize;
-
- out_free:
-	return ret;
-}
-
-/* Parse a DfuSe file and download contents to device */
-int dfuse_do_dfuse_dnload(struct dfu_if *dif, int xfer_size,
-			  struct dfu_file *file)
+/* Walks the images of a DfuSe file (without prefix and suffix) and hands
+ * every element to fn, which stops the walk by returning nonzero. Returns
+ * 0, -EINVAL for a malformed file or the nonzero value of fn. */
+int dfuse_parse_file(unsigned char *data, int rem, int altsetting,
+		     dfuse_element_fn fn, void *ctx)
 {
 	uint8_t dfuprefix[11];
 	uint8_t targetprefix[274];
 	uint8_t elementheader[8];
+	struct dfuse_element el;
 	int image;
 	int element;
 	int bTargets;
-	int bAlternateSetting;
 	int dwNbElements;
-	unsigned int dwElementAddress;
-	unsigned int dwElementSize;
-	uint8_t *data;
 	int ret;
-	int rem;
-	int bFirstAddressSaved = 0;
-
-	rem = file->size.total - file->size.prefix - file->size.suffix;
-	data = file->firmware + file->size.prefix;
 
         /* Must be larger than a minimal DfuSe header and suffix */
 	if (rem < (int)(sizeof(dfuprefix) +
 	    sizeof(targetprefix) + sizeof(elementheader))) {
-		errx(EX_SOFTWARE, "File too small for a DfuSe file");
+		warnx("File too small for a DfuSe file");
+		return -EINVAL;
         }
 
 	dfuse_memcpy(dfuprefix, &data, &rem, sizeof(dfuprefix));
 
 	if (strncmp((char *)dfuprefix, "DfuSe", 5)) {
-		errx(EX_IOERR, "No valid DfuSe signature");
+		warnx("No valid DfuSe signature");
 		return -EINVAL;
 	}
 	if (dfuprefix[5] != 0x01) {
-		errx(EX_IOERR, "DFU format revision %i not supported",
+		warnx("DFU format revision %i not supported",
 			dfuprefix[5]);
 		return -EINVAL;
 	}
@@ -545,49 +515,44 @@ int dfuse_do_dfuse_dnload(struct dfu_if *dif, int xfer_size,
 
 	for (image = 1; image <= bTargets; image++) {
 		printf("parsing DFU image %i\n", image);
-		dfuse_memcpy(targetprefix, &data, &rem, sizeof(targetprefix));
+		if (dfuse_memcpy(targetprefix, &data, &rem, sizeof(targetprefix)))
+			return -EINVAL;
 		if (strncmp((char *)targetprefix, "Target", 6)) {
-			errx(EX_IOERR, "No valid target signature");
+			warnx("No valid target signature");
 			return -EINVAL;
 		}
-		bAlternateSetting = targetprefix[6];
+		el.alt = targetprefix[6];
 		dwNbElements = quad2uint((unsigned char *)targetprefix + 270);
-		printf("image for alternate setting %i, ", bAlternateSetting);
+		printf("image for alternate setting %i, ", el.alt);
 		printf("(%i elements, ", dwNbElements);
 		printf("total size = %i)\n",
 		       quad2uint((unsigned char *)targetprefix + 266));
-		if (bAlternateSetting != dif->altsetting)
+		if (el.alt != altsetting)
 			printf("Warning: Image does not match current alternate"
 			       " setting.\n"
 			       "Please rerun with the correct -a option setting"
 			       " to download this image!\n");
 		for (element = 1; element <= dwNbElements; element++) {
 			printf("parsing element %i, ", element);
-			dfuse_memcpy(elementheader, &data, &rem, sizeof(elementheader));
-			dwElementAddress =
-			    quad2uint((unsigned char *)elementheader);
-			dwElementSize =
-			    quad2uint((unsigned char *)elementheader + 4);
-			printf("address = 0x%08x, ", dwElementAddress);
-			printf("size = %i\n", dwElementSize);
-
-			if (!bFirstAddressSaved) {
-				bFirstAddressSaved = 1;
-				dfuse_address = dwElementAddress;
-			}
+			if (dfuse_memcpy(elementheader, &data, &rem,
+					 sizeof(elementheader)))
+				return -EINVAL;
+			el.address = quad2uint((unsigned char *)elementheader);
+			el.size = quad2uint((unsigned char *)elementheader + 4);
+			el.data = data;
+			printf("address = 0x%08x, ", el.address);
+			printf("size = %i\n", el.size);
+
 			/* sanity check */
-			if ((int)dwElementSize > rem)
-				errx(EX_SOFTWARE, "File too small for element size");
-
-			if (bAlternateSetting == dif->altsetting) {
-				ret = dfuse_dnload_element(dif, dwElementAddress,
-				    dwElementSize, data, xfer_size);
-			} else {
-				ret = 0;
+			if ((int)el.size < 0 || (int)el.size > rem) {
+				warnx("File too small for element size");
+				return -EINVAL;
 			}
 
+			ret = fn(ctx, &el);
+
 			/* advance read pointer */
-			dfuse_memcpy(NULL, &data, &rem, dwElementSize);
+			dfuse_memcpy(NULL, &data, &rem, el.size);
 
 			if (ret != 0)
 				return ret;
@@ -602,6 +567,165 @@ int dfuse_do_dfuse_dnload(struct dfu_if *dif, int xfer_size,
 	return 0;
 }
 
+/* Reads the planned pages back and drops those already holding the image */
+static void dfuse_plan_delta(struct dfu_if *dif, int xfer_size,
+			     struct dfuse_element *elements, int count)
+{
+	struct dfuse_delta delta;
+	struct dfu_reader reader;
+	unsigned int address, size;
+	unsigned char *buf;
+
+	if (dfuse_plan_delta_begin(&delta, &erase_plan, elements, count) < 0) {
+		printf("Image too small for delta flashing, "
+		       "flashing all of it\n");
+		return;
+	}
+	buf = dfu_malloc(xfer_size);
+	while (dfuse_plan_delta_range(&delta, &address, &size)) {
+		if (verbose)
+			printf("Reading back 0x%08x-0x%08x\n", address,
+			       address + size - 1);
+		dfu_reader_init(&reader, dif, DFU_ADDR_DFUSE, xfer_size, buf,
+				address, size, dfuse_plan_compare, &delta);
+		if (dfu_reader_run(&reader) < 0)
+			errx(EX_IOERR, "Reading back for delta flashing "
+			     "failed, try without delta");
+	}
+	free(buf);
+	dfuse_plan_delta_end(&delta);
+}
+
+/* Plans the erases for all elements. Returns 1 in dry-run mode, where
+ * the plan is shown and nothing is written. */
+static int dfuse_plan_elements(struct dfu_if *dif, int xfer_size,
+			       struct dfuse_element *elements, int count)
+{
+	char *report;
+	int len;
+
+	if (dfuse_plan_erase(&erase_plan, mem_layout, elements, count, 0) < 0)
+		errx(EX_IOERR, "Failed to plan page erases");
+	erase_plan_pending = 1;
+	if (dfuse_mass_erase) {
+		/* already done, nothing left to erase */
+		erase_plan.mass_erase = 1;
+		erase_plan_pending = 0;
+	} else if (dfuse_delta) {
+		/* reading changes nothing, so a dry run shows the delta too */
+		dfuse_plan_delta(dif, xfer_size, elements, count);
+	}
+
+	if (verbose || dfuse_dry_run) {
+		len = dfuse_plan_report(&erase_plan, NULL, 0);
+		report = dfu_malloc(len + 1);
+		dfuse_plan_report(&erase_plan, report, len + 1);
+		fputs(report, stdout);
+		free(report);
+	}
+	return dfuse_dry_run;
+}
+
+/* Download raw binary file to DfuSe device */
+int dfuse_do_bin_dnload(struct dfu_if *dif, int xfer_size,
+			struct dfu_file *file, unsigned int start_address)
+{
+	unsigned int dwElementAddress;
+	unsigned int dwElementSize;
+	unsigned char *data;
+	struct dfuse_element element;
+	int ret;
+
+	dwElementAddress = start_address;
+	dwElementSize = file->size.total -
+	    file->size.suffix - file->size.prefix;
+
+	printf("Downloading to address = 0x%08x, size = %i\n",
+	       dwElementAddress, dwElementSize);
+
+	data = file->firmware + file->size.prefix;
+
+	element.address = dwElementAddress;
+	element.size = dwElementSize;
+	element.data = data;
+	element.alt = dif->altsetting;
+	if (dfuse_plan_elements(dif, xfer_size, &element, 1)) {
+		ret = 0;
+		goto out_free;
+	}
+
+	ret = dfuse_dnload_element(dif, dwElementAddress, dwElementSize, data,
+				   xfer_size);
+	if (ret != 0)
+		goto out_free;
+
+	printf("File downloaded successfully\n");
+	ret = dwElementSize;
+
+ out_free:
+	return ret;
+}
+
+struct dfuse_file_dnload {
+	struct dfu_if *dif;
+	struct dfuse_element *elements;
+	int count;
+	int bFirstAddressSaved;
+};
+
+static int dfuse_add_file_element(void *ctx, struct dfuse_element *el)
+{
+	struct dfuse_file_dnload *dl = ctx;
+
+	if (!dl->bFirstAddressSaved) {
+		dl->bFirstAddressSaved = 1;
+		dfuse_address = el->address;
+	}
+	if (el->alt != dl->dif->altsetting)
+		return 0;
+
+	dl->elements = realloc(dl->elements,
+			       (dl->count + 1) * sizeof(*dl->elements));
+	if (!dl->elements)
+		errx(EX_SOFTWARE, "Cannot allocate memory for DfuSe elements");
+	dl->elements[dl->count++] = *el;
+	return 0;
+}
+
+/* Parse a DfuSe file and download contents to device */
+int dfuse_do_dfuse_dnload(struct dfu_if *dif, int xfer_size,
+			  struct dfu_file *file)
+{
+	struct dfuse_file_dnload dl;
+	int element;
+	int ret;
+
+	dl.dif = dif;
+	dl.elements = NULL;
+	dl.count = 0;
+	dl.bFirstAddressSaved = 0;
+
+	ret = dfuse_parse_file(file->firmware + file->size.prefix,
+			       file->size.total - file->size.prefix -
+			       file->size.suffix, dif->altsetting,
+			       dfuse_add_file_element, &dl);
+	if (ret == -EINVAL)
+		errx(EX_IOERR, "Invalid DfuSe file");
+
+	/* all pages are erased up front, then elements written in turn */
+	if (ret == 0 &&
+	    !dfuse_plan_elements(dif, xfer_size, dl.elements, dl.count)) {
+		for (element = 0; element < dl.count && ret == 0; element++) {
+			ret = dfuse_dnload_element(dif,
+			    dl.elements[element].address,
+			    dl.elements[element].size,
+			    dl.elements[element].data, xfer_size);
+		}
+	}
+	free(dl.elements);
+	return ret;
+}
+
 int dfuse_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file,
 		    const char *dfuse_options)
 {
@@ -609,7 +733,8 @@ int dfuse_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file,
 
 	if (dfuse_options)
 		dfuse_parse_options(dfuse_options);
-	mem_layout = parse_memory_layout((char *)dif->alt_name);
+	dfu_poll_begin_session(&dif->poll);
+	mem_layout = parse_memory_layout(dif->alt_name);
 	if (!mem_layout) {
 		errx(EX_IOERR, "Failed to parse memory layout");
 	}
@@ -623,7 +748,7 @@ int dfuse_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file,
 		printf("Device disconnects, erases flash and resets now\n");
 		exit(0);
 	}
-	if (dfuse_mass_erase) {
+	if (dfuse_mass_erase && !dfuse_dry_run) {
 		if (!dfuse_force) {
 			errx(EX_IOERR, "The mass erase command "
 				"can only be used with force");
@@ -645,13 +770,16 @@ int dfuse_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file,
 		}
 		ret = dfuse_do_dfuse_dnload(dif, xfer_size, file);
 	}
-	free_segment_list(mem_layout);
+	dfuse_plan_free(&erase_plan);
+	free_memory_layout(mem_layout);
 
 	dfu_abort_to_idle(dif);
 
-	if (dfuse_leave) {
+	if (dfuse_leave && !dfuse_dry_run) {
 		dfuse_special_command(dif, dfuse_address, SET_ADDRESS);
 		dfuse_dnload_chunk(dif, NULL, 0, 2); /* Zero-size */
 	}
+	if (dif->poll.saved_ms)
+		printf("Adaptive polling saved %llu ms\n", dif->poll.saved_ms);
 	return ret;
 }
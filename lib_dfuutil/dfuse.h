@@ -22,14 +22,27 @@
 #define DFUSE_H
 
 #include "dfu.h"
+#include "dfu_sink.h"
 
 enum dfuse_command { SET_ADDRESS, ERASE_PAGE, MASS_ERASE, READ_UNPROTECT };
 
+/* One element of a DfuSe file, data points into the file */
+struct dfuse_element {
+	unsigned int address;
+	unsigned int size;
+	unsigned char *data;
+	int alt;		/* bAlternateSetting of the image */
+};
+
+typedef int (*dfuse_element_fn)(void *ctx, struct dfuse_element *el);
+
 int dfuse_special_command(struct dfu_if *dif, unsigned int address,
 			  enum dfuse_command command);
-int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd,
+int dfuse_do_upload(struct dfu_if *dif, int xfer_size, struct dfu_sink *sink,
 		    const char *dfuse_options);
 int dfuse_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file,
 		    const char *dfuse_options);
+int dfuse_parse_file(unsigned char *data, int size, int altsetting,
+		     dfuse_element_fn fn, void *ctx);
 
 #endif /* DFUSE_H */
@@ -28,118 +28,162 @@
 #include "dfu_file.h"
 #include "dfuse_mem.h"
 
-int add_segment(struct memsegment **segment_list, struct memsegment segment)
+static int add_segment(struct memlayout *layout, unsigned int *size,
+		       const struct memsegment *segment)
 {
-	struct memsegment *new_element;
-
-	new_element = dfu_malloc(sizeof(struct memsegment));
-	*new_element = segment;
-	new_element->next = NULL;
-
-	if (*segment_list == NULL)
-		/* list can be empty on first call */
-		*segment_list = new_element;
-	else {
-		struct memsegment *next_element;
-
-		/* find last element in list */
-		next_element = *segment_list;
-		while (next_element->next != NULL)
-			next_element = next_element->next;
-		next_element->next = new_element;
+	if (layout->count == *size) {
+		struct memsegment *segments;
+
+		*size = *size ? *size * 2 : 8;
+		segments = realloc(layout->segments,
+				   *size * sizeof(*segments));
+		if (!segments)
+			return -1;
+		layout->segments = segments;
 	}
+	layout->segments[layout->count++] = *segment;
 	return 0;
 }
 
-struct memsegment *find_segment(struct memsegment *segment_list,
-				unsigned int address)
+static int cmp_segment(const void *a, const void *b)
 {
-	while (segment_list != NULL) {
-		if (segment_list->start <= address &&
-		    segment_list->end >= address)
-			return segment_list;
-		segment_list = segment_list->next;
+	const struct memsegment *sa = a;
+	const struct memsegment *sb = b;
+
+	return sa->start < sb->start ? -1 : sa->start > sb->start;
+}
+
+/* Segments don't overlap, so a binary search over the start addresses
+ * finds the one holding address */
+const struct memsegment *find_segment(const struct memlayout *layout,
+				      unsigned int address)
+{
+	unsigned int lo = 0;
+	unsigned int hi = layout ? layout->count : 0;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		const struct memsegment *segment = &layout->segments[mid];
+
+		if (address < segment->start)
+			hi = mid;
+		else if (address > segment->end)
+			lo = mid + 1;
+		else
+			return segment;
 	}
 	return NULL;
 }
 
-void free_segment_list(struct memsegment *segment_list)
+void free_memory_layout(struct memlayout *layout)
 {
-	struct memsegment *next_element;
+	if (!layout)
+		return;
+	free(layout->segments);
+	free(layout);
+}
 
-	while (segment_list->next != NULL) {
-		next_element = segment_list->next;
-		free(segment_list);
-		segment_list = next_element;
+/* Reads a number without sign or leading blanks, returns 0 if there is
+ * no digit at *str */
+static int parse_number(const char **str, unsigned int base,
+			unsigned int *value)
+{
+	const char *p = *str;
+	unsigned int v = 0;
+
+	for (;; p++) {
+		unsigned int digit;
+
+		if (*p >= '0' && *p <= '9')
+			digit = *p - '0';
+		else if (base == 16 && *p >= 'a' && *p <= 'f')
+			digit = *p - 'a' + 10;
+		else if (base == 16 && *p >= 'A' && *p <= 'F')
+			digit = *p - 'A' + 10;
+		else
+			break;
+		v = v * base + digit;
 	}
-	free(segment_list);
+	if (p == *str)
+		return 0;
+	*str = p;
+	*value = v;
+	return 1;
 }
 
 /* Parse memory map from interface descriptor string
- * encoded as per ST document UM0424 section 4.3.2.
+ * encoded as per ST document UM0424 section 4.3.2:
+ *
+ *   @name/0x<address>/<sectors>*<size><multiplier><type>,.../0x<address>/...
+ *
+ * The result is a sorted array for find_segment().
  */
-struct memsegment *parse_memory_layout(char *intf_desc)
+struct memlayout *parse_memory_layout(const char *intf_desc)
 {
-
-	char multiplier, memtype;
-	unsigned int address;
-	int sectors, size;
-	char *name, *typestring;
-	int ret;
+	struct memlayout *layout;
+	const char *name, *p;
+	int name_len;
+	int feature_quirk;
+	unsigned int size = 0;
 	int count = 0;
-	char separator;
-	int scanned;
-	struct memsegment *segment_list = NULL;
-	struct memsegment segment;
 
-	name = dfu_malloc(strlen(intf_desc));
-
-	ret = sscanf(intf_desc, "@%[^/]%n", name, &scanned);
-	if (ret < 1) {
-		free(name);
-		warnx("Could not read name, sscanf returned %d", ret);
+	if (intf_desc[0] != '@' || !intf_desc[1] || intf_desc[1] == '/') {
+		warnx("Could not read name of \"%s\"", intf_desc);
 		return NULL;
 	}
-	printf("DfuSe interface name: \"%s\"\n", name);
-
-	intf_desc += scanned;
-	typestring = dfu_malloc(strlen(intf_desc));
-
-	while (ret = sscanf(intf_desc, "/0x%x/%n", &address, &scanned),
-	       ret > 0) {
-
-		intf_desc += scanned;
-		while (ret = sscanf(intf_desc, "%d*%d%c%[^,/]%n",
-				    &sectors, &size, &multiplier, typestring,
-				    &scanned), ret > 2) {
-			intf_desc += scanned;
-
+	name = intf_desc + 1;
+	name_len = (int)strcspn(name, "/");
+	printf("DfuSe interface name: \"%.*s\"\n", name_len, name);
+	/* Quirk for STM32F4 devices */
+	feature_quirk = name_len == 14 && !strncmp(name, "Device Feature", 14);
+
+	layout = dfu_malloc(sizeof(*layout));
+	layout->segments = NULL;
+	layout->count = 0;
+
+	p = name + name_len;
+	while (p[0] == '/' && p[1] == '0' && (p[2] == 'x' || p[2] == 'X')) {
+		unsigned int address;
+
+		p += 3;
+		if (!parse_number(&p, 16, &address) || *p != '/')
+			break;
+		p++;
+
+		for (;;) {
+			struct memsegment segment;
+			unsigned int sectors, pagesize;
+			char multiplier, memtype = 0;
+			size_t type_len;
+
+			if (!parse_number(&p, 10, &sectors) || *p != '*')
+				break;
+			p++;
+			if (!parse_number(&p, 10, &pagesize) || !*p)
+				break;
+			multiplier = *p++;
 			count++;
-			memtype = 0;
-			if (ret == 4) {
-				if (strlen(typestring) == 1
-				    && typestring[0] != '/')
-					memtype = typestring[0];
-				else {
-					warnx("Parsing type identifier '%s' "
-						"failed for segment %i",
-						typestring, count);
-					continue;
-				}
-			}
 
-			/* Quirk for STM32F4 devices */
-			if (strcmp(name, "Device Feature") == 0)
+			type_len = strcspn(p, ",/");
+			if (type_len == 1)
+				memtype = *p;
+			else if (type_len)
+				warnx("Parsing type identifier '%.*s' "
+				      "failed for segment %i",
+				      (int)type_len, p, count);
+			p += type_len;
+
+			if (feature_quirk)
 				memtype = 'e';
 
 			switch (multiplier) {
 			case 'B':
 				break;
 			case 'K':
-				size *= 1024;
+				pagesize *= 1024;
 				break;
 			case 'M':
-				size *= 1024 * 1024;
+				pagesize *= 1024 * 1024;
 				break;
 			case 'a':
 			case 'b':
@@ -148,7 +192,7 @@ struct memsegment *parse_memory_layout(char *intf_desc)
 			case 'e':
 			case 'f':
 			case 'g':
-				if (!memtype) {
+				if (!memtype && type_len <= 1) {
 					warnx("Non-valid multiplier '%c', "
 						"interpreted as type "
 						"identifier instead",
@@ -163,36 +207,41 @@ struct memsegment *parse_memory_layout(char *intf_desc)
 			}
 
 			if (!memtype) {
-				warnx("No valid type for segment %d\n", count);
-				continue;
+				if (type_len <= 1)
+					warnx("No valid type for segment %d",
+					      count);
+			} else if (sectors && pagesize) {
+				segment.start = address;
+				segment.end = address + sectors * pagesize - 1;
+				segment.pagesize = pagesize;
+				segment.memtype = memtype & 7;
+				if (add_segment(layout, &size, &segment) < 0) {
+					free_memory_layout(layout);
+					return NULL;
+				}
+
+				if (verbose)
+					printf("Memory segment at 0x%08x "
+					       "%3d x %4d = %5d (%s%s%s)\n",
+					       address, sectors, pagesize,
+					       sectors * pagesize,
+					       memtype & DFUSE_READABLE  ? "r" : "",
+					       memtype & DFUSE_ERASABLE  ? "e" : "",
+					       memtype & DFUSE_WRITEABLE ? "w" : "");
 			}
+			address += sectors * pagesize;
 
-			segment.start = address;
-			segment.end = address + sectors * size - 1;
-			segment.pagesize = size;
-			segment.memtype = memtype & 7;
-			add_segment(&segment_list, segment);
-
-			if (verbose)
-				printf("Memory segment at 0x%08x %3d x %4d = "
-				       "%5d (%s%s%s)\n",
-				       address, sectors, size, sectors * size,
-				       memtype & DFUSE_READABLE  ? "r" : "",
-				       memtype & DFUSE_ERASABLE  ? "e" : "",
-				       memtype & DFUSE_WRITEABLE ? "w" : "");
-
-			address += sectors * size;
-
-			separator = *intf_desc;
-			if (separator == ',')
-				intf_desc += 1;
-			else
+			if (*p != ',')
 				break;
-		}	/* while per segment */
+			p++;
+		}	/* per segment */
+	}		/* per address */
 
-	}		/* while per address */
-	free(name);
-	free(typestring);
-
-	return segment_list;
+	if (!layout->count) {
+		free_memory_layout(layout);
+		return NULL;
+	}
+	qsort(layout->segments, layout->count, sizeof(*layout->segments),
+	      cmp_segment);
+	return layout;
 }
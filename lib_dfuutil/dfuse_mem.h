@@ -30,15 +30,19 @@ struct memsegment {
 	unsigned int end;
 	int pagesize;
 	int memtype;
-	struct memsegment *next;
 };
 
-int add_segment(struct memsegment **list, struct memsegment new_element);
+/* Segments of one alternate setting, sorted by start address */
+struct memlayout {
+	struct memsegment *segments;
+	unsigned int count;
+};
 
-struct memsegment *find_segment(struct memsegment *list, unsigned int address);
+const struct memsegment *find_segment(const struct memlayout *layout,
+				      unsigned int address);
 
-void free_segment_list(struct memsegment *list);
+void free_memory_layout(struct memlayout *layout);
 
-struct memsegment *parse_memory_layout(char *intf_desc_str);
+struct memlayout *parse_memory_layout(const char *intf_desc_str);
 
 #endif /* DFUSE_MEM_H */
@@ -0,0 +1,404 @@
+/*
+ * DfuSe erase planner
+ *
+ * Deciding per chunk which pages to erase, as dfu-util did, erases a page
+ * again whenever elements are not written in address order or share a
+ * page. The planner looks at all elements up front and computes each page
+ * exactly once, so the erases can run before anything is written and the
+ * plan can be shown without touching the device.
+ *
+ * For delta flashing the planned pages are read back and compared with
+ * the image first. Pages already holding their part of the image are
+ * neither erased nor written.
+ *
+ * SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+ * SPDX-License-Identifier: GPL2.0-or-later
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "portable.h"
+#include "dfu_engine.h"
+#include "dfuse_plan.h"
+
+static int cmp_page(const void *a, const void *b)
+{
+	unsigned int pa = *(const unsigned int *)a;
+	unsigned int pb = *(const unsigned int *)b;
+
+	return pa < pb ? -1 : pa > pb;
+}
+
+static int add_page(struct dfuse_erase_plan *plan, unsigned int *size,
+		    unsigned int page)
+{
+	if (plan->count == *size) {
+		unsigned int *pages;
+
+		*size = *size ? *size * 2 : 64;
+		pages = realloc(plan->pages, *size * sizeof(*pages));
+		if (!pages)
+			return -1;
+		plan->pages = pages;
+	}
+	plan->pages[plan->count++] = page;
+	return 0;
+}
+
+static int planned(const struct dfuse_erase_plan *plan, unsigned int page)
+{
+	return bsearch(&page, plan->pages, plan->count, sizeof(*plan->pages),
+		       cmp_page) != NULL;
+}
+
+static int kept(const struct dfuse_erase_plan *plan, unsigned int page)
+{
+	return plan->kept_count &&
+	       bsearch(&page, plan->kept, plan->kept_count,
+		       sizeof(*plan->kept), cmp_page) != NULL;
+}
+
+static unsigned int page_size(const struct dfuse_erase_plan *plan,
+			      unsigned int page)
+{
+	return find_segment(plan->layout, page)->pagesize;
+}
+
+/* Index of the planned page holding address, or -1 */
+static int page_index(const struct dfuse_erase_plan *plan,
+		      unsigned int address)
+{
+	unsigned int lo = 0;
+	unsigned int hi = plan->count;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (plan->pages[mid] <= address)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo || address - plan->pages[lo - 1] >=
+		   page_size(plan, plan->pages[lo - 1]))
+		return -1;
+	return lo - 1;
+}
+
+int dfuse_plan_erase(struct dfuse_erase_plan *plan,
+		     const struct memlayout *layout,
+		     const struct dfuse_element *elements, int count,
+		     int allow_mass_erase)
+{
+	const struct memsegment *segment;
+	unsigned int size = 0;
+	unsigned int i, n;
+	int e;
+
+	memset(plan, 0, sizeof(*plan));
+	plan->layout = layout;
+
+	for (e = 0; e < count; e++) {
+		unsigned int address = elements[e].address;
+		unsigned int end = address + elements[e].size;
+
+		while (address < end) {
+			unsigned int page;
+
+			segment = find_segment(layout, address);
+			if (!segment || !(segment->memtype & DFUSE_WRITEABLE)) {
+				warnx("Page at 0x%08x is not writeable", address);
+				goto fail;
+			}
+			if (segment->pagesize <= 0 ||
+			    !(segment->memtype & DFUSE_ERASABLE)) {
+				if (segment->end >= end - 1)
+					break;
+				address = segment->end + 1;
+				continue;
+			}
+			page = address & ~(segment->pagesize - 1);
+			if (add_page(plan, &size, page) < 0)
+				goto fail;
+			if (page + segment->pagesize < page)
+				break;	/* top of the address space */
+			address = page + segment->pagesize;
+		}
+	}
+
+	/* sort and drop pages shared by elements */
+	qsort(plan->pages, plan->count, sizeof(*plan->pages), cmp_page);
+	for (i = 0, n = 0; i < plan->count; i++) {
+		if (n && plan->pages[n - 1] == plan->pages[i])
+			continue;
+		plan->pages[n++] = plan->pages[i];
+	}
+	plan->count = n;
+
+	for (i = 0; i < plan->count; i++) {
+		segment = find_segment(layout, plan->pages[i]);
+		plan->bytes += segment->pagesize;
+	}
+	for (i = 0; i < layout->count; i++) {
+		segment = &layout->segments[i];
+		if (segment->memtype & DFUSE_ERASABLE)
+			plan->flash_bytes += segment->end - segment->start + 1;
+	}
+
+	plan->page_cost_ms = plan->count * DFUSE_CMD_COST_MS +
+			     plan->bytes / 1024 * DFUSE_PAGE_COST_MS_PER_KB;
+	plan->mass_cost_ms = DFUSE_CMD_COST_MS +
+			     plan->flash_bytes / 1024 * DFUSE_MASS_COST_MS_PER_KB;
+	if (plan->count && plan->mass_cost_ms < plan->page_cost_ms &&
+	    (allow_mass_erase || plan->bytes == plan->flash_bytes))
+		plan->mass_erase = 1;
+	return 0;
+
+fail:
+	dfuse_plan_free(plan);
+	return -1;
+}
+
+void dfuse_plan_free(struct dfuse_erase_plan *plan)
+{
+	free(plan->pages);
+	free(plan->kept);
+	plan->pages = NULL;
+	plan->count = 0;
+	plan->kept = NULL;
+	plan->kept_count = 0;
+}
+
+int dfuse_plan_delta_begin(struct dfuse_delta *delta,
+			   struct dfuse_erase_plan *plan,
+			   const struct dfuse_element *elements, int count)
+{
+	unsigned long long image = 0;
+	unsigned int i;
+	int e;
+
+	memset(delta, 0, sizeof(*delta));
+	delta->plan = plan;
+	delta->elements = elements;
+	delta->count = count;
+
+	for (e = 0; e < count; e++)
+		image += elements[e].size;
+	if (!plan->count || image < DFUSE_DELTA_MIN_BYTES)
+		return -1;
+	delta->changed = calloc(plan->count, 1);
+	if (!delta->changed)
+		return -1;
+
+	/* what can't be read back is always rewritten */
+	for (i = 0; i < plan->count; i++) {
+		const struct memsegment *segment;
+
+		segment = find_segment(plan->layout, plan->pages[i]);
+		if (!(segment->memtype & DFUSE_READABLE)) {
+			delta->changed[i] = 1;
+			delta->changed_bytes += segment->pagesize;
+		}
+	}
+	/* a mass erase would defeat the purpose */
+	plan->mass_erase = 0;
+	return 0;
+}
+
+int dfuse_plan_delta_range(struct dfuse_delta *delta, unsigned int *address,
+			   unsigned int *size)
+{
+	const struct dfuse_erase_plan *plan = delta->plan;
+	unsigned int i = delta->next_page;
+	unsigned int end;
+
+	if (delta->full)
+		return 0;
+	while (i < plan->count && delta->changed[i])
+		i++;
+	if (i >= plan->count) {
+		delta->next_page = i;
+		return 0;
+	}
+
+	/* one readback per run of adjacent pages */
+	*address = plan->pages[i];
+	end = *address + page_size(plan, *address);
+	for (i++; i < plan->count && !delta->changed[i] &&
+		  plan->pages[i] == end; i++)
+		end += page_size(plan, end);
+	*size = end - *address;
+	delta->next_page = i;
+	return 1;
+}
+
+int dfuse_plan_compare(void *ctx, unsigned int address,
+		       const unsigned char *data, unsigned int len)
+{
+	struct dfuse_delta *delta = ctx;
+	const struct dfuse_erase_plan *plan = delta->plan;
+	unsigned int end = address + len;
+	int e;
+
+	for (e = 0; e < delta->count; e++) {
+		const struct dfuse_element *el = &delta->elements[e];
+		unsigned int el_end = el->address + el->size;
+		unsigned int lo = address > el->address ? address : el->address;
+		unsigned int hi = end < el_end ? end : el_end;
+
+		while (lo < hi) {
+			int i = page_index(plan, lo);
+			unsigned int stop;
+
+			if (i < 0)
+				break;
+			stop = plan->pages[i] + page_size(plan, plan->pages[i]);
+			if (stop > hi || stop < lo)
+				stop = hi;
+			if (!delta->changed[i] &&
+			    memcmp(data + (lo - address),
+				   el->data + (lo - el->address), stop - lo)) {
+				delta->changed[i] = 1;
+				delta->changed_bytes +=
+				    page_size(plan, plan->pages[i]);
+			}
+			lo = stop;
+		}
+	}
+
+	if (delta->changed_bytes * 2 > plan->bytes) {
+		delta->full = 1;
+		return 1;
+	}
+	return 0;
+}
+
+void dfuse_plan_delta_end(struct dfuse_delta *delta)
+{
+	struct dfuse_erase_plan *plan = delta->plan;
+	unsigned int i, n, k;
+
+	if (delta->full || !delta->changed) {
+		printf("Delta: flashing all %u pages\n", plan->count);
+		goto out;
+	}
+
+	plan->kept = malloc(plan->count * sizeof(*plan->kept));
+	if (!plan->kept)
+		goto out;
+	for (i = 0, n = 0, k = 0; i < plan->count; i++) {
+		unsigned int page = plan->pages[i];
+
+		if (delta->changed[i]) {
+			plan->pages[n++] = page;
+			continue;
+		}
+		plan->kept[k++] = page;
+		plan->bytes -= page_size(plan, page);
+	}
+	plan->count = n;
+	plan->kept_count = k;
+	plan->page_cost_ms = plan->count * DFUSE_CMD_COST_MS +
+			     plan->bytes / 1024 * DFUSE_PAGE_COST_MS_PER_KB;
+	printf("Delta: %u pages changed, %u unchanged\n", n, k);
+
+ out:
+	free(delta->changed);
+	delta->changed = NULL;
+}
+
+int dfuse_plan_report(const struct dfuse_erase_plan *plan, char *buf,
+		      size_t len)
+{
+	size_t used = 0;
+	unsigned int i;
+	int ret;
+
+	ret = snprintf(buf, len, "Erase plan: %u pages, %llu of %llu bytes, "
+		       "page erase %llu ms, mass erase %llu ms, using %s\n",
+		       plan->count, plan->bytes, plan->flash_bytes,
+		       plan->page_cost_ms, plan->mass_cost_ms,
+		       plan->mass_erase ? "mass erase" : "page erase");
+	if (ret >= 0 && plan->kept_count) {
+		used += ret;
+		ret = snprintf(buf + (used < len ? used : len),
+			       used < len ? len - used : 0,
+			       "%u unchanged pages are left as they are\n",
+			       plan->kept_count);
+	}
+	if (ret < 0)
+		return ret;
+	used += ret;
+
+	for (i = 0; i < plan->count; i++) {
+		const struct memsegment *segment;
+
+		segment = find_segment(plan->layout, plan->pages[i]);
+		ret = snprintf(buf + (used < len ? used : len),
+			       used < len ? len - used : 0,
+			       "  0x%08x %6i bytes\n",
+			       plan->pages[i], segment->pagesize);
+		if (ret < 0)
+			return ret;
+		used += ret;
+	}
+	return (int)used;
+}
+
+int dfuse_plan_ready(void *ctx, unsigned int address, unsigned int *len,
+		     unsigned int *page)
+{
+	struct dfuse_erase_plan *plan = ctx;
+	unsigned int start = address;
+	unsigned int end = address + *len;
+	int result = DFU_ERASE_BLANK;
+	int unchanged = -1;	/* whether the pages so far were kept */
+
+	while (address < end) {
+		const struct memsegment *segment;
+		unsigned int page_start;
+		int is_kept;
+
+		segment = find_segment(plan->layout, address);
+		if (!segment || !(segment->memtype & DFUSE_WRITEABLE)) {
+			warnx("Page at 0x%08x is not writeable", address);
+			return DFU_ERASE_FAIL;
+		}
+		if (segment->pagesize <= 0 ||
+		    !(segment->memtype & DFUSE_ERASABLE)) {
+			/* e.g. RAM, written as is */
+			if (unchanged == 1)
+				goto cut;
+			unchanged = 0;
+			result = DFU_ERASE_WRITE;
+			if (segment->end >= end - 1)
+				break;
+			address = segment->end + 1;
+			continue;
+		}
+
+		page_start = address & ~(segment->pagesize - 1);
+		is_kept = !plan->mass_erase && kept(plan, page_start);
+		if (!is_kept && !plan->mass_erase &&
+		    !planned(plan, page_start)) {
+			warnx("Page at 0x%08x is not in the erase plan",
+			      page_start);
+			return DFU_ERASE_FAIL;
+		}
+		/* kept pages are not written, split the chunk there */
+		if (unchanged >= 0 && unchanged != is_kept)
+			goto cut;
+		unchanged = is_kept;
+		if (page_start + segment->pagesize < page_start)
+			break;	/* top of the address space */
+		address = page_start + segment->pagesize;
+	}
+	(void)page;
+	return unchanged == 1 ? DFU_ERASE_SKIP : result;
+
+ cut:
+	*len = address - start;
+	return unchanged == 1 ? DFU_ERASE_SKIP : result;
+}
@@ -0,0 +1,85 @@
+/*
+ * DfuSe erase planner
+ *
+ * SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+ * SPDX-License-Identifier: GPL2.0-or-later
+ */
+
+#ifndef DFUSE_PLAN_H
+#define DFUSE_PLAN_H
+
+#include <stddef.h>
+
+#include "dfu_file.h"
+#include "dfuse.h"
+#include "dfuse_mem.h"
+
+/* Cost model of the planner, in milliseconds. Page erase time grows with
+ * the sector size, a mass erase is cheaper per KiB but wipes everything. */
+#define DFUSE_CMD_COST_MS		5	/* one DNLOAD + GETSTATUS */
+#define DFUSE_PAGE_COST_MS_PER_KB	20
+#define DFUSE_MASS_COST_MS_PER_KB	12
+
+/* Delta flashing reads the planned pages back first. Below this size a
+ * full flash is about as fast, and once more than half of the planned
+ * bytes differ the rest of the readback is not worth it either. */
+#define DFUSE_DELTA_MIN_BYTES		(16 * 1024)
+
+struct dfuse_erase_plan {
+	const struct memlayout *layout;
+	unsigned int *pages;		/* sorted page start addresses */
+	unsigned int count;
+	unsigned long long bytes;	/* bytes in the planned pages */
+	unsigned long long flash_bytes;	/* erasable bytes of the layout */
+	unsigned long long page_cost_ms;
+	unsigned long long mass_cost_ms;
+	int mass_erase;			/* one mass erase instead of pages */
+	unsigned int *kept;		/* delta: sorted pages left as they are */
+	unsigned int kept_count;
+};
+
+/* State of a delta comparison, see dfuse_plan_delta_begin() */
+struct dfuse_delta {
+	struct dfuse_erase_plan *plan;
+	const struct dfuse_element *elements;
+	int count;
+	unsigned char *changed;		/* per page of plan->pages */
+	unsigned long long changed_bytes;
+	unsigned int next_page;		/* where the next readback range starts */
+	int full;			/* gave up, flash everything */
+};
+
+/* Computes the pages touched by the elements. Mass erase is chosen when it
+ * is cheaper and either allowed or wiping nothing the image doesn't cover.
+ * Returns 0, or -1 if an element is not writeable. */
+int dfuse_plan_erase(struct dfuse_erase_plan *plan,
+		     const struct memlayout *layout,
+		     const struct dfuse_element *elements, int count,
+		     int allow_mass_erase);
+void dfuse_plan_free(struct dfuse_erase_plan *plan);
+
+/* Writes a readable description of the plan, returns its length like
+ * snprintf() */
+int dfuse_plan_report(const struct dfuse_erase_plan *plan, char *buf,
+		      size_t len);
+
+/* Delta flashing. begin() returns -1 when a full flash is the better
+ * choice, otherwise the pages handed out by dfuse_plan_delta_range() are
+ * read back into dfuse_plan_compare(), a dfu_read_sink. end() drops the
+ * unchanged pages from the plan, moving them to plan->kept, unless the
+ * comparison gave up. dfuse_plan_ready() then splits chunks at the
+ * kept pages and skips those parts. */
+int dfuse_plan_delta_begin(struct dfuse_delta *delta,
+			   struct dfuse_erase_plan *plan,
+			   const struct dfuse_element *elements, int count);
+int dfuse_plan_delta_range(struct dfuse_delta *delta, unsigned int *address,
+			   unsigned int *size);
+int dfuse_plan_compare(void *ctx, unsigned int address,
+		       const unsigned char *data, unsigned int len);
+void dfuse_plan_delta_end(struct dfuse_delta *delta);
+
+/* dfu_engine erase policy checking writes against the executed plan */
+int dfuse_plan_ready(void *ctx, unsigned int address, unsigned int *len,
+		     unsigned int *page);
+
+#endif /* DFUSE_PLAN_H */
@@ -17,6 +17,7 @@
 # include <unistd.h>
 #endif /* HAVE_UNISTD_H */
 
+/* milli_time() is a monotonic clock in milliseconds, for deadlines */
 #ifdef HAVE_NANOSLEEP
 # include <time.h>
 # define milli_sleep(msec) do {\
@@ -24,11 +25,18 @@
     struct timespec nanosleepDelay = { (msec) / 1000, ((msec) % 1000) * 1000000 };\
     nanosleep(&nanosleepDelay, NULL);\
   } } while (0)
+static inline unsigned long long milli_time(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 #elif defined HAVE_WINDOWS_H
 # define milli_sleep(msec) do {\
   if (msec) {\
     Sleep(msec);\
   } } while (0)
+# define milli_time() ((unsigned long long)GetTickCount64())
 #else
 # error "Can't get no sleep! Please report"
 #endif /* HAVE_NANOSLEEP */
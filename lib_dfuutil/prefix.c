@@ -153,7 +153,7 @@ int main(int argc, char **argv)
 		break;
 
 	case MODE_CHECK:
-		dfu_load_file(&file, MAYBE_SUFFIX, MAYBE_PREFIX);
+		dfu_map_file(&file, MAYBE_SUFFIX, MAYBE_PREFIX);
 		show_suffix_and_prefix(&file);
 		if (type > ZERO_PREFIX && file.prefix_type != type)
 			errx(EX_IOERR, "No prefix of requested type");
@@ -21,9 +21,43 @@
 #include <stdint.h>
 #include "quirks.h"
 
+static struct {
+	uint16_t vendor;
+	uint16_t product;
+} adaptive_poll_devices[MAX_ADAPTIVE_POLL_DEVICES];
+static int num_adaptive_poll_devices = 0;
+
+/* Select (or deselect) adaptive status polling for a vid/pid, it takes
+ * effect for devices probed afterwards. Returns -1 if the table is full. */
+int set_adaptive_poll(uint16_t vendor, uint16_t product, int enable)
+{
+	int i;
+
+	for (i = 0; i != num_adaptive_poll_devices; i++) {
+		if (adaptive_poll_devices[i].vendor == vendor &&
+		    adaptive_poll_devices[i].product == product)
+			break;
+	}
+	if (!enable) {
+		if (i != num_adaptive_poll_devices)
+			adaptive_poll_devices[i] =
+			    adaptive_poll_devices[--num_adaptive_poll_devices];
+		return 0;
+	}
+	if (i != num_adaptive_poll_devices)
+		return 0;
+	if (num_adaptive_poll_devices == MAX_ADAPTIVE_POLL_DEVICES)
+		return -1;
+	adaptive_poll_devices[i].vendor = vendor;
+	adaptive_poll_devices[i].product = product;
+	num_adaptive_poll_devices++;
+	return 0;
+}
+
 uint16_t get_quirks(uint16_t vendor, uint16_t product, uint16_t bcdDevice)
 {
 	uint16_t quirks = 0;
+	int i;
 
 	/* Device returns bogus bwPollTimeout values */
 	if ((vendor == VENDOR_OPENMOKO || vendor == VENDOR_FIC) &&
@@ -52,5 +86,12 @@ uint16_t get_quirks(uint16_t vendor, uint16_t product, uint16_t bcdDevice)
 	    product == PRODUCT_TRANSIT)
 		quirks |= QUIRK_POLLTIMEOUT;
 
+	/* Devices known to over-report bwPollTimeout, poll them early */
+	for (i = 0; i != num_adaptive_poll_devices; i++) {
+		if (adaptive_poll_devices[i].vendor == vendor &&
+		    adaptive_poll_devices[i].product == product)
+			quirks |= QUIRK_ADAPTIVE_POLL;
+	}
+
 	return (quirks);
 }
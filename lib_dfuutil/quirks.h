@@ -18,10 +18,15 @@
 
 #define QUIRK_POLLTIMEOUT  (1<<0)
 #define QUIRK_FORCE_DFU11  (1<<1)
+#define QUIRK_ADAPTIVE_POLL (1<<2)
+
+/* Room for devices selected for adaptive polling at run time */
+#define MAX_ADAPTIVE_POLL_DEVICES 16
 
 /* Fallback value, works for OpenMoko */
 #define DEFAULT_POLLTIMEOUT  5
 
 uint16_t get_quirks(uint16_t vendor, uint16_t product, uint16_t bcdDevice);
+int set_adaptive_poll(uint16_t vendor, uint16_t product, int enable);
 
 #endif /* DFU_QUIRKS_H */
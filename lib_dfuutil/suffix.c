@@ -157,7 +157,7 @@ int main(int argc, char **argv)
 		break;
 
 	case MODE_CHECK:
-		dfu_load_file(&file, NEEDS_SUFFIX, MAYBE_PREFIX);
+		dfu_map_file(&file, NEEDS_SUFFIX, MAYBE_PREFIX);
 		show_suffix_and_prefix(&file);
 		break;
 
@@ -0,0 +1,119 @@
+/*
+ * dfu_crc32 known answer test
+ *
+ * Compares every path of dfu_crc32.c with a bit at a time CRC32, over
+ * lengths 0 to 300 starting at several alignments. The file is included
+ * so the paths the CPU has can be forced one at a time.
+ *
+ * SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+ * SPDX-License-Identifier: GPL2.0-or-later
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "dfu_crc32.c"
+
+#define MAX_LEN 300
+
+static const size_t s_alignments[] = { 0, 1, 2, 3, 4, 7, 8, 13, 15 };
+
+static int s_failures = 0;
+
+static void check(int ok, const char *what, size_t align, size_t len)
+{
+	if (!ok) {
+		printf("FAILED: %s, %u bytes at offset %u\n", what,
+		       (unsigned int)len, (unsigned int)align);
+		s_failures++;
+	}
+}
+
+/* The CRC32 of the DFU spec one bit at a time, no pre or post inversion
+ * like dfu_crc32() */
+static uint32_t reference(uint32_t crc, const uint8_t *p, size_t size)
+{
+	int i;
+
+	for (; size; size--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+	}
+	return crc;
+}
+
+/* Runs dfu_crc32() over every length and alignment with the paths left
+ * enabled */
+static void test_lengths(const char *what, const uint8_t *buf)
+{
+	size_t a, len;
+
+	for (a = 0; a < sizeof(s_alignments) / sizeof(s_alignments[0]); a++) {
+		const uint8_t *p = buf + s_alignments[a];
+
+		for (len = 0; len <= MAX_LEN; len++) {
+			check(dfu_crc32(0xffffffff, p, len) ==
+			      reference(0xffffffff, p, len), what,
+			      s_alignments[a], len);
+			/* a running CRC is carried on, not restarted */
+			check(dfu_crc32(0x12345678, p, len) ==
+			      reference(0x12345678, p, len), what,
+			      s_alignments[a], len);
+		}
+	}
+}
+
+int main(void)
+{
+	static uint8_t buf[MAX_LEN + 16];
+	uint32_t seed = 1;
+	size_t i;
+
+	for (i = 0; i < sizeof(buf); i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+	/* the reference itself against the well known check value */
+	check((reference(0xffffffff, (const uint8_t *)"123456789", 9) ^
+	       0xffffffff) == 0xcbf43926, "reference check value", 0, 9);
+
+	/* sets up the tables and finds what the CPU has */
+	dfu_crc32(0, buf, 0);
+
+#ifdef CRC32_CLMUL
+	if (crc32_clmul_ok) {
+		size_t a, len;
+
+		test_lengths("PCLMULQDQ from 256 bytes", buf);
+		/* the folding itself, below the size dfu_crc32() uses it */
+		for (a = 0; a < sizeof(s_alignments) / sizeof(s_alignments[0]);
+		     a++) {
+			const uint8_t *p = buf + s_alignments[a];
+
+			for (len = 64; len <= MAX_LEN; len += 16)
+				check(crc32_clmul(0xffffffff, p, len) ==
+				      reference(0xffffffff, p, len),
+				      "PCLMULQDQ", s_alignments[a], len);
+		}
+	} else {
+		printf("No PCLMULQDQ, only slice-by-16 is tested\n");
+	}
+	crc32_clmul_ok = 0;
+#endif
+#ifdef CRC32_ARMV8
+	if (crc32_armv8_ok)
+		test_lengths("ARMv8 CRC32", buf);
+	else
+		printf("No ARMv8 CRC32, only slice-by-16 is tested\n");
+	crc32_armv8_ok = 0;
+#endif
+	test_lengths("slice-by-16", buf);
+
+	if (s_failures) {
+		printf("%d checks failed\n", s_failures);
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,341 @@
+/*
+ * dfu_engine deadline test
+ *
+ * Runs the engine against a fake device, the libusb transfers of dfu.c and
+ * the polling of dfu_poll.c are replaced below. The device takes every
+ * block at once, counts the DfuSe commands it gets, spends as long in
+ * manifestation as the test asks and reads back what the test gives it.
+ *
+ * SPDX-FileCopyrightText: 2020 Bloomberg Finance LP
+ * SPDX-License-Identifier: GPL2.0-or-later
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "libusb.h"
+
+#include "portable.h"
+#include "dfu.h"
+#include "usb_dfu.h"
+#include "dfu_engine.h"
+
+int verbose = 0;
+
+static int s_failures = 0;
+
+/* The fake device */
+static int s_manifesting;
+static unsigned long long s_manifestStart;
+static unsigned int s_manifestMs;	/* time spent in dfuMANIFEST */
+static unsigned int s_pollTimeout;	/* bwPollTimeout while manifesting */
+static unsigned int s_statusMs;		/* time GETSTATUS takes to answer */
+static int s_aborts;
+static int s_erases;			/* DfuSe 0x41 commands */
+static int s_addresses;			/* DfuSe 0x21 commands */
+static const unsigned char *s_readBack;	/* what UPLOAD returns, NULL for
+					 * a failing UPLOAD */
+static unsigned int s_readSize;
+static unsigned int s_readOffset;
+
+int dfu_download(libusb_device_handle *device, const unsigned short interface,
+		 const unsigned short length, const unsigned short transaction,
+		 unsigned char *data)
+{
+	/* DfuSe commands are wBlockNum 0, the image ends with a zero sized
+	 * request */
+	if (!transaction && length && data[0] == 0x41)
+		s_erases++;
+	if (!transaction && length && data[0] == 0x21)
+		s_addresses++;
+	if (!length) {
+		s_manifesting = 1;
+		s_manifestStart = milli_time();
+	}
+	return length;
+}
+
+int dfu_upload(libusb_device_handle *device, const unsigned short interface,
+	       const unsigned short length, const unsigned short transaction,
+	       unsigned char *data)
+{
+	unsigned int len = s_readSize - s_readOffset;
+
+	if (!s_readBack)
+		return -1;
+	if (len > length)
+		len = length;
+	memcpy(data, s_readBack + s_readOffset, len);
+	s_readOffset += len;
+	return len;
+}
+
+int dfu_get_status(struct dfu_if *dif, struct dfu_status *status)
+{
+	memset(status, 0, sizeof(*status));
+	status->bStatus = DFU_STATUS_OK;
+	if (!s_manifesting) {
+		status->bState = DFU_STATE_dfuDNLOAD_IDLE;
+		return 0;
+	}
+	milli_sleep(s_statusMs);
+	if (milli_time() - s_manifestStart < s_manifestMs) {
+		status->bState = DFU_STATE_dfuMANIFEST;
+		status->bwPollTimeout = s_pollTimeout;
+		return 0;
+	}
+	status->bState = DFU_STATE_dfuIDLE;
+	return 0;
+}
+
+int dfu_abort(libusb_device_handle *device, const unsigned short interface)
+{
+	s_aborts++;
+	return 0;
+}
+
+unsigned int dfu_poll_next(struct dfu_poll_state *poll, unsigned int timeout,
+			   enum dfu_poll_phase phase)
+{
+	return timeout;
+}
+
+void dfu_poll_finish(struct dfu_poll_state *poll, enum dfu_poll_phase phase)
+{
+}
+
+const char *dfu_state_to_string(int state)
+{
+	return "state";
+}
+
+const char *dfu_status_to_string(int status)
+{
+	return "status";
+}
+
+static void check(int ok, const char *what)
+{
+	if (!ok) {
+		printf("FAILED: %s\n", what);
+		s_failures++;
+	}
+}
+
+/* Download a small image with the manifest deadline given, returns what
+ * dfu_engine_run() did and the milliseconds it took in elapsed */
+static int download(struct dfu_engine *eng, unsigned int manifest_deadline,
+		    unsigned long long *elapsed)
+{
+	static unsigned char data[256];
+	static struct dfu_if dif;
+	static struct dfu_engine_policy policy;
+	unsigned long long start;
+	int ret;
+
+	memset(&dif, 0, sizeof(dif));
+	memset(&policy, 0, sizeof(policy));
+	policy.addressing = DFU_ADDR_BLOCKNUM;
+	policy.finish = DFU_FINISH_MANIFEST;
+	policy.manifest_deadline = manifest_deadline;
+	s_manifesting = 0;
+	s_aborts = 0;
+	s_erases = 0;
+	s_addresses = 0;
+
+	dfu_engine_init(eng, &dif, &policy, 64, data, sizeof(data), 0);
+	start = milli_time();
+	ret = dfu_engine_run(eng);
+	*elapsed = milli_time() - start;
+	return ret;
+}
+
+static void test_manifest_in_time(void)
+{
+	struct dfu_engine eng;
+	unsigned long long elapsed;
+
+	s_manifestMs = 50;
+	s_pollTimeout = 10;
+	s_statusMs = 0;
+	check(download(&eng, 1000, &elapsed) == 0,
+	      "a device manifesting within its deadline succeeds");
+	check(eng.timed_out == DFU_DEADLINE_NONE, "no deadline expired");
+	check(s_aborts == 0, "the device is not aborted");
+}
+
+static void test_manifest_expires(void)
+{
+	struct dfu_engine eng;
+	unsigned long long elapsed;
+
+	s_manifestMs = 10000;
+	s_pollTimeout = 5000;
+	s_statusMs = 0;
+	check(download(&eng, 200, &elapsed) < 0,
+	      "a device still manifesting at its deadline fails");
+	check(eng.timed_out == DFU_DEADLINE_MANIFEST,
+	      "the manifest deadline expired");
+	check(s_aborts == 1, "the device is aborted once");
+	check(elapsed < 2000, "the bwPollTimeout is cut at the deadline");
+}
+
+static void test_manifest_finishes_late(void)
+{
+	struct dfu_engine eng;
+	unsigned long long elapsed;
+
+	/* the device answers dfuIDLE, but only after the deadline */
+	s_manifestMs = 0;
+	s_pollTimeout = 0;
+	s_statusMs = 300;
+	check(download(&eng, 100, &elapsed) < 0,
+	      "a device that finished manifesting late fails");
+	check(eng.timed_out == DFU_DEADLINE_MANIFEST,
+	      "the manifest deadline expired");
+}
+
+/* Every page was erased up front, see policy erase_pages */
+static int erased(void *ctx, unsigned int address, unsigned int *len,
+		  unsigned int *page)
+{
+	return DFU_ERASE_WRITE;
+}
+
+static void test_planned_erase(void)
+{
+	static const unsigned int pages[] = {
+		0x08000000, 0x08004000, 0x08008000
+	};
+	static unsigned char data[3 * 64];
+	struct dfu_engine_policy policy;
+	struct dfu_engine eng;
+	struct dfu_if dif;
+
+	memset(&dif, 0, sizeof(dif));
+	memset(&policy, 0, sizeof(policy));
+	policy.addressing = DFU_ADDR_DFUSE;
+	policy.finish = DFU_FINISH_NONE;
+	policy.erase = erased;
+	policy.erase_pages = pages;
+	policy.erase_count = 3;
+	s_manifesting = 0;
+	s_erases = 0;
+	s_addresses = 0;
+
+	dfu_engine_init(&eng, &dif, &policy, 64, data, sizeof(data),
+			0x08000000);
+	/* libdfu moves the policy on to the next element right away */
+	policy.erase_count = 0;
+	check(dfu_engine_run(&eng) == 0, "a planned DfuSe download succeeds");
+	check(s_erases == 3, "every planned page is erased");
+	check(eng.bytes_sent == sizeof(data), "every chunk is sent");
+}
+
+/* Sends three full chunks to a DfuSe device with the wTransferSize given,
+ * returns how often the address pointer was set */
+static int chunk_run(unsigned short transfer_size)
+{
+	static unsigned char data[3 * 64];
+	struct dfu_engine_policy policy;
+	struct dfu_engine eng;
+	struct dfu_if dif;
+
+	memset(&dif, 0, sizeof(dif));
+	memset(&policy, 0, sizeof(policy));
+	dif.func_dfu.wTransferSize = libusb_cpu_to_le16(transfer_size);
+	policy.addressing = DFU_ADDR_DFUSE;
+	policy.finish = DFU_FINISH_NONE;
+	policy.erase = erased;
+	s_manifesting = 0;
+	s_addresses = 0;
+
+	dfu_engine_init(&eng, &dif, &policy, 64, data, sizeof(data),
+			0x08000000);
+	check(dfu_engine_run(&eng) == 0, "a DfuSe download succeeds");
+	return s_addresses;
+}
+
+static void test_chunk_runs(void)
+{
+	check(chunk_run(64) == 1,
+	      "chunks of wTransferSize run from one address");
+	check(chunk_run(128) == 3,
+	      "other chunks are each addressed");
+}
+
+/* The ranges the engine reported different */
+static unsigned int s_mismatches;
+static unsigned int s_mismatchAddress;
+static unsigned int s_mismatchLen;
+
+static void mismatch(void *ctx, unsigned int address, unsigned int len)
+{
+	s_mismatches++;
+	s_mismatchAddress = address;
+	s_mismatchLen = len;
+}
+
+static void test_verify_mismatch(void)
+{
+	static unsigned char data[256];
+	static unsigned char device[256];
+	static unsigned char block[64];
+	struct dfu_engine_policy policy;
+	struct dfu_engine eng;
+	struct dfu_if dif;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = i;
+	/* four bytes of the second block did not take */
+	memcpy(device, data, sizeof(device));
+	memset(device + 100, 0xff, 4);
+
+	memset(&dif, 0, sizeof(dif));
+	memset(&policy, 0, sizeof(policy));
+	dif.func_dfu.bmAttributes = USB_DFU_CAN_UPLOAD;
+	policy.addressing = DFU_ADDR_BLOCKNUM;
+	policy.finish = DFU_FINISH_MANIFEST;
+	policy.verify = 1;
+	policy.verify_buf = block;
+	policy.mismatch = mismatch;
+	s_manifesting = 0;
+	s_manifestMs = 0;
+	s_pollTimeout = 0;
+	s_statusMs = 0;
+	s_readBack = device;
+	s_readSize = sizeof(device);
+	s_readOffset = 0;
+	s_mismatches = 0;
+
+	dfu_engine_init(&eng, &dif, &policy, sizeof(block), data,
+			sizeof(data), 0);
+	check(dfu_engine_run(&eng) < 0,
+	      "a download that reads back different fails");
+	check(eng.phase == DFU_ENGINE_ERROR, "the engine stops in error");
+	check(!eng.verified, "the download is not verified");
+	check(s_readOffset == sizeof(device), "the whole image is read back");
+	check(s_mismatches == 1, "one range is reported");
+	check(s_mismatchAddress == 100 && s_mismatchLen == 4,
+	      "the range that differs is reported");
+	check(eng.mismatched == 4, "only the bytes that differ count");
+	s_readBack = NULL;
+}
+
+int main(void)
+{
+	test_manifest_in_time();
+	test_manifest_expires();
+	test_manifest_finishes_late();
+	test_planned_erase();
+	test_chunk_runs();
+	test_verify_mismatch();
+
+	if (s_failures) {
+		printf("%d checks failed\n", s_failures);
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}